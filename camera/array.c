@@ -0,0 +1,457 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "fitsio.h"
+#include "camera.h"
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+#define MAX_STRING 256
+
+#define usage "\n\
+NAME\n\
+array --- operate more than four SBIG cameras on one computer \n\
+\n\
+SYNOPSIS\n\
+array [options] expose imageType exposureTime\n\
+array status\n\
+array regulate setpoint\n\
+\n\
+DESCRIPTION\n\
+The SBIG driver only hands out four camera handles per process. \"array\" is a\n\
+coordinator which forks one worker process (a \"shard\") for each group of four\n\
+cameras on the USB bus, fans the requested operation out to the shards and\n\
+gathers their results into a single report. Camera numbers in the report\n\
+count across all shards, so camera 5 is the second camera of shard 1.\n\
+\n\
+When exposing, each shard initializes its cameras and reports back to the\n\
+coordinator. Only when every shard is ready does the coordinator release\n\
+them all at once, so exposures on all cameras start together. With -t, the\n\
+released shards start their cameras at the requested wall-clock time instead\n\
+(see \"expose\").\n\
+\n\
+COMMANDS\n\
+expose          - take an image on every camera (see \"expose\" for imageType)\n\
+status          - report temperatures of every camera on one line\n\
+regulate        - set the temperature setpoint of every camera\n\
+\n\
+OPTIONS\n\
+-v          # verbose mode \n\
+-n Name      \n\
+-r RA        \n\
+-d Dec       \n\
+-a Alt       \n\
+-z Az        \n\
+-t Time     # start exposures at this time (seconds since 1970, or \"+N\") \n\
+\n\
+EXAMPLES\n\
+array expose flat 15 \n\
+array -n M101 expose light 120 \n\
+array status \n\
+array regulate -20 \n\
+\n\
+FEATURES\n\
+The coordinator holds the lockfile for the whole operation. Shards never touch\n\
+it, since fcntl() locks are per process and a shard would otherwise block on\n\
+its own coordinator.\n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+/* Operations a shard can be asked to carry out */
+#define ARRAY_EXPOSE   0
+#define ARRAY_STATUS   1
+#define ARRAY_REGULATE 2
+
+/* Pipes connecting the coordinator to each shard */
+typedef struct {
+    pid_t pid;
+    int   ready_fd;   // shard -> coordinator: cameras initialized
+    int   go_fd;      // coordinator -> shard: start now
+    int   result_fd;  // shard -> coordinator: one line per camera
+} t_shard;
+
+static t_shard *shards = NULL;
+static int nshards = 0;
+
+/* Exposure request shared by every shard */
+static int   verbose = 0;
+static char  name[MAX_STRING] = "";
+static char  ra[MAX_STRING] = "";
+static char  dec[MAX_STRING] = "";
+static char  alt[MAX_STRING] = "";
+static char  az[MAX_STRING] = "";
+static char  imtype[8];
+static float exptime;
+static float setpoint;
+static double start_time = 0;
+
+
+/* Write a formatted line down a pipe */
+static void pipe_printf(int fd, const char *fmt, ...)
+{
+    char line[MAX_STRING];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    write(fd, line, strlen(line));
+}
+
+
+/* A shard interrupted mid-exposure closes its shutters and exits */
+void ShardInterruptHandler(int sig)
+{
+    int phase=2;
+    for (int cam_num = 0; cam_num <ccd_ncam; cam_num++)
+    {
+        SetActiveCamera(cam_num);
+        CaptureImage(&phase,ccd_image_data[cam_num],ccd_type,0,FALSE,0,0,0,0);
+    }
+    DisconnectAllCameras();
+    _exit(EXIT_FAILURE);
+}
+
+
+/* The coordinator forwards an interrupt to all shards */
+void InterruptHandler(int sig)
+{
+    fprintf(stdout,"Integration terminated by user.\n");
+    for (int s = 0; s < nshards; s++)
+        kill(shards[s].pid, SIGINT);
+    for (int s = 0; s < nshards; s++)
+        waitpid(shards[s].pid, NULL, 0);
+    release_lock();
+    exit(EXIT_FAILURE);
+}
+
+
+/* Sleep for a number of seconds */
+static void wait_seconds(double seconds)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t) seconds;
+    ts.tv_nsec = (long) ((seconds - ts.tv_sec)*1e9);
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+}
+
+
+/* Wait for the exposures to end: sit out the exposure time, then ask */
+/* each camera until it reports its integration complete.             */
+static void wait_for_cameras(double exptime)
+{
+    int status;
+
+    wait_seconds(exptime);
+    for (int cam_num = 0; cam_num < ccd_ncam; cam_num++) {
+        SetActiveCamera(cam_num);
+        do {
+            GetCameraStatus(&status);
+            if (status != COMPLETE)
+                wait_seconds(0.01);
+        } while (status != COMPLETE);
+    }
+}
+
+
+/* Body of a shard process. Everything reported back to the coordinator
+ * is tagged with the camera's array-wide number. */
+static int run_shard(int shard, int action, int ready_fd, int go_fd, int result_fd)
+{
+    int phase;
+    int failed = 0;
+    int first = shard*MAX_CAMERAS_PER_SHARD;
+    char go;
+
+    signal(SIGINT, ShardInterruptHandler);
+
+    // A shard that can't reach its cameras exits without reporting ready,
+    // which tells the coordinator it failed.
+    SetCameraShard(shard);
+    if (CountCameras() || ccd_ncam < 1) {
+        fprintf(stderr,"Shard %d found no cameras\n",shard);
+        return(1);
+    }
+    if (InitializeAllCameras()) {
+        DisconnectAllCameras();
+        return(1);
+    }
+
+    if (action == ARRAY_STATUS) {
+        for (int i = 0; i < ccd_ncam; i++) {
+            SetActiveCamera(i);
+            GetCameraTemperature();
+            pipe_printf(result_fd,"%d: T=%.1fC S=%.1fC A=%.1f [%.1f%%]    ",
+                    first + i,
+                    (double)ccd_camera_info[i].temperature,
+                    (double)ccd_camera_info[i].setpoint,
+                    (double)ccd_camera_info[i].ambientTemperature,
+                    (double)ccd_camera_info[i].power);
+        }
+        DisconnectAllCameras();
+        return(0);
+    }
+
+    if (action == ARRAY_REGULATE) {
+        for (int i = 0; i < ccd_ncam; i++) {
+            SetActiveCamera(i);
+            RegulateTemperature(setpoint);
+            pipe_printf(result_fd,"Camera %d regulating to %.1fC\n",first + i,setpoint);
+        }
+        DisconnectAllCameras();
+        return(0);
+    }
+
+    // Get everything ready before reporting in, so that the only thing
+    // left to do when the coordinator says go is start the exposures.
+    ccd_type = value_from_imagetype_key(imtype);
+    for (int cam_num = 0; cam_num < ccd_ncam; cam_num++) {
+        SetActiveCamera(cam_num);
+        ccd_image_data[cam_num] =
+            (unsigned short *) malloc(ccd_image_width*ccd_image_height*sizeof(unsigned short));
+    }
+    write(ready_fd, "r", 1);
+    if (read(go_fd, &go, 1) != 1) {
+        DisconnectAllCameras();
+        return(1);
+    }
+
+    StartExposuresAt(start_time,ccd_type,exptime);
+    wait_for_cameras(exptime);
+
+    for (int cam_num = 0; cam_num < ccd_ncam; cam_num++) {
+        char newname[MAX_STRING] = "";
+        phase = 1;
+        SetActiveCamera(cam_num);
+        CaptureImage(&phase,ccd_image_data[cam_num],ccd_type,exptime,FALSE,0,0,0,0);
+
+        new_filename(ccd_serial_number,imtype,newname);
+        GetCameraTemperature();
+        double temperature = ccd_camera_info[cam_num].temperature;
+        int filterNumber = 0;
+        if (IsCameraAnST402ME())
+            filterNumber = FilterWheelPosition();
+        if (write_fits(newname, ccd_image_width, ccd_image_height, ccd_image_data[cam_num],
+                   exptime,imtype,temperature,filterNumber,ccd_serial_number, name,
+                   ra,dec,alt,az)) {
+            pipe_printf(result_fd,"Camera %d failed to write: %s\n",first + cam_num,newname);
+            failed = 1;
+        }
+        else
+            pipe_printf(result_fd,"Camera %d wrote: %s\n",first + cam_num,newname);
+        free(ccd_image_data[cam_num]);
+    }
+    if (WaitForDurability())
+        failed = 1;
+
+    DisconnectAllCameras();
+    return(failed);
+}
+
+
+/* Fork one shard. Returns 0 on success. */
+static int start_shard(int shard, int action)
+{
+    int ready[2], go[2], result[2];
+
+    if (pipe(ready) || pipe(go) || pipe(result)) {
+        perror("Unable to create pipes for shard");
+        return(1);
+    }
+
+    shards[shard].pid = fork();
+    if (shards[shard].pid < 0) {
+        perror("Unable to fork shard");
+        return(1);
+    }
+
+    if (shards[shard].pid == 0) {
+        close(ready[0]); close(go[1]); close(result[0]);
+        _exit(run_shard(shard, action, ready[1], go[0], result[1]));
+    }
+
+    close(ready[1]); close(go[0]); close(result[1]);
+    shards[shard].ready_fd = ready[0];
+    shards[shard].go_fd = go[1];
+    shards[shard].result_fd = result[0];
+    return(0);
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int arg=1;
+    int action;
+    char command[MAX_STRING];
+    char buffer[MAX_STRING];
+    char ready;
+    ssize_t n;
+    int status = 0;
+
+    if (argc < 2) {
+        error_exit(usage);
+    };
+    while (arg < argc && argv[arg][0] == '-')
+    {
+        switch (argv[arg++][1]) {
+            case 'v':
+                verbose = 1;
+                SetVerbosity(verbose);
+                break;
+            case 'n':
+                sscanf(argv[arg++], "%s", name);
+                break;
+             case 'r':
+                sscanf(argv[arg++], "%s", ra);
+                break;
+             case 'd':
+                sscanf(argv[arg++], "%s", dec);
+                break;
+             case 'a':
+                sscanf(argv[arg++], "%s", alt);
+                break;
+             case 'z':
+                sscanf(argv[arg++], "%s", az);
+                break;
+             case 't':
+                if (argv[arg][0] == '+') {
+                    struct timespec now;
+                    clock_gettime(CLOCK_REALTIME, &now);
+                    start_time = now.tv_sec + 1e-9*now.tv_nsec + atof(argv[arg++] + 1);
+                }
+                else
+                    start_time = atof(argv[arg++]);
+                break;
+             default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (arg >= argc) {
+        error_exit(usage);
+    }
+    sscanf(argv[arg++],"%s",command);
+
+    if (strcmp(command,"expose") == 0) {
+        if (argc - arg != 2) {
+            error_exit(usage);
+        }
+        action = ARRAY_EXPOSE;
+        sscanf(argv[arg++],"%7s",imtype);
+        sscanf(argv[arg++],"%f",&exptime);
+        if (value_from_imagetype_key(imtype) == BADKEY) {
+            fprintf(stderr,"Unknown image type %s\n",imtype);
+            return(1);
+        }
+    }
+    else if (strcmp(command,"status") == 0) {
+        action = ARRAY_STATUS;
+    }
+    else if (strcmp(command,"regulate") == 0) {
+        if (argc - arg != 1) {
+            error_exit(usage);
+        }
+        action = ARRAY_REGULATE;
+        sscanf(argv[arg++],"%f",&setpoint);
+    }
+    else {
+        error_exit(usage);
+    }
+
+    if (action == ARRAY_EXPOSE) {
+        if(signal(SIGINT, SIG_IGN) != SIG_IGN)
+            signal(SIGINT, InterruptHandler);
+        get_lock();
+        store_pid_in_lockfile();
+    }
+    else {
+        get_nondestructive_lock();
+    }
+
+    if (CountCameras()) {
+        release_lock();
+        return(1);
+    }
+    if (ccd_ncam_total < 1){
+        fprintf(stderr,"Found 0 cameras\n");
+        release_lock();
+        return(action == ARRAY_STATUS ? 0 : 1);
+    }
+    // One shard for every four cameras found
+    nshards = CountShards();
+    if ((shards = (t_shard *) calloc(nshards, sizeof(t_shard))) == NULL) {
+        fprintf(stderr,"Unable to allocate %d shards\n",nshards);
+        release_lock();
+        return(1);
+    }
+    if (verbose)
+        printf("Driving %d cameras with %d shards.\n",ccd_ncam_total,nshards);
+    fflush(stdout);     // or every shard prints it again
+
+    if (action == ARRAY_EXPOSE) {
+        store_timestamped_note_in_lockfile("Started");
+        store_directory_in_lockfile();
+        snprintf(buffer,sizeof(buffer),"Exptime: %5.1f\n",exptime);
+        store_note_in_lockfile(buffer);
+    }
+
+    for (int s = 0; s < nshards; s++) {
+        if (start_shard(s, action)) {
+            nshards = s;
+            status = 1;
+            break;
+        }
+    }
+
+    // Synchronized start: wait for every shard to report ready, then
+    // release them all together.
+    if (action == ARRAY_EXPOSE && status == 0) {
+        for (int s = 0; s < nshards; s++) {
+            if (read(shards[s].ready_fd, &ready, 1) != 1) {
+                fprintf(stderr,"Shard %d failed to initialize\n",s);
+                status = 1;
+            }
+        }
+        for (int s = 0; s < nshards && status == 0; s++)
+            write(shards[s].go_fd, "g", 1);
+    }
+
+    // Gather results in shard order so the report lists cameras in order.
+    // A shard still waiting for the go signal sees EOF and gives up.
+    for (int s = 0; s < nshards; s++) {
+        int shard_status;
+        close(shards[s].go_fd);
+        while ((n = read(shards[s].result_fd, buffer, sizeof(buffer)-1)) > 0) {
+            buffer[n] = '\0';
+            fputs(buffer, stdout);
+            if (action == ARRAY_EXPOSE)
+                store_note_in_lockfile(buffer);
+        }
+        close(shards[s].result_fd);
+        close(shards[s].ready_fd);
+        waitpid(shards[s].pid, &shard_status, 0);
+        if (!WIFEXITED(shard_status) || WEXITSTATUS(shard_status) != 0) {
+            fprintf(stderr,"Shard %d failed\n",s);
+            status = 1;
+        }
+    }
+    if (action == ARRAY_STATUS)
+        fprintf(stdout,"\n");
+
+    if (action == ARRAY_EXPOSE)
+        store_timestamped_note_in_lockfile("Completed");
+    release_lock();
+    fflush(stdout);
+    free(shards);
+
+    return(status);
+
+}
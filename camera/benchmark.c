@@ -0,0 +1,383 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include "fitsio.h"
+#include "camera.h"
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+#define MAX_STRING 256
+
+#define usage "\n\
+NAME\n\
+benchmark --- time the pieces of the exposure cycle \n\
+\n\
+SYNOPSIS\n\
+benchmark [options]\n\
+\n\
+DESCRIPTION\n\
+\"benchmark\" measures the cost of the steps that make up the dead time between\n\
+exposures: writing a full STF-8300 frame with write_fits() under each\n\
+durability policy (rows write_fits_none, write_fits_async and write_fits_sync;\n\
+see SBIG_DURABILITY in \"expose\"), choosing the next file name with\n\
+new_filename() in directories holding 100 to 10,000 frames,\n\
+reading out a frame with CaptureImage(), reading out a frame with a readout\n\
+hook that byte-swaps every line into a FITS-ordered copy as it arrives, and\n\
+acquiring and releasing a lockfile the way the camera programs do (on a\n\
+private lockfile, so a running expose is not held up). Readout is measured\n\
+against one simulated camera (sbigsim.c) with no per-line delay, so it\n\
+measures our own overhead rather than the camera's, and the frames read out\n\
+are kept out of the shared frame ring, so \"lastframe\" never shows them.\n\
+\n\
+Results are written to stdout as a SExtractor-style ASCII table, one row per\n\
+measurement, so they can be filtered with tfilter and tcolumn and appended to\n\
+a history file to track regressions.\n\
+\n\
+OPTIONS\n\
+-n niter     # number of timed iterations per measurement (default 10) \n\
+-d dir       # scratch directory (default: a new directory in /var/tmp) \n\
+-b name      # only run the named benchmark: write_fits, new_filename, \n\
+             # readout, hooks or lock. May be repeated. \n\
+-v           # verbose mode \n\
+\n\
+EXAMPLES\n\
+benchmark \n\
+benchmark -n 50 -b write_fits -b lock \n\
+benchmark | tfilter 'BENCHMARK eq \"new_filename\"' | tcolumn PARAMETER MEAN_TIME \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+#define STF8300_WIDTH  3326
+#define STF8300_HEIGHT 2504
+
+static int verbose = 0;
+static int niter = 10;
+
+
+static double wallclock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+/* Accumulates the timings of one measurement */
+typedef struct {
+    int    n;
+    double sum;
+    double min;
+    double max;
+} t_timing;
+
+static void timing_reset(t_timing *t)
+{
+    t->n = 0;
+    t->sum = 0.0;
+    t->min = 1e30;
+    t->max = 0.0;
+}
+
+static void timing_add(t_timing *t, double dt)
+{
+    t->n++;
+    t->sum += dt;
+    if (dt < t->min) t->min = dt;
+    if (dt > t->max) t->max = dt;
+}
+
+
+static void print_header()
+{
+    printf("#   1 BENCHMARK       Name of the benchmark\n");
+    printf("#   2 PARAMETER       Problem size (pixels, files, lines or iterations)\n");
+    printf("#   3 NITER           Number of timed iterations\n");
+    printf("#   4 MEAN_TIME       Mean time per iteration                                   [s]\n");
+    printf("#   5 MIN_TIME        Fastest iteration                                         [s]\n");
+    printf("#   6 MAX_TIME        Slowest iteration                                         [s]\n");
+    printf("#   7 RATE            Work per second at the mean time (MB/s, files/s, lines/s or ops/s)\n");
+}
+
+
+static void print_row(char *name, long parameter, t_timing *t, double work)
+{
+    double mean = t->n > 0 ? t->sum/t->n : 0.0;
+    printf("%-16s %10ld %5d %12.6e %12.6e %12.6e %12.6e\n",
+            name, parameter, t->n, mean, t->min, t->max,
+            mean > 0 ? work/mean : 0.0);
+    fflush(stdout);
+}
+
+
+/* write_fits() throughput for a full STF-8300 frame under a durability */
+/* policy. With DURABLE_ASYNC this is the time the exposure loop sees;   */
+/* the flushes go on behind it.                                          */
+static void benchmark_write_fits(int policy)
+{
+    static char *names[] = { "write_fits_none", "write_fits_async", "write_fits_sync" };
+    t_timing t;
+    long npix = (long) STF8300_WIDTH*STF8300_HEIGHT;
+    unsigned short *data = (unsigned short *) malloc(npix*sizeof(unsigned short));
+
+    // Sky-like data so any compression or checksumming does real work
+    srand(1);
+    for (long i = 0; i < npix; i++)
+        data[i] = 1000 + rand() % 64;
+
+    SetDurability(policy);
+    timing_reset(&t);
+    for (int i = 0; i < niter; i++) {
+        double t0 = wallclock();
+        if (write_fits("benchmark_write.fits", STF8300_WIDTH, STF8300_HEIGHT, data,
+                60.0, "light", -20.0, 0, "BENCHMARK", "Benchmark",
+                "00:00:00", "+00:00:00", "90.0", "0.0")) {
+            fprintf(stderr,"Unable to write benchmark_write.fits\n");
+            break;
+        }
+        timing_add(&t, wallclock() - t0);
+    }
+    if (WaitForDurability())
+        fprintf(stderr,"Unable to put benchmark_write.fits in place\n");
+    remove("benchmark_write.fits");
+    print_row(names[policy], npix, &t, npix*sizeof(unsigned short)/1.0e6);
+    free(data);
+}
+
+
+/* new_filename() in a directory already holding nfiles frames */
+static void benchmark_new_filename(int nfiles)
+{
+    t_timing t;
+    char name[MAX_STRING];
+    static int nexisting = 0;
+
+    // Grow the population of frames from the previous call
+    for (int i = nexisting; i < nfiles; i++) {
+        int fd;
+        snprintf(name, sizeof(name), "BENCHMARK_%d_light.fits", i + 1);
+        if ((fd = open(name, O_WRONLY|O_CREAT, 0644)) != -1)
+            close(fd);
+    }
+    nexisting = nfiles;
+
+    timing_reset(&t);
+    for (int i = 0; i < niter; i++) {
+        double t0;
+        name[0] = '\0';
+        t0 = wallclock();
+        new_filename("BENCHMARK", "light", name);
+        timing_add(&t, wallclock() - t0);
+    }
+    if (verbose)
+        fprintf(stderr, "new_filename with %d files: %s\n", nfiles, name);
+    print_row("new_filename", nfiles, &t, 1.0);
+}
+
+
+static void remove_new_filename_files(int nfiles)
+{
+    char name[MAX_STRING];
+    for (int i = 0; i < nfiles; i++) {
+        snprintf(name, sizeof(name), "BENCHMARK_%d_light.fits", i + 1);
+        remove(name);
+    }
+}
+
+
+/* A readout hook with about the cost of preparing a frame for a socket */
+static unsigned short *swapped = NULL;
+
+static void swap_lines(void *context, int camera, unsigned short *data, int first, int nlines, int width)
+{
+    unsigned short *out = swapped + (long) first*width;
+    for (long i = 0; i < (long) nlines*width; i++)
+        out[i] = (data[i] >> 8) | (data[i] << 8);
+}
+
+
+/* CaptureImage() readout of a zero-length exposure, optionally with the */
+/* byte-swapping hook running as the lines arrive                        */
+static void benchmark_readout(int hooked)
+{
+    t_timing t;
+    t_readouthook hook = { NULL, swap_lines, NULL, NULL, 16 };
+    int phase;
+    int status;
+
+    CountCameras();
+    if (ccd_ncam < 1) {
+        fprintf(stderr, "No cameras found for the readout benchmark.\n");
+        return;
+    }
+    SetFrameRing(0);
+    InitializeCamera(0);
+    SetActiveCamera(0);
+    ccd_image_data[0] =
+        (unsigned short *) malloc(ccd_image_width*ccd_image_height*sizeof(unsigned short));
+    if (hooked) {
+        swapped = (unsigned short *) malloc(ccd_image_width*ccd_image_height*sizeof(unsigned short));
+        AddReadoutHook(&hook);
+    }
+
+    timing_reset(&t);
+    for (int i = 0; i < niter; i++) {
+        double t0;
+        phase = 0;
+        CaptureImage(&phase,ccd_image_data[0],BIAS,0.0,FALSE,0,0,0,0);
+        do {
+            GetCameraStatus(&status);
+        } while (status != COMPLETE);
+        phase = 1;
+        t0 = wallclock();
+        CaptureImage(&phase,ccd_image_data[0],BIAS,0.0,FALSE,0,0,0,0);
+        timing_add(&t, wallclock() - t0);
+    }
+    print_row(hooked ? "hooks" : "readout", ccd_image_height, &t, (double) ccd_image_height);
+
+    if (hooked) {
+        RemoveReadoutHook(&hook);
+        free(swapped);
+    }
+    free(ccd_image_data[0]);
+    DisconnectCamera(0);
+}
+
+
+/* Lockfile acquire and release, on a private lockfile so a running */
+/* expose is never held up                                          */
+static void benchmark_lock(char *dir)
+{
+    t_timing t;
+    int nlock = 1000;
+    char lockfile[MAX_STRING + 16];
+
+    snprintf(lockfile, sizeof(lockfile), "%s/benchmark.lock", dir);
+    SetLockFile(lockfile);
+    timing_reset(&t);
+    for (int i = 0; i < niter; i++) {
+        double t0 = wallclock();
+        for (int j = 0; j < nlock; j++) {
+            get_nondestructive_lock();
+            release_lock();
+        }
+        timing_add(&t, (wallclock() - t0)/nlock);
+    }
+    print_row("lock", nlock, &t, 1.0);
+    remove(lockfile);
+}
+
+
+static int selected(char **names, int nnames, char *name)
+{
+    if (nnames == 0)
+        return(1);
+    for (int i = 0; i < nnames; i++)
+        if (strcmp(names[i], name) == 0)
+            return(1);
+    return(0);
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int arg = 1;
+    char dir[MAX_STRING] = "";
+    char *names[8];
+    int nnames = 0;
+    int made_dir = 0;
+    int nfiles[] = { 100, 1000, 10000 };
+
+    while (arg < argc)
+    {
+        if (argv[arg][0] != '-') {
+            error_exit(usage);
+        }
+        if (argv[arg][1] != 'v' && arg + 1 >= argc) {
+            error_exit(usage);
+        }
+        switch (argv[arg++][1]) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'n':
+                niter = atoi(argv[arg++]);
+                break;
+            case 'd':
+                snprintf(dir, sizeof(dir), "%s", argv[arg++]);
+                break;
+            case 'b':
+                if (nnames < 8)
+                    names[nnames++] = argv[arg];
+                arg++;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (niter < 1) {
+        error_exit(usage);
+    }
+
+    // The readout benchmark measures our code, not the simulated camera
+    setenv("SBIGSIM_LINE_USEC", "0", 1);
+    setenv("SBIGSIM_CAMERAS", "1", 1);
+
+    if (dir[0] == '\0') {
+        strcpy(dir, "/var/tmp/benchmark.XXXXXX");
+        if (mkdtemp(dir) == NULL) {
+            perror("Unable to create scratch directory");
+            return(1);
+        }
+        made_dir = 1;
+    }
+    if (chdir(dir) != 0) {
+        perror("Unable to use scratch directory");
+        return(1);
+    }
+    if (verbose)
+        fprintf(stderr, "Benchmarking in %s\n", dir);
+
+    print_header();
+
+    if (selected(names, nnames, "write_fits")) {
+        benchmark_write_fits(DURABLE_NONE);
+        benchmark_write_fits(DURABLE_ASYNC);
+        benchmark_write_fits(DURABLE_SYNC);
+    }
+
+    if (selected(names, nnames, "new_filename")) {
+        for (int i = 0; i < sizeof(nfiles)/sizeof(int); i++)
+            benchmark_new_filename(nfiles[i]);
+        remove_new_filename_files(nfiles[sizeof(nfiles)/sizeof(int) - 1]);
+    }
+
+    if (selected(names, nnames, "readout"))
+        benchmark_readout(0);
+
+    if (selected(names, nnames, "hooks"))
+        benchmark_readout(1);
+
+    if (selected(names, nnames, "lock"))
+        benchmark_lock(dir);
+
+    // write_fits() also keeps the frame catalog and timing log
+    if (made_dir) {
+        remove("frames.cat");
+        remove("timing.log");
+        chdir("/");
+        if (rmdir(dir) != 0)
+            fprintf(stderr, "Unable to remove %s: %s\n", dir, strerror(errno));
+    }
+
+    return(0);
+
+}
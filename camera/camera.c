@@ -1,3 +1,5 @@
+#define _DEFAULT_SOURCE
+
 #include <glob.h>
 #include <regex.h>
 #include <stdio.h>
@@ -5,11 +7,17 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include <fitsio.h>
 #include <fcntl.h>
 #include <time.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 #include "camera.h"
+#include "framering.h"
 
 /* Define global variables */
 static OpenDeviceParams                odp;
@@ -20,7 +28,7 @@ static EstablishLinkResults            elr;
 static GetCCDInfoParams                gip;
 static GetCCDInfoResults0              info_results_main;
 static GetCCDInfoResults2              info_results_extended;
-static QueryUSBResults                 qur;
+static QueryUSBResults2                qur;
 static QueryCommandStatusParams        qcsp;
 static QueryCommandStatusResults       qcsr;
 static QueryTemperatureStatusParams    qtsp;
@@ -48,8 +56,118 @@ static int active_camera; // Index of currently active camera
 static int verbosity = 0; // Print debug information?
 static int err;
 static struct flock fl;
-static int fd;
-static char camlockfile[] = "/var/tmp/sbig.lock";
+static int fd = -1;
+static char camlockfile[1024] = "/var/tmp/sbig.lock";
+static char timinglogfile[] = "timing.log";   // In the (nightly) data directory
+static char catalogfile[] = "frames.cat";     // Alongside the frames it lists
+static char manifestfifo[] = "/var/tmp/frames.fifo";   // See "framewatch -m"
+static t_framering frame_ring;    // Shared-memory ring of the latest frames
+static int frame_ring_state = 0;  // 0 not opened yet, 1 open, -1 unavailable or turned off
+
+/* A closed frame waiting to be put in place under its real name, with */
+/* what goes into the catalog, manifest and timing log once it is       */
+typedef struct {
+    char   tmpname[1024];
+    char   filename[1024];
+    int    is_frame;              // 0 for stacks, which are only put in place
+    int    camera;
+    int    w, h;
+    double exptime;
+    char   obs_type[FLEN_VALUE];
+    double temperature;
+    int    filter;
+    char   serial_number[FLEN_VALUE];
+    char   name[256], ra[FLEN_VALUE], dec[FLEN_VALUE], alt[FLEN_VALUE];
+    char   date[FLEN_VALUE];
+    int    timed;
+    t_frametiming timing;
+} t_pending;
+
+/* Frames written with DURABLE_ASYNC wait here to be put in place */
+#define FLUSH_QUEUE 64
+static int durability = -1;       // Not chosen yet
+static void (*frame_hook)(char *filename) = NULL;
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    pthread_t thread;
+    int started;
+    t_pending *frame[FLUSH_QUEUE];
+    int head;                     // Next to put in place
+    int count;                    // Waiting, including the one being put in place
+    int failed;                   // Not put in place since WaitForDurability() was last called
+} flusher = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Defect masks (see SetDefectMasking()) */
+#define CR_SIGMA         5        // Cosmic ray threshold on the Laplacian (robust sigma)
+#define CR_CONTRAST      4        // How many times higher than its neighbours one stands
+#define CR_GROW_SIGMA    3        // Threshold for the pixels next to one (sigma above sky)
+#define MASK_SAMPLE      11       // Sky and noise come from every 11th pixel of every 11th row
+#define MAX_MASK_THREADS 8
+#define MASK_GROWN       0x80     // Added next to a cosmic ray (while the mask is built)
+static int masking = -1;          // Not chosen yet
+static char bad_pixel_dir[1024];
+static struct {
+    char serial_number[16];
+    int width;
+    int height;
+    unsigned char *map;           // NULL if the camera has none
+} bad_pixel_maps[MAX_CAMERAS];
+static int nbad_pixel_maps = 0;
+
+/* Readout hooks (see camera.h). Statistics are always gathered. */
+static void stats_start(void *, int, unsigned short *, int, int);
+static void stats_lines(void *, int, unsigned short *, int, int, int);
+static void stats_end(void *, int, int);
+typedef struct {
+    uint64_t sum;                 // Of the pixel values
+    uint64_t hi, lo;              // Of the high and low halves of the FITS data words
+} t_pixelsums;
+static t_pixelsums stats_sums[MAX_CAMERAS_PER_SHARD];
+static t_readouthook stats_hook = { stats_start, stats_lines, stats_end, stats_sums, 64 };
+static t_readouthook *readout_hooks[MAX_READOUT_HOOKS] = { &stats_hook };
+static int nreadout_hooks = 1;
+
+/* Co-adding stacks, one per camera, filled by a readout hook */
+static void stack_start(void *, int, unsigned short *, int, int);
+static void stack_lines(void *, int, unsigned short *, int, int, int);
+static void stack_end(void *, int, int);
+#define MAX_STACK_DEPTH 65535     // Keeps the sums and counts from overflowing
+#define MIN_CLIP_VALUES 5         // Values a pixel needs before any are clipped
+typedef struct {
+    int width;                    // 0 until the stack takes its first frame
+    int height;
+    int nframes;                  // Frames added
+    int adding;                   // The frame being read out is being added
+    unsigned short *data;         // That frame
+    long added;                   // Pixels of it added so far
+    uint32_t *sum;                // STACK_SUM and STACK_VARIANCE
+    uint64_t *sumsq;              // STACK_VARIANCE
+    float *mean;                  // STACK_CLIP: mean and summed squared
+    float *m2;                    //   deviations of the values taken,
+    uint16_t *count;              //   how many were taken,
+    uint8_t *taken;               //   and which of the current frame's were
+} t_stack;
+static t_stack stacks[MAX_CAMERAS_PER_SHARD];
+static t_readouthook stack_hook = { stack_start, stack_lines, stack_end, stacks, 64 };
+static int stack_mode = -1;       // Not stacking
+static double stack_kappa;        // Clipping threshold in sigma
+
+/* The frame being read out, shared with the thread running the hooks */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    pthread_t thread;
+    int threaded;
+    unsigned short *data;
+    int camera;
+    int width;
+    int height;
+    int nread;                    // Lines read so far
+    int done;                     // No more lines are coming
+    int status;                   // 0 if every line was read
+} readout = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
 
 char  *ccd_image_name;
 char  *ccd_serial_number;
@@ -61,9 +179,17 @@ int    ccd_phase;
 CAMERA_TYPE ccd_camera_type;
 int    ccd_type;
 int    ccd_ncam;
+int    ccd_ncam_total;
+int    ccd_shard = 0;
+
+t_camerainfo ccd_camera_info[MAX_CAMERAS_PER_SHARD];
+unsigned short *ccd_image_data[MAX_CAMERAS_PER_SHARD];
 
-t_camerainfo ccd_camera_info[4];
-unsigned short *ccd_image_data[4];
+/* USB device assigned to each camera on the host, in bus order */
+static SBIG_DEVICE_TYPE usbdevicetable[MAX_CAMERAS] = {
+        DEV_USB1, DEV_USB2, DEV_USB3, DEV_USB4,
+        DEV_USB5, DEV_USB6, DEV_USB7, DEV_USB8
+};
 
 static t_keyval imagetypelookuptable[] = {
         { "DARK", DARK },   { "dark", DARK },   { "Dark", DARK }, 
@@ -85,31 +211,44 @@ static t_keyval filternamelookuptable[] = {
 
 
 
+static int  setup_start_exposure(StartExposureParams2 *p, int frame, double exposure);
+static int  start_exposure(StartExposureParams2 *p);
+static void write_fits_hdu(fitsfile *, int, int, unsigned short *, double, char*, double,
+        int, char*, char*, char*, char*, char*, char*, int *);
+static void format_utc_time(double t, char *datestr);
+static void store_frame_manifest(char *filename, char *serial_number, char *obs_type,
+        double exptime, int w, int h, int camera);
+static void publish_frame(unsigned short *data, int frame, double exposure,
+        int x, int y, int width, int height);
+static void add_to_datasum(t_pixelsums *sums, unsigned short *data, long first, long n);
+static unsigned long datasum_value(t_pixelsums *sums);
+static void write_checksums(fitsfile *fptr, int w, int h, unsigned short *data, int *statusp);
+static void write_mask_hdu(fitsfile *fptr, int w, int h, unsigned short *data,
+        char *serial_number, int *statusp);
+static void start_readout_hooks(unsigned short *data, int width, int height);
+static int  temporary_name(char *filename, char *tmpname, size_t n);
+static int  put_frame(t_pending *p);
+static void lines_read(int nread);
+static void finish_readout_hooks(int status);
+static void store_frame_timing(char *filename, char *serial_number, double exptime,
+        t_frametiming *timing);
+static void store_frame_catalog(char *filename, int w, int h, double exptime, char *obs_type,
+        double temperature, int filter, char *serial_number, char *name, char *ra,
+        char *dec, char *alt, char *date, t_frametiming *timing);
+
 /* Define functions */
 
 int InitializeCamera(int camnum){
 
     int info_mode = 0;
+    int usbnum = ccd_shard*MAX_CAMERAS_PER_SHARD + camnum;
     SBIG_DEVICE_TYPE usb;
 
-    switch (camnum) {
-	case 0:
-	    usb = DEV_USB1;
-	    break;
-	case 1:
-	    usb = DEV_USB2;
-	    break;
-	case 2:
-	    usb = DEV_USB3;
-	    break;
-	case 3:
-	    usb = DEV_USB4;
-	    break;
-	default:
-	    fprintf(stderr,"Cannot assign camera.");
-	    return(1);
-	    break;
+    if (camnum < 0 || camnum >= MAX_CAMERAS_PER_SHARD || usbnum >= MAX_CAMERAS) {
+        fprintf(stderr,"Cannot assign camera.");
+        return(1);
     }
+    usb = usbdevicetable[usbnum];
 
 
     if (verbosity)
@@ -117,31 +256,37 @@ int InitializeCamera(int camnum){
 
     // Load driver
     err = SBIGUnivDrvCommand(CC_OPEN_DRIVER, NULL, NULL);
-    check_sbig_error(err,"Error opening camera driver\n");
+    if (check_sbig_error(err,"Error opening camera driver\n"))
+        return(1);
 
     // Open the device
     odp.deviceType = usb;
     err = SBIGUnivDrvCommand(CC_OPEN_DEVICE, &odp, NULL);
-    check_sbig_error(err,"Error opening device\n");
+    if (check_sbig_error(err,"Error opening device\n"))
+        return(1);
 
     // Connect to the device
     elp.sbigUseOnly = 0;
     err = SBIGUnivDrvCommand(CC_ESTABLISH_LINK, &elp, &elr);
-    check_sbig_error(err,"Link to camera could not be established\n");
+    if (check_sbig_error(err,"Link to camera could not be established\n"))
+        return(1);
 
     // Get handle for the device
     err = SBIGUnivDrvCommand(CC_GET_DRIVER_HANDLE, NULL, &gdhr);
-    check_sbig_error(err,"Could not get driver handle\n");
+    if (check_sbig_error(err,"Could not get driver handle\n"))
+        return(1);
 
     // Get camera information
     gip.request = CCD_INFO_IMAGING;
     err = SBIGUnivDrvCommand(CC_GET_CCD_INFO, &gip, &info_results_main);
-    check_sbig_error(err,"Camera information could not be determined\n");
+    if (check_sbig_error(err,"Camera information could not be determined\n"))
+        return(1);
 
     // Get camera serial number
     gip.request = CCD_INFO_EXTENDED;
     err = SBIGUnivDrvCommand(CC_GET_CCD_INFO, &gip, &info_results_extended);
-    check_sbig_error(err,"Extended camera information could not be determined\n");
+    if (check_sbig_error(err,"Extended camera information could not be determined\n"))
+        return(1);
 
     // Store camera info
     strcpy(ccd_camera_info[camnum].name,info_results_main.name);
@@ -173,15 +318,15 @@ int InitializeCamera(int camnum){
     }
 
     // Free the handle. This allows access to other cameras. If we're
-    // on the last camera don't free the handle, as no new handle can
-    // be assigned... we're at the limit of 4 cameras. Here is how
+    // on the last camera of the shard don't free the handle, as no new
+    // handle can be assigned... we're at the limit of 4 cameras. Here is how
     // the procedure is explained in the SBIG Universal Driver documentation: 
     //
     // "Each time you call Set Driver Handle with INVALID_HANDLE_VALUE 
     // you are allowing access to an additional camera up to a maximum 
     // of four cameras."
 
-    if (camnum < 3) {
+    if (camnum < MAX_CAMERAS_PER_SHARD - 1) {
         sdhp.handle = INVALID_HANDLE_VALUE;
         err = SBIGUnivDrvCommand(CC_SET_DRIVER_HANDLE,&sdhp, NULL);
 
@@ -195,6 +340,27 @@ int InitializeCamera(int camnum){
 }
 
 
+/* Select which group of four cameras on the USB bus this process drives.
+ * Shard 0 holds DEV_USB1-DEV_USB4, shard 1 holds DEV_USB5-DEV_USB8. This
+ * must be called before CountCameras(). */
+int SetCameraShard(int shard)
+{
+    if (shard < 0 || shard >= MAX_SHARDS) {
+        fprintf(stderr,"Invalid camera shard %d\n",shard);
+        return(1);
+    }
+    ccd_shard = shard;
+    return(0);
+}
+
+
+/* Number of shards needed to drive every camera found by CountCameras() */
+int CountShards()
+{
+    return((ccd_ncam_total + MAX_CAMERAS_PER_SHARD - 1)/MAX_CAMERAS_PER_SHARD);
+}
+
+
 int CountCameras()
 {
     // Load driver
@@ -206,7 +372,7 @@ int CountCameras()
     }
 
     // Query the USB bus to figure out how many cameras are hooked up.
-    err = SBIGUnivDrvCommand(CC_QUERY_USB, NULL, &qur);
+    err = SBIGUnivDrvCommand(CC_QUERY_USB2, NULL, &qur);
     if (err != CE_NO_ERROR)
     {
         fprintf(stderr,"Error querying USB bus\n");
@@ -221,7 +387,13 @@ int CountCameras()
         return(1);
     }
 
-    ccd_ncam = qur.camerasFound;
+    // Only the cameras in our own shard are visible to the caller.
+    ccd_ncam_total = qur.camerasFound;
+    ccd_ncam = ccd_ncam_total - ccd_shard*MAX_CAMERAS_PER_SHARD;
+    if (ccd_ncam < 0)
+        ccd_ncam = 0;
+    if (ccd_ncam > MAX_CAMERAS_PER_SHARD)
+        ccd_ncam = MAX_CAMERAS_PER_SHARD;
 
     return(0);
 
@@ -239,7 +411,7 @@ int  PrintUSBNetworkInformation()
     }
 
     // Query the USB bus to figure out how many cameras are hooked up.
-    err = SBIGUnivDrvCommand(CC_QUERY_USB, NULL, &qur);
+    err = SBIGUnivDrvCommand(CC_QUERY_USB2, NULL, &qur);
     if (err != CE_NO_ERROR)
     {
         fprintf(stderr,"Error querying USB bus\n");
@@ -248,25 +420,13 @@ int  PrintUSBNetworkInformation()
 
     fprintf(stdout,"Found %d cameras\n",qur.camerasFound);
     for(int i=0; i<qur.camerasFound; i++){
-        switch(i)
-        {
-            case 0:
-                fprintf(stdout,"USB1: ");
-                break;
-            case 1:
-                fprintf(stdout,"USB2: ");
-                break;
-            case 2:
-                fprintf(stdout,"USB3: ");
-                break;
-            case 3:
-                fprintf(stdout,"USB4: ");
-                break;
-            default:
-                fprintf(stdout,"Error: More than 4 cameras found.\n");
-                return(1);
+        if (i >= MAX_CAMERAS) {
+            fprintf(stdout,"Error: More than %d cameras found.\n",MAX_CAMERAS);
+            return(1);
         }
-        fprintf(stdout,"id = %-9s name = %s \n",qur.usbInfo[i].serialNumber,qur.usbInfo[i].name);
+        fprintf(stdout,"USB%d: ",i+1);
+        fprintf(stdout,"id = %-9s name = %s shard = %d\n",qur.usbInfo[i].serialNumber,qur.usbInfo[i].name,
+                i/MAX_CAMERAS_PER_SHARD);
 
     }
 
@@ -283,36 +443,47 @@ int  PrintUSBNetworkInformation()
 }
 
 
+/* Returns 1 if any camera could not be initialized */
 int InitializeAllCameras()
 {
+    int failed = 0;
+
     for (int i= 0; i < ccd_ncam; i++){
-        err = InitializeCamera(i);
-        check_sbig_error(err,"Error initializing camera\n");
+        if (InitializeCamera(i)) {
+            fprintf(stderr,"Error initializing camera %d\n",i);
+            failed = 1;
+        }
     }
-    return(0);
+    return(failed);
 }
 
 
 int DisconnectAllCameras()
 {
     for (int i=0;i<ccd_ncam;i++)
+        DisconnectCamera(i);
+
+    return(0); 
+}
+
+
+int DisconnectCamera(int camnum)
+{
+    err = SetActiveCamera(camnum);
+
+    err = SBIGUnivDrvCommand(CC_CLOSE_DEVICE, NULL, NULL);
+    if (err != CE_NO_ERROR )
     {
-        err = SetActiveCamera(i);
-    
-        err = SBIGUnivDrvCommand(CC_CLOSE_DEVICE, NULL, NULL);
-        if (err != CE_NO_ERROR )
-        {
-            fprintf (stderr, "SBIG close device error\n");
-        }
-       
-        err = SBIGUnivDrvCommand(CC_CLOSE_DRIVER, NULL, NULL);
-        if ( err != CE_NO_ERROR ) 
-        {
-            fprintf (stderr, "SBIG close driver error\n");
-        } 
+        fprintf (stderr, "SBIG close device error\n");
     }
+   
+    err = SBIGUnivDrvCommand(CC_CLOSE_DRIVER, NULL, NULL);
+    if ( err != CE_NO_ERROR ) 
+    {
+        fprintf (stderr, "SBIG close driver error\n");
+    } 
 
-    return(0); 
+    return(0);
 }
 
 
@@ -333,6 +504,73 @@ int SetActiveCamera(int camnum) {
     return(0);
 }
 
+/* Start an exposure on every camera at the same wall-clock time,
+ * start_time, given in seconds since 1970 (0 means now). Everything
+ * that can be done beforehand is, so that at start_time all that is left
+ * is to switch handles and issue CC_START_EXPOSURE2 on each camera in
+ * turn. The skew that remains is recorded in each camera's timing. */
+int StartExposuresAt(double start_time, int frame, double exposure)
+{
+    StartExposureParams2 armed[MAX_CAMERAS_PER_SHARD];
+    int status = 0;
+
+    for (int i = 0; i < ccd_ncam; i++) {
+        SetActiveCamera(i);
+        if (setup_start_exposure(&armed[i], frame, exposure))
+            return(1);
+        ccd_camera_info[i].stats.data = NULL;
+    }
+
+    if (start_time > 0) {
+        struct timespec ts;
+        struct timespec now;
+        ts.tv_sec = (time_t) start_time;
+        ts.tv_nsec = (long) ((start_time - ts.tv_sec)*1e9);
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (now.tv_sec + 1e-9*now.tv_nsec > start_time)
+            fprintf(stderr,"Armed %.3f s after the requested start time\n",
+                    now.tv_sec + 1e-9*now.tv_nsec - start_time);
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+
+    for (int i = 0; i < ccd_ncam; i++) {
+        SetActiveCamera(i);
+        err = start_exposure(&armed[i]);
+        ccd_camera_info[i].timing.scheduled_start = start_time;
+        if (check_sbig_error(err,"Request to start camera exposure ignored\n"))
+            status = 1;
+    }
+    ccd_phase = 1;
+
+    return(status);
+}
+
+
+/* Have a hook see the lines of every frame read out from now on */
+int AddReadoutHook(t_readouthook *hook)
+{
+    if (nreadout_hooks >= MAX_READOUT_HOOKS) {
+        fprintf(stderr,"Too many readout hooks\n");
+        return(1);
+    }
+    readout_hooks[nreadout_hooks++] = hook;
+    return(0);
+}
+
+
+void RemoveReadoutHook(t_readouthook *hook)
+{
+    for (int i = 0; i < nreadout_hooks; i++)
+        if (readout_hooks[i] == hook) {
+            memmove(readout_hooks + i, readout_hooks + i + 1,
+                    (nreadout_hooks - i - 1)*sizeof(t_readouthook *));
+            nreadout_hooks--;
+            return;
+        }
+}
+
+
 int ActiveCamera()
 {
     return (active_camera);
@@ -498,31 +736,11 @@ int CaptureImage(int *phase,  unsigned short *data,
 
         /* Send start request to the camera */
 
-        sep2.ccd = CCD_IMAGING;
-        sep2.readoutMode = 0;
-        sep2.abgState = ABG_LOW7;
-        if ( ( frame == LIGHT ) | (frame == FLAT) )
-        {  
-            /* Shutter open */
-            sep2.openShutter =  SC_OPEN_SHUTTER;
-        }
-        else if ( ( frame == DARK ) | (frame == BIAS ) )
-        {
-            /* Shutter closed */
-            sep2.openShutter =  SC_CLOSE_SHUTTER;
-        }
-        else
-        {
-            fprintf(stderr,"Unknown frame type requested in CaptureImage for camera %d\n",active_camera);
+        if (setup_start_exposure(&sep2, frame, exposure))
             return(1);
-        }
-        sep2.exposureTime = (int)(100.0*exposure + 0.5);
-        sep2.top = 0;
-        sep2.left = 0;
-        sep2.height = ccd_image_height;
-        sep2.width = ccd_image_width;
+        ccd_camera_info[active_camera].stats.data = NULL;
         if (verbosity) fprintf(stderr,"Calling CC_START_EXPOSURE2\n");
-        err=SBIGUnivDrvCommand(CC_START_EXPOSURE2, &sep2, NULL);   
+        err = start_exposure(&sep2);
         if (verbosity) fprintf(stderr,"Finished calling CC_START_EXPOSURE2\n");
         check_sbig_error(err,"Request to start camera exposure ignored\n");
         if (verbosity)
@@ -557,6 +775,7 @@ int CaptureImage(int *phase,  unsigned short *data,
         *phase = ccd_phase;
         return(0);
     }  
+    ccd_camera_info[active_camera].timing.exposure_complete = monotonic_time();
 
     /* Test for subarea request */
     /* If not subarea, then default to driver's values for ccd dimensions */
@@ -589,12 +808,8 @@ int CaptureImage(int *phase,  unsigned short *data,
         }
     }          
 
-    /* Flush the buffers */
-    /* This probably isn't necessary.  It's a carryover from earlier versions. */
-
     fflush(stdout);
     fflush(stderr);
-    sync();
 
     /* End the exposure */
 
@@ -609,11 +824,6 @@ int CaptureImage(int *phase,  unsigned short *data,
         return(1);
     } 
 
-    /* Prepare to read the image */
-
-    sync();
-    fflush(stdout);
-
     /* Read it */
 
     if (verbosity)
@@ -626,8 +836,10 @@ int CaptureImage(int *phase,  unsigned short *data,
 
     if (verbosity)
         fprintf(stderr,"Sending CC_START_READOUT to camera %d... ",active_camera);
+    ccd_camera_info[active_camera].timing.readout_start = monotonic_time();
     err = SBIGUnivDrvCommand(CC_START_READOUT, &srp, NULL);
     check_sbig_error(err,"Error reading out device\n");
+    start_readout_hooks(data, width, srp.height);
 
     for (i = 0; i < srp.height; ++i) 
     {
@@ -640,15 +852,19 @@ int CaptureImage(int *phase,  unsigned short *data,
         if (err != CE_NO_ERROR) 
         {
             fprintf(stderr,"Unable to read image data from camera %d\n",active_camera);
+            finish_readout_hooks(1);
             ccd_phase = 0;
             *phase = ccd_phase;
             return(1);
         }
+        lines_read(i + 1);
     }
     fprintf(stderr,"Readout successful on camera %d\n",active_camera);
 
     /* Successful readout. Send the End Readout command to the camera. */
     err = SBIGUnivDrvCommand(CC_END_READOUT, &erp, NULL);
+    ccd_camera_info[active_camera].timing.readout_end = monotonic_time();
+    finish_readout_hooks(0);
     if (err != CE_NO_ERROR) 
     {
         fprintf(stderr,"Unable to end readout from camera %d\n",active_camera);
@@ -658,6 +874,8 @@ int CaptureImage(int *phase,  unsigned short *data,
     }
 
 
+    publish_frame(data, frame, exposure, x, y, width, height);
+
     /* Indicate that a new image is available */
     if (verbosity)
         fprintf(stderr,"finished\n");
@@ -673,8 +891,16 @@ int CaptureImage(int *phase,  unsigned short *data,
 /* Write a FITS primary array with a 2-D image */
 /*   and a header with keywords                */
 /*                                             */             
+/* If the active camera has just taken an      */
+/*   exposure, its phase timings are written   */
+/*   to the header and to the nightly timing   */
+/*   log.                                      */
+/*                                             */
+/* Returns 0 once the frame is in place under  */
+/*   its real name, or 1 if it could not be    */
+/*   written.                                  */
 
-void write_fits(char *filename, int w, int h, unsigned short *data, 
+int write_fits(char *filename, int w, int h, unsigned short *data, 
 	double obs_duration, 
 	char*  obs_type, 
 	double obs_temperature,
@@ -689,7 +915,230 @@ void write_fits(char *filename, int w, int h, unsigned short *data,
 {
     fitsfile *fptr;       /* pointer to the FITS file, defined in fitsio.h */
     int status;
+    int datestatus = 0;
+    t_pending *p;
+    t_frametiming *timing = &ccd_camera_info[active_camera].timing;
+
+    timing->write_start = monotonic_time();
+
+    /* The frame is written under a temporary name and renamed into place */
+    /* when it is complete, replacing any old file of the same name.      */
+
+    if ((p = calloc(1, sizeof(t_pending))) == NULL)
+        return(1);
+    if (temporary_name(filename, p->tmpname, sizeof(p->tmpname))) {
+        free(p);
+        return(1);
+    }
+
+    /* Must initialize status before calling fitsio routines */           
+
+    status = 0;  
+
+    /* Create a new FITS file and show error message if one occurs */
+
+    if (fits_create_file(&fptr, p->tmpname, &status)) {
+	show_cfitsio_error( status );           
+        free(p);
+        return(1);
+    }
+
+    write_fits_hdu(fptr, w, h, data, obs_duration, obs_type, obs_temperature,
+            obs_filterNumber, serial_number, name, ra, dec, alt, az, &status);
+    write_checksums(fptr, w, h, data, &status);
+
+    /* Keep the DATE written by cfitsio for the catalog */
+
+    if ( fits_read_key(fptr, TSTRING, "DATE", p->date, NULL, &datestatus) )
+        strcpy(p->date, "---");
+
+    write_mask_hdu(fptr, w, h, data, serial_number, &status);
+
+    /* Close the file */             
+
+    if ( fits_close_file(fptr, &status) )              
+	show_cfitsio_error( status );           
+
+    if (status) {
+        unlink(p->tmpname + 1);
+        free(p);
+        return(1);
+    }
+
+    /* What the catalog, manifest and timing log need once it is in place */
+    timing->write_end = monotonic_time();
+    snprintf(p->filename, sizeof(p->filename), "%s", filename);
+    p->is_frame = 1;
+    p->camera = ccd_shard*MAX_CAMERAS_PER_SHARD + active_camera;
+    p->w = w;
+    p->h = h;
+    p->exptime = obs_duration;
+    snprintf(p->obs_type, sizeof(p->obs_type), "%s", obs_type);
+    p->temperature = obs_temperature;
+    p->filter = obs_filterNumber;
+    snprintf(p->serial_number, sizeof(p->serial_number), "%s", serial_number);
+    snprintf(p->name, sizeof(p->name), "%s", name);
+    snprintf(p->ra, sizeof(p->ra), "%s", ra);
+    snprintf(p->dec, sizeof(p->dec), "%s", dec);
+    snprintf(p->alt, sizeof(p->alt), "%s", alt);
+    p->timed = (timing->exposure_start > 0);
+    p->timing = *timing;
+
+    return(put_frame(p));
+}
+
+
+/* Make the same FITS file as write_fits, but in memory, optionally as a   */
+/* tile-compressed (RICE) image. On success *buffer holds *size bytes of   */
+/* FITS file, which the caller must free.                                  */
+
+int write_fits_to_memory(void **buffer, size_t *size, int compress,
+        int w, int h, unsigned short *data, 
+	double obs_duration, 
+	char*  obs_type, 
+	double obs_temperature,
+    int    obs_filterNumber,
+    char*  serial_number,
+    char*  name,
+    char*  ra,
+    char*  dec,
+    char*  alt,
+    char * az
+    )
+{
+    fitsfile *fptr;
+    int status = 0;
+    size_t allocated = 2880*((2L*w*h)/2880 + 20);
+    LONGLONG headstart, datastart, dataend;
+
+    *buffer = malloc(allocated);
+    *size = allocated;
+    if (*buffer == NULL)
+        return(1);
+
+    if (fits_create_memfile(&fptr, buffer, size, 2880*100, realloc, &status)) {
+	show_cfitsio_error( status );
+        free(*buffer);
+        return(1);
+    }
+    if (compress && fits_set_compression_type(fptr, RICE_1, &status))
+	show_cfitsio_error( status );
+
+    write_fits_hdu(fptr, w, h, data, obs_duration, obs_type, obs_temperature,
+            obs_filterNumber, serial_number, name, ra, dec, alt, az, &status);
+
+    /* A compressed image's data unit is a table of compressed tiles, so */
+    /* its checksums have to be made from what cfitsio wrote (in memory) */
+    if (compress) {
+        if ( fits_write_chksum(fptr, &status) )
+            show_cfitsio_error( status );
+    }
+    else
+        write_checksums(fptr, w, h, data, &status);
+    write_mask_hdu(fptr, w, h, data, serial_number, &status);
+
+    /* The buffer may be bigger than the file, so find where the file ends */
+    if ( fits_flush_file(fptr, &status) || fits_get_hduaddrll(fptr, &headstart, &datastart, &dataend, &status) )
+	show_cfitsio_error( status );
+    if ( fits_close_file(fptr, &status) )              
+	show_cfitsio_error( status );           
+
+    if (status) {
+        free(*buffer);
+        return(1);
+    }
+    dataend = 2880*((dataend + 2879)/2880);
+    if (dataend < *size)
+        *size = dataend;
+    return(0);
+}
+
+
+/* Read a FITS file into memory, tile-compressing (RICE) its images if    */
+/* compress is set, as write_fits_to_memory makes them. For a frame that  */
+/* is already on the disk, e.g. one passed to the frame hook.             */
+
+int read_fits_to_memory(void **buffer, size_t *size, int compress, char *filename)
+{
+    fitsfile *infptr, *fptr;
+    int status = 0;
+    int hdutype;
+    struct stat sb;
+    LONGLONG headstart, datastart, dataend;
+
+    if (stat(filename, &sb) != 0)
+        return(1);
+    *size = 2880*(sb.st_size/2880 + 20);
+    if ((*buffer = malloc(*size)) == NULL)
+        return(1);
+
+    if (fits_open_file(&infptr, filename, READONLY, &status)) {
+	show_cfitsio_error( status );
+        free(*buffer);
+        return(1);
+    }
+    if (fits_create_memfile(&fptr, buffer, size, 2880*100, realloc, &status)) {
+	show_cfitsio_error( status );
+        fits_close_file(infptr, &status);
+        free(*buffer);
+        return(1);
+    }
+    if (compress && fits_set_compression_type(fptr, RICE_1, &status))
+	show_cfitsio_error( status );
+
+    for (int hdu = 1; status == 0; hdu++) {
+        if (fits_movabs_hdu(infptr, hdu, &hdutype, &status)) {
+            if (status == END_OF_FILE)
+                status = 0;
+            break;
+        }
+        if (compress && hdutype == IMAGE_HDU) {
+            fits_img_compress(infptr, fptr, &status);
+            fits_write_chksum(fptr, &status);
+        }
+        else
+            fits_copy_hdu(infptr, fptr, 0, &status);
+    }
+
+    /* The buffer may be bigger than the file, so find where the file ends */
+    if ( status || fits_flush_file(fptr, &status)
+            || fits_get_hduaddrll(fptr, &headstart, &datastart, &dataend, &status) )
+	show_cfitsio_error( status );
+    fits_close_file(fptr, &status);
+    fits_close_file(infptr, &status);
+
+    if (status) {
+        free(*buffer);
+        return(1);
+    }
+    dataend = 2880*((dataend + 2879)/2880);
+    if (dataend < *size)
+        *size = dataend;
+    return(0);
+}
+
+
+/* Write the image and all of our keywords to the current HDU */
+
+static void write_fits_hdu(fitsfile *fptr, int w, int h, unsigned short *data, 
+	double obs_duration, 
+	char*  obs_type, 
+	double obs_temperature,
+    int    obs_filterNumber,
+    char*  serial_number,
+    char*  name,
+    char*  ra,
+    char*  dec,
+    char*  alt,
+    char * az,
+    int   *statusp
+    )
+{
     long  fpixel, nelements;
+    t_frametiming *timing = &ccd_camera_info[active_camera].timing;
+    t_readoutstats *stats = &ccd_camera_info[active_camera].stats;
+    int timed = (timing->exposure_start > 0);
+    int status = *statusp;
 
     /* Initialize FITS image parameters */
 
@@ -702,19 +1151,6 @@ void write_fits(char *filename, int w, int h, unsigned short *data,
     naxes[0] = w;
     naxes[1] = h;
 
-    /* Delete old FITS file if it already exists */  
-
-    remove(filename); 
-
-    /* Must initialize status before calling fitsio routines */           
-
-    status = 0;  
-
-    /* Create a new FITS file and show error message if one occurs */
-
-    if (fits_create_file(&fptr, filename, &status)) 
-	show_cfitsio_error( status );           
-
     /* Write the required keywords for the primary array image.       */
     /* Since bitpix = USHORT_IMG, this will cause cfitsio to create   */
     /* a FITS image with BITPIX = 16 (signed short integers) with     */
@@ -790,65 +1226,1436 @@ void write_fits(char *filename, int w, int h, unsigned short *data,
 		"Azimuth (deg)", &status) )
 	show_cfitsio_error( status );
 
-    /* Close the file */             
+    /* Pixel statistics, if they were gathered as this frame was read out */
 
-    if ( fits_close_file(fptr, &status) )              
-	show_cfitsio_error( status );           
+    if (stats->data == data && stats->width == w && stats->height == h) {
+        int datamin = stats->min, datamax = stats->max;
 
-    return;
+        if ( fits_update_key(fptr, TINT, "DATAMIN", &datamin,
+                    "minimum pixel value", &status) )
+            show_cfitsio_error( status );
+
+        if ( fits_update_key(fptr, TINT, "DATAMAX", &datamax,
+                    "maximum pixel value", &status) )
+            show_cfitsio_error( status );
+
+        if ( fits_update_key(fptr, TLONG, "NSATUR", &stats->nsaturated,
+                    "pixels at 65535", &status) )
+            show_cfitsio_error( status );
+    }
+
+    /* Write the exposure timing. Phases are in seconds after the start. */
+
+    if (timed) {
+        char date_obs[32];
+        format_utc_time(timing->date_obs, date_obs);
+
+        if ( fits_update_key_str(fptr, "DATE-OBS", 
+                    date_obs, "UTC at start of exposure", &status) )
+            show_cfitsio_error( status );  
+
+        if (timing->scheduled_start > 0) {
+            if ( fits_update_key_dbl(fptr, "STARTOFF", timing->date_obs - timing->scheduled_start, -4,
+                        "start minus requested start time (s)", &status) )
+                show_cfitsio_error( status );
+        }
+
+        if ( fits_update_key_dbl(fptr, "EXPDONE", timing->exposure_complete - timing->exposure_start, -4,
+                    "integration complete detected (s after start)", &status) )
+            show_cfitsio_error( status );
+
+        if ( fits_update_key_dbl(fptr, "RDSTART", timing->readout_start - timing->exposure_start, -4,
+                    "readout started (s after start)", &status) )
+            show_cfitsio_error( status );
+
+        if ( fits_update_key_dbl(fptr, "RDEND", timing->readout_end - timing->exposure_start, -4,
+                    "readout ended (s after start)", &status) )
+            show_cfitsio_error( status );
+
+        if ( fits_update_key_dbl(fptr, "WRSTART", timing->write_start - timing->exposure_start, -4,
+                    "file write started (s after start)", &status) )
+            show_cfitsio_error( status );
+    }
+
+    *statusp = status;
 }
 
 
-/* Print cfitsio error report */
+/* Announce a new frame on the manifest FIFO. Nothing is written unless */
+/* something (such as "framewatch -m") has the FIFO open for reading,   */
+/* and a line is short enough that lines from several programs writing */
+/* at once never interleave.                                            */
 
-void show_cfitsio_error(int status)
+static void store_frame_manifest(char *filename, char *serial_number, char *obs_type,
+        double exptime, int w, int h, int camera)
 {
-    if (status)
-    {
-	fits_report_error(stderr, status); 
+    char line[1024];
+    char cwd[512] = "";
+    struct timespec now;
+    struct stat sb;
+    int manifestfd;
+
+    if ((manifestfd = open(manifestfifo, O_WRONLY|O_NONBLOCK)) < 0)
+        return;
+    if (fstat(manifestfd, &sb) != 0 || !S_ISFIFO(sb.st_mode)) {
+        close(manifestfd);
+        return;
     }
-    return;
-}  
+    if (filename[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL)
+        strcat(cwd, "/");
+    clock_gettime(CLOCK_REALTIME, &now);
+    snprintf(line, sizeof(line),
+            "%.3f frame file=%s%s serial=%s imtype=%s exptime=%.3f width=%d height=%d camera=%d\n",
+            now.tv_sec + 1e-9*now.tv_nsec, cwd, filename, serial_number, obs_type,
+            exptime, w, h, camera);
+    write(manifestfd, line, strlen(line));
+    close(manifestfd);
+}
 
 
-/* Check for error and print error message */
-int check_sbig_error(int err, char *msg)
+/* Durable writes. A frame goes to "dir/.name.PID.N.tmp" ("!" tells cfitsio */
+/* to overwrite any leftover from a crash) and is renamed over "dir/name"   */
+/* once it is closed. Its rows in the catalog and timing log, its line on   */
+/* the manifest and the frame hook (see SetFrameHook()) all wait for the    */
+/* rename, so nothing is told about a frame before it is in place. How much */
+/* more is done depends on the durability policy:                           */
+/*                                                                          */
+/*   DURABLE_NONE   the frame is renamed at once and the kernel writes it   */
+/*                  back in its own time, so a power cut can leave a short  */
+/*                  frame under the real name.                              */
+/*   DURABLE_ASYNC  the default. A background thread flushes the frame with */
+/*                  fdatasync(), renames it and flushes its directory, so   */
+/*                  the cameras never wait for the disk and the real name   */
+/*                  only ever holds a whole frame. The frames still queued  */
+/*                  for the thread, normally just the last one or two, are  */
+/*                  lost in a crash or power cut (only their .tmp files are */
+/*                  left) and are not yet in the catalog; WaitForDurability */
+/*                  waits for them, and is called at exit.                  */
+/*   DURABLE_SYNC   as DURABLE_ASYNC, but all before write_fits() returns.  */
+/*                                                                          */
+/* These replace the sync() calls that used to be made before every        */
+/* readout, which flushed every dirty page on the machine.                  */
+
+void SetDurability(int policy)
 {
-    if (err != CE_NO_ERROR)
-    {
-        fprintf(stderr,"%s",msg);
-        return(1);
-    }
-    return(0);
+    durability = policy;
 }
 
 
-/* Utility routine */
-int value_from_imagetype_key(char *key)
+void SetFrameHook(void (*hook)(char *filename))
 {
-    int i;
-    for (i=0; i < NIMAGETYPEKEYS; i++) {
-	t_keyval *sym = imagetypelookuptable + i;
-	if (strcmp(sym->key, key) == 0)
-	    return sym->val;
-    }
-    return BADKEY;
+    frame_hook = hook;
 }
 
-int value_from_filtername_key(char *key)
+
+static int current_durability()
 {
-    int i;
-    for (i=0; i < NFILTERNAMEKEYS; i++) {
-	t_keyval *sym = filternamelookuptable + i;
-	if (strcmp(sym->key, key) == 0)
-	    return sym->val;
+    char *policy;
+
+    if (durability < 0) {
+        durability = DURABLE_ASYNC;
+        if ((policy = getenv("SBIG_DURABILITY")) != NULL) {
+            if (strcmp(policy, "none") == 0)
+                durability = DURABLE_NONE;
+            else if (strcmp(policy, "sync") == 0)
+                durability = DURABLE_SYNC;
+            else if (strcmp(policy, "async") != 0)
+                fprintf(stderr,"Unknown SBIG_DURABILITY %s: using async\n",policy);
+        }
     }
-    return BADKEY;
+    return(durability);
 }
 
-/* Display a progress bar                               */
-/* Process has done i out of n rounds,                  */
-/* and we want a bar of width w and resolution r.       */
+
+/* The temporary name carries the process id, so the shards of "array",   */
+/* which write into the same directory at the same moment, never share it, */
+/* and a count, so a frame still waiting to be renamed is never            */
+/* overwritten by the next one written under the same name.               */
+static int temporary_name(char *filename, char *tmpname, size_t n)
+{
+    static unsigned int count = 0;
+    char dir[1024], path[1024], base[1024];
+    char *dot;
+
+    snprintf(dir, sizeof(dir), "%s", filename);
+    snprintf(path, sizeof(path), "%s", filename);
+    snprintf(base, sizeof(base), "%s", basename(path));
+    if ((dot = strstr(base, ".fits")) != NULL && dot[5] == '\0')
+        *dot = '\0';
+    if ((size_t) snprintf(tmpname, n, "!%s/.%s.%ld.%u.tmp", dirname(dir), base,
+                (long) getpid(), count++) >= n) {
+        fprintf(stderr,"File name %s is too long\n",filename);
+        return(1);
+    }
+    return(0);
+}
+
+
+/* Flush a file, or a directory, to disk */
+static int flush_path(char *path)
+{
+    int fd, rc;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return(1);
+    rc = fdatasync(fd);
+    close(fd);
+    return(rc != 0);
+}
+
+
+/* Move a closed frame into place under its real name, flushing it first */
+/* and its directory after unless the policy is DURABLE_NONE. The        */
+/* temporary file is removed if anything goes wrong.                     */
+static int install_frame(t_pending *p, int policy)
+{
+    char *tmpname = p->tmpname + 1;     // past the "!"
+    char dir[1024];
+
+    if (policy != DURABLE_NONE && flush_path(tmpname)) {
+        fprintf(stderr,"Unable to flush %s to disk: %s\n",p->filename,strerror(errno));
+        unlink(tmpname);
+        return(1);
+    }
+    if (rename(tmpname, p->filename) != 0) {
+        fprintf(stderr,"Unable to rename %s to %s: %s\n",tmpname,p->filename,strerror(errno));
+        unlink(tmpname);
+        return(1);
+    }
+    snprintf(dir, sizeof(dir), "%s", p->filename);
+    if (policy != DURABLE_NONE && flush_path(dirname(dir)))
+        fprintf(stderr,"Unable to flush directory of %s: %s\n",p->filename,strerror(errno));
+    return(0);
+}
+
+
+/* Announce a frame that is in place. Frames can be installed by the       */
+/* background thread and by write_fits() at once (when the queue is full), */
+/* so this is done under a lock to keep the frame hook to one at a time.   */
+static void finish_frame(t_pending *p)
+{
+    static pthread_mutex_t finishing = PTHREAD_MUTEX_INITIALIZER;
+
+    if (!p->is_frame)
+        return;
+    pthread_mutex_lock(&finishing);
+    if (p->timed)
+        store_frame_timing(p->filename, p->serial_number, p->exptime, &p->timing);
+    store_frame_catalog(p->filename, p->w, p->h, p->exptime, p->obs_type, p->temperature,
+            p->filter, p->serial_number, p->name, p->ra, p->dec, p->alt, p->date, &p->timing);
+    store_frame_manifest(p->filename, p->serial_number, p->obs_type, p->exptime,
+            p->w, p->h, p->camera);
+    if (frame_hook != NULL)
+        frame_hook(p->filename);
+    pthread_mutex_unlock(&finishing);
+}
+
+
+static void *run_flusher(void *arg)
+{
+    t_pending *p;
+
+    pthread_mutex_lock(&flusher.lock);
+    for (;;) {
+        while (flusher.count == 0) {
+            pthread_cond_broadcast(&flusher.idle);
+            pthread_cond_wait(&flusher.wake, &flusher.lock);
+        }
+        p = flusher.frame[flusher.head];
+        pthread_mutex_unlock(&flusher.lock);
+
+        if (install_frame(p, DURABLE_ASYNC) == 0)
+            finish_frame(p);
+        else {
+            pthread_mutex_lock(&flusher.lock);
+            flusher.failed++;
+            pthread_mutex_unlock(&flusher.lock);
+        }
+        free(p);
+
+        pthread_mutex_lock(&flusher.lock);
+        flusher.head = (flusher.head + 1) % FLUSH_QUEUE;
+        flusher.count--;
+    }
+    return(NULL);
+}
+
+
+/* Block until every frame queued for the background thread is in place. */
+/* Returns the number that could not be put in place since the last call. */
+int WaitForDurability()
+{
+    int failed;
+
+    pthread_mutex_lock(&flusher.lock);
+    while (flusher.started > 0 && flusher.count > 0)
+        pthread_cond_wait(&flusher.idle, &flusher.lock);
+    failed = flusher.failed;
+    flusher.failed = 0;
+    pthread_mutex_unlock(&flusher.lock);
+    return(failed);
+}
+
+
+static void wait_at_exit()
+{
+    WaitForDurability();
+}
+
+
+/* Put a closed frame in place, or hand it to the background thread with */
+/* DURABLE_ASYNC. Takes p, which must have come from malloc().            */
+static int put_frame(t_pending *p)
+{
+    int policy = current_durability();
+    int rc;
+
+    if (policy == DURABLE_ASYNC) {
+        pthread_mutex_lock(&flusher.lock);
+        if (!flusher.started) {
+            if (pthread_create(&flusher.thread, NULL, run_flusher, NULL) == 0) {
+                pthread_detach(flusher.thread);
+                flusher.started = 1;
+                atexit(wait_at_exit);
+            }
+            else
+                flusher.started = -1;
+        }
+        if (flusher.started > 0 && flusher.count < FLUSH_QUEUE) {
+            flusher.frame[(flusher.head + flusher.count) % FLUSH_QUEUE] = p;
+            flusher.count++;
+            pthread_cond_signal(&flusher.wake);
+            pthread_mutex_unlock(&flusher.lock);
+            return(0);
+        }
+        pthread_mutex_unlock(&flusher.lock);
+    }
+
+    /* Otherwise do it here: the thread can't be started or is far behind */
+    if ((rc = install_frame(p, policy)) == 0)
+        finish_frame(p);
+    free(p);
+    return(rc);
+}
+
+
+/* Run the readout hooks over the lines of the current frame as they    */
+/* arrive. Each hook is called once it has a full block of new lines    */
+/* (or whatever is left once the readout is over).                      */
+
+static void *run_readout_hooks(void *arg)
+{
+    int next[MAX_READOUT_HOOKS] = { 0 };
+    int nread, done, wanted;
+
+    for (int h = 0; h < nreadout_hooks; h++)
+        if (readout_hooks[h]->start)
+            readout_hooks[h]->start(readout_hooks[h]->context, readout.camera,
+                    readout.data, readout.width, readout.height);
+    do {
+        wanted = readout.height;
+        for (int h = 0; h < nreadout_hooks; h++) {
+            int block = readout_hooks[h]->block > 0 ? readout_hooks[h]->block : 1;
+            if (next[h] + block < wanted)
+                wanted = next[h] + block;
+        }
+        pthread_mutex_lock(&readout.lock);
+        while (!readout.done && readout.nread < wanted)
+            pthread_cond_wait(&readout.more, &readout.lock);
+        nread = readout.nread;
+        done = readout.done;
+        pthread_mutex_unlock(&readout.lock);
+
+        for (int h = 0; h < nreadout_hooks; h++) {
+            int block = readout_hooks[h]->block > 0 ? readout_hooks[h]->block : 1;
+            while (next[h] < nread && (nread - next[h] >= block || done)) {
+                int n = nread - next[h] < block ? nread - next[h] : block;
+                readout_hooks[h]->lines(readout_hooks[h]->context, readout.camera,
+                        readout.data + (long) next[h]*readout.width, next[h], n, readout.width);
+                next[h] += n;
+            }
+        }
+    } while (!done);
+    for (int h = 0; h < nreadout_hooks; h++)
+        if (readout_hooks[h]->end)
+            readout_hooks[h]->end(readout_hooks[h]->context, readout.camera, readout.status);
+    return(NULL);
+}
+
+
+static void start_readout_hooks(unsigned short *data, int width, int height)
+{
+    readout.data = data;
+    readout.camera = active_camera;
+    readout.width = width;
+    readout.height = height;
+    readout.nread = 0;
+    readout.done = 0;
+    readout.status = 0;
+    readout.threaded = (pthread_create(&readout.thread, NULL, run_readout_hooks, NULL) == 0);
+}
+
+
+static void lines_read(int nread)
+{
+    if (!readout.threaded)
+        return;
+    pthread_mutex_lock(&readout.lock);
+    readout.nread = nread;
+    pthread_cond_signal(&readout.more);
+    pthread_mutex_unlock(&readout.lock);
+}
+
+
+/* Wait for the hooks to see the rest of the frame. Without a thread */
+/* they see it all now.                                              */
+static void finish_readout_hooks(int status)
+{
+    pthread_mutex_lock(&readout.lock);
+    readout.done = 1;
+    readout.status = status;
+    if (!readout.threaded && status == 0)
+        readout.nread = readout.height;
+    pthread_cond_signal(&readout.more);
+    pthread_mutex_unlock(&readout.lock);
+    if (readout.threaded)
+        pthread_join(readout.thread, NULL);
+    else
+        run_readout_hooks(NULL);
+}
+
+
+/* The built-in hook: the pixel statistics written to the FITS header */
+
+static void stats_start(void *context, int camera, unsigned short *data, int width, int height)
+{
+    t_readoutstats *stats = &ccd_camera_info[camera].stats;
+
+    stats->data = data;
+    stats->width = width;
+    stats->height = height;
+    stats->min = 65535;
+    stats->max = 0;
+    stats->nsaturated = 0;
+    memset((t_pixelsums *) context + camera, 0, sizeof(t_pixelsums));
+}
+
+
+static void stats_lines(void *context, int camera, unsigned short *data, int first, int nlines, int width)
+{
+    t_readoutstats *stats = &ccd_camera_info[camera].stats;
+    t_pixelsums *sums = (t_pixelsums *) context + camera;
+    unsigned short min = stats->min, max = stats->max;
+    long n = (long) nlines*width, nsaturated = 0;
+    uint64_t sum = 0;
+
+    for (long i = 0; i < n; i++) {
+        unsigned short v = data[i];
+        sum += v;
+        if (v < min) min = v;
+        if (v > max) max = v;
+        nsaturated += (v == 65535);
+    }
+    stats->min = min;
+    stats->max = max;
+    stats->nsaturated += nsaturated;
+    sums->sum += sum;
+    add_to_datasum(sums, data, (long) first*width, n);
+}
+
+
+static void stats_end(void *context, int camera, int status)
+{
+    t_readoutstats *stats = &ccd_camera_info[camera].stats;
+    t_pixelsums *sums = (t_pixelsums *) context + camera;
+    long npix = (long) stats->width*stats->height;
+
+    if (status || npix == 0)
+        stats->data = NULL;
+    else {
+        stats->mean = (double) sums->sum/npix;
+        stats->datasum = datasum_value(sums);
+    }
+}
+
+
+/* FITS checksums (the convention cfitsio follows). write_fits() stores    */
+/* pixels as big-endian 16-bit integers offset by BZERO = 32768, i.e. with */
+/* the top bit flipped, and DATASUM is the 32-bit ones' complement sum of  */
+/* the data taken as big-endian 32-bit words. A word is the pixels at an   */
+/* even and the following odd position, so the sum is built from the sums */
+/* of the even (high) and odd (low) halves. These are gathered in runs     */
+/* short enough that 32-bit lanes cannot overflow, which the compiler      */
+/* turns into vector adds.                                                 */
+
+static void add_to_datasum(t_pixelsums *sums, unsigned short *data, long first, long n)
+{
+    long i = 0;
+
+    if (n > 0 && (first & 1)) {
+        sums->lo += data[0] ^ 0x8000;
+        i = 1;
+    }
+    while (n - i >= 2) {
+        long npairs = (n - i)/2 < 65536 ? (n - i)/2 : 65536;
+        unsigned short *p = data + i;
+        uint32_t hi = 0, lo = 0;
+        for (long k = 0; k < npairs; k++) {
+            hi += p[2*k] ^ 0x8000;
+            lo += p[2*k + 1] ^ 0x8000;
+        }
+        sums->hi += hi;
+        sums->lo += lo;
+        i += 2*npairs;
+    }
+    if (i < n)
+        sums->hi += data[i] ^ 0x8000;
+}
+
+
+/* Fold the sums into 32 bits with the end-around carry */
+static unsigned long datasum_value(t_pixelsums *sums)
+{
+    uint64_t sum = (sums->hi << 16) + sums->lo;
+
+    while (sum >> 32)
+        sum = (sum & 0xffffffff) + (sum >> 32);
+    return (unsigned long) sum;
+}
+
+
+/* Write DATASUM and CHECKSUM for an image written by write_fits_hdu(). The */
+/* data sum made during readout is used if it describes this frame, so the  */
+/* pixels are not summed again; cfitsio then only has to sum the header.    */
+
+static void write_checksums(fitsfile *fptr, int w, int h, unsigned short *data, int *statusp)
+{
+    t_readoutstats *stats = &ccd_camera_info[active_camera].stats;
+    unsigned long datasum;
+    char value[32];
+    int status = *statusp;
+
+    if (stats->data == data && stats->width == w && stats->height == h)
+        datasum = stats->datasum;
+    else {
+        t_pixelsums sums = { 0, 0, 0 };
+        add_to_datasum(&sums, data, 0, (long) w*h);
+        datasum = datasum_value(&sums);
+    }
+    snprintf(value, sizeof(value), "%lu", datasum);
+
+    if ( fits_update_key_str(fptr, "DATASUM", value, "data unit checksum", &status) )
+        show_cfitsio_error( status );
+
+    if ( fits_update_chksum(fptr, &status) )
+        show_cfitsio_error( status );
+
+    *statusp = status;
+}
+
+
+/* Defect masks. When masking is on, write_fits() follows each frame  */
+/* with a PLIO-compressed MASK extension flagging its bad pixels: those */
+/* in the camera's bad pixel maps, saturated ones, and cosmic rays. A   */
+/* cosmic ray is a pixel whose Laplacian (its height above the mean of  */
+/* its four neighbours) is more than CR_SIGMA times the noise, and that */
+/* stands CR_CONTRAST times higher above the sky than one pair of       */
+/* opposite neighbours, which a star cannot but a pixel in the middle   */
+/* of a track can. Its neighbours more than CR_GROW_SIGMA above the sky */
+/* are flagged too, to catch the ends of the track. The frame is split  */
+/* into strips of rows, one thread each.                                */
+
+void SetDefectMasking(char *bpmdir)
+{
+    for (int i = 0; i < nbad_pixel_maps; i++)
+        free(bad_pixel_maps[i].map);
+    nbad_pixel_maps = 0;
+    masking = (bpmdir != NULL);
+    if (bpmdir)
+        snprintf(bad_pixel_dir, sizeof(bad_pixel_dir), "%s", bpmdir);
+}
+
+
+static int current_masking()
+{
+    if (masking < 0)
+        SetDefectMasking(getenv("SBIG_MASKS"));
+    return(masking);
+}
+
+
+/* Add the bad pixels of one map made by combine to a camera's map */
+static void read_bad_pixel_map(char *filename, int n)
+{
+    fitsfile *fptr;
+    long naxes[2] = { 0, 0 };
+    unsigned char *map;
+    int status = 0;
+
+    if (fits_open_file(&fptr, filename, READONLY, &status)
+            || fits_get_img_size(fptr, 2, naxes, &status)) {
+        show_cfitsio_error( status );
+        return;
+    }
+    if (bad_pixel_maps[n].map == NULL) {
+        bad_pixel_maps[n].width = naxes[0];
+        bad_pixel_maps[n].height = naxes[1];
+        bad_pixel_maps[n].map = calloc(naxes[0]*naxes[1], 1);
+    }
+    if (naxes[0] != bad_pixel_maps[n].width || naxes[1] != bad_pixel_maps[n].height)
+        fprintf(stderr,"Bad pixel map %s is the wrong size: ignored\n",filename);
+    else if ((map = malloc(naxes[0]*naxes[1])) != NULL) {
+        if (fits_read_img(fptr, TBYTE, 1, naxes[0]*naxes[1], NULL, map, NULL, &status) == 0)
+            for (long i = 0; i < naxes[0]*naxes[1]; i++)
+                bad_pixel_maps[n].map[i] |= map[i];
+        else
+            show_cfitsio_error( status );
+        free(map);
+    }
+    status = 0;
+    fits_close_file(fptr, &status);
+}
+
+
+/* A camera's bad pixel map: all its master_SERIAL_TYPE_bpm.fits maps in   */
+/* the bad pixel directory put together, read the first time it is needed. */
+/* NULL if it has none, or they do not fit the frame (e.g. a subframe).    */
+static unsigned char *bad_pixel_map(char *serial_number, int w, int h)
+{
+    char pattern[1200];
+    glob_t glob_results;
+    int n;
+
+    for (n = 0; n < nbad_pixel_maps; n++)
+        if (strcmp(bad_pixel_maps[n].serial_number, serial_number) == 0)
+            break;
+    if (n == nbad_pixel_maps) {
+        if (n == MAX_CAMERAS)
+            return(NULL);
+        memset(&bad_pixel_maps[n], 0, sizeof(bad_pixel_maps[n]));
+        snprintf(bad_pixel_maps[n].serial_number, sizeof(bad_pixel_maps[n].serial_number),
+                "%s", serial_number);
+        nbad_pixel_maps++;
+        snprintf(pattern, sizeof(pattern), "%s/master_%s_*_bpm.fits", bad_pixel_dir, serial_number);
+        if (glob(pattern, 0, NULL, &glob_results) == 0) {
+            for (size_t i = 0; i < glob_results.gl_pathc; i++)
+                read_bad_pixel_map(glob_results.gl_pathv[i], n);
+            globfree(&glob_results);
+        }
+    }
+    if (bad_pixel_maps[n].width != w || bad_pixel_maps[n].height != h)
+        return(NULL);
+    return(bad_pixel_maps[n].map);
+}
+
+
+typedef struct {
+    unsigned short *data;
+    unsigned char *bpm;
+    unsigned char *mask;
+    int width;
+    int height;
+    int first;                    // Rows of the strip
+    int last;
+    int sky;
+    int threshold;                // On four times the Laplacian
+} t_maskstrip;
+
+
+static void *mask_strip(void *arg)
+{
+    t_maskstrip *strip = (t_maskstrip *) arg;
+    int w = strip->width, sky = strip->sky, threshold = strip->threshold;
+
+    for (int y = strip->first; y < strip->last; y++) {
+        unsigned short *restrict row = strip->data + (long) y*w;
+        unsigned char *restrict mask = strip->mask + (long) y*w;
+
+        for (int x = 0; x < w; x++)
+            mask[x] = (row[x] == 65535)*MASK_SATURATED;
+        if (strip->bpm) {
+            unsigned char *restrict bpm = strip->bpm + (long) y*w;
+            for (int x = 0; x < w; x++)
+                mask[x] |= (bpm[x] != 0)*MASK_BADPIXEL;
+        }
+        if (y == 0 || y == strip->height - 1)
+            continue;
+
+        unsigned short *restrict up = row - w;
+        unsigned short *restrict down = row + w;
+        for (int x = 1; x < w - 1; x++) {
+            int height = row[x] - sky;
+            int across = up[x] + down[x], along = row[x-1] + row[x+1];
+            int laplacian = 4*row[x] - across - along;
+            int lower = across < along ? across : along;
+            mask[x] |= ((laplacian > threshold)
+                    & (CR_CONTRAST*(lower - 2*sky) < 2*height))*MASK_COSMIC;
+        }
+    }
+    return(NULL);
+}
+
+
+static int compare_ints(const void *a, const void *b)
+{
+    int x = *(const int *) a, y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+
+/* Fill in the mask of a frame. Returns the number of cosmic ray pixels. */
+static long build_mask(unsigned short *data, unsigned char *bpm, unsigned char *mask, int w, int h)
+{
+    t_maskstrip strips[MAX_MASK_THREADS];
+    pthread_t threads[MAX_MASK_THREADS];
+    int started[MAX_MASK_THREADS];
+    int nsample = 0, nstrips, sky, level;
+    long ncosmic = 0;
+    int *values, *laplacians;
+
+    /* The sky, and the noise in the Laplacian, from a sample of the frame */
+    values = malloc(((w/MASK_SAMPLE + 1)*(h/MASK_SAMPLE + 1))*sizeof(int));
+    laplacians = malloc(((w/MASK_SAMPLE + 1)*(h/MASK_SAMPLE + 1))*sizeof(int));
+    if (values == NULL || laplacians == NULL) {
+        free(values);
+        free(laplacians);
+        return(-1);
+    }
+    for (int y = 1; y < h - 1; y += MASK_SAMPLE)
+        for (int x = 1; x < w - 1; x += MASK_SAMPLE) {
+            unsigned short *p = data + (long) y*w + x;
+            values[nsample] = p[0];
+            laplacians[nsample++] = 4*p[0] - p[-w] - p[w] - p[-1] - p[1];
+        }
+    if (nsample == 0) {
+        free(values);
+        free(laplacians);
+        return(-1);
+    }
+    qsort(values, nsample, sizeof(int), compare_ints);
+    qsort(laplacians, nsample, sizeof(int), compare_ints);
+    sky = values[nsample/2];
+    for (int i = 0; i < nsample; i++)
+        values[i] = abs(laplacians[i] - laplacians[nsample/2]);
+    qsort(values, nsample, sizeof(int), compare_ints);
+    double sigma = 1.4826*values[nsample/2]/4;     // Of the Laplacian
+    if (sigma < 1)
+        sigma = 1;
+    level = (int) (CR_GROW_SIGMA*sigma);
+    free(values);
+    free(laplacians);
+
+    nstrips = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nstrips > MAX_MASK_THREADS)
+        nstrips = MAX_MASK_THREADS;
+    if (nstrips > h/64)
+        nstrips = h/64;
+    if (nstrips < 1)
+        nstrips = 1;
+    for (int i = 0; i < nstrips; i++) {
+        t_maskstrip strip = { data, bpm, mask, w, h, (int) ((long) h*i/nstrips),
+            (int) ((long) h*(i + 1)/nstrips), sky, (int) (4*CR_SIGMA*sigma) };
+        strips[i] = strip;
+        started[i] = (i > 0 && pthread_create(&threads[i], NULL, mask_strip, &strips[i]) == 0);
+    }
+    mask_strip(&strips[0]);
+    for (int i = 1; i < nstrips; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            mask_strip(&strips[i]);
+    }
+
+    /* Grow the cosmic rays into the pixels next to them */
+    for (int y = 1; y < h - 1; y++) {
+        unsigned char *m = mask + (long) y*w;
+        unsigned short *p = data + (long) y*w;
+        for (int x = 1; x < w - 1; x++) {
+            if (!(m[x] & MASK_COSMIC))
+                continue;
+            long near[4] = { x - 1, x + 1, x - w, x + w };
+            for (int k = 0; k < 4; k++)
+                if (!(m[near[k]] & MASK_COSMIC) && p[near[k]] > sky + level)
+                    m[near[k]] |= MASK_GROWN;
+        }
+    }
+    for (long i = 0; i < (long) w*h; i++) {
+        if (mask[i] & MASK_GROWN)
+            mask[i] = (mask[i] & ~MASK_GROWN) | MASK_COSMIC;
+        ncosmic += (mask[i] & MASK_COSMIC) != 0;
+    }
+    return(ncosmic);
+}
+
+
+/* Write the MASK extension after a frame's primary HDU */
+static void write_mask_hdu(fitsfile *fptr, int w, int h, unsigned short *data,
+        char *serial_number, int *statusp)
+{
+    long naxes[2] = { w, h };
+    long ncosmic, nbad = 0, nsaturated = 0;
+    unsigned char *mask, *bpm;
+    int status = *statusp;
+
+    if (status || !current_masking())
+        return;
+    if ((mask = malloc((long) w*h)) == NULL) {
+        fprintf(stderr,"Not enough memory for the defect mask\n");
+        return;
+    }
+    bpm = bad_pixel_map(serial_number, w, h);
+    if ((ncosmic = build_mask(data, bpm, mask, w, h)) < 0) {
+        fprintf(stderr,"Unable to make the defect mask\n");
+        free(mask);
+        return;
+    }
+    for (long i = 0; i < (long) w*h; i++) {
+        nbad += mask[i] & MASK_BADPIXEL;
+        nsaturated += (mask[i] & MASK_SATURATED) != 0;
+    }
+
+    fits_set_compression_type(fptr, PLIO_1, &status);
+    fits_create_img(fptr, BYTE_IMG, 2, naxes, &status);
+    fits_write_img(fptr, TBYTE, 1, (LONGLONG) w*h, mask, &status);
+    fits_update_key_str(fptr, "EXTNAME", "MASK", "defect mask", &status);
+    fits_write_comment(fptr, "1 = in the bad pixel map, 2 = cosmic ray, 4 = saturated", &status);
+    fits_update_key_log(fptr, "BPMUSED", bpm != NULL, "bad pixel map applied", &status);
+    fits_update_key_lng(fptr, "NBADPIX", nbad, "pixels in the bad pixel map", &status);
+    fits_update_key_lng(fptr, "NCOSMIC", ncosmic, "pixels hit by cosmic rays", &status);
+    fits_update_key_lng(fptr, "NSATUR", nsaturated, "pixels at 65535", &status);
+    fits_update_key_dbl(fptr, "CRSIGMA", CR_SIGMA, -2, "cosmic ray threshold (sigma)", &status);
+    fits_write_chksum(fptr, &status);
+    if (status)
+        show_cfitsio_error( status );
+    free(mask);
+    *statusp = status;
+}
+
+
+/* Co-adding. Frames are added to their camera's stack line by line as */
+/* they are read out. STACK_SUM and STACK_VARIANCE keep exact integer   */
+/* sums, which the compiler turns into vector adds, and if a readout    */
+/* fails the lines already added are taken away again. STACK_CLIP keeps */
+/* a running (Welford) mean and variance of each pixel and, once it has */
+/* MIN_CLIP_VALUES values, turns away any value further than kappa      */
+/* sigma from the mean, allowing for the uncertainty in the mean. 1     */
+/* ADU^2 is added to the variance so that a pixel which has not varied  */
+/* yet cannot turn everything away.                                     */
+
+static void free_stack(t_stack *stack)
+{
+    free(stack->sum);
+    free(stack->sumsq);
+    free(stack->mean);
+    free(stack->m2);
+    free(stack->count);
+    free(stack->taken);
+    memset(stack, 0, sizeof(t_stack));
+}
+
+
+static int allocate_stack(t_stack *stack, int width, int height)
+{
+    size_t npix = (size_t) width*height;
+    int failed;
+
+    if (stack_mode == STACK_CLIP) {
+        stack->mean = calloc(npix, sizeof(float));
+        stack->m2 = calloc(npix, sizeof(float));
+        stack->count = calloc(npix, sizeof(uint16_t));
+        stack->taken = calloc(npix, sizeof(uint8_t));
+        failed = !stack->mean || !stack->m2 || !stack->count || !stack->taken;
+    }
+    else {
+        stack->sum = calloc(npix, sizeof(uint32_t));
+        if (stack_mode == STACK_VARIANCE)
+            stack->sumsq = calloc(npix, sizeof(uint64_t));
+        failed = !stack->sum || (stack_mode == STACK_VARIANCE && !stack->sumsq);
+    }
+    if (failed) {
+        fprintf(stderr,"Not enough memory to stack %dx%d frames\n",width,height);
+        free_stack(stack);
+        return(1);
+    }
+    stack->width = width;
+    stack->height = height;
+    return(0);
+}
+
+
+static void stack_start(void *context, int camera, unsigned short *data, int width, int height)
+{
+    t_stack *stack = (t_stack *) context + camera;
+
+    stack->adding = 0;
+    stack->added = 0;
+    stack->data = data;
+    if (stack->width == 0 && allocate_stack(stack, width, height))
+        return;
+    if (width != stack->width || height != stack->height)
+        fprintf(stderr,"Camera %d: %dx%d frame not added to its %dx%d stack\n",
+                camera,width,height,stack->width,stack->height);
+    else if (stack->nframes == MAX_STACK_DEPTH)
+        fprintf(stderr,"Camera %d: stack is full\n",camera);
+    else
+        stack->adding = 1;
+}
+
+
+static void add_lines(t_stack *stack, unsigned short *restrict data, long first, long n)
+{
+    uint32_t *restrict sum = stack->sum + first;
+
+    for (long i = 0; i < n; i++)
+        sum[i] += data[i];
+    if (stack->sumsq) {
+        uint64_t *restrict sumsq = stack->sumsq + first;
+        for (long i = 0; i < n; i++)
+            sumsq[i] += (uint32_t) data[i]*data[i];
+    }
+}
+
+
+static void remove_lines(t_stack *stack, unsigned short *restrict data, long n)
+{
+    for (long i = 0; i < n; i++)
+        stack->sum[i] -= data[i];
+    if (stack->sumsq)
+        for (long i = 0; i < n; i++)
+            stack->sumsq[i] -= (uint32_t) data[i]*data[i];
+}
+
+
+static void clip_lines(t_stack *stack, unsigned short *restrict data, long first, long n)
+{
+    float *restrict mean = stack->mean + first;
+    float *restrict m2 = stack->m2 + first;
+    uint16_t *restrict count = stack->count + first;
+    uint8_t *restrict taken = stack->taken + first;
+    float kappa2 = stack_kappa*stack_kappa;
+
+    for (long i = 0; i < n; i++) {
+        float c = count[i];
+        float d = data[i] - mean[i];
+        int take = (count[i] < MIN_CLIP_VALUES) | (d*d*c*(c - 1) <= kappa2*(c + 1)*(m2[i] + c - 1));
+        float w = take;
+        mean[i] += w*d/(c + 1);
+        m2[i] += w*d*(data[i] - mean[i]);
+        count[i] += take;
+        taken[i] = take;
+    }
+}
+
+
+static void unclip_lines(t_stack *stack, unsigned short *data, long n)
+{
+    for (long i = 0; i < n; i++) {
+        if (!stack->taken[i])
+            continue;
+        float c = stack->count[i], v = data[i], mean = stack->mean[i];
+        float old = c > 1 ? (c*mean - v)/(c - 1) : 0.0f;
+        stack->m2[i] -= (v - old)*(v - mean);
+        stack->mean[i] = old;
+        stack->count[i]--;
+    }
+}
+
+
+static void stack_lines(void *context, int camera, unsigned short *data, int first, int nlines, int width)
+{
+    t_stack *stack = (t_stack *) context + camera;
+    long n = (long) nlines*width;
+
+    if (!stack->adding)
+        return;
+    if (stack_mode == STACK_CLIP)
+        clip_lines(stack, data, (long) first*width, n);
+    else
+        add_lines(stack, data, (long) first*width, n);
+    stack->added += n;
+}
+
+
+static void stack_end(void *context, int camera, int status)
+{
+    t_stack *stack = (t_stack *) context + camera;
+
+    if (!stack->adding)
+        return;
+    stack->adding = 0;
+    if (status == 0)
+        stack->nframes++;
+    else if (stack_mode == STACK_CLIP)
+        unclip_lines(stack, stack->data, stack->added);
+    else
+        remove_lines(stack, stack->data, stack->added);
+}
+
+
+int StartStack(int mode, double kappa)
+{
+    if (mode < STACK_SUM || mode > STACK_CLIP) {
+        fprintf(stderr,"Unknown stack mode %d\n",mode);
+        return(1);
+    }
+    StopStack();
+    stack_mode = mode;
+    stack_kappa = kappa;
+    if (AddReadoutHook(&stack_hook)) {
+        stack_mode = -1;
+        return(1);
+    }
+    return(0);
+}
+
+
+/* Empty every camera's stack. The next frame each camera reads out */
+/* starts its stack again, at that frame's size.                    */
+void ResetStack()
+{
+    for (int i = 0; i < MAX_CAMERAS_PER_SHARD; i++)
+        free_stack(&stacks[i]);
+}
+
+
+void StopStack()
+{
+    if (stack_mode < 0)
+        return;
+    RemoveReadoutHook(&stack_hook);
+    ResetStack();
+    stack_mode = -1;
+}
+
+
+int StackDepth(int camera)
+{
+    if (camera < 0 || camera >= MAX_CAMERAS_PER_SHARD)
+        return(0);
+    return(stacks[camera].nframes);
+}
+
+
+static int write_stack_file(char *filename, int camera, int bitpix, int datatype, void *data,
+        double exposure, char *obs_type, char *comment)
+{
+    static char *modes[] = { "sum", "variance", "clip" };
+    t_stack *stack = &stacks[camera];
+    long naxes[2] = { stack->width, stack->height };
+    t_pending *p;
+    fitsfile *fptr;
+    int status = 0;
+
+    if ((p = calloc(1, sizeof(t_pending))) == NULL)
+        return(1);
+    if (temporary_name(filename, p->tmpname, sizeof(p->tmpname))) {
+        free(p);
+        return(1);
+    }
+    snprintf(p->filename, sizeof(p->filename), "%s", filename);
+    if (fits_create_file(&fptr, p->tmpname, &status)) {
+        show_cfitsio_error( status );
+        free(p);
+        return(1);
+    }
+    fits_create_img(fptr, bitpix, 2, naxes, &status);
+    fits_write_img(fptr, datatype, 1, (LONGLONG) naxes[0]*naxes[1], data, &status);
+    fits_write_comment(fptr, comment, &status);
+    fits_update_key_dbl(fptr, "EXPTIME", exposure*stack->nframes, -3,
+            "total exposure time (seconds)", &status);
+    fits_update_key_dbl(fptr, "FRAMEXP", exposure, -3,
+            "exposure time of each frame (seconds)", &status);
+    fits_update_key_str(fptr, "IMAGETYP", obs_type, "image type", &status);
+    fits_update_key_str(fptr, "SERIALNO", ccd_camera_info[camera].serial_number,
+            "serial number", &status);
+    fits_update_key_lng(fptr, "NSTACK", stack->nframes, "frames stacked", &status);
+    fits_update_key_str(fptr, "STACKTYP", modes[stack_mode], "how they were stacked", &status);
+    if (stack_mode == STACK_CLIP) {
+        long nrejected = (long) stack->nframes*naxes[0]*naxes[1];
+        for (long i = 0; i < naxes[0]*naxes[1]; i++)
+            nrejected -= stack->count[i];
+        fits_update_key_dbl(fptr, "CLIPSIG", stack_kappa, -3,
+                "clipping threshold (sigma)", &status);
+        fits_update_key_lng(fptr, "NREJECT", nrejected, "pixel values clipped", &status);
+    }
+    fits_write_date(fptr, &status);
+    fits_write_chksum(fptr, &status);
+    if (status)
+        show_cfitsio_error( status );
+    fits_close_file(fptr, &status);
+
+    if (status) {
+        unlink(p->tmpname + 1);
+        free(p);
+        return(1);
+    }
+    return(put_frame(p));
+}
+
+
+/* Write a camera's stack to filename: the sum of its frames, or for       */
+/* STACK_CLIP the clipped mean scaled up to the number of frames, so every */
+/* kind of stack is in the same units. The variance of a single frame at   */
+/* each pixel goes to varname, unless it is NULL or the stack is a         */
+/* STACK_SUM, which has none. exposure is the exposure time of each frame. */
+/* Must not be called while a frame is being read out.                     */
+
+int WriteStack(int camera, char *filename, char *varname, double exposure, char *obs_type)
+{
+    t_stack *stack;
+    long npix;
+    float *image;
+    int rc;
+
+    if (camera < 0 || camera >= MAX_CAMERAS_PER_SHARD || stacks[camera].nframes == 0) {
+        fprintf(stderr,"Nothing stacked for camera %d\n",camera);
+        return(1);
+    }
+    stack = &stacks[camera];
+    npix = (long) stack->width*stack->height;
+
+    if ((image = malloc(npix*sizeof(float))) == NULL) {
+        fprintf(stderr,"Not enough memory to write the stack\n");
+        return(1);
+    }
+    if (stack_mode == STACK_CLIP) {
+        for (long i = 0; i < npix; i++)
+            image[i] = stack->mean[i]*stack->nframes;
+        rc = write_stack_file(filename, camera, FLOAT_IMG, TFLOAT, image, exposure, obs_type,
+                "Clipped mean of the frames times NSTACK");
+    }
+    else
+        rc = write_stack_file(filename, camera, ULONG_IMG, TUINT, stack->sum, exposure, obs_type,
+                "Sum of the frames");
+
+    if (rc == 0 && varname && stack_mode != STACK_SUM) {
+        int n = stack->nframes;
+        for (long i = 0; i < npix; i++) {
+            if (stack_mode == STACK_CLIP)
+                image[i] = stack->count[i] > 1 ? stack->m2[i]/(stack->count[i] - 1) : 0.0f;
+            else
+                image[i] = n > 1 ? (stack->sumsq[i] - (double) stack->sum[i]*stack->sum[i]/n)/(n - 1) : 0.0f;
+        }
+        rc = write_stack_file(varname, camera, FLOAT_IMG, TFLOAT, image, exposure, obs_type,
+                "Variance of a single frame");
+    }
+    free(image);
+    return(rc);
+}
+
+
+/* Put a frame that has just been read out into the shared-memory ring */
+/* (see framering.h) so tools can look at it before it reaches disk.   */
+/* The ring is opened on the first readout, and again if it has been */
+/* removed since, unless SetFrameRing(0) or SBIG_FRAMERING=off has    */
+/* turned it off. Acquisition carries on regardless if it can't be,   */
+/* or if the frame has to be dropped.                                 */
+
+void SetFrameRing(int on)
+{
+    if (!on && frame_ring_state > 0)
+        CloseFrameRing(&frame_ring);
+    frame_ring_state = on ? (frame_ring_state > 0 ? 1 : 0) : -1;
+}
+
+
+static void publish_frame(unsigned short *data, int frame, double exposure,
+        int x, int y, int width, int height)
+{
+    t_ringslot info;
+    char *wanted;
+
+    if (frame_ring_state == 0 && (wanted = getenv("SBIG_FRAMERING")) != NULL
+            && (strcmp(wanted, "off") == 0 || strcmp(wanted, "0") == 0))
+        frame_ring_state = -1;
+    if (frame_ring_state > 0 && FrameRingRemoved(&frame_ring)) {
+        // Removed under us ("lastframe -R"): lay out a new one
+        CloseFrameRing(&frame_ring);
+        frame_ring_state = 0;
+    }
+    if (frame_ring_state == 0)
+        frame_ring_state = OpenFrameRing(&frame_ring, 1) ? -1 : 1;
+    if (frame_ring_state < 0)
+        return;
+
+    memset(&info, 0, sizeof(info));
+    snprintf(info.serial_number, sizeof(info.serial_number), "%s",
+            ccd_camera_info[active_camera].serial_number);
+    info.frame = frame;
+    info.shard = ccd_shard;
+    info.camera = ccd_shard*MAX_CAMERAS_PER_SHARD + active_camera;
+    info.x = x;
+    info.y = y;
+    info.width = width;
+    info.height = height;
+    info.exposure = exposure;
+    info.date_obs = ccd_camera_info[active_camera].timing.date_obs;
+    info.readout_end = ccd_camera_info[active_camera].timing.readout_end;
+    info.temperature = ccd_camera_info[active_camera].temperature;
+    if (PublishFrame(&frame_ring, &info, data) && verbosity)
+        fprintf(stderr,"Frame from camera %d not published: ring slot in use\n",active_camera);
+}
+
+
+/* Fill in the parameters for starting an exposure on the active camera */
+
+static int setup_start_exposure(StartExposureParams2 *p, int frame, double exposure)
+{
+    p->ccd = CCD_IMAGING;
+    p->readoutMode = 0;
+    p->abgState = ABG_LOW7;
+    if ( ( frame == LIGHT ) | (frame == FLAT) )
+    {  
+        /* Shutter open */
+        p->openShutter =  SC_OPEN_SHUTTER;
+    }
+    else if ( ( frame == DARK ) | (frame == BIAS ) )
+    {
+        /* Shutter closed */
+        p->openShutter =  SC_CLOSE_SHUTTER;
+    }
+    else
+    {
+        fprintf(stderr,"Unknown frame type requested in CaptureImage for camera %d\n",active_camera);
+        return(1);
+    }
+    p->exposureTime = (int)(100.0*exposure + 0.5);
+    p->top = 0;
+    p->left = 0;
+    p->height = ccd_image_height;
+    p->width = ccd_image_width;
+    return(0);
+}
+
+
+/* Start an exposure on the active camera and timestamp it. The exposure   */
+/* begins somewhere during the command, so use the midpoint of the call.   */
+
+static int start_exposure(StartExposureParams2 *p)
+{
+    t_frametiming *timing = &ccd_camera_info[active_camera].timing;
+    struct timespec wall;
+    double before, after;
+    int rc;
+
+    memset(timing, 0, sizeof(t_frametiming));
+    clock_gettime(CLOCK_REALTIME, &wall);
+    before = monotonic_time();
+    rc = SBIGUnivDrvCommand(CC_START_EXPOSURE2, p, NULL);   
+    after = monotonic_time();
+    timing->exposure_start = 0.5*(before + after);
+    timing->date_obs = wall.tv_sec + 1e-9*wall.tv_nsec + 0.5*(after - before);
+    return(rc);
+}
+
+
+/* Format a wall-clock time as a FITS date string (UTC, millisecond precision) */
+
+static void format_utc_time(double t, char *datestr)
+{
+    time_t seconds = (time_t) t;
+    struct tm utc;
+    int ms = (int) ((t - seconds)*1000.0);
+    gmtime_r(&seconds, &utc);
+    sprintf(datestr, "%04d-%02d-%02dT%02d:%02d:%02d.%03d",
+            utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+            utc.tm_hour, utc.tm_min, utc.tm_sec, ms);
+}
+
+
+/* Append one line per frame to the timing log in the data directory. The */
+/* log is a SExtractor-style table so it can be read with tfilter etc.     */
+
+static void store_frame_timing(char *filename, char *serial_number, double exptime,
+        t_frametiming *timing)
+{
+    char line[512];
+    char date_obs[32];
+    struct stat sb;
+    int logfd;
+
+    if ((logfd = open(timinglogfile, O_WRONLY|O_APPEND|O_CREAT, 0644)) == -1)
+        return;
+
+    if (fstat(logfd, &sb) == 0 && sb.st_size == 0) {
+        char header[] =
+            "#   1 FILENAME        Name of the FITS file\n"
+            "#   2 SERIALNO        Camera serial number\n"
+            "#   3 DATE_OBS        UTC at start of exposure\n"
+            "#   4 EXPTIME         Requested exposure time                                   [s]\n"
+            "#   5 EXPDONE         Integration complete detected, after start                [s]\n"
+            "#   6 RDSTART         Readout started, after start                              [s]\n"
+            "#   7 RDEND           Readout ended, after start                                [s]\n"
+            "#   8 WRSTART         File write started, after start                           [s]\n"
+            "#   9 WREND           File write ended, after start                             [s]\n"
+            "#  10 DEADTIME        Time from end of exposure to end of write                 [s]\n"
+            "#  11 STARTOFF        Start minus requested start time (0 if none requested)    [s]\n";
+        write(logfd, header, strlen(header));
+    }
+
+    format_utc_time(timing->date_obs, date_obs);
+    snprintf(line, sizeof(line), "%s %s %s %.3f %.4f %.4f %.4f %.4f %.4f %.4f %.4f\n",
+            filename, serial_number, date_obs, exptime,
+            timing->exposure_complete - timing->exposure_start,
+            timing->readout_start - timing->exposure_start,
+            timing->readout_end - timing->exposure_start,
+            timing->write_start - timing->exposure_start,
+            timing->write_end - timing->exposure_start,
+            timing->write_end - timing->exposure_start - exptime,
+            timing->scheduled_start > 0 ? timing->date_obs - timing->scheduled_start : 0.0);
+    write(logfd, line, strlen(line));
+    close(logfd);
+}
+
+
+/* Copy a header value into a catalog column, which must be one word */
+
+static void catalog_word(char *dst, size_t n, char *src)
+{
+    if (src == NULL || *src == '\0') {
+        snprintf(dst, n, "---");
+        return;
+    }
+    snprintf(dst, n, "%s", src);
+    for (; *dst; dst++)
+        if (*dst == ' ' || *dst == '\t')
+            *dst = '_';
+}
+
+
+/* Append the frame to the catalog in its directory, so that summarize and  */
+/* friends can list a night without opening every file. The catalog is a   */
+/* SExtractor-style table. store_metadata appends a fresh row for a frame   */
+/* when it adds SEEING etc.; the last row for a file is the one that counts */
+/* and is trusted only while MTIME matches the file, so anything else that  */
+/* edits the header sends readers back to the header itself.                */
+
+static void store_frame_catalog(char *filename, int w, int h, double exptime, char *obs_type,
+        double temperature, int filter, char *serial_number, char *name, char *ra,
+        char *dec, char *alt, char *date, t_frametiming *timing)
+{
+    char line[1024];
+    char path[1024];
+    char dir[512];
+    char base[256];
+    char target[128], objctra[64], objctdec[64];
+    char date_obs[32] = "---";
+    char deadtime[32] = "---";
+    struct stat sb;
+    int catfd;
+
+    if (stat(filename, &sb) != 0)
+        return;
+
+    // dirname() and basename() may modify their argument
+    snprintf(dir, sizeof(dir), "%s", filename);
+    snprintf(path, sizeof(path), "%s/%s", dirname(dir), catalogfile);
+    snprintf(dir, sizeof(dir), "%s", filename);
+    snprintf(base, sizeof(base), "%s", basename(dir));
+
+    if ((catfd = open(path, O_WRONLY|O_APPEND|O_CREAT, 0644)) == -1)
+        return;
+
+    // The shards of an array write to the same directory
+    flock(catfd, LOCK_EX);
+
+    if (fstat(catfd, &sb) == 0 && sb.st_size == 0) {
+        char header[] =
+            "#   1 FILENAME        Name of the FITS file\n"
+            "#   2 SERIALNO        Camera serial number\n"
+            "#   3 IMAGETYP        Image type\n"
+            "#   4 EXPTIME         Exposure time                                             [s]\n"
+            "#   5 TEMPERAT        CCD temperature                                           [C]\n"
+            "#   6 FILTNUM         Filter number\n"
+            "#   7 FILTNAM         Filter name\n"
+            "#   8 TARGET          Target name\n"
+            "#   9 OBJCTRA         Right ascension\n"
+            "#  10 OBJCTDEC        Declination\n"
+            "#  11 ALTITUDE        Altitude                                                  [deg]\n"
+            "#  12 NAXIS1          Width                                                     [pixel]\n"
+            "#  13 NAXIS2          Height                                                    [pixel]\n"
+            "#  14 DATE            UTC when the file was written\n"
+            "#  15 DATE_OBS        UTC at start of exposure\n"
+            "#  16 DEADTIME        Time from end of exposure to end of write                 [s]\n"
+            "#  17 SEEING          Seeing FWHM                                               [pixel]\n"
+            "#  18 ELLIP           Ellipticity\n"
+            "#  19 NOBJ            Number of objects detected\n"
+            "#  20 MEAN            Mean of central pixels\n"
+            "#  21 MODE            Mode of central pixels\n"
+            "#  22 WCS             Y if the header has a WCS\n"
+            "#  23 MTIME           Modification time of the file for this row                [s]\n";
+        write(catfd, header, strlen(header));
+    }
+
+    catalog_word(target, sizeof(target), name);
+    catalog_word(objctra, sizeof(objctra), ra);
+    catalog_word(objctdec, sizeof(objctdec), dec);
+    if (timing->exposure_start > 0) {
+        format_utc_time(timing->date_obs, date_obs);
+        snprintf(deadtime, sizeof(deadtime), "%.4f",
+                timing->write_end - timing->exposure_start - exptime);
+    }
+    stat(filename, &sb);
+    snprintf(line, sizeof(line),
+            "%s %s %s %.3f %.3f %d --- %s %s %s %.4f %d %d %s %s %s --- --- --- --- --- N %ld\n",
+            base, serial_number, obs_type, exptime, temperature, filter,
+            target, objctra, objctdec, atof(alt), w, h, date, date_obs, deadtime,
+            (long) sb.st_mtime);
+    write(catfd, line, strlen(line));
+    close(catfd);
+}
+
+
+/* Print cfitsio error report */
+
+void show_cfitsio_error(int status)
+{
+    if (status)
+    {
+	fits_report_error(stderr, status); 
+    }
+    return;
+}  
+
+
+/* Check for error and print error message */
+int check_sbig_error(int err, char *msg)
+{
+    if (err != CE_NO_ERROR)
+    {
+        fprintf(stderr,"%s",msg);
+        return(1);
+    }
+    return(0);
+}
+
+
+/* Utility routine */
+int value_from_imagetype_key(char *key)
+{
+    int i;
+    for (i=0; i < NIMAGETYPEKEYS; i++) {
+	t_keyval *sym = imagetypelookuptable + i;
+	if (strcmp(sym->key, key) == 0)
+	    return sym->val;
+    }
+    return BADKEY;
+}
+
+int value_from_filtername_key(char *key)
+{
+    int i;
+    for (i=0; i < NFILTERNAMEKEYS; i++) {
+	t_keyval *sym = filternamelookuptable + i;
+	if (strcmp(sym->key, key) == 0)
+	    return sym->val;
+    }
+    return BADKEY;
+}
+
+/* Display a progress bar                               */
+/* Process has done i out of n rounds,                  */
+/* and we want a bar of width w and resolution r.       */
 void load_bar(int x, int n, int r, int w)
 {
     // Only update r times.
@@ -876,7 +2683,7 @@ void load_bar(int x, int n, int r, int w)
 
 int new_filename(char *serial_number, char *image_type, char *filename) 
 {
-    char scratch[256];
+    char scratch[256] = "";
 
     char *gfilename;
     int max_filenumber = 0;
@@ -888,8 +2695,13 @@ int new_filename(char *serial_number, char *image_type, char *filename)
     glob("*.fits", GLOB_NOMAGIC, NULL, &glob_results);
     //fprintf(stderr,"Found %d files.\n", (int)glob_results.gl_pathc);
 
+    // Step 2. Frames still waiting to be put in place aren't there yet
+    pthread_mutex_lock(&flusher.lock);
+    int npending = flusher.count;
+    pthread_mutex_unlock(&flusher.lock);
+
     // Step 3. Use a regexp to turn each filename into an integer.
-    if ( (int)glob_results.gl_pathc > 0) {
+    if ( (int)glob_results.gl_pathc > 0 || npending > 0) {
 	char *aStrRegex;                      // Pointer to the string holding the regex 
 	regex_t aCmpRegex;                    // Pointer to our compiled regex       
 	char outMsgBuf[MAX_ERR_STR_LEN];      // Holds error messages from regerror()   
@@ -909,7 +2721,7 @@ int new_filename(char *serial_number, char *image_type, char *filename)
 	    exit(1);
 	};
 	// Apply the regexp
-	for(aLineToMatch=glob_results.gl_pathv; *aLineToMatch != NULL; aLineToMatch++) {
+	for(aLineToMatch=glob_results.gl_pathv; glob_results.gl_pathc > 0 && *aLineToMatch != NULL; aLineToMatch++) {
 	    if( !(result = regexec(&aCmpRegex, *aLineToMatch, MAX_SUB_EXPR_CNT, pMatch, 0))) {
 		int this_filenumber;
 		int fieldnum=2;
@@ -923,6 +2735,17 @@ int new_filename(char *serial_number, char *image_type, char *filename)
 		}
 	    }
 	}
+	pthread_mutex_lock(&flusher.lock);
+	for (int i = 0; i < flusher.count; i++) {
+	    char *pending = flusher.frame[(flusher.head + i) % FLUSH_QUEUE]->filename;
+	    if( !regexec(&aCmpRegex, pending, MAX_SUB_EXPR_CNT, pMatch, 0)) {
+		int this_filenumber = atoi(pending + pMatch[2].rm_so);
+		if (this_filenumber > max_filenumber)
+		    max_filenumber = this_filenumber;
+	    }
+	}
+	pthread_mutex_unlock(&flusher.lock);
+	regfree(&aCmpRegex);
     }
 
     //fprintf(stderr,"Max filenumber: %d\n",max_filenumber); 
@@ -1004,6 +2827,14 @@ int SetFilter(CFW_POSITION pos)
     return(err);
 }
 
+/* Use another lockfile, e.g. to exercise the locking without blocking the */
+/* camera programs                                                          */
+void SetLockFile(char *path)
+{
+    snprintf(camlockfile, sizeof(camlockfile), "%s", path);
+}
+
+
 int get_lock()
 {
     fl.l_type = F_WRLCK;
@@ -1011,6 +2842,9 @@ int get_lock()
     fl.l_start = 0;
     fl.l_len = 0;
     fl.l_pid = getpid();
+    // Don't leak the descriptor from an earlier lock
+    if (fd != -1)
+        close(fd);
     if ((fd = open(camlockfile, O_RDWR|O_CREAT|O_TRUNC,0644)) == -1) {
         fprintf(stderr,"Error opening lockfile\n");
         exit(1);
@@ -1029,6 +2863,9 @@ int get_nondestructive_lock()
     fl.l_start = 0;
     fl.l_len = 0;
     fl.l_pid = getpid();
+    // Don't leak the descriptor from an earlier lock
+    if (fd != -1)
+        close(fd);
     if ((fd = open(camlockfile, O_RDWR|O_CREAT,0644)) == -1) {
         fprintf(stderr,"Error opening lockfile\n");
         exit(1);
@@ -1075,6 +2912,14 @@ void store_timestamped_note_in_lockfile(char *note)
     write(fd,lockstring,strlen(lockstring));
 }
 
+/* Seconds on the monotonic clock, for timing intervals */
+double monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
 int store_directory_in_lockfile()
 {
     char * cwd;
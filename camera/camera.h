@@ -21,14 +21,79 @@
 #define BIAS             2  
 #define FLAT             3  
 
+/* How hard write_fits() works to get frames onto the disk. Frames are
+ * always written under a temporary name and renamed into place, so a
+ * crash never leaves half a frame under the real name. */
+#define DURABLE_NONE     0     // Rename at once and leave writing back to the kernel
+#define DURABLE_ASYNC    1     // Flush and rename on a background thread (default)
+#define DURABLE_SYNC     2     // Flush and rename before write_fits() returns
+
+/* Bits of the defect mask written with each frame (see SetDefectMasking()) */
+#define MASK_BADPIXEL    1     // In the camera's bad pixel map
+#define MASK_COSMIC      2     // Cosmic ray, or a hot pixel missing from the map
+#define MASK_SATURATED   4     // At 65535
+
+/* What a co-adding stack (see StartStack()) keeps for each pixel */
+#define STACK_SUM        0     // 32-bit sum
+#define STACK_VARIANCE   1     // 32-bit sum and 64-bit sum of squares
+#define STACK_CLIP       2     // Sigma-clipped running mean and variance
+
 #ifndef INVALID_HANDLE_VALUE
  #define INVALID_HANDLE_VALUE -1
 #endif
 
+/* The SBIG driver hands out at most four device handles per process, so
+ * each process drives a "shard" of up to four cameras. Hosts with more
+ * cameras than that run one shard per process (see array.c). */
+#define MAX_CAMERAS_PER_SHARD 4
+#define MAX_CAMERAS           8     // the driver's USB devices, DEV_USB1-DEV_USB8
+#define MAX_SHARDS            ((MAX_CAMERAS + MAX_CAMERAS_PER_SHARD - 1)/MAX_CAMERAS_PER_SHARD)
+
 
 
 /***** TYPES *****/
 
+/* Times at which the phases of the most recent exposure happened. All are
+ * seconds on the monotonic clock, except date_obs and scheduled_start which
+ * are wall-clock (UTC) times in seconds since 1970. */
+typedef struct {
+    double scheduled_start;    // Wall-clock time the start was requested for (0 if none)
+    double date_obs;           // Wall-clock time exposure started
+    double exposure_start;     // CC_START_EXPOSURE2 issued
+    double exposure_complete;  // Integration complete detected
+    double readout_start;      // CC_START_READOUT issued
+    double readout_end;        // CC_END_READOUT returned
+    double write_start;        // write_fits() called
+    double write_end;          // FITS file closed
+} t_frametiming;
+
+/* Pixel statistics gathered while the most recent frame was read out */
+typedef struct {
+    unsigned short *data;      // Frame they describe (NULL if none)
+    int width;
+    int height;
+    unsigned short min;
+    unsigned short max;
+    long nsaturated;           // Pixels at 65535
+    double mean;
+    unsigned long datasum;     // FITS DATASUM of the frame as write_fits() stores it
+} t_readoutstats;
+
+/* A readout hook is handed the lines of every frame CaptureImage() reads
+ * out, "block" lines at a time, as soon as they have arrived. The hooks
+ * run on their own thread, so their work overlaps the rest of the readout;
+ * CaptureImage() does not return until they have seen the whole frame.
+ * start and end may be NULL. end is told whether the readout succeeded. */
+typedef struct {
+    void (*start)(void *context, int camera, unsigned short *data, int width, int height);
+    void (*lines)(void *context, int camera, unsigned short *data, int first, int nlines, int width);
+    void (*end)(void *context, int camera, int status);
+    void *context;
+    int block;                 // Lines per call (at least 1)
+} t_readouthook;
+
+#define MAX_READOUT_HOOKS 8
+
 typedef struct {
     char name[128]; 
     char serial_number[16];
@@ -41,6 +106,8 @@ typedef struct {
     double temperature;
     double ambientTemperature;
     double power;
+    t_frametiming timing;
+    t_readoutstats stats;
 } t_camerainfo;
 
 typedef struct {
@@ -65,11 +132,13 @@ extern double      ccd_image_gain;         // Gain in funny units
 extern int ccd_image_status;
 extern int ccd_phase;
 extern int ccd_type;
-extern int ccd_ncam;
+extern int ccd_ncam;          // Cameras in this process's shard
+extern int ccd_ncam_total;    // Cameras on the USB bus
+extern int ccd_shard;         // Shard driven by this process
 
-/* We support four cameras */
-extern t_camerainfo ccd_camera_info[4];
-extern unsigned short *ccd_image_data[4];
+/* We support four cameras per shard */
+extern t_camerainfo ccd_camera_info[MAX_CAMERAS_PER_SHARD];
+extern unsigned short *ccd_image_data[MAX_CAMERAS_PER_SHARD];
 
 
 
@@ -78,6 +147,7 @@ extern unsigned short *ccd_image_data[4];
 /* Functions that act on the currently active camera. */
 int  SetActiveCamera(int);
 int  InitializeCamera(int);
+int  DisconnectCamera(int);
 int  RegulateTemperature(double sp);
 int  GetCameraTemperature();
 int  DisableTemperatureRegulation();
@@ -91,26 +161,60 @@ int  FilterWheelPosition();       // ST-402ME only
 int  FilterWheelStatus();         // ST-402ME only
 int  NumberOfFilters();           // ST-402ME only
 
-/* Functions that act on all cameras */
+/* Functions that act on all cameras (in the current shard) */
+int  SetCameraShard(int);
+int  CountShards();
 int  CountCameras();
 int  InitializeAllCameras();
 int  DisconnectAllCameras();
+int  StartExposuresAt(double, int, double);
+int  AddReadoutHook(t_readouthook *);
+void RemoveReadoutHook(t_readouthook *);
+
+/* Co-adding. While a stack is running every frame CaptureImage() reads out
+ * is added to its camera's stack as it arrives. WriteStack() may be called
+ * at any time between readouts, and leaves the stack running. */
+int  StartStack(int mode, double kappa);
+void ResetStack();
+void StopStack();
+int  StackDepth(int camera);
+int  WriteStack(int camera, char *filename, char *varname, double exposure, char *obs_type);
 
 /* Accessor methods */
 int  ActiveCamera();
 int  GetCameraStatus(int *);
 
+/* Durability of written frames (also set by SBIG_DURABILITY=none|async|sync).
+ * WaitForDurability() returns the number of frames that could not be put in
+ * place since it was last called. The frame hook is called with the name of
+ * each frame write_fits() makes once it is in place (on the background thread
+ * with DURABLE_ASYNC), one call at a time, e.g. to stream it. */
+void SetDurability(int);
+int  WaitForDurability();
+void SetFrameHook(void (*)(char *));
+
+/* Defect masks written with each frame (also set by SBIG_MASKS=dir). The
+ * directory holds the bad pixel maps made by combine; NULL turns masks off. */
+void SetDefectMasking(char *bpmdir);
+
+/* Publishing each readout in the shared-memory frame ring (framering.h).
+ * On by default; SetFrameRing(0) or SBIG_FRAMERING=off turns it off. */
+void SetFrameRing(int);
+
 /* Debug methods */
 void SetVerbosity(int);
 
 /* Utilities */
 int  value_from_imagetype_key(char *);
 int  value_from_filtername_key(char *);
-void write_fits(char *, int, int, unsigned short *, double, char*, double,int,char*,char*,char*,char*,char*,char*); 
+int  write_fits(char *, int, int, unsigned short *, double, char*, double,int,char*,char*,char*,char*,char*,char*); 
+int  write_fits_to_memory(void **, size_t *, int, int, int, unsigned short *, double, char*, double,int,char*,char*,char*,char*,char*,char*);
+int  read_fits_to_memory(void **, size_t *, int, char *); 
 void show_cfitsio_error(int);
 int  check_sbig_error(int err, char *msg);
 void load_bar(int, int, int, int);
 int  new_filename(char *, char *, char *);
+void SetLockFile(char *);
 int  get_lock();
 int  get_nondestructive_lock();
 int  release_lock();
@@ -118,5 +222,6 @@ void store_pid_in_lockfile();
 void store_note_in_lockfile();
 int  store_directory_in_lockfile();
 void store_timestamped_note_in_lockfile(char *);
+double monotonic_time();
 
 #endif
@@ -1,10 +1,13 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <time.h>
 #include "fitsio.h"
 #include "camera.h"
+#include "transfer.h"
 
 #define error_exit(a)   fprintf(stderr, (a)); return(1)
 #define MAX_STRING 256
@@ -18,6 +21,7 @@ expose [options...] imageType exposureTime\n\
 \n\
 DESCRIPTION\n\
 \"expose\" operates an array of SBIG CCD cameras. Up to four cameras can be controlled per computer.\n\
+Use \"array expose\" to drive more than four cameras on one computer.\n\
 \n\
 PARAMETERS\n\
 imageType       - must be one of \"bias\", \"dark\", \"flat\" or \"light\".\n\
@@ -30,11 +34,26 @@ OPTIONS\n\
 -d Dec       \n\
 -a Alt       \n\
 -z Az        \n\
+-t Time     # start all exposures at this wall-clock time, in seconds since 1970 \n\
+            # (UTC), or \"+N\" for N seconds from now \n\
+-s host     # also stream each frame to the frame receiver (framerecv) on host, \n\
+            # given as host or host:port \n\
+-C          # tile-compress the streamed frames (sent as name.fits.fz) \n\
 \n\
 EXAMPLES\n\
 expose flat 15 \n\
 expose light 120 \n\
 expose dark 10 \n\
+expose -t 1500000000.0 flat 0.5 \n\
+\n\
+SYNCHRONIZED STARTS\n\
+With -t, the cameras are initialized and everything needed to start them is\n\
+prepared, and then the exposures are started at the requested time. Giving\n\
+every computer in the array the same time (with their clocks kept in step by\n\
+NTP) starts the whole array together, however long the commands took to\n\
+arrive. The difference between the actual and requested start is written to\n\
+the STARTOFF header keyword and the timing log. If the cameras are not ready\n\
+by the requested time they are started immediately.\n\
 \n\
 BUGS\n\
 None known\n\
@@ -52,6 +71,24 @@ access to the lockfile even though they don't write data. This is because this w
 program happens to be writing to the file at that exact moment, but then things will continue. The\n\
 lockfile contains useful information about the current integration request.\n\
 \n\
+Frames are written under a temporary name (.NAME.PID.N.tmp) and renamed into place when complete, so\n\
+a crash of the program never leaves a partial frame behind under its real name. SBIG_DURABILITY in\n\
+the environment says how hard to work to get frames onto the disk: \"async\" (the default) flushes\n\
+each frame and then renames it on a background thread while the next exposure runs, so not even a\n\
+power cut can leave a short frame under its real name, though it can cost the frames still waiting\n\
+to be renamed; \"sync\" does the same before going on to the next exposure, and \"none\" renames at\n\
+once and leaves the flushing to the kernel. A frame is catalogued, announced on the manifest and\n\
+streamed (-s) only once it is in place.\n\
+\n\
+If SBIG_MASKS names a directory, each frame is followed by a compressed MASK extension flagging\n\
+its defects: 1 for pixels in the camera's bad pixel maps (the master_SERIAL_TYPE_bpm.fits files\n\
+made by combine in that directory), 2 for cosmic rays and 4 for saturated pixels. The number of\n\
+each is in the NBADPIX, NCOSMIC and NSATUR keywords of the extension.\n\
+\n\
+Each frame is also put into a ring of recent frames in shared memory for \"lastframe\" and\n\
+\"preview -r\". The ring holds up to 255 MB until it is removed with \"lastframe -R\";\n\
+SBIG_FRAMERING=off keeps frames out of it.\n\
+\n\
 AUTHOR\n\
 Bob Abraham:  abraham@astro.utoronto.ca\n\
 \n\
@@ -59,6 +96,41 @@ LAST UPDATE\n\
 April 2012\n\
 "
 
+/* Frames are streamed once they are in place (see SetFrameHook()) */
+static char stream_host[MAX_STRING] = "";
+static int stream_fd = -1;
+static int compress = 0;
+
+
+static void stream_frame(char *filename)
+{
+    int rc;
+
+    // Reconnect if the last frame left the connection closed
+    if (stream_fd < 0 && (stream_fd = OpenFrameStream(stream_host)) < 0)
+        return;
+    if (compress) {
+        void *buffer;
+        size_t size;
+        char fzname[MAX_STRING + 4];
+        snprintf(fzname, sizeof(fzname), "%s.fz", filename);
+        if (read_fits_to_memory(&buffer, &size, compress, filename))
+            return;
+        rc = SendFrameBuffer(stream_fd, fzname, buffer, size);
+        free(buffer);
+    }
+    else
+        rc = SendFrameFile(stream_fd, filename);
+
+    // The connection is in an unknown state after a failure
+    if (rc) {
+        fprintf(stderr,"Unable to stream %s to %s: reconnecting for the next frame\n",
+                filename,stream_host);
+        CloseFrameStream(stream_fd);
+        stream_fd = -1;
+    }
+}
+
 
 void InterruptHandler(int sig)
 {
@@ -87,9 +159,11 @@ int main(int argc, char *argv[]) {
     char alt[MAX_STRING] = "";
     char az[MAX_STRING] = "";
     char imtype[8];
+    double start_time = 0;
     int phase;
     float exptime;
     int err;
+    int failed = 0;
 
     /* Set an interrupt handler to trap Ctr-C nicely */
     if(signal(SIGINT, SIG_IGN) != SIG_IGN)
@@ -126,6 +200,21 @@ int main(int argc, char *argv[]) {
              case 'z':
                 sscanf(argv[arg++], "%s", az);
                 break;
+             case 't':
+                if (argv[arg][0] == '+') {
+                    struct timespec now;
+                    clock_gettime(CLOCK_REALTIME, &now);
+                    start_time = now.tv_sec + 1e-9*now.tv_nsec + atof(argv[arg++] + 1);
+                }
+                else
+                    start_time = atof(argv[arg++]);
+                break;
+             case 's':
+                sscanf(argv[arg++], "%s", stream_host);
+                break;
+             case 'C':
+                compress = 1;
+                break;
              default:
                 error_exit(usage);
                 break;
@@ -151,6 +240,10 @@ int main(int argc, char *argv[]) {
     }
 
     InitializeAllCameras();
+    if (stream_host[0]) {
+        stream_fd = OpenFrameStream(stream_host);
+        SetFrameHook(stream_frame);
+    }
     store_timestamped_note_in_lockfile("Started");
     store_directory_in_lockfile();
     char myline[128];
@@ -158,15 +251,15 @@ int main(int argc, char *argv[]) {
     store_note_in_lockfile(myline);
 
 
-    // Start integrations going on each of the cameras one by one.
+    // Get everything ready, then start integrations going on all of the
+    // cameras together (at the requested time, if there is one).
     for (int cam_num = 0; cam_num <ccd_ncam; cam_num++)
     {
         err = SetActiveCamera(cam_num);
         ccd_image_data[cam_num] = 
             (unsigned short *) malloc(ccd_image_width*ccd_image_height*sizeof(unsigned short));
-        phase = 0;
-        err = CaptureImage(&phase,ccd_image_data[cam_num],ccd_type,exptime,FALSE,0,0,0,0);
     }
+    err = StartExposuresAt(start_time,ccd_type,exptime);
 
     // Wait until the data is ready. I'm intentionally playing this safe by
     // making sure I wait at least 1s before trying to read out the data.
@@ -208,7 +301,7 @@ int main(int argc, char *argv[]) {
 
         // Figure out what to call the new file
         char *newname;
-        newname = (char *)malloc(MAX_STRING*sizeof(char));
+        newname = (char *)calloc(MAX_STRING,sizeof(char));
         new_filename(ccd_serial_number,imtype,newname);    
 
         // Save as a FITS file
@@ -217,17 +310,27 @@ int main(int argc, char *argv[]) {
         int filterNumber = 0;
         if (IsCameraAnST402ME())
             filterNumber = FilterWheelPosition();
-        write_fits(newname, ccd_image_width, ccd_image_height, ccd_image_data[cam_num], 
+        int saved = (write_fits(newname, ccd_image_width, ccd_image_height, ccd_image_data[cam_num], 
                    exptime,imtype,temperature,filterNumber,ccd_serial_number, name,
-                   ra,dec,alt,az);
-        fprintf(stderr,"Saved %s \n",newname);
-        sprintf(infoline,"Camera %d wrote: %s\n",cam_num,newname);
+                   ra,dec,alt,az) == 0);
+        if (saved)
+            fprintf(stderr,"Saved %s \n",newname);
+        else {
+            fprintf(stderr,"Unable to save %s \n",newname);
+            failed = 1;
+        }
+
+        sprintf(infoline,"Camera %d %s: %s\n",cam_num,saved ? "wrote" : "failed to write",newname);
         store_note_in_lockfile(infoline);
         free(ccd_image_data[cam_num]);
         free(newname);
 
     }
 
+    // Wait for the last frames to be put in place (and streamed)
+    if (WaitForDurability())
+        failed = 1;
+    CloseFrameStream(stream_fd);
     DisconnectAllCameras();
     release_lock();
 
@@ -241,7 +344,7 @@ int main(int argc, char *argv[]) {
     	printf("Camera(s) opened and closed successfully.\n");
     putchar('\a'); putchar('\a'); putchar('\a');
 
-    return(0);
+    return(failed);
 
 }
 
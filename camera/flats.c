@@ -0,0 +1,512 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include "fitsio.h"
+#include "camera.h"
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+#define MAX_STRING 256
+#define MAX_SAMPLES 32
+#define SATURATED 60000     // median level past which a frame says nothing about the sky
+
+#define usage "\n\
+NAME\n\
+flats --- take twilight flats, timing each one from the brightening or fading sky \n\
+\n\
+SYNOPSIS\n\
+flats [options] \n\
+\n\
+DESCRIPTION\n\
+\"flats\" takes twilight flat fields on the cameras attached to this computer,\n\
+choosing every exposure time itself so that each flat reaches the target\n\
+level. The sky level is measured in memory as frames are read out: the\n\
+median of a box in the middle of the detector, less a bias level measured the\n\
+same way at the start. To get going, and again whenever the sky has drifted\n\
+out of range, it takes short probe exposures reading out only that box.\n\
+After that every flat is also a measurement, so flats follow each other\n\
+with no probes and no waiting. As the SBIG driver only hands one process four\n\
+cameras, flats drives the first four and warns if there are more.\n\
+\n\
+The sky brightness is modelled as changing exponentially with time, with\n\
+the rate fitted to the last ten minutes of measurements (or, until they\n\
+span 15 s, doubling or halving every three minutes, after Tyson &\n\
+Gal 1993). The next exposure time is the one that collects the target\n\
+level while the sky changes during the exposure.\n\
+\n\
+A flat is only written out for the cameras whose level is between the low\n\
+and high limits. In the evening, flats end when the exposure time needed\n\
+passes the maximum; while the sky is too bright, \"flats\" waits for it to\n\
+fade. In the morning (-M) it is the other way round.\n\
+\n\
+One event per line is written to stdout and to the lockfile, as by \"plan\":\n\
+\n\
+    1500000000.125 bias camera=0 level=1003.0\n\
+    1500000001.300 probe exptime=0.100 rate=81234.5 slope=-0.00385\n\
+    1500000003.010 wait seconds=60.0 exptime=0.071\n\
+    1500000071.402 flat exptime=0.130 rate=77621.0 slope=-0.00385\n\
+    1500000073.519 frame camera=0 level=10120.4 file=83F010783_17_flat.fits\n\
+    1500000301.883 done flats=8 exptimes=0.130,0.162,...\n\
+\n\
+A flat that cannot be written is reported with a \"failed\" event in place of\n\
+\"frame\" and is not counted, and flats then exits with status 1.\n\
+\n\
+OPTIONS\n\
+-v          # verbose mode \n\
+-n number   # number of flats wanted (default 8) \n\
+-t level    # target level above bias in ADU (default 10000) \n\
+-l level    # lowest level kept (default 5000) \n\
+-u level    # highest level kept (default 15000) \n\
+-e seconds  # shortest exposure time (default 0.1) \n\
+-m seconds  # longest exposure time (default 60) \n\
+-b pixels   # size of the box measured in the middle of the detector (default 512) \n\
+-M          # morning twilight: the sky is getting brighter \n\
+-N Name     # object name (default twilight_flat) \n\
+-D command  # shell command run after each flat that is kept, e.g. to dither \n\
+\n\
+EXAMPLES\n\
+flats \n\
+flats -n 12 -D \"mount dither 10 N\" \n\
+flats -M -t 20000 -l 12000 -u 28000 \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+/* One measurement of the sky: ADU/s above bias, at the middle of an exposure */
+typedef struct {
+    double time;
+    double rate;
+} t_sample;
+
+static t_sample samples[MAX_SAMPLES];
+static int nsamples = 0;
+
+static int verbose = 0;
+static int morning = 0;
+static int box = 512;
+static double target = 10000;
+static double low = 5000;
+static double high = 15000;
+static double min_exptime = 0.1;
+static double max_exptime = 60;
+static double bias[MAX_CAMERAS_PER_SHARD];
+
+static volatile sig_atomic_t aborted = 0;
+
+
+void InterruptHandler(int sig)
+{
+    aborted = 1;
+}
+
+
+/* Write an event to stdout and the lockfile */
+static void emit(const char *fmt, ...)
+{
+    char line[2*MAX_STRING];
+    struct timespec now;
+    va_list ap;
+    int n;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    n = snprintf(line, sizeof(line), "%.3f ", now.tv_sec + 1e-9*now.tv_nsec);
+    va_start(ap, fmt);
+    vsnprintf(line + n, sizeof(line) - n, fmt, ap);
+    va_end(ap);
+
+    fputs(line, stdout);
+    fflush(stdout);
+    store_note_in_lockfile(line);
+}
+
+
+/* Sleep for up to seconds, or until interrupted */
+static void wait_seconds(double seconds)
+{
+    double done = monotonic_time() + seconds;
+    struct timespec ts;
+
+    while (!aborted && monotonic_time() < done) {
+        double left = done - monotonic_time();
+        if (left > 1.0)
+            left = 1.0;
+        ts.tv_sec = (time_t) left;
+        ts.tv_nsec = (long) ((left - ts.tv_sec)*1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+/* Median of the measuring box of a frame "width" pixels wide. The box is */
+/* at (x,y) in the frame.                                                 */
+static double box_median(unsigned short *data, int width, int x, int y, int w, int h)
+{
+    static uint32_t histogram[65536];
+    long half = (long) w*h/2, count = 0;
+    int v;
+
+    memset(histogram, 0, sizeof(histogram));
+    for (int j = y; j < y + h; j++) {
+        unsigned short *row = data + (long) j*width + x;
+        for (int i = 0; i < w; i++)
+            histogram[row[i]]++;
+    }
+    for (v = 0; v < 65535; v++) {
+        count += histogram[v];
+        if (count > half)
+            break;
+    }
+    return((double) v);
+}
+
+
+static void box_position(int *x, int *y, int *w, int *h)
+{
+    *w = box < ccd_image_width ? box : ccd_image_width;
+    *h = box < ccd_image_height ? box : ccd_image_height;
+    *x = (ccd_image_width - *w)/2;
+    *y = (ccd_image_height - *h)/2;
+}
+
+
+/* Median of a list of numbers (which is reordered) */
+static double median_of(double *v, int n)
+{
+    for (int i = 1; i < n; i++)
+        for (int j = i; j > 0 && v[j] < v[j-1]; j--) {
+            double t = v[j]; v[j] = v[j-1]; v[j-1] = t;
+        }
+    return (n % 2) ? v[n/2] : 0.5*(v[n/2 - 1] + v[n/2]);
+}
+
+
+/* Wait for the exposures to end. Returns 1 if interrupted. */
+static int wait_for_cameras(double exptime)
+{
+    int status;
+
+    wait_seconds(exptime);
+    for (int cam_num = 0; cam_num < ccd_ncam && !aborted; cam_num++) {
+        SetActiveCamera(cam_num);
+        do {
+            GetCameraStatus(&status);
+            if (status != COMPLETE)
+                wait_seconds(0.01);
+        } while (status != COMPLETE && !aborted);
+    }
+    return(aborted);
+}
+
+
+static void add_sample(double time, double rate)
+{
+    if (nsamples == MAX_SAMPLES) {
+        memmove(samples, samples + 1, (MAX_SAMPLES - 1)*sizeof(t_sample));
+        nsamples--;
+    }
+    samples[nsamples].time = time;
+    samples[nsamples].rate = rate;
+    nsamples++;
+}
+
+
+/* Fit log(rate) = a + k*t to the recent samples. Returns the rate now and */
+/* sets k (per second).                                                    */
+static double sky_now(double *k)
+{
+    double now = monotonic_time();
+    double st = 0, sl = 0, stt = 0, stl = 0;
+    double first = now;
+    int n = 0;
+
+    *k = (morning ? 1.0 : -1.0)*log(2.0)/180.0;
+    for (int i = 0; i < nsamples; i++) {
+        double t = samples[i].time - now;
+        double l = log(samples[i].rate);
+        if (t < -600.0)
+            continue;
+        if (samples[i].time < first)
+            first = samples[i].time;
+        st += t; sl += l; stt += t*t; stl += t*l;
+        n++;
+    }
+    if (n == 0)
+        return(0);
+
+    /* Only trust a fitted rate of change once the samples span 15 s */
+    if (n >= 3 && samples[nsamples-1].time - first > 15.0
+            && n*stt - st*st > 0)
+        *k = (n*stl - st*sl)/(n*stt - st*st);
+    return exp((sl - *k*st)/n);
+}
+
+
+/* The exposure time that collects the target level starting now, with the */
+/* sky changing as exp(k t). 0 if no exposure time will do.                */
+static double exposure_for(double rate, double k)
+{
+    double x;
+
+    if (rate <= 0)
+        return(0);
+    if (fabs(k) < 1e-9)
+        return(target/rate);
+    x = 1.0 + k*target/rate;
+    if (x <= 0)
+        return(0);     // fading too fast ever to get there
+    return(log(x)/k);
+}
+
+
+/* Read out every camera. If "probe", only the measuring box is read out. */
+/* Stores a sample (unless every camera saturated) and each camera's      */
+/* level above bias. Returns 1 if interrupted or a readout failed.        */
+static int measure(int frame, double exptime, int probe, double *level)
+{
+    double rates[MAX_CAMERAS_PER_SHARD];
+    double middle = 0;
+    int nrates = 0;
+    int phase;
+    int x, y, w, h;
+
+    if (StartExposuresAt(0, frame, exptime) || wait_for_cameras(exptime))
+        return(1);
+
+    for (int cam_num = 0; cam_num < ccd_ncam; cam_num++) {
+        phase = 1;
+        SetActiveCamera(cam_num);
+        box_position(&x, &y, &w, &h);
+        if (probe) {
+            if (CaptureImage(&phase,ccd_image_data[cam_num],frame,exptime,TRUE,x,y,w,h))
+                return(1);
+            level[cam_num] = box_median(ccd_image_data[cam_num], w, 0, 0, w, h);
+        }
+        else {
+            if (CaptureImage(&phase,ccd_image_data[cam_num],frame,exptime,FALSE,0,0,0,0))
+                return(1);
+            level[cam_num] = box_median(ccd_image_data[cam_num], ccd_image_width, x, y, w, h);
+        }
+        if (frame == BIAS || level[cam_num] >= SATURATED)
+            continue;
+        level[cam_num] -= bias[cam_num];
+        rates[nrates++] = level[cam_num] > 1 ? level[cam_num]/exptime : 1/exptime;
+        middle += ccd_camera_info[cam_num].timing.exposure_start + 0.5*exptime;
+    }
+    if (nrates > 0)
+        add_sample(middle/nrates, median_of(rates, nrates));
+    return(0);
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int arg=1;
+    int nwanted = 8;
+    int ngood = 0;
+    char name[MAX_STRING] = "twilight_flat";
+    char dither[MAX_STRING] = "";
+    char exptimes[4*MAX_STRING] = "";
+    double level[MAX_CAMERAS_PER_SHARD];
+    double probe = 0;
+    double exptime, rate, k;
+    int status = 0;
+    int failed = 0;
+
+    while (arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0')
+    {
+        if (argv[arg][1] != 'v' && argv[arg][1] != 'M' && arg + 1 >= argc) {
+            error_exit(usage);
+        }
+        switch (argv[arg++][1]) {
+            case 'v':
+                verbose = 1;
+                SetVerbosity(verbose);
+                break;
+            case 'n':
+                nwanted = atoi(argv[arg++]);
+                break;
+            case 't':
+                target = atof(argv[arg++]);
+                break;
+            case 'l':
+                low = atof(argv[arg++]);
+                break;
+            case 'u':
+                high = atof(argv[arg++]);
+                break;
+            case 'e':
+                min_exptime = atof(argv[arg++]);
+                break;
+            case 'm':
+                max_exptime = atof(argv[arg++]);
+                break;
+            case 'b':
+                box = atoi(argv[arg++]);
+                break;
+            case 'M':
+                morning = 1;
+                break;
+            case 'N':
+                snprintf(name, sizeof(name), "%s", argv[arg++]);
+                break;
+            case 'D':
+                snprintf(dither, sizeof(dither), "%s", argv[arg++]);
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (arg != argc || nwanted < 1 || box < 16 || min_exptime <= 0
+            || max_exptime < min_exptime || low >= high || target < low || target > high) {
+        error_exit(usage);
+    }
+
+    signal(SIGINT, InterruptHandler);
+    signal(SIGTERM, InterruptHandler);
+
+    get_lock();
+    store_pid_in_lockfile();
+
+    CountCameras();
+    if (ccd_ncam < 1){
+        fprintf(stderr,"Found 0 cameras\n");
+        release_lock();
+        return(1);
+    }
+    if (ccd_ncam_total > ccd_ncam)
+        fprintf(stderr,"Warning: driving only the first %d of %d cameras (see \"array\")\n",
+                ccd_ncam,ccd_ncam_total);
+    InitializeAllCameras();
+    store_timestamped_note_in_lockfile("Started");
+    store_directory_in_lockfile();
+
+    for (int cam_num = 0; cam_num < ccd_ncam; cam_num++) {
+        SetActiveCamera(cam_num);
+        ccd_image_data[cam_num] =
+            (unsigned short *) malloc(ccd_image_width*ccd_image_height*sizeof(unsigned short));
+    }
+
+    /* The bias level, from the measuring box of a bias frame */
+    status = measure(BIAS, 0, TRUE, bias);
+    for (int cam_num = 0; cam_num < ccd_ncam && !status; cam_num++)
+        emit("bias camera=%d level=%.1f\n", cam_num, bias[cam_num]);
+
+    while (!status && !aborted && ngood < nwanted) {
+
+        rate = sky_now(&k);
+        exptime = exposure_for(rate, k);
+
+        /* Probe the sky if we have no idea how bright it is. Probes */
+        /* are lengthened or shortened until the level is usable.    */
+        if (rate == 0) {
+            if (probe == 0)
+                probe = min_exptime;
+            if ((status = measure(FLAT, probe, TRUE, level)) != 0)
+                break;
+            rate = sky_now(&k);
+            emit("probe exptime=%.3f rate=%.1f slope=%.5f\n", probe, rate, k);
+            if (rate == 0 && probe > min_exptime)
+                probe = probe/10 > min_exptime ? probe/10 : min_exptime;
+            else if (rate == 0 && morning) {
+                emit("end exptime=0.000 reason=bright\n");
+                break;
+            }
+            else if (rate == 0) {
+                emit("wait seconds=60.0 exptime=0.000\n");
+                wait_seconds(60.0);
+            }
+            else if (rate*probe < 0.05*target && probe < max_exptime) {
+                nsamples = 0;
+                probe = probe*10 < max_exptime ? probe*10 : max_exptime;
+            }
+            continue;
+        }
+
+        /* Too bright (or too dark) to take a flat yet: wait for the sky */
+        /* to come into range, checking again at least once a minute     */
+        if (exptime < min_exptime || exptime > max_exptime) {
+            double wanted = exptime < min_exptime ? min_exptime : max_exptime;
+            double wait;
+            if ((exptime == 0 || exptime > max_exptime) != morning) {
+                emit("end exptime=%.3f reason=%s\n", exptime, morning ? "bright" : "dark");
+                break;
+            }
+            wait = log(target/(wanted*rate))/k;
+            if (wait > 60.0 || wait <= 0)
+                wait = 60.0;
+            emit("wait seconds=%.1f exptime=%.3f\n", wait, exptime);
+            wait_seconds(wait);
+            nsamples = 0;
+            continue;
+        }
+
+        /* Take the flat on every camera, and keep what came out right */
+        exptime = floor(exptime*100 + 0.5)/100;
+        emit("flat exptime=%.3f rate=%.1f slope=%.5f\n", exptime, rate, k);
+        if ((status = measure(FLAT, exptime, FALSE, level)) != 0)
+            break;
+        int kept = 0;
+        for (int cam_num = 0; cam_num < ccd_ncam; cam_num++) {
+            char newname[MAX_STRING] = "";
+            int filterNumber = 0;
+            SetActiveCamera(cam_num);
+            if (level[cam_num] < low || level[cam_num] > high) {
+                emit("reject camera=%d level=%.1f\n", cam_num, level[cam_num]);
+                continue;
+            }
+            new_filename(ccd_serial_number,"flat",newname);
+            GetCameraTemperature();
+            if (IsCameraAnST402ME())
+                filterNumber = FilterWheelPosition();
+            if (write_fits(newname, ccd_image_width, ccd_image_height, ccd_image_data[cam_num],
+                    exptime,"flat",ccd_camera_info[cam_num].temperature,filterNumber,
+                    ccd_serial_number,name,"","","","")) {
+                emit("failed camera=%d file=%s\n", cam_num, newname);
+                failed = 1;
+                continue;
+            }
+            emit("frame camera=%d level=%.1f file=%s\n", cam_num, level[cam_num], newname);
+            kept++;
+        }
+        if (kept == 0)
+            continue;
+        ngood++;
+        snprintf(exptimes + strlen(exptimes), sizeof(exptimes) - strlen(exptimes),
+                 "%s%.2f", ngood > 1 ? "," : "", exptime);
+        if (dither[0] && ngood < nwanted && !aborted) {
+            int rc = system(dither);
+            emit("dither status=%d\n", rc);
+        }
+    }
+
+    if (aborted) {
+        for (int cam_num = 0; cam_num < ccd_ncam; cam_num++) {
+            int phase = 2;
+            SetActiveCamera(cam_num);
+            CaptureImage(&phase,ccd_image_data[cam_num],FLAT,0,FALSE,0,0,0,0);
+        }
+        emit("aborted flats=%d exptimes=%s\n", ngood, exptimes);
+    }
+    else
+        emit("done flats=%d exptimes=%s\n", ngood, exptimes);
+
+    for (int cam_num = 0; cam_num < ccd_ncam; cam_num++)
+        free(ccd_image_data[cam_num]);
+    if (WaitForDurability())
+        failed = 1;
+
+    DisconnectAllCameras();
+    store_timestamped_note_in_lockfile("Completed");
+    release_lock();
+
+    return(aborted || status || failed ? 1 : 0);
+
+}
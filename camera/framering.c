@@ -0,0 +1,340 @@
+/*
+ * FRAMERING - Publish frames in shared memory as they are read out, and
+ * let other processes look at them without copying (see framering.h).
+ *
+ * There are no locks on the data path: sequence numbers are handed out
+ * with an atomic increment, a writer claims a slot by swapping its reader
+ * count from 0 to -1, and readers pin a slot by incrementing that count
+ * whenever it is not negative. A slot's sequence number is zero while its
+ * pixels are being replaced, so a reader that finds the sequence it
+ * expected after pinning the slot knows the pixels are whole.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "framering.h"
+
+
+static double ring_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+static size_t control_size(uint32_t nslots)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = sizeof(t_framering_header) + nslots*sizeof(t_ringslot);
+    return (size + page - 1)/page*page;
+}
+
+
+/* Lay out an empty ring. Called with the segment locked. */
+static int initialize_ring(int fd)
+{
+    t_framering_header *h;
+    struct stat st;
+    size_t csize = control_size(FRAMERING_SLOTS);
+    size_t total = csize + (size_t) FRAMERING_SLOTS*FRAMERING_SLOTSIZE;
+
+    // Pixel pages are only allocated as frames are written into them, so
+    // an old segment is emptied first to give back the pages of old frames.
+    // macOS only lets a shared memory object be sized once: there an old
+    // segment that is big enough is reused as it is, and one that is too
+    // small has to be removed (RemoveFrameRing()) before it can be laid out.
+    if (fstat(fd, &st))
+        return(1);
+    if (st.st_size == 0) {
+        if (ftruncate(fd, total))
+            return(1);
+    }
+    else if (ftruncate(fd, 0) || ftruncate(fd, total)) {
+        if (fstat(fd, &st) || (size_t) st.st_size < total)
+            return(1);
+    }
+    h = (t_framering_header *) mmap(NULL, csize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED)
+        return(1);
+    memset(h, 0, csize);
+    h->nslots = FRAMERING_SLOTS;
+    h->slotsize = FRAMERING_SLOTSIZE;
+    h->dataoffset = csize;
+    h->next = h->latest = 0;
+    __sync_synchronize();
+    memcpy(h->magic, FRAMERING_MAGIC, sizeof(h->magic));
+    munmap(h, csize);
+    return(0);
+}
+
+
+static int valid_ring(int fd)
+{
+    struct stat st;
+    t_framering_header h;
+
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(h))
+        return(0);
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t) sizeof(h))
+        return(0);
+    return (memcmp(h.magic, FRAMERING_MAGIC, sizeof(h.magic)) == 0
+            && h.dataoffset == control_size(h.nslots)
+            && (size_t) st.st_size >= h.dataoffset + (size_t) h.nslots*h.slotsize);
+}
+
+
+/* Attach to the ring. The acquisition side creates it if need be; readers */
+/* fail if no frame has ever been published. Returns 0 or 1.              */
+int OpenFrameRing(t_framering *ring, int create)
+{
+    t_framering_header h;
+
+    memset(ring, 0, sizeof(t_framering));
+    ring->writable = create;
+    ring->fd = shm_open(FRAMERING_NAME, create ? O_RDWR|O_CREAT : O_RDWR, 0660);
+    if (ring->fd < 0) {
+        if (create || errno != ENOENT)
+            fprintf(stderr,"Unable to open frame ring %s: %s\n",FRAMERING_NAME,strerror(errno));
+        else
+            fprintf(stderr,"No frame ring: no frames have been read out on this host\n");
+        return(1);
+    }
+
+    if (create) {
+        // Readers pin slots, so they need to write the control block too:
+        // that is left to the camera user's group rather than everyone
+        fchmod(ring->fd, 0660);
+        flock(ring->fd, LOCK_EX);
+        if (!valid_ring(ring->fd) && initialize_ring(ring->fd)) {
+            fprintf(stderr,"Unable to lay out frame ring %s: %s\n",FRAMERING_NAME,strerror(errno));
+            flock(ring->fd, LOCK_UN);
+            close(ring->fd);
+            return(1);
+        }
+        flock(ring->fd, LOCK_UN);
+    }
+    else {
+        flock(ring->fd, LOCK_SH);
+        if (!valid_ring(ring->fd)) {
+            fprintf(stderr,"Frame ring %s is not laid out yet\n",FRAMERING_NAME);
+            flock(ring->fd, LOCK_UN);
+            close(ring->fd);
+            return(1);
+        }
+        flock(ring->fd, LOCK_UN);
+    }
+
+    pread(ring->fd, &h, sizeof(h), 0);
+    ring->controlsize = h.dataoffset;
+    ring->datasize = (size_t) h.nslots*h.slotsize;
+    ring->header = (t_framering_header *) mmap(NULL, ring->controlsize, PROT_READ|PROT_WRITE,
+                                               MAP_SHARED, ring->fd, 0);
+    ring->pixels = (unsigned char *) mmap(NULL, ring->datasize,
+                                          create ? PROT_READ|PROT_WRITE : PROT_READ,
+                                          MAP_SHARED, ring->fd, ring->controlsize);
+    if (ring->header == MAP_FAILED || ring->pixels == MAP_FAILED) {
+        fprintf(stderr,"Unable to map frame ring %s: %s\n",FRAMERING_NAME,strerror(errno));
+        CloseFrameRing(ring);
+        return(1);
+    }
+    return(0);
+}
+
+
+/* Remove the ring, giving its memory back once every process has closed */
+/* it. The acquisition side notices (FrameRingRemoved()) and lays out a  */
+/* new one at its next readout.                                          */
+int RemoveFrameRing()
+{
+    if (shm_unlink(FRAMERING_NAME) != 0 && errno != ENOENT) {
+        fprintf(stderr,"Unable to remove frame ring %s: %s\n",FRAMERING_NAME,strerror(errno));
+        return(1);
+    }
+    return(0);
+}
+
+
+/* Whether the ring has been removed since it was opened. Returns 1 if */
+/* so: the mapping is then private to the processes that still hold it */
+/* and the writer should close it and open a new one.                  */
+int FrameRingRemoved(t_framering *ring)
+{
+#ifdef __linux__
+    struct stat sb;
+
+    // The segment is a file in /dev/shm, with no links left once removed
+    if (ring->fd >= 0 && fstat(ring->fd, &sb) == 0 && sb.st_nlink == 0)
+        return(1);
+#endif
+    return(0);
+}
+
+
+void CloseFrameRing(t_framering *ring)
+{
+    if (ring->header && ring->header != MAP_FAILED)
+        munmap(ring->header, ring->controlsize);
+    if (ring->pixels && ring->pixels != MAP_FAILED)
+        munmap(ring->pixels, ring->datasize);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(t_framering));
+    ring->fd = -1;
+}
+
+
+/* Copy a frame into the next slot. Returns 0, or 1 if the frame was */
+/* dropped because the slot it belongs in is pinned.                 */
+int PublishFrame(t_framering *ring, t_ringslot *info, unsigned short *data)
+{
+    t_framering_header *h = ring->header;
+    size_t nbytes = (size_t) info->width*info->height*sizeof(unsigned short);
+    uint64_t seq, latest;
+    t_ringslot *slot;
+    int32_t r;
+
+    if (!ring->writable || nbytes > h->slotsize)
+        return(1);
+
+    seq = __sync_add_and_fetch(&h->next, 1);
+    slot = &h->slot[seq % h->nslots];
+    if (!__sync_bool_compare_and_swap(&slot->readers, 0, -1)) {
+        // Only take a slot from a reader (or writer) that has stopped moving
+        r = slot->readers;
+        if (ring_time() - slot->held < FRAMERING_LEASE
+                || !__sync_bool_compare_and_swap(&slot->readers, r, -1))
+            return(1);
+    }
+    slot->held = ring_time();
+    slot->sequence = 0;
+    __sync_synchronize();
+
+    slot->frame = info->frame;
+    memcpy(slot->serial_number, info->serial_number, sizeof(slot->serial_number));
+    slot->shard = info->shard;
+    slot->camera = info->camera;
+    slot->x = info->x;
+    slot->y = info->y;
+    slot->width = info->width;
+    slot->height = info->height;
+    slot->exposure = info->exposure;
+    slot->date_obs = info->date_obs;
+    slot->readout_end = info->readout_end;
+    slot->temperature = info->temperature;
+    memcpy(ring->pixels + (seq % h->nslots)*h->slotsize, data, nbytes);
+
+    __sync_synchronize();
+    slot->sequence = seq;
+    __sync_synchronize();
+    slot->readers = 0;
+    while ((latest = h->latest) < seq && !__sync_bool_compare_and_swap(&h->latest, latest, seq))
+        ;
+    return(0);
+}
+
+
+static void unpin(t_ringslot *slot)
+{
+    int32_t r;
+
+    do {
+        r = slot->readers;
+        if (r <= 0)     // a writer has taken the slot back
+            return;
+    } while (!__sync_bool_compare_and_swap(&slot->readers, r, r - 1));
+}
+
+
+/* Pin the newest frame later than sequence "after", from the camera with */
+/* the given serial number (any camera if NULL). Returns 0, or 1 if there */
+/* is no such frame.                                                      */
+int AcquireFrame(t_framering *ring, uint64_t after, char *serial, t_ringframe *frame)
+{
+    t_framering_header *h = ring->header;
+    t_ringslot *slot;
+    uint64_t seq, best;
+    int32_t r;
+    int i, tries, n;
+
+    for (tries = 0; tries < 4; tries++) {
+        best = after;
+        n = -1;
+        for (i = 0; i < (int) h->nslots; i++) {
+            seq = h->slot[i].sequence;
+            if (seq > best && (!serial || !strncmp(h->slot[i].serial_number, serial, 16))) {
+                best = seq;
+                n = i;
+            }
+        }
+        if (n < 0)
+            return(1);
+
+        slot = &h->slot[n];
+        do {
+            r = slot->readers;
+        } while (r >= 0 && !__sync_bool_compare_and_swap(&slot->readers, r, r + 1));
+        if (r < 0)
+            continue;       // being rewritten
+        __sync_synchronize();
+        if (slot->sequence != best
+                || (serial && strncmp(slot->serial_number, serial, 16))) {
+            unpin(slot);
+            continue;
+        }
+        slot->held = ring_time();
+        frame->slot = n;
+        frame->sequence = best;
+        frame->info = *slot;
+        frame->data = (const unsigned short *) (ring->pixels + (size_t) n*h->slotsize);
+        return(0);
+    }
+    return(1);
+}
+
+
+/* As AcquireFrame(), but poll for up to timeout seconds for the frame */
+int WaitForFrame(t_framering *ring, uint64_t after, char *serial, double timeout, t_ringframe *frame)
+{
+    double give_up = ring_time() + timeout;
+
+    while (AcquireFrame(ring, after, serial, frame)) {
+        if (ring_time() > give_up)
+            return(1);
+        usleep(10000);
+    }
+    return(0);
+}
+
+
+/* Unpin a frame. Returns 0, or 1 if the pixels were overwritten while */
+/* the frame was pinned (which only happens after FRAMERING_LEASE).    */
+int ReleaseFrame(t_framering *ring, t_ringframe *frame)
+{
+    t_ringslot *slot = &ring->header->slot[frame->slot];
+    int overwritten;
+
+    __sync_synchronize();
+    overwritten = (slot->sequence != frame->sequence);
+    if (!overwritten)   // otherwise our pin went with the slot
+        unpin(slot);
+    frame->data = NULL;
+    return(overwritten);
+}
+
+
+uint64_t LatestFrame(t_framering *ring)
+{
+    return ring->header->latest;
+}
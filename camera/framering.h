@@ -0,0 +1,107 @@
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Shared-memory frame ring
+ *
+ * Every process that reads out a camera publishes the frame into a POSIX
+ * shared memory segment as soon as CC_END_READOUT returns, so tools that
+ * only want to look at the latest frame need not wait for write_fits()
+ * and read the file back. The segment is a control block followed by
+ * FRAMERING_SLOTS slots of pixels:
+ *
+ *     t_framering_header  (magic, sizes, sequence counters)
+ *     t_ringslot[nslots]  (one header per slot)
+ *     pixels[nslots][slotsize]
+ *
+ * Frames get increasing sequence numbers starting from 1 and frame n
+ * lives in slot n % nslots. Readers map the pixels read-only and pin a
+ * slot by counting themselves in its readers field; a writer never waits
+ * for a reader but drops the frame from the ring instead (the frame is
+ * still written to disk as usual). A reader that dies while holding a
+ * slot only pins it for FRAMERING_LEASE seconds, and ReleaseFrame() tells
+ * a reader that held on for longer than that whether its pixels were
+ * overwritten in the meantime.
+ *
+ * There is one ring per computer. It outlives the processes that use it
+ * and, once every slot has held a frame, takes FRAMERING_SLOTS full frames
+ * of memory (255 MB) until it is removed with RemoveFrameRing(), i.e.
+ * shm_unlink(FRAMERING_NAME), or "lastframe -R" (on Linux it is the file
+ * /dev/shm/sbig.frames). Acquisition can be kept from using it at all
+ * with SetFrameRing(0) or SBIG_FRAMERING=off in the environment.
+ *
+ * The ring is readable and writable by the user running the cameras and
+ * that user's group only, so tools looking at frames have to run as one
+ * of them. A camera program that is running when the ring is removed sees
+ * that at its next readout (FrameRingRemoved()) and lays out a new one;
+ * readers keep the old, removed ring until they are restarted.
+ *
+ * macOS only lets a shared memory object be sized once, so there an old
+ * ring is reused rather than emptied, and a ring of a different size has
+ * to be removed before a new one can be laid out. Until then acquisition
+ * carries on without it. Nor can a removed ring be told apart there, so a
+ * camera program that is already running keeps writing into the old one
+ * until it exits.
+ */
+
+#define FRAMERING_NAME      "/sbig.frames"
+#define FRAMERING_MAGIC     "SBIGRNG1"
+#define FRAMERING_SLOTS     16          // two frames for each of eight cameras
+#define FRAMERING_SLOTSIZE  (3326*2504*2)  // bytes; a full STF-8300 frame
+#define FRAMERING_LEASE     60.0        // seconds a reader may pin a slot
+
+typedef struct {
+    volatile int32_t  readers;      // readers holding the slot, -1 while it is written
+    int32_t  frame;                 // DARK, LIGHT, BIAS or FLAT
+    volatile uint64_t sequence;     // of the frame in the slot, 0 while empty or being written
+    double   held;                  // monotonic time a reader last pinned the slot
+    char     serial_number[16];
+    int32_t  shard, camera;         // which process and camera read it out
+    int32_t  x, y, width, height;   // on the detector
+    double   exposure;              // seconds
+    double   date_obs;              // wall-clock time the exposure started
+    double   readout_end;           // monotonic time
+    double   temperature;           // CCD, degrees C
+} t_ringslot;
+
+typedef struct {
+    char     magic[8];
+    uint32_t nslots;
+    uint32_t pad;
+    uint64_t slotsize;              // bytes of pixels per slot
+    uint64_t dataoffset;            // of the first slot's pixels from the start of the segment
+    volatile uint64_t next;         // last sequence number handed out
+    volatile uint64_t latest;       // newest frame published
+    t_ringslot slot[];
+} t_framering_header;
+
+typedef struct {
+    int fd;
+    int writable;
+    t_framering_header *header;     // always mapped read/write (readers count themselves here)
+    size_t controlsize;
+    unsigned char *pixels;          // read-only for readers
+    size_t datasize;
+} t_framering;
+
+/* A frame pinned by a reader. The pixels stay valid until ReleaseFrame(). */
+typedef struct {
+    int slot;
+    uint64_t sequence;
+    t_ringslot info;                // copy of the slot header
+    const unsigned short *data;     // width*height pixels, row 0 first
+} t_ringframe;
+
+int  OpenFrameRing(t_framering *ring, int create);    // create = 1 for the acquisition side
+void CloseFrameRing(t_framering *ring);
+int  RemoveFrameRing();
+int  FrameRingRemoved(t_framering *ring);
+int  PublishFrame(t_framering *ring, t_ringslot *info, unsigned short *data);
+int  AcquireFrame(t_framering *ring, uint64_t after, char *serial, t_ringframe *frame);
+int  WaitForFrame(t_framering *ring, uint64_t after, char *serial, double timeout, t_ringframe *frame);
+int  ReleaseFrame(t_framering *ring, t_ringframe *frame);
+uint64_t LatestFrame(t_framering *ring);
+
+#endif
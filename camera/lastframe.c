@@ -0,0 +1,212 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "fitsio.h"
+#include "framering.h"
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+#define MAX_STRING 256
+
+#define usage "\n\
+NAME\n\
+lastframe --- look at the latest frames without waiting for them to reach disk \n\
+\n\
+SYNOPSIS\n\
+lastframe [options...] \n\
+\n\
+DESCRIPTION\n\
+Every frame read out on this computer is put into a ring of frames in shared\n\
+memory as soon as the readout ends (see framering.h), before it is written to\n\
+disk. \"lastframe\" prints statistics of the newest frame in the ring, or\n\
+lists the ring, or writes a frame out as a FITS file for tools that need one.\n\
+The ring is read in place, so looking at a frame costs no copies and no disk\n\
+I/O, and never holds up the cameras.\n\
+\n\
+The ring stays in memory (up to 255 MB) after the cameras are done with it.\n\
+-R removes it; the next readout lays out a new one (on Linux; on macOS a\n\
+camera program that is already running keeps writing into the removed ring\n\
+until it exits). Tools still reading the old ring have to be restarted. Set\n\
+SBIG_FRAMERING=off for the camera programs to keep frames out of the ring\n\
+altogether. The ring can only be read by the user running the cameras and\n\
+that user's group.\n\
+\n\
+The statistics line gives the serial number, sequence number in the ring,\n\
+image type, exposure time, size, seconds since the readout ended, and the\n\
+minimum, median, mean and maximum pixel values and the number of saturated\n\
+(65535) pixels.\n\
+\n\
+OPTIONS\n\
+-l          # list the frames in the ring \n\
+-c serial   # only frames from the camera with this serial number \n\
+-w seconds  # wait up to this long for a frame newer than any in the ring now \n\
+-o file     # write the frame to a FITS file (overwritten if it exists) \n\
+-R          # remove the ring and give its memory back \n\
+\n\
+EXAMPLES\n\
+lastframe \n\
+lastframe -c 83F010783 -w 600 \n\
+lastframe -c 83F010783 -o /var/tmp/focus.fits \n\
+lastframe -R \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+static char *frametype[] = { "dark", "light", "bias", "flat" };
+
+
+static char *type_name(int frame)
+{
+    return (frame >= 0 && frame < 4) ? frametype[frame] : "unknown";
+}
+
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+static void print_statistics(t_ringframe *f)
+{
+    static uint32_t histogram[65536];
+    long npix = (long) f->info.width*f->info.height;
+    long half = npix/2, count = 0;
+    double sum = 0;
+    int min = 65535, max = 0, median = 0;
+
+    memset(histogram, 0, sizeof(histogram));
+    for (long i = 0; i < npix; i++)
+        histogram[f->data[i]]++;
+    for (int v = 0; v < 65536; v++) {
+        if (!histogram[v])
+            continue;
+        if (v < min) min = v;
+        max = v;
+        sum += (double) v*histogram[v];
+        if (count <= half && count + histogram[v] > half)
+            median = v;
+        count += histogram[v];
+    }
+    printf("%s %llu %s %.3f %dx%d %.1f %d %d %.1f %d %u\n",
+           f->info.serial_number, (unsigned long long) f->sequence, type_name(f->info.frame),
+           f->info.exposure, f->info.width, f->info.height, now() - f->info.readout_end,
+           min, median, npix ? sum/npix : 0.0, max, histogram[65535]);
+}
+
+
+static int write_frame(t_ringframe *f, char *filename)
+{
+    fitsfile *fptr;
+    char path[MAX_STRING + 1];
+    char date[32];
+    long naxes[2] = { f->info.width, f->info.height };
+    time_t t = (time_t) f->info.date_obs;
+    int status = 0;
+
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", gmtime(&t));
+    snprintf(path, sizeof(path), "!%s", filename);
+    fits_create_file(&fptr, path, &status);
+    fits_create_img(fptr, USHORT_IMG, 2, naxes, &status);
+    fits_update_key(fptr, TSTRING, "IMAGETYP", type_name(f->info.frame), "Image type", &status);
+    fits_update_key(fptr, TDOUBLE, "EXPTIME", &f->info.exposure, "Exposure time (s)", &status);
+    fits_update_key(fptr, TSTRING, "DATE-OBS", date, "Exposure start (UTC)", &status);
+    fits_update_key(fptr, TSTRING, "SERIALNO", f->info.serial_number, "Camera serial number", &status);
+    fits_update_key(fptr, TDOUBLE, "CCD-TEMP", &f->info.temperature, "CCD temperature (C)", &status);
+    fits_write_img(fptr, TUSHORT, 1, (LONGLONG) naxes[0]*naxes[1], (void *) f->data, &status);
+    fits_close_file(fptr, &status);
+    if (status) {
+        fits_report_error(stderr, status);
+        return(1);
+    }
+    return(0);
+}
+
+
+int main(int argc, char *argv[]) {
+
+    t_framering ring;
+    t_ringframe frame;
+    char *serial = NULL;
+    char *output = NULL;
+    double wait = -1;
+    int list = 0;
+    int remove_ring = 0;
+    int status = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "lc:w:o:Rh")) != -1) {
+        switch (c) {
+            case 'l':
+                list = 1;
+                break;
+            case 'c':
+                serial = optarg;
+                break;
+            case 'w':
+                wait = atof(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'R':
+                remove_ring = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (optind != argc) {
+        error_exit(usage);
+    }
+    if (remove_ring)
+        return(RemoveFrameRing());
+
+    if (OpenFrameRing(&ring, 0))
+        return(1);
+
+    if (list) {
+        t_framering_header *h = ring.header;
+        printf("# ring of %u frames, newest %llu\n", h->nslots, (unsigned long long) h->latest);
+        for (int i = 0; i < (int) h->nslots; i++) {
+            t_ringslot *s = &h->slot[i];
+            if (s->sequence == 0 || (serial && strncmp(s->serial_number, serial, 16)))
+                continue;
+            printf("%2d %llu %s %s %.3f %dx%d %.1f %d\n", i, (unsigned long long) s->sequence,
+                   s->serial_number, type_name(s->frame), s->exposure, s->width, s->height,
+                   now() - s->readout_end, s->readers);
+        }
+        CloseFrameRing(&ring);
+        return(0);
+    }
+
+    if (wait >= 0)
+        status = WaitForFrame(&ring, LatestFrame(&ring), serial, wait, &frame);
+    else
+        status = AcquireFrame(&ring, 0, serial, &frame);
+    if (status) {
+        fprintf(stderr,"No frame%s%s in the ring\n", serial ? " from " : "", serial ? serial : "");
+        CloseFrameRing(&ring);
+        return(1);
+    }
+
+    if (output)
+        status = write_frame(&frame, output);
+    else
+        print_statistics(&frame);
+    if (ReleaseFrame(&ring, &frame)) {
+        fprintf(stderr,"Frame %llu was overwritten while it was being read\n",
+                (unsigned long long) frame.sequence);
+        status = 1;
+    }
+    CloseFrameRing(&ring);
+    return(status);
+
+}
@@ -0,0 +1,659 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "fitsio.h"
+#include "camera.h"
+#include "transfer.h"
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+#define MAX_STRING 256
+#define MAX_STEPS 256
+#define MAX_SUBSCRIBERS 16
+
+#define usage "\n\
+NAME\n\
+plan --- carry out a sequence of exposures without supervision \n\
+\n\
+SYNOPSIS\n\
+plan [options] planFile\n\
+plan [options] -c \"step; step; ...\"\n\
+\n\
+DESCRIPTION\n\
+\"plan\" takes a whole observing sequence up front and runs it back to back on\n\
+the cameras attached to this computer, so nothing has to be sent over the\n\
+network between frames. Each step of the plan is one line of the plan file\n\
+(or one ;-separated item given with -c) of the form:\n\
+\n\
+    imageType exposureTime [count [filter [name [dither]]]]\n\
+\n\
+imageType and exposureTime are as for \"expose\". count is the number of frames\n\
+(default 1). filter is a filter name for cameras with a filter wheel. name is\n\
+written to the OBJECT keyword. dither is a shell command run after each frame\n\
+of the step except the last frame of the plan, e.g. to move the mount. Use \"-\"\n\
+to skip a field. Quote fields containing spaces. Blank lines and lines\n\
+starting with # are ignored.\n\
+\n\
+The SBIG driver only hands one process four cameras, so on a computer with\n\
+more, plan drives the first four and warns that the rest are left idle.\n\
+\n\
+As the plan runs, one event per line is written to stdout, to the lockfile,\n\
+and to every client connected to the subscriber port (-p). Each event is the\n\
+time (seconds since 1970) followed by the event name and key=value pairs:\n\
+\n\
+    1500000000.123 start steps=2 frames=4\n\
+    1500000000.125 exposing step=1 frame=1/3 imtype=light exptime=600.000\n\
+    1500000603.410 frame step=1 frame=1/3 camera=0 file=83F010783_17_light.fits\n\
+    1500000603.902 dither step=1 frame=1/3 status=0\n\
+    1500002455.004 done frames=4\n\
+\n\
+An interrupt or termination signal ends the current exposures without\n\
+reading them out and finishes with an \"aborted\" event. A frame that cannot\n\
+be written is reported with a \"failed\" event in place of \"frame\", is not\n\
+streamed, and makes plan exit with status 1 once the plan is done.\n\
+\n\
+A \"frame\" event means the frame has been written. It is flushed to disk and\n\
+put in place under its name, and only then streamed (-s), while the next\n\
+exposure runs (see SBIG_DURABILITY in \"expose\"). A frame that cannot be put\n\
+in place is reported on stderr and also makes plan exit with status 1.\n\
+\n\
+With -S each camera also co-adds the frames of every step in memory as they\n\
+are read out. At the end of the step (or when it is cut short) the stack is\n\
+written as SERIAL_N_stack.fits, holding the sum of the frames, together with\n\
+SERIAL_N_stack_var.fits, the variance of a single frame at each pixel:\n\
+\n\
+    sum       the sum only (32 bits per pixel, no variance file)\n\
+    variance  the sum and the sum of squares (96 bits per pixel)\n\
+    clip      a running mean and variance; once a pixel has five values,\n\
+              values more than -k sigma from its mean are left out. The\n\
+              stack is the mean times the number of frames.\n\
+\n\
+A SIGUSR1 signal writes the stacks as they stand without stopping the plan,\n\
+e.g. to look at a long focus or monitoring sequence part way through. Each\n\
+stack written is reported with an event like:\n\
+\n\
+    1500002455.010 stack step=1 camera=0 frames=3 file=83F010783_18_stack.fits\n\
+\n\
+OPTIONS\n\
+-v          # verbose mode \n\
+-c plan     # read the plan from the command line instead of a file \n\
+-p port     # accept event subscribers on this TCP port \n\
+-s host     # also stream each frame to the frame receiver (framerecv) on host, \n\
+            # given as host or host:port, over one connection for the whole plan \n\
+            # (opened again for the next frame if a frame cannot be sent) \n\
+-C          # tile-compress the streamed frames (sent as name.fits.fz) \n\
+-S type     # stack the frames of each step: sum, variance or clip \n\
+-k kappa    # clipping threshold in sigma for -S clip (default 3) \n\
+-N          # with -S, write only the stacks, not the individual frames \n\
+-r RA        \n\
+-d Dec       \n\
+-a Alt       \n\
+-z Az        \n\
+\n\
+EXAMPLES\n\
+plan -c \"light 600 3 - M101 'dither.pl 10'; dark 600 3\" \n\
+plan -p 7079 tonight.plan \n\
+plan -S clip -N -c \"light 1 300\" \n\
+pkill -USR1 -x plan \n\
+nc localhost 7079 \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+/* One line of the plan */
+typedef struct {
+    char  imtype[8];
+    float exptime;
+    int   count;
+    char  filter[16];
+    char  name[MAX_STRING];
+    char  dither[MAX_STRING];
+} t_step;
+
+static t_step steps[MAX_STEPS];
+static int nsteps = 0;
+static int verbose = 0;
+static char ra[MAX_STRING] = "";
+static char dec[MAX_STRING] = "";
+static char alt[MAX_STRING] = "";
+static char az[MAX_STRING] = "";
+
+/* Frames are streamed once they are in place (see SetFrameHook()) */
+static char stream_host[MAX_STRING] = "";
+static int stream_fd = -1;
+static int compress = 0;
+
+static int listen_fd = -1;
+static int subscribers[MAX_SUBSCRIBERS];
+static int nsubscribers = 0;
+
+static int stack_mode = -1;       // Not stacking
+static double kappa = 3.0;
+static int stacks_only = 0;
+static int current_step = 0;
+
+static volatile sig_atomic_t aborted = 0;
+static volatile sig_atomic_t stacks_wanted = 0;
+
+
+void InterruptHandler(int sig)
+{
+    aborted = 1;
+}
+
+
+void StackHandler(int sig)
+{
+    stacks_wanted = 1;
+}
+
+
+/* Split off the next whitespace-separated field, which may be quoted */
+static char *next_field(char **s)
+{
+    char *p = *s;
+    char *field;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p == '\0' || *p == '\n')
+        return(NULL);
+    if (*p == '"' || *p == '\'') {
+        char quote = *p++;
+        field = p;
+        while (*p && *p != quote)
+            p++;
+    }
+    else {
+        field = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\n')
+            p++;
+    }
+    if (*p)
+        *p++ = '\0';
+    *s = p;
+    return(field);
+}
+
+
+/* Parse one step. Returns 0 on success, 1 for a blank line, -1 on error. */
+static int parse_step(char *line, t_step *step)
+{
+    char *field;
+
+    memset(step, 0, sizeof(t_step));
+    step->count = 1;
+
+    if ((field = next_field(&line)) == NULL || field[0] == '#')
+        return(1);
+    snprintf(step->imtype, sizeof(step->imtype), "%s", field);
+    if (value_from_imagetype_key(step->imtype) == BADKEY) {
+        fprintf(stderr,"Unknown image type %s\n",step->imtype);
+        return(-1);
+    }
+
+    if ((field = next_field(&line)) == NULL) {
+        fprintf(stderr,"No exposure time given for %s\n",step->imtype);
+        return(-1);
+    }
+    step->exptime = atof(field);
+
+    if ((field = next_field(&line)) != NULL && strcmp(field,"-") != 0)
+        step->count = atoi(field);
+    if (field && (field = next_field(&line)) != NULL && strcmp(field,"-") != 0) {
+        snprintf(step->filter, sizeof(step->filter), "%s", field);
+        if (value_from_filtername_key(step->filter) == BADKEY) {
+            fprintf(stderr,"Unknown filter %s\n",step->filter);
+            return(-1);
+        }
+    }
+    if (field && (field = next_field(&line)) != NULL && strcmp(field,"-") != 0)
+        snprintf(step->name, sizeof(step->name), "%s", field);
+    if (field && (field = next_field(&line)) != NULL && strcmp(field,"-") != 0)
+        snprintf(step->dither, sizeof(step->dither), "%s", field);
+
+    if (step->count < 1 || step->exptime < 0) {
+        fprintf(stderr,"Bad count or exposure time for %s\n",step->imtype);
+        return(-1);
+    }
+    return(0);
+}
+
+
+static int add_step(char *line)
+{
+    int rc;
+    if (nsteps == MAX_STEPS) {
+        fprintf(stderr,"Plans are limited to %d steps\n",MAX_STEPS);
+        return(1);
+    }
+    rc = parse_step(line, &steps[nsteps]);
+    if (rc == 0)
+        nsteps++;
+    return(rc < 0);
+}
+
+
+/* Take any subscribers waiting to connect */
+static void accept_subscribers()
+{
+    int fd;
+    if (listen_fd < 0)
+        return;
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        if (nsubscribers == MAX_SUBSCRIBERS) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        subscribers[nsubscribers++] = fd;
+    }
+}
+
+
+static int open_subscriber_port(int port)
+{
+    struct sockaddr_in addr;
+    int on = 1;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || listen(listen_fd, MAX_SUBSCRIBERS) != 0) {
+        perror("Unable to open subscriber port");
+        return(1);
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    return(0);
+}
+
+
+/* The frame hook. It runs on the background thread that puts frames in
+ * place, so it says nothing through emit(). */
+static void stream_frame(char *filename)
+{
+    int rc;
+
+    // Reconnect if the last frame left the connection closed
+    if (stream_fd < 0 && (stream_fd = OpenFrameStream(stream_host)) < 0)
+        return;
+    if (compress) {
+        void *buffer;
+        size_t size;
+        char fzname[MAX_STRING + 4];
+        snprintf(fzname, sizeof(fzname), "%s.fz", filename);
+        if (read_fits_to_memory(&buffer, &size, compress, filename))
+            return;
+        rc = SendFrameBuffer(stream_fd, fzname, buffer, size);
+        free(buffer);
+    }
+    else
+        rc = SendFrameFile(stream_fd, filename);
+
+    // The connection is in an unknown state after a failure
+    if (rc) {
+        fprintf(stderr,"Unable to stream %s to %s: reconnecting for the next frame\n",
+                filename,stream_host);
+        CloseFrameStream(stream_fd);
+        stream_fd = -1;
+    }
+}
+
+
+/* Send an event to stdout, the lockfile and all subscribers. A subscriber
+ * that has gone away or cannot keep up is dropped. */
+static void emit(const char *fmt, ...)
+{
+    char line[2*MAX_STRING];
+    struct timespec now;
+    va_list ap;
+    int n;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    n = snprintf(line, sizeof(line), "%.3f ", now.tv_sec + 1e-9*now.tv_nsec);
+    va_start(ap, fmt);
+    vsnprintf(line + n, sizeof(line) - n, fmt, ap);
+    va_end(ap);
+
+    fputs(line, stdout);
+    fflush(stdout);
+    store_note_in_lockfile(line);
+
+    accept_subscribers();
+    for (int i = 0; i < nsubscribers; i++) {
+        if (write(subscribers[i], line, strlen(line)) != (ssize_t) strlen(line)) {
+            close(subscribers[i]);
+            subscribers[i--] = subscribers[--nsubscribers];
+        }
+    }
+}
+
+
+/* Sleep for up to msec, taking new subscribers as they arrive */
+static void wait_msec(int msec)
+{
+    if (listen_fd < 0) {
+        struct timespec ts;
+        ts.tv_sec = msec/1000;
+        ts.tv_nsec = (msec % 1000)*1000000L;
+        nanosleep(&ts, NULL);
+        return;
+    }
+    struct pollfd pfd;
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, msec) > 0)
+        accept_subscribers();
+}
+
+
+/* Write each camera's stack of the current step so far */
+static void write_stacks()
+{
+    t_step *step = &steps[current_step];
+
+    stacks_wanted = 0;
+    for (int cam_num = 0; cam_num < ccd_ncam; cam_num++) {
+        char name[MAX_STRING] = "";
+        char varname[MAX_STRING + 8];
+        if (StackDepth(cam_num) == 0)
+            continue;
+        SetActiveCamera(cam_num);
+        new_filename(ccd_serial_number, "stack", name);
+        snprintf(varname, sizeof(varname), "%.*s_var.fits", (int) strlen(name) - 5, name);
+        if (WriteStack(cam_num, name, stack_mode == STACK_SUM ? NULL : varname,
+                    step->exptime, step->imtype) == 0)
+            emit("stack step=%d camera=%d frames=%d file=%s\n",
+                    current_step + 1, cam_num, StackDepth(cam_num), name);
+    }
+}
+
+
+/* Wait until every camera has finished integrating. Returns 1 if the plan
+ * was aborted in the meantime. */
+static int wait_for_cameras(float exptime)
+{
+    double done = monotonic_time() + exptime;
+    int status;
+
+    // Nothing to ask the cameras until the exposure time has run out
+    while (!aborted && monotonic_time() < done) {
+        int msec = (int) ((done - monotonic_time())*1000.0) + 1;
+        wait_msec(msec > 1000 ? 1000 : msec);
+        if (stacks_wanted)
+            write_stacks();
+    }
+
+    for (int cam_num = 0; cam_num < ccd_ncam && !aborted; cam_num++) {
+        SetActiveCamera(cam_num);
+        do {
+            GetCameraStatus(&status);
+            if (status != COMPLETE)
+                wait_msec(10);
+        } while (status != COMPLETE && !aborted);
+    }
+    return(aborted);
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int arg=1;
+    int port = 0;
+    char *inline_plan = NULL;
+    char *planfile = NULL;
+    char line[4*MAX_STRING];
+    int phase;
+    int nframes = 0;
+    int nwritten = 0;
+    int failed = 0;
+    struct sigaction sa;
+
+    while (arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0')
+    {
+        if (strchr("vCN", argv[arg][1]) == NULL && arg + 1 >= argc) {
+            error_exit(usage);
+        }
+        switch (argv[arg++][1]) {
+            case 'v':
+                verbose = 1;
+                SetVerbosity(verbose);
+                break;
+            case 'c':
+                inline_plan = argv[arg++];
+                break;
+            case 'p':
+                port = atoi(argv[arg++]);
+                break;
+            case 's':
+                sscanf(argv[arg++], "%s", stream_host);
+                break;
+            case 'C':
+                compress = 1;
+                break;
+            case 'S':
+                if (strcmp(argv[arg], "sum") == 0)
+                    stack_mode = STACK_SUM;
+                else if (strcmp(argv[arg], "variance") == 0)
+                    stack_mode = STACK_VARIANCE;
+                else if (strcmp(argv[arg], "clip") == 0)
+                    stack_mode = STACK_CLIP;
+                else {
+                    error_exit(usage);
+                }
+                arg++;
+                break;
+            case 'k':
+                kappa = atof(argv[arg++]);
+                break;
+            case 'N':
+                stacks_only = 1;
+                break;
+             case 'r':
+                sscanf(argv[arg++], "%s", ra);
+                break;
+             case 'd':
+                sscanf(argv[arg++], "%s", dec);
+                break;
+             case 'a':
+                sscanf(argv[arg++], "%s", alt);
+                break;
+             case 'z':
+                sscanf(argv[arg++], "%s", az);
+                break;
+             default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (inline_plan == NULL) {
+        if (argc - arg != 1) {
+            error_exit(usage);
+        }
+        planfile = argv[arg];
+    }
+    else if (arg != argc) {
+        error_exit(usage);
+    }
+    if (stacks_only && stack_mode < 0) {
+        fprintf(stderr,"-N needs -S\n");
+        return(1);
+    }
+
+    /* Read the whole plan before touching the cameras */
+    if (inline_plan) {
+        char *copy = strdup(inline_plan);
+        char *item = strtok(copy, ";");
+        while (item) {
+            if (add_step(item))
+                return(1);
+            item = strtok(NULL, ";");
+        }
+        free(copy);
+    }
+    else {
+        FILE *fp = strcmp(planfile,"-") == 0 ? stdin : fopen(planfile, "r");
+        if (fp == NULL) {
+            perror(planfile);
+            return(1);
+        }
+        while (fgets(line, sizeof(line), fp))
+            if (add_step(line))
+                return(1);
+        if (fp != stdin)
+            fclose(fp);
+    }
+    if (nsteps == 0) {
+        fprintf(stderr,"The plan is empty\n");
+        return(1);
+    }
+    for (int s = 0; s < nsteps; s++)
+        nframes += steps[s].count;
+
+    if (port > 0 && open_subscriber_port(port))
+        return(1);
+
+    signal(SIGINT, InterruptHandler);
+    signal(SIGTERM, InterruptHandler);
+    signal(SIGPIPE, SIG_IGN);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = StackHandler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    get_lock();
+    store_pid_in_lockfile();
+
+    CountCameras();
+    if (ccd_ncam < 1){
+        fprintf(stderr,"Found 0 cameras\n");
+        release_lock();
+        return(1);
+    }
+    if (ccd_ncam_total > ccd_ncam)
+        fprintf(stderr,"Warning: driving only the first %d of %d cameras (see \"array\")\n",
+                ccd_ncam,ccd_ncam_total);
+    InitializeAllCameras();
+    if (stream_host[0]) {
+        stream_fd = OpenFrameStream(stream_host);
+        SetFrameHook(stream_frame);
+    }
+    store_timestamped_note_in_lockfile("Started");
+    store_directory_in_lockfile();
+
+    for (int cam_num = 0; cam_num < ccd_ncam; cam_num++) {
+        SetActiveCamera(cam_num);
+        ccd_image_data[cam_num] =
+            (unsigned short *) malloc(ccd_image_width*ccd_image_height*sizeof(unsigned short));
+    }
+    if (stack_mode >= 0 && StartStack(stack_mode, kappa)) {
+        release_lock();
+        return(1);
+    }
+
+    emit("start steps=%d frames=%d\n", nsteps, nframes);
+
+    for (int s = 0, n = 0; s < nsteps && !aborted; s++) {
+        t_step *step = &steps[s];
+        ccd_type = value_from_imagetype_key(step->imtype);
+        current_step = s;
+        if (stack_mode >= 0)
+            ResetStack();
+
+        if (step->filter[0]) {
+            for (int cam_num = 0; cam_num < ccd_ncam; cam_num++) {
+                SetActiveCamera(cam_num);
+                if (IsCameraAnST402ME())
+                    SetFilter(value_from_filtername_key(step->filter));
+            }
+        }
+
+        for (int i = 0; i < step->count && !aborted; i++, n++) {
+            emit("exposing step=%d frame=%d/%d imtype=%s exptime=%.3f\n",
+                    s + 1, i + 1, step->count, step->imtype, step->exptime);
+            StartExposuresAt(0,ccd_type,step->exptime);
+
+            if (wait_for_cameras(step->exptime))
+                break;
+
+            for (int cam_num = 0; cam_num < ccd_ncam; cam_num++) {
+                char newname[MAX_STRING] = "";
+                phase = 1;
+                SetActiveCamera(cam_num);
+                CaptureImage(&phase,ccd_image_data[cam_num],ccd_type,step->exptime,FALSE,0,0,0,0);
+                if (stacks_only)
+                    continue;
+
+                new_filename(ccd_serial_number,step->imtype,newname);
+                GetCameraTemperature();
+                double temperature = ccd_camera_info[cam_num].temperature;
+                int filterNumber = 0;
+                if (IsCameraAnST402ME())
+                    filterNumber = FilterWheelPosition();
+                if (write_fits(newname, ccd_image_width, ccd_image_height, ccd_image_data[cam_num],
+                        step->exptime,step->imtype,temperature,filterNumber,ccd_serial_number,
+                        step->name,ra,dec,alt,az)) {
+                    emit("failed step=%d frame=%d/%d camera=%d file=%s\n",
+                            s + 1, i + 1, step->count, cam_num, newname);
+                    failed = 1;
+                    continue;
+                }
+                emit("frame step=%d frame=%d/%d camera=%d file=%s\n",
+                        s + 1, i + 1, step->count, cam_num, newname);
+            }
+            nwritten++;
+            if (stacks_wanted)
+                write_stacks();
+
+            if (step->dither[0] && n + 1 < nframes && !aborted) {
+                int rc = system(step->dither);
+                emit("dither step=%d frame=%d/%d status=%d\n",
+                        s + 1, i + 1, step->count, rc);
+            }
+        }
+        if (stack_mode >= 0)
+            write_stacks();
+    }
+
+    if (aborted) {
+        for (int cam_num = 0; cam_num < ccd_ncam; cam_num++) {
+            phase = 2;
+            SetActiveCamera(cam_num);
+            CaptureImage(&phase,ccd_image_data[cam_num],ccd_type,0,FALSE,0,0,0,0);
+        }
+        emit("aborted frames=%d\n", nwritten);
+    }
+    else
+        emit("done frames=%d\n", nwritten);
+
+    StopStack();
+    for (int cam_num = 0; cam_num < ccd_ncam; cam_num++)
+        free(ccd_image_data[cam_num]);
+    for (int i = 0; i < nsubscribers; i++)
+        close(subscribers[i]);
+    if (WaitForDurability())
+        failed = 1;
+    CloseFrameStream(stream_fd);
+
+    DisconnectAllCameras();
+    store_timestamped_note_in_lockfile("Completed");
+    release_lock();
+
+    return(aborted || failed ? 1 : 0);
+
+}
@@ -0,0 +1,753 @@
+/*
+ * SBIGSIM - A simulated SBIG Universal Driver.
+ *
+ * This file implements SBIGUnivDrvCommand() for the subset of the SBIG
+ * Universal Driver used by camera.c, so that the camera programs can be
+ * run (and benchmarked) without libsbigudrv or any cameras attached. It is
+ * selected at link time:
+ *
+ *   make DRIVER=simulator
+ *
+ * Like the real driver, handles are private to the calling process and at
+ * most four of them can be open at once. The cooler and filter wheel keep
+ * running between programs on real hardware, so their state is saved in a
+ * small state file that every simulated driver shares. The simulated
+ * cameras are configured with environment variables:
+ *
+ *   SBIGSIM_CAMERAS    number of cameras on the USB bus (default 4, max 8)
+ *   SBIGSIM_MODEL      "STF8300" (default) or "ST402"
+ *   SBIGSIM_LINE_USEC  readout time per CCD line in microseconds
+ *                      (default 400, roughly one second per STF-8300 frame)
+ *   SBIGSIM_AMBIENT    ambient temperature in C (default 10)
+ *   SBIGSIM_TAU        cooler time constant in seconds (default 60)
+ *   SBIGSIM_STARS      number of stars in the synthetic field (default 200)
+ *   SBIGSIM_FWHM       stellar FWHM in pixels (default 3)
+ *   SBIGSIM_SKY        sky level in ADU/s with the shutter open (default 20)
+ *   SBIGSIM_TWILIGHT   seconds for the sky level to halve, as in evening
+ *                      twilight, or to double if negative (default 0: the
+ *                      sky level is constant). Counted from the start of
+ *                      the first exposure the process takes.
+ *   SBIGSIM_SEED       random number seed (default 1)
+ *   SBIGSIM_STATE      cooler/filter wheel state file
+ *                      (default /var/tmp/sbigsim.state)
+ *
+ * Frames are built one line at a time as CC_READOUT_LINE is called: a bias
+ * level plus dark current, sky and Gaussian stars, with shot noise and read
+ * noise added.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sbigudrv.h>
+
+#ifndef INVALID_HANDLE_VALUE
+ #define INVALID_HANDLE_VALUE -1
+#endif
+
+#ifndef M_PI
+ #define M_PI 3.14159265358979323846
+#endif
+
+#define SIM_MAX_CAMERAS  8
+#define SIM_MAX_HANDLES  4
+#define SIM_MAX_STARS    5000
+#define SIM_NOISE_TABLE  65536   /* Precomputed unit Gaussian deviates */
+#define SIM_BIAS         1000.0
+#define SIM_READ_NOISE   9.0     /* ADU */
+#define SIM_DARK_CURRENT 0.02    /* ADU/s/pixel at 0C, doubling every 6C */
+#define SIM_MAX_DELTA_T  40.0    /* Largest cooling below ambient */
+#define SIM_CFW_SLOT_SEC 0.5     /* Filter wheel time per slot */
+
+typedef struct {
+    double x, y, flux;
+} t_simstar;
+
+typedef struct {
+    char name[64];
+    char serial_number[10];
+    unsigned short camera_type;
+    int width;
+    int height;
+    unsigned short gain;            /* BCD e-/ADU, as the driver reports it */
+    double gain_e;
+
+    /* Exposure state */
+    int exposing;
+    int shutter_open;
+    double exposure_start;
+    double exposure_length;
+
+    /* Readout state */
+    int readout_top, readout_left, readout_height, readout_width;
+    int readout_line;
+    double readout_start;
+
+    /* Thermal state */
+    int regulating;
+    double setpoint;
+    double t0;                      /* Temperature at time_t0 */
+    double time_t0;                 /* Wall clock, shared across processes */
+
+    /* Filter wheel state */
+    int cfw_position;
+    int cfw_target;
+    double cfw_arrival;             /* Wall clock */
+
+    /* Synthetic star field */
+    int nstars;
+    t_simstar *stars;
+    unsigned long long rng;
+} t_simcamera;
+
+/* Driver state. Handles are indices into handle_camera[]. */
+static int driver_open = 0;
+static int configured = 0;
+static int ncameras;
+static t_simcamera cameras[SIM_MAX_CAMERAS];
+static int handle_camera[SIM_MAX_HANDLES];   /* camera on each handle or -1 */
+static int current_handle = INVALID_HANDLE_VALUE;
+
+/* Configuration */
+static long   line_usec;
+static double ambient;
+static double tau;
+static int    nstars;
+static double fwhm;
+static double sky_rate;
+static double twilight;
+static double twilight_start = -1;
+static unsigned long long seed;
+static char   statefile[256];
+static float  noise_table[SIM_NOISE_TABLE];
+
+
+/* Monotonic clock in seconds */
+static double sim_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+/* Wall clock in seconds, for state that outlives a process */
+static double sim_wallclock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+static double env_double(const char *name, double def)
+{
+    char *val = getenv(name);
+    return val ? atof(val) : def;
+}
+
+
+/* xorshift64* generator; each camera has its own stream */
+static double sim_uniform(t_simcamera *cam)
+{
+    cam->rng ^= cam->rng >> 12;
+    cam->rng ^= cam->rng << 25;
+    cam->rng ^= cam->rng >> 27;
+    return ((cam->rng * 2685821657736338717ULL) >> 11) * (1.0/9007199254740992.0);
+}
+
+
+static double sim_gaussian(t_simcamera *cam)
+{
+    double u1 = sim_uniform(cam);
+    double u2 = sim_uniform(cam);
+    if (u1 < 1e-300) u1 = 1e-300;
+    return sqrt(-2.0*log(u1)) * cos(2.0*M_PI*u2);
+}
+
+
+/* Pixel noise is drawn from a table so that synthesizing a frame costs
+ * far less than reading it out, even with no readout delay */
+static double sim_fast_gaussian(t_simcamera *cam)
+{
+    cam->rng ^= cam->rng >> 12;
+    cam->rng ^= cam->rng << 25;
+    cam->rng ^= cam->rng >> 27;
+    return noise_table[(cam->rng * 2685821657736338717ULL) >> 48];
+}
+
+
+/* Cooler and filter wheel state is kept one line per camera, in USB order */
+static int sim_read_state(FILE *fp, t_simcamera *cam)
+{
+    return fscanf(fp, "%d %lf %lf %lf %d %d %lf", &cam->regulating, &cam->setpoint,
+            &cam->t0, &cam->time_t0, &cam->cfw_position, &cam->cfw_target,
+            &cam->cfw_arrival) == 7;
+}
+
+
+static void sim_load_state(void)
+{
+    FILE *fp = fopen(statefile, "r");
+    if (fp == NULL)
+        return;
+    for (int i = 0; i < ncameras; i++)
+        if (!sim_read_state(fp, &cameras[i]))
+            break;
+    fclose(fp);
+}
+
+
+/* Several processes may drive cameras at once (one per shard), so the file
+ * is locked and only the line for the camera that changed is replaced. */
+static void sim_save_state(t_simcamera *changed)
+{
+    t_simcamera saved[SIM_MAX_CAMERAS];
+    struct flock fl;
+    int fd, nsaved = 0;
+    FILE *fp;
+
+    if ((fd = open(statefile, O_RDWR|O_CREAT, 0644)) == -1)
+        return;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fcntl(fd, F_SETLKW, &fl);
+
+    // Closing the descriptor drops the lock too
+    if ((fp = fdopen(fd, "r+")) == NULL) {
+        close(fd);
+        return;
+    }
+    while (nsaved < ncameras && sim_read_state(fp, &saved[nsaved]))
+        nsaved++;
+    for (int i = nsaved; i < ncameras; i++)
+        saved[i] = cameras[i];
+    saved[changed - cameras] = *changed;
+
+    rewind(fp);
+    for (int i = 0; i < ncameras; i++)
+        fprintf(fp, "%d %.3f %.3f %.3f %d %d %.3f\n", saved[i].regulating, saved[i].setpoint,
+                saved[i].t0, saved[i].time_t0, saved[i].cfw_position, saved[i].cfw_target,
+                saved[i].cfw_arrival);
+    fflush(fp);
+    ftruncate(fd, ftell(fp));
+    fclose(fp);
+}
+
+
+/* Populate the simulated USB bus the first time the driver is opened */
+static void sim_configure(void)
+{
+    t_simcamera noise;
+    char *model;
+    int is_st402;
+
+    if (configured)
+        return;
+
+    ncameras  = (int) env_double("SBIGSIM_CAMERAS", 4);
+    if (ncameras < 0) ncameras = 0;
+    if (ncameras > SIM_MAX_CAMERAS) ncameras = SIM_MAX_CAMERAS;
+    line_usec = (long) env_double("SBIGSIM_LINE_USEC", 400);
+    ambient   = env_double("SBIGSIM_AMBIENT", 10.0);
+    tau       = env_double("SBIGSIM_TAU", 60.0);
+    nstars    = (int) env_double("SBIGSIM_STARS", 200);
+    if (nstars < 0) nstars = 0;
+    if (nstars > SIM_MAX_STARS) nstars = SIM_MAX_STARS;
+    fwhm      = env_double("SBIGSIM_FWHM", 3.0);
+    sky_rate  = env_double("SBIGSIM_SKY", 20.0);
+    twilight  = env_double("SBIGSIM_TWILIGHT", 0.0);
+    seed      = (unsigned long long) env_double("SBIGSIM_SEED", 1);
+    snprintf(statefile, sizeof(statefile), "%s",
+            getenv("SBIGSIM_STATE") ? getenv("SBIGSIM_STATE") : "/var/tmp/sbigsim.state");
+
+    model = getenv("SBIGSIM_MODEL");
+    is_st402 = (model != NULL && strcmp(model, "ST402") == 0);
+
+    for (int i = 0; i < ncameras; i++) {
+        t_simcamera *cam = &cameras[i];
+        memset(cam, 0, sizeof(t_simcamera));
+        if (is_st402) {
+            strcpy(cam->name, "SBIG ST-402 Dual CCD Camera");
+            cam->camera_type = ST402_CAMERA;
+            cam->width = 765;
+            cam->height = 510;
+            cam->gain = 0x0140;
+            cam->gain_e = 1.40;
+        } else {
+            strcpy(cam->name, "SBIG STF-8300 CCD Camera");
+            cam->camera_type = STF8300_CAMERA;
+            cam->width = 3326;
+            cam->height = 2504;
+            cam->gain = 0x0037;
+            cam->gain_e = 0.37;
+        }
+        snprintf(cam->serial_number, sizeof(cam->serial_number), "SIM%05d", (i + 1) % 100000);
+        cam->t0 = ambient;
+        cam->time_t0 = sim_wallclock();
+        cam->setpoint = ambient;
+        cam->cfw_position = CFWP_1;
+        cam->cfw_target = CFWP_1;
+        cam->rng = (seed + 1) * 0x9E3779B97F4A7C15ULL + (unsigned long long) i * 0xBF58476D1CE4E5B9ULL;
+
+        /* Stars are uniformly distributed with a steep flux distribution,
+         * so there are many faint stars and a few bright ones. */
+        cam->nstars = nstars;
+        cam->stars = (t_simstar *) malloc((nstars > 0 ? nstars : 1) * sizeof(t_simstar));
+        for (int s = 0; s < nstars; s++) {
+            cam->stars[s].x = sim_uniform(cam) * cam->width;
+            cam->stars[s].y = sim_uniform(cam) * cam->height;
+            cam->stars[s].flux = 200.0 * pow(sim_uniform(cam) + 1e-3, -1.5);
+        }
+    }
+
+    for (int h = 0; h < SIM_MAX_HANDLES; h++)
+        handle_camera[h] = -1;
+
+    noise.rng = (seed + 1) * 0xD1B54A32D192ED03ULL;
+    for (int i = 0; i < SIM_NOISE_TABLE; i++)
+        noise_table[i] = (float) sim_gaussian(&noise);
+
+    sim_load_state();
+    configured = 1;
+}
+
+
+static t_simcamera *sim_current_camera(void)
+{
+    if (current_handle < 0 || current_handle >= SIM_MAX_HANDLES)
+        return NULL;
+    if (handle_camera[current_handle] < 0)
+        return NULL;
+    return &cameras[handle_camera[current_handle]];
+}
+
+
+/* The CCD relaxes exponentially towards the regulation target (or ambient) */
+static double sim_temperature_target(t_simcamera *cam)
+{
+    if (!cam->regulating)
+        return ambient;
+    if (cam->setpoint < ambient - SIM_MAX_DELTA_T)
+        return ambient - SIM_MAX_DELTA_T;
+    return cam->setpoint;
+}
+
+
+static double sim_temperature(t_simcamera *cam)
+{
+    double target = sim_temperature_target(cam);
+    double dt = sim_wallclock() - cam->time_t0;
+    return target + (cam->t0 - target) * exp(-dt/tau);
+}
+
+
+static void sim_set_regulation(t_simcamera *cam, int regulating, double setpoint)
+{
+    cam->t0 = sim_temperature(cam);
+    cam->time_t0 = sim_wallclock();
+    cam->regulating = regulating;
+    cam->setpoint = setpoint;
+    sim_save_state(cam);
+}
+
+
+/* Sleep until an absolute monotonic time */
+static void sim_sleep_until(double when)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t) when;
+    ts.tv_nsec = (long) ((when - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+
+/* Sky collected during the current exposure, in ADU */
+static double sim_sky(t_simcamera *cam)
+{
+    double k, t0;
+
+    if (twilight == 0.0)
+        return sky_rate * cam->exposure_length;
+    k = -log(2.0) / twilight;
+    t0 = cam->exposure_start - twilight_start;
+    return sky_rate * exp(k*t0) * (exp(k*cam->exposure_length) - 1.0) / k;
+}
+
+
+/* Synthesize one line of the current frame */
+static void sim_readout_line(t_simcamera *cam, int line, int start, int length, unsigned short *out)
+{
+    double sigma = fwhm / 2.3548;
+    double reach = 4.0 * sigma;
+    double temperature = sim_temperature(cam);
+    double dark = SIM_DARK_CURRENT * pow(2.0, temperature/6.0) * cam->exposure_length;
+    double background = 0.0;
+    double *row;
+
+    if (cam->shutter_open)
+        background = sim_sky(cam);
+
+    row = (double *) malloc(length * sizeof(double));
+    for (int i = 0; i < length; i++)
+        row[i] = dark + background;
+
+    /* Stars are only visible with the shutter open */
+    if (cam->shutter_open) {
+        double norm = 1.0 / (2.0*M_PI*sigma*sigma);
+        for (int s = 0; s < cam->nstars; s++) {
+            t_simstar *star = &cam->stars[s];
+            double dy = line + 0.5 - star->y;
+            int x0, x1;
+            if (fabs(dy) > reach)
+                continue;
+            x0 = (int) (star->x - reach) - start;
+            x1 = (int) (star->x + reach) - start;
+            if (x0 < 0) x0 = 0;
+            if (x1 >= length) x1 = length - 1;
+            for (int i = x0; i <= x1; i++) {
+                double dx = start + i + 0.5 - star->x;
+                row[i] += star->flux * cam->exposure_length * norm
+                    * exp(-(dx*dx + dy*dy)/(2.0*sigma*sigma));
+            }
+        }
+    }
+
+    for (int i = 0; i < length; i++) {
+        double noise = sqrt(row[i]/cam->gain_e + SIM_READ_NOISE*SIM_READ_NOISE);
+        double value = SIM_BIAS + row[i] + noise*sim_fast_gaussian(cam);
+        if (value < 0) value = 0;
+        if (value > 65535) value = 65535;
+        out[i] = (unsigned short) value;
+    }
+
+    free(row);
+}
+
+
+static short sim_query_usb(QUERY_USB_INFO *info, unsigned short *found, int maxcam)
+{
+    int n = ncameras < maxcam ? ncameras : maxcam;
+    for (int i = 0; i < maxcam; i++) {
+        memset(&info[i], 0, sizeof(QUERY_USB_INFO));
+        if (i < n) {
+            info[i].cameraFound = TRUE;
+            info[i].cameraType = cameras[i].camera_type;
+            strcpy(info[i].name, cameras[i].name);
+            strcpy(info[i].serialNumber, cameras[i].serial_number);
+        }
+    }
+    *found = n;
+    return CE_NO_ERROR;
+}
+
+
+static short sim_cfw(t_simcamera *cam, CFWParams *p, CFWResults *r)
+{
+    double now = sim_wallclock();
+
+    if (cam->camera_type != ST402_CAMERA)
+        return CE_CFW_ERROR;
+
+    if (now >= cam->cfw_arrival)
+        cam->cfw_position = cam->cfw_target;
+
+    memset(r, 0, sizeof(CFWResults));
+    r->cfwModel = p->cfwModel;
+    switch (p->cfwCommand) {
+        case CFWC_QUERY:
+            r->cfwPosition = (now >= cam->cfw_arrival) ? cam->cfw_position : CFWP_UNKNOWN;
+            r->cfwStatus = (now >= cam->cfw_arrival) ? CFWS_IDLE : CFWS_BUSY;
+            break;
+        case CFWC_GOTO:
+            if (p->cfwParam1 < CFWP_1 || p->cfwParam1 > CFWP_4) {
+                r->cfwError = CFWE_BAD_COMMAND;
+                return CE_CFW_ERROR;
+            }
+            cam->cfw_arrival = now + SIM_CFW_SLOT_SEC * abs((int) p->cfwParam1 - cam->cfw_position);
+            cam->cfw_target = (int) p->cfwParam1;
+            r->cfwPosition = CFWP_UNKNOWN;
+            r->cfwStatus = CFWS_BUSY;
+            sim_save_state(cam);
+            break;
+        case CFWC_INIT:
+            cam->cfw_arrival = now + 4*SIM_CFW_SLOT_SEC;
+            cam->cfw_target = CFWP_1;
+            r->cfwStatus = CFWS_BUSY;
+            sim_save_state(cam);
+            break;
+        case CFWC_GET_INFO:
+            r->cfwResult1 = 0x0100;   /* Firmware version */
+            r->cfwResult2 = 4;        /* Number of filter positions */
+            break;
+        case CFWC_OPEN_DEVICE:
+        case CFWC_CLOSE_DEVICE:
+            break;
+        default:
+            r->cfwError = CFWE_BAD_COMMAND;
+            return CE_CFW_ERROR;
+    }
+    return CE_NO_ERROR;
+}
+
+
+short SBIGUnivDrvCommand(short command, void *Params, void *Results)
+{
+    t_simcamera *cam;
+
+    if (command == CC_OPEN_DRIVER) {
+        sim_configure();
+        if (driver_open)
+            return CE_DRIVER_NOT_CLOSED;
+        driver_open = 1;
+        return CE_NO_ERROR;
+    }
+
+    if (command == CC_GET_ERROR_STRING) {
+        GetErrorStringParams *p = (GetErrorStringParams *) Params;
+        GetErrorStringResults *r = (GetErrorStringResults *) Results;
+        snprintf(r->errorString, sizeof(r->errorString), "Simulated driver error %d", p->errorNo);
+        return CE_NO_ERROR;
+    }
+
+    /* Handles survive closing the driver, as with the real thing, so
+     * switching handles is allowed at any time. */
+    if (command == CC_SET_DRIVER_HANDLE) {
+        SetDriverHandleParams *p = (SetDriverHandleParams *) Params;
+        if (p->handle == INVALID_HANDLE_VALUE) {
+            current_handle = INVALID_HANDLE_VALUE;
+            driver_open = 0;
+            return CE_NO_ERROR;
+        }
+        if (p->handle < 0 || p->handle >= SIM_MAX_HANDLES || handle_camera[p->handle] < 0)
+            return CE_BAD_PARAMETER;
+        current_handle = p->handle;
+        driver_open = 1;
+        return CE_NO_ERROR;
+    }
+
+    if (!driver_open)
+        return CE_DRIVER_NOT_OPEN;
+
+    switch (command) {
+
+        case CC_CLOSE_DRIVER:
+            driver_open = 0;
+            return CE_NO_ERROR;
+
+        case CC_QUERY_USB:
+            return sim_query_usb(((QueryUSBResults *) Results)->usbInfo,
+                    &((QueryUSBResults *) Results)->camerasFound, 4);
+
+        case CC_QUERY_USB2:
+            return sim_query_usb(((QueryUSBResults2 *) Results)->usbInfo,
+                    &((QueryUSBResults2 *) Results)->camerasFound, 8);
+
+        case CC_OPEN_DEVICE: {
+            OpenDeviceParams *p = (OpenDeviceParams *) Params;
+            int camnum = (int) p->deviceType - DEV_USB1;
+            int h;
+            if (sim_current_camera() != NULL)
+                return CE_DEVICE_NOT_CLOSED;
+            if (camnum < 0 || camnum >= ncameras)
+                return CE_DEVICE_NOT_FOUND;
+            for (h = 0; h < SIM_MAX_HANDLES; h++)
+                if (handle_camera[h] == camnum)
+                    return CE_DEVICE_NOT_CLOSED;
+            for (h = 0; h < SIM_MAX_HANDLES; h++)
+                if (handle_camera[h] < 0)
+                    break;
+            if (h == SIM_MAX_HANDLES)
+                return CE_SHARE_ERROR;
+            handle_camera[h] = camnum;
+            current_handle = h;
+            return CE_NO_ERROR;
+        }
+
+        case CC_GET_DRIVER_HANDLE:
+            ((GetDriverHandleResults *) Results)->handle = current_handle;
+            return CE_NO_ERROR;
+
+        case CC_GET_DRIVER_INFO: {
+            GetDriverInfoResults0 *r = (GetDriverInfoResults0 *) Results;
+            r->version = 0x0400;
+            strcpy(r->name, "SBIG Simulated Driver");
+            r->maxRequest = 1;
+            return CE_NO_ERROR;
+        }
+
+        default:
+            break;
+    }
+
+    /* Everything below talks to a particular camera */
+    cam = sim_current_camera();
+    if (cam == NULL)
+        return CE_DEVICE_NOT_OPEN;
+
+    switch (command) {
+
+        case CC_CLOSE_DEVICE:
+            handle_camera[current_handle] = -1;
+            return CE_NO_ERROR;
+
+        case CC_ESTABLISH_LINK:
+            ((EstablishLinkResults *) Results)->cameraType = cam->camera_type;
+            return CE_NO_ERROR;
+
+        case CC_GET_CCD_INFO: {
+            GetCCDInfoParams *p = (GetCCDInfoParams *) Params;
+            if (p->request == CCD_INFO_IMAGING) {
+                GetCCDInfoResults0 *r = (GetCCDInfoResults0 *) Results;
+                memset(r, 0, sizeof(GetCCDInfoResults0));
+                r->firmwareVersion = 0x0100;
+                r->cameraType = cam->camera_type;
+                strcpy(r->name, cam->name);
+                r->readoutModes = 1;
+                r->readoutInfo[0].mode = 0;
+                r->readoutInfo[0].width = cam->width;
+                r->readoutInfo[0].height = cam->height;
+                r->readoutInfo[0].gain = cam->gain;
+                r->readoutInfo[0].pixelWidth = 0x540;
+                r->readoutInfo[0].pixelHeight = 0x540;
+                return CE_NO_ERROR;
+            }
+            if (p->request == CCD_INFO_EXTENDED) {
+                GetCCDInfoResults2 *r = (GetCCDInfoResults2 *) Results;
+                memset(r, 0, sizeof(GetCCDInfoResults2));
+                strcpy(r->serialNumber, cam->serial_number);
+                return CE_NO_ERROR;
+            }
+            return CE_BAD_PARAMETER;
+        }
+
+        case CC_QUERY_COMMAND_STATUS: {
+            QueryCommandStatusParams *p = (QueryCommandStatusParams *) Params;
+            QueryCommandStatusResults *r = (QueryCommandStatusResults *) Results;
+            r->status = CS_IDLE;
+            if ((p->command == CC_START_EXPOSURE || p->command == CC_START_EXPOSURE2) && cam->exposing) {
+                if (sim_now() - cam->exposure_start >= cam->exposure_length)
+                    r->status = CS_INTEGRATION_COMPLETE;
+                else
+                    r->status = CS_INTEGRATING;
+            }
+            return CE_NO_ERROR;
+        }
+
+        case CC_START_EXPOSURE2: {
+            StartExposureParams2 *p = (StartExposureParams2 *) Params;
+            if (p->ccd != CCD_IMAGING)
+                return CE_BAD_PARAMETER;
+            if (cam->exposing)
+                return CE_EXPOSURE_IN_PROGRESS;
+            cam->exposing = 1;
+            cam->shutter_open = (p->openShutter == SC_OPEN_SHUTTER);
+            cam->exposure_length = p->exposureTime / 100.0;
+            cam->exposure_start = sim_now();
+            if (twilight_start < 0)
+                twilight_start = cam->exposure_start;
+            return CE_NO_ERROR;
+        }
+
+        case CC_START_EXPOSURE: {
+            StartExposureParams *p = (StartExposureParams *) Params;
+            if (cam->exposing)
+                return CE_EXPOSURE_IN_PROGRESS;
+            cam->exposing = 1;
+            cam->shutter_open = (p->openShutter == SC_OPEN_SHUTTER);
+            cam->exposure_length = p->exposureTime / 100.0;
+            cam->exposure_start = sim_now();
+            if (twilight_start < 0)
+                twilight_start = cam->exposure_start;
+            return CE_NO_ERROR;
+        }
+
+        case CC_END_EXPOSURE:
+            if (!cam->exposing)
+                return CE_NO_EXPOSURE_IN_PROGRESS;
+            /* An early end truncates the exposure */
+            if (sim_now() - cam->exposure_start < cam->exposure_length)
+                cam->exposure_length = sim_now() - cam->exposure_start;
+            cam->exposing = 0;
+            return CE_NO_ERROR;
+
+        case CC_START_READOUT: {
+            StartReadoutParams *p = (StartReadoutParams *) Params;
+            if (p->top + p->height > cam->height || p->left + p->width > cam->width)
+                return CE_BAD_PARAMETER;
+            cam->readout_top = p->top;
+            cam->readout_left = p->left;
+            cam->readout_height = p->height;
+            cam->readout_width = p->width;
+            cam->readout_line = 0;
+            cam->readout_start = sim_now();
+            return CE_NO_ERROR;
+        }
+
+        case CC_READOUT_LINE: {
+            ReadoutLineParams *p = (ReadoutLineParams *) Params;
+            if (cam->readout_line >= cam->readout_height)
+                return CE_BAD_PARAMETER;
+            if (p->pixelStart + p->pixelLength > cam->width)
+                return CE_BAD_PARAMETER;
+            /* Pace lines against the start of readout so per-call overhead
+             * does not accumulate */
+            sim_sleep_until(cam->readout_start + (cam->readout_line + 1) * line_usec * 1e-6);
+            sim_readout_line(cam, cam->readout_top + cam->readout_line,
+                    p->pixelStart, p->pixelLength, (unsigned short *) Results);
+            cam->readout_line++;
+            return CE_NO_ERROR;
+        }
+
+        case CC_END_READOUT:
+            cam->readout_line = 0;
+            cam->readout_height = 0;
+            return CE_NO_ERROR;
+
+        case CC_SET_TEMPERATURE_REGULATION2: {
+            SetTemperatureRegulationParams2 *p = (SetTemperatureRegulationParams2 *) Params;
+            sim_set_regulation(cam, p->regulation == 1, p->regulation == 1 ? p->ccdSetpoint : cam->setpoint);
+            return CE_NO_ERROR;
+        }
+
+        case CC_QUERY_TEMPERATURE_STATUS: {
+            QueryTemperatureStatusParams *p = (QueryTemperatureStatusParams *) Params;
+            QueryTemperatureStatusResults2 *r = (QueryTemperatureStatusResults2 *) Results;
+            double t;
+            if (p->request != 2)
+                return CE_BAD_PARAMETER;
+            t = sim_temperature(cam);
+            memset(r, 0, sizeof(QueryTemperatureStatusResults2));
+            r->coolingEnabled = cam->regulating;
+            r->fanEnabled = TRUE;
+            r->ccdSetpoint = cam->setpoint;
+            r->imagingCCDTemperature = t;
+            r->ambientTemperature = ambient;
+            r->heatsinkTemperature = ambient + 2.0;
+            r->imagingCCDPower = cam->regulating ? 100.0*(ambient - t)/SIM_MAX_DELTA_T : 0.0;
+            if (r->imagingCCDPower < 0) r->imagingCCDPower = 0;
+            if (r->imagingCCDPower > 100) r->imagingCCDPower = 100;
+            r->fanPower = 100.0;
+            return CE_NO_ERROR;
+        }
+
+        case CC_MISCELLANEOUS_CONTROL:
+            return CE_NO_ERROR;
+
+        case CC_CFW:
+            return sim_cfw(cam, (CFWParams *) Params, (CFWResults *) Results);
+
+        default:
+            return CE_UNKNOWN_COMMAND;
+    }
+}
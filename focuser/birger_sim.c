@@ -0,0 +1,452 @@
+/*
+ * BIRGER_SIM - Simulate one or more Birger Canon EF focus controllers on
+ * pseudo-terminals.
+ *
+ * Each simulated focuser is a pty whose slave side looks like the serial
+ * port of a real adapter, so the birger program (and anything built on
+ * it) can be exercised without hardware:
+ *
+ * birger_sim -n 2 &
+ * birger -p /dev/pts/5 status
+ *
+ * Only the commands used by birger.c are implemented, and they answer the
+ * way the real firmware does in verbose response mode (rm1,1), quirks
+ * included. See the comments in FocuserSendRawCommand() in birger.c.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <ctype.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_STRING     256
+#define MAX_FOCUSERS   32
+
+/* Raw encoder range of the simulated lens */
+#define FOCUS_RAW_MIN  4000
+#define FOCUS_RAW_MAX  7360
+
+/* Commands understood by the simulator */
+#define BADKEY          -1
+#define SIM_RESPONSE     0
+#define SIM_PRINT_FOCUS  1
+#define SIM_FOCUS_RANGE  2
+#define SIM_FOCUS_ABS    3
+#define SIM_FOCUS_MOVE   4
+#define SIM_MOVE_ZERO    5
+#define SIM_SET_FOCUS    6
+#define SIM_LEARN        7
+#define SIM_INIT_APER    8
+#define NSIMCOMMANDS     9
+
+
+/* The structure and lookup table below are used to parse
+ * incoming commands by their two-letter prefix */
+typedef struct {
+    char *key;
+    int val;
+} t_keyval;
+
+static t_keyval sim_command_lookup_table[] = {
+        {"rm", SIM_RESPONSE},   {"pf", SIM_PRINT_FOCUS}, {"fp", SIM_FOCUS_RANGE},
+        {"fa", SIM_FOCUS_ABS},  {"mf", SIM_FOCUS_MOVE},  {"mz", SIM_MOVE_ZERO},
+        {"sf", SIM_SET_FOCUS},  {"la", SIM_LEARN},       {"in", SIM_INIT_APER}
+};
+#define NSIMCOMMANDKEYS (sizeof(sim_command_lookup_table)/sizeof(t_keyval))
+
+
+/* Return an integer value corresponding to a command prefix */
+int value_from_sim_command_key(char *command)
+{
+    int i;
+    for (i=0; i < NSIMCOMMANDKEYS; i++) {
+	t_keyval *sym = sim_command_lookup_table + i;
+	if (strncmp(sym->key, command, 2) == 0)
+	    return sym->val;
+    }
+    return BADKEY;
+}
+
+
+/* Global variable help string (structured like a man page) */
+char   *help[] = {
+    "NAME",
+    "    birger_sim --- simulate Birger Canon EF focus controllers on pseudo-terminals",
+    "",
+    "SYNOPSIS",
+    "    birger_sim [options]",
+    "",
+    "OPTIONS",
+    "    -n number       - number of focusers to simulate (default 1)",
+    "    -b baud         - simulated serial line speed (default 115200)",
+    "    -s speed        - focus motor speed in encoder steps per second (default 3000)",
+    "    -d percent      - chance that a command's response line is dropped (default 0)",
+    "    -l linkname     - also create symlinks linkname0, linkname1, ... to the ptys",
+    "    -v              - verbose mode: log every command received",
+    "    -h              - print help information",
+    "",
+    "EXAMPLES",
+    "    birger_sim",
+    "    birger_sim -n 10 -l /var/tmp/birger",
+    "    birger_sim -b 9600 -d 5 -v",
+    "",
+    "DESCRIPTION",
+    "    Each focuser is simulated by its own process. The name of each focuser's pty",
+    "    is printed on standard output, one per line, once it is ready for use. Point",
+    "    birger at it with the -p flag or the $BIRGER_SERIAL_PORT environment variable.",
+    "",
+    "    Every byte sent back is delayed by the time it would take to cross a serial",
+    "    line at the given baud rate, and commands that move the lens take as long as",
+    "    the motor would. This makes it possible to measure command latency, throughput",
+    "    and the behaviour of many concurrent focuser clients.",
+    "",
+    "    The firmware quirks that birger.c works around are reproduced: sf0 and la send",
+    "    a bare carriage return followed by an echo of the command, and with -d a",
+    "    response line may go missing altogether.",
+    "",
+    "    When stopped with an interrupt each focuser prints a summary of the commands",
+    "    it received and their mean and maximum service times on standard error.",
+    "",
+    "AUTHOR",
+    "    Roberto Abraham:  abraham@astro.utoronto.ca",
+    "",
+    0
+};
+
+
+/* Global variables controlling the simulation */
+int verbose = 0;
+int baud = 115200;
+int motor_speed = 3000;
+int drop_percent = 0;
+
+/* State of this process's focuser */
+static int focuser_id;
+static int raw_position = 5000;
+static int focus_offset = FOCUS_RAW_MIN;
+static int ncommands[NSIMCOMMANDS];
+static double total_time[NSIMCOMMANDS];
+static double max_time[NSIMCOMMANDS];
+
+static pid_t pids[MAX_FOCUSERS];
+static int nfocusers = 1;
+
+static char *command_names[NSIMCOMMANDS] = {
+    "rm", "pf", "fp", "fa", "mf", "mz", "sf", "la", "in"
+};
+
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+static void sleep_seconds(double t)
+{
+    struct timespec ts;
+    if (t <= 0)
+        return;
+    ts.tv_sec = (time_t) t;
+    ts.tv_nsec = (long) ((t - ts.tv_sec)*1e9);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+
+/* Send a string down the line at the simulated baud rate (10 bits per
+ * byte for 8N1) */
+static void send_line(int fd, const char *s)
+{
+    double t0 = now();
+    size_t n = strlen(s);
+    for (size_t i = 0; i < n; i++) {
+        double due = t0 + (i + 1)*10.0/baud;
+        sleep_seconds(due - now());
+        write(fd, s + i, 1);
+    }
+}
+
+
+/* Move the lens, taking as long as the motor would */
+static void move_to(int target)
+{
+    if (target < FOCUS_RAW_MIN) target = FOCUS_RAW_MIN;
+    if (target > FOCUS_RAW_MAX) target = FOCUS_RAW_MAX;
+    sleep_seconds((double) abs(target - raw_position)/motor_speed);
+    raw_position = target;
+}
+
+
+/* Carry out one command and send back what the firmware would */
+static int respond(int fd, char *command)
+{
+    char reply[MAX_STRING];
+    char echo[MAX_STRING+2];
+    int action = value_from_sim_command_key(command);
+    int drop = (drop_percent > 0 && rand() % 100 < drop_percent);
+
+    snprintf(echo, sizeof(echo), "%s\r", command);
+
+    switch (action) {
+        case SIM_RESPONSE:
+            send_line(fd, echo);
+            send_line(fd, "OK\r");
+            break;
+        case SIM_PRINT_FOCUS:
+            send_line(fd, echo);
+            snprintf(reply, sizeof(reply), "%d\r", raw_position - focus_offset);
+            if (!drop) send_line(fd, reply);
+            break;
+        case SIM_FOCUS_RANGE:
+            send_line(fd, echo);
+            snprintf(reply, sizeof(reply), "fmin:%d  fmax:%d  current:%d\r",
+                    FOCUS_RAW_MIN, FOCUS_RAW_MAX, raw_position);
+            if (!drop) send_line(fd, reply);
+            break;
+        case SIM_FOCUS_ABS:
+            send_line(fd, echo);
+            move_to(atoi(command + 2) + focus_offset);
+            snprintf(reply, sizeof(reply), "DONE%d,1\r", raw_position - focus_offset);
+            if (!drop) send_line(fd, reply);
+            break;
+        case SIM_FOCUS_MOVE:
+            send_line(fd, echo);
+            move_to(raw_position + atoi(command + 2));
+            snprintf(reply, sizeof(reply), "DONE%d,1\r", raw_position - focus_offset);
+            if (!drop) send_line(fd, reply);
+            break;
+        case SIM_MOVE_ZERO:
+            send_line(fd, echo);
+            move_to(FOCUS_RAW_MIN);
+            if (!drop) send_line(fd, "DONE\r");
+            break;
+        case SIM_SET_FOCUS:
+            /* Quirk: bare carriage return first, then the echo */
+            focus_offset = raw_position - atoi(command + 2);
+            send_line(fd, "\r");
+            if (!drop) send_line(fd, echo);
+            break;
+        case SIM_LEARN: {
+            /* Quirk as for sf. Learning sweeps the whole focus range and
+             * returns to where it started. */
+            int start = raw_position;
+            send_line(fd, "\r");
+            move_to(FOCUS_RAW_MAX);
+            move_to(FOCUS_RAW_MIN);
+            move_to(start);
+            if (!drop) send_line(fd, echo);
+            break;
+        }
+        case SIM_INIT_APER:
+            send_line(fd, echo);
+            sleep_seconds(0.5);
+            if (!drop) send_line(fd, "DONE\r");
+            break;
+        default:
+            send_line(fd, echo);
+            send_line(fd, "ERR5\r");
+            break;
+    }
+
+    if (verbose)
+        fprintf(stderr, "focuser %d: %s -> position %d%s\n", focuser_id, command,
+                raw_position - focus_offset, drop ? " (response dropped)" : "");
+    return action;
+}
+
+
+static void print_summary(int sig)
+{
+    char line[MAX_STRING];
+    for (int i = 0; i < NSIMCOMMANDS; i++) {
+        if (ncommands[i] == 0)
+            continue;
+        snprintf(line, sizeof(line), "focuser %d: %s count=%d mean=%.4fs max=%.4fs\n",
+                focuser_id, command_names[i], ncommands[i],
+                total_time[i]/ncommands[i], max_time[i]);
+        write(STDERR_FILENO, line, strlen(line));
+    }
+    _exit(0);
+}
+
+
+/* Pass a termination request on to every focuser */
+static void stop_focusers(int sig)
+{
+    for (int i = 0; i < nfocusers; i++)
+        kill(pids[i], SIGTERM);
+}
+
+
+/* Put a terminal into raw 8N1 mode, as the real adapter's port would be */
+static void set_raw(int fd)
+{
+    struct termios options;
+    tcgetattr(fd, &options);
+    options.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    options.c_oflag &= ~OPOST;
+    options.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    options.c_cflag &= ~(CSIZE | PARENB | CSTOPB);
+    options.c_cflag |= CS8 | CLOCAL | CREAD;
+    tcsetattr(fd, TCSANOW, &options);
+}
+
+
+/* Serve one focuser forever */
+static int run_focuser(int master)
+{
+    char command[MAX_STRING];
+    int count = 0;
+    double start = 0;
+    char c;
+
+    signal(SIGINT, print_summary);
+    signal(SIGTERM, print_summary);
+    srand(focuser_id + 1);
+
+    for (;;) {
+        ssize_t n = read(master, &c, 1);
+        if (n != 1) {
+            /* Nobody has the slave side open right now */
+            sleep_seconds(0.01);
+            continue;
+        }
+        if (count == 0)
+            start = now();
+        if (c != '\r' && count < MAX_STRING - 1) {
+            command[count++] = c;
+            continue;
+        }
+        command[count] = '\0';
+        /* Empty commands (birger sends an extra carriage return after
+         * most commands) are silently ignored by the firmware */
+        if (count > 0) {
+            int action = respond(master, command);
+            if (action != BADKEY) {
+                double dt = now() - start;
+                ncommands[action]++;
+                total_time[action] += dt;
+                if (dt > max_time[action])
+                    max_time[action] = dt;
+            }
+        }
+        count = 0;
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+
+    char *linkname = NULL;
+    int c;
+
+    /* parse command-line options */
+    opterr = 0;
+    while ((c = getopt (argc, argv, "hvn:b:s:d:l:")) != -1)
+        switch (c)
+        {
+            case 'h':
+                for (int i = 0; help[i] != 0; i++) fprintf (stdout, "%s\n", help[i]);
+                return 0;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'n':
+                nfocusers = atoi(optarg);
+                break;
+            case 'b':
+                baud = atoi(optarg);
+                break;
+            case 's':
+                motor_speed = atoi(optarg);
+                break;
+            case 'd':
+                drop_percent = atoi(optarg);
+                break;
+            case 'l':
+                linkname = optarg;
+                break;
+            case '?':
+                if (isprint (optopt))
+                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+                else
+                    fprintf(stderr,
+                            "Unknown option character `\\x%x'.\n",
+                            optopt);
+                for (int i = 0; help[i] != 0; i++)
+                    fprintf (stdout, "%s\n", help[i]);
+                return 1;
+            default:
+                abort();
+        }
+
+    if (nfocusers < 1 || nfocusers > MAX_FOCUSERS || baud <= 0 || motor_speed <= 0) {
+        fprintf(stderr, "Invalid simulation parameters.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < nfocusers; i++) {
+        int master, slave;
+        char *slavename;
+        char link[MAX_STRING];
+
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+            perror("Error - unable to create pseudo-terminal.");
+            return 1;
+        }
+        slavename = ptsname(master);
+
+        /* Hold the slave side open ourselves so the pty survives between
+         * clients, and start it off in raw mode. */
+        slave = open(slavename, O_RDWR | O_NOCTTY);
+        if (slave == -1) {
+            perror("Error - unable to open pseudo-terminal.");
+            return 1;
+        }
+        set_raw(slave);
+
+        if (linkname != NULL) {
+            snprintf(link, sizeof(link), "%s%d", linkname, i);
+            unlink(link);
+            if (symlink(slavename, link) == -1)
+                perror("Warning - unable to create symlink.");
+        }
+
+        fprintf(stdout, "%s\n", slavename);
+        fflush(stdout);
+
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            focuser_id = i;
+            return run_focuser(master);
+        }
+        close(master);
+    }
+
+    /* An interrupt from the terminal reaches the focusers directly; a
+     * termination request is passed on. Either way each prints its
+     * summary before exiting. */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, stop_focusers);
+    for (int i = 0; i < nfocusers; i++)
+        waitpid(pids[i], NULL, 0);
+
+    return 0;
+
+}
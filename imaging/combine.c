@@ -0,0 +1,711 @@
+/*
+ * COMBINE - Build master biases, darks and flats from a night's frames.
+ *
+ * The frames are never held in memory whole. The detector is cut into
+ * strips of rows, and a pool of threads takes strips in turn, reading that
+ * strip of every input with pread() and combining it. The strip height is
+ * chosen so that the strips being worked on fit in the memory allowed.
+ *
+ * The pixels of a strip are kept as one plane per input frame, so a
+ * compare-exchange of two frames is a loop of min/max over a run of
+ * pixels that the compiler turns into vector instructions. A Batcher
+ * odd-even merge sorting network made of these leaves every pixel's
+ * values in order, which gives the median directly and the centre for
+ * sigma clipping. Clipping also runs over whole planes at a time.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "fitsio.h"
+
+#define MAX_STRING 1024
+#define MAX_FRAMES 1024
+#define TILE 512                // pixels combined at a time, so a tile of every frame stays in cache
+#define NORM_ROWS 64            // rows sampled to find a frame's level
+#define BPM_STEP 16             // sample every 16th pixel of the master for its level and noise
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+
+#define usage "\n\
+NAME\n\
+combine --- build master calibration frames \n\
+\n\
+SYNOPSIS\n\
+combine [options] file1.fits file2.fits ... \n\
+\n\
+DESCRIPTION\n\
+\"combine\" builds a master frame for each camera from a set of biases, darks\n\
+or flats, such as those listed by jorganize. Frames are grouped by the serial\n\
+number in their SERIALNO keyword and each group is combined pixel by pixel,\n\
+either by taking the median or by a sigma-clipped mean: values more than\n\
+-k standard deviations from the median are dropped and the rest averaged,\n\
+repeating -i times.\n\
+\n\
+Flats (IMAGETYP flat) are normalized: after subtracting the master bias, if\n\
+one is given, each frame is divided by its own median level before they are\n\
+combined, and the master is scaled to a median of 1. The level of every\n\
+input is recorded in the header of the master (NORMnnnn, beside its name in\n\
+IMCMBnnn), along with NCOMBINE, COMBTYPE and the mean EXPTIME and TEMPERAT.\n\
+\n\
+Each master comes with a bad pixel map, an 8-bit image that is 1 for pixels\n\
+more than -B robust standard deviations from the level of the master (hot,\n\
+dead or unstable pixels) and 0 elsewhere, with a sigma-clipped combination\n\
+also flagging pixels that lost more than half their values to clipping.\n\
+\n\
+The master for serial number S is written to master_S_TYPE.fits, where TYPE is\n\
+the image type of its frames, and the bad pixel map to master_S_TYPE_bpm.fits.\n\
+-o gives another name, with \"%%s\" standing for the serial number. Masters are\n\
+32-bit floating point.\n\
+\n\
+One line is printed for each master: the serial number, the name of the\n\
+master, the number of frames combined, the name of the bad pixel map and the\n\
+number of bad pixels.\n\
+\n\
+Only uncompressed 16-bit and 32-bit floating point images can be combined.\n\
+Memory use is bounded by -M, plus one master-sized image (and the master bias)\n\
+per camera.\n\
+\n\
+OPTIONS\n\
+-c method    # median (default) or clip \n\
+-k sigma     # clipping threshold (default 3) \n\
+-i number    # clipping iterations (default 3) \n\
+-b file      # master bias to subtract first; \"%%s\" stands for the serial number \n\
+-n           # normalize the frames, even if they are not flats \n\
+-N           # do not normalize flats \n\
+-B sigma     # bad pixel threshold (default 5) \n\
+-o file      # output file name; \"%%s\" stands for the serial number \n\
+-M megabytes # memory for the strips being combined (default 256) \n\
+-j threads   # number of threads (default: one per processor) \n\
+-v           # verbose \n\
+\n\
+EXAMPLES\n\
+combine *_bias.fits \n\
+combine -c clip -k 2.5 *_dark.fits \n\
+combine -b master_%%s_bias.fits *_flat.fits \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+typedef struct {
+    char   *filename;
+    int     fd;
+    int     bitpix;
+    double  bscale, bzero;
+    long    nx, ny;
+    off_t   datastart;
+    char    serial[FLEN_VALUE];
+    char    imagetype[FLEN_VALUE];
+    double  exptime;
+    double  temperature;
+    double  norm;               // level the frame is divided by (1 if not normalized)
+    int     used;
+} t_input;
+
+static t_input inputs[MAX_FRAMES];
+static int ninputs = 0;
+
+static int verbose = 0;
+static int clip = 0;
+static double kappa = 3.0;
+static int iterations = 3;
+static double bpm_sigma = 5.0;
+
+/* The group of frames being combined, and where the strips go */
+static t_input *group[MAX_FRAMES];
+static int ngroup;
+static long nx, ny;
+static float *bias = NULL;
+static float *master = NULL;
+static unsigned char *bpm = NULL;
+
+/* The sorting network for ngroup values: compare-exchange pairs */
+static int (*comparators)[2] = NULL;
+static int ncomparators = 0;
+
+/* Strips are handed out in order */
+static long strip_rows;
+static long next_row;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static double monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+/* Batcher's odd-even merge sort network for n values (any n). Returns */
+/* the number of comparators, storing them if "store".                 */
+static int network(int n, int store)
+{
+    int count = 0;
+
+    for (int p = 1; p < n; p <<= 1)
+        for (int k = p; k >= 1; k >>= 1)
+            for (int j = k % p; j + k < n; j += 2*k)
+                for (int i = 0; i < k && i + j + k < n; i++)
+                    if ((i + j)/(2*p) == (i + j + k)/(2*p)) {
+                        if (store) {
+                            comparators[count][0] = i + j;
+                            comparators[count][1] = i + j + k;
+                        }
+                        count++;
+                    }
+    return(count);
+}
+
+
+static void make_network(int n)
+{
+    ncomparators = network(n, 0);
+    comparators = realloc(comparators, (ncomparators + 1)*sizeof(*comparators));
+    network(n, 1);
+}
+
+
+/* The k-th smallest of n values (which are reordered) */
+static float select_kth(float *v, long n, long k)
+{
+    long lo = 0, hi = n - 1;
+
+    while (lo < hi) {
+        float pivot = v[(lo + hi)/2];
+        long i = lo, j = hi;
+        while (i <= j) {
+            while (v[i] < pivot) i++;
+            while (v[j] > pivot) j--;
+            if (i <= j) {
+                float t = v[i]; v[i] = v[j]; v[j] = t;
+                i++; j--;
+            }
+        }
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+    return(v[k]);
+}
+
+
+/* Read rows [row, row + nrows) of an input as floats, less the master */
+/* bias, divided by the frame's level. raw must hold the rows as read. */
+static int read_rows(t_input *in, long row, long nrows, void *raw, float *out)
+{
+    long n = nrows*nx;
+    size_t bytes = n*(abs(in->bitpix)/8);
+    off_t offset = in->datastart + (off_t) row*nx*(abs(in->bitpix)/8);
+    float scale = (float) (1.0/in->norm);
+    float bscale = (float) in->bscale;
+    float bzero = (float) in->bzero;
+    const float *b = bias ? bias + row*nx : NULL;
+
+    if (pread(in->fd, raw, bytes, offset) != (ssize_t) bytes) {
+        fprintf(stderr,"Unable to read %s\n",in->filename);
+        return(1);
+    }
+    if (in->bitpix == 16) {
+        const uint8_t *p = (const uint8_t *) raw;
+        for (long i = 0; i < n; i++)
+            out[i] = (int16_t) ((p[2*i] << 8) | p[2*i + 1])*bscale + bzero;
+    }
+    else {
+        const uint8_t *p = (const uint8_t *) raw;
+        for (long i = 0; i < n; i++) {
+            uint32_t u = ((uint32_t) p[4*i] << 24) | (p[4*i + 1] << 16) | (p[4*i + 2] << 8) | p[4*i + 3];
+            float f;
+            memcpy(&f, &u, sizeof(f));
+            out[i] = f*bscale + bzero;
+        }
+    }
+    if (b)
+        for (long i = 0; i < n; i++)
+            out[i] -= b[i];
+    if (scale != 1.0f)
+        for (long i = 0; i < n; i++)
+            out[i] *= scale;
+    return(0);
+}
+
+
+/* Combine n pixels whose values, one plane per frame, start at planes */
+/* with the given stride between planes                                */
+static void combine_tile(float *planes, long stride, int n, float *out, unsigned char *flag)
+{
+    int nf = ngroup;
+
+    /* Sort every pixel's values with the network, a plane at a time */
+    for (int c = 0; c < ncomparators; c++) {
+        float *restrict a = planes + comparators[c][0]*stride;
+        float *restrict b = planes + comparators[c][1]*stride;
+        for (int j = 0; j < n; j++) {
+            float lo = a[j] < b[j] ? a[j] : b[j];
+            float hi = a[j] < b[j] ? b[j] : a[j];
+            a[j] = lo;
+            b[j] = hi;
+        }
+    }
+
+    float median[TILE];
+    float *m1 = planes + (nf/2)*stride;
+    float *m0 = planes + ((nf - 1)/2)*stride;
+    for (int j = 0; j < n; j++)
+        median[j] = 0.5f*(m0[j] + m1[j]);
+
+    if (!clip) {
+        memcpy(out, median, n*sizeof(float));
+        return;
+    }
+
+    /* Sigma clipping about the median */
+    float limit[TILE], sum[TILE], sum2[TILE], count[TILE];
+    for (int j = 0; j < n; j++)
+        limit[j] = INFINITY;
+    for (int it = 0; it <= iterations; it++) {
+        for (int j = 0; j < n; j++)
+            sum[j] = sum2[j] = count[j] = 0;
+        for (int k = 0; k < nf; k++) {
+            float *v = planes + k*stride;
+            for (int j = 0; j < n; j++) {
+                float d = v[j] - median[j];
+                float w = fabsf(d) <= limit[j] ? 1.0f : 0.0f;
+                sum[j] += w*d;
+                sum2[j] += w*d*d;
+                count[j] += w;
+            }
+        }
+        for (int j = 0; j < n; j++) {
+            float mean = sum[j]/count[j];
+            float var = sum2[j]/count[j] - mean*mean;
+            if (count[j] > 0)
+                limit[j] = (float) kappa*sqrtf(var > 0 ? var : 0);
+        }
+    }
+    for (int j = 0; j < n; j++) {
+        out[j] = count[j] > 0 ? median[j] + sum[j]/count[j] : median[j];
+        flag[j] = 2*count[j] < nf;
+    }
+}
+
+
+static void *worker(void *arg)
+{
+    long stride = strip_rows*nx;
+    float *planes = (float *) malloc((size_t) ngroup*stride*sizeof(float));
+    void *raw = malloc((size_t) stride*4);
+    long row, nrows;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        row = next_row;
+        next_row += strip_rows;
+        pthread_mutex_unlock(&lock);
+        if (row >= ny)
+            break;
+        nrows = row + strip_rows > ny ? ny - row : strip_rows;
+
+        for (int k = 0; k < ngroup; k++)
+            if (read_rows(group[k], row, nrows, raw, planes + k*stride))
+                exit(1);
+
+        /* A tile at a time, so that tile of every frame stays in cache */
+        long npix = nrows*nx;
+        for (long j = 0; j < npix; j += TILE) {
+            int n = npix - j < TILE ? (int) (npix - j) : TILE;
+            combine_tile(planes + j, stride, n, master + row*nx + j, bpm + row*nx + j);
+        }
+    }
+    free(raw);
+    free(planes);
+    return(NULL);
+}
+
+
+/* Median level of a frame, from a sample of its rows */
+static double frame_level(t_input *in)
+{
+    long step = ny > NORM_ROWS ? ny/NORM_ROWS : 1;
+    long nsample = 0;
+    float *row = (float *) malloc(nx*sizeof(float));
+    float *sample = (float *) malloc(((ny + step - 1)/step)*((nx + 3)/4)*sizeof(float));
+    void *raw = malloc(nx*4);
+    double level;
+
+    in->norm = 1.0;
+    for (long y = step/2; y < ny; y += step) {
+        if (read_rows(in, y, 1, raw, row))
+            exit(1);
+        for (long x = 0; x < nx; x += 4)
+            sample[nsample++] = row[x];
+    }
+    level = select_kth(sample, nsample, nsample/2);
+    free(raw);
+    free(sample);
+    free(row);
+    return(level);
+}
+
+
+/* Flag pixels far from the level of the master. Returns the level and */
+/* sets the robust standard deviation and number of bad pixels.        */
+static double flag_bad_pixels(double *sigma, long *nbad)
+{
+    long npix = nx*ny;
+    long nsample = 0;
+    float *sample = (float *) malloc((npix/BPM_STEP + 1)*sizeof(float));
+    double level, mad;
+
+    for (long i = 0; i < npix; i += BPM_STEP)
+        sample[nsample++] = master[i];
+    level = select_kth(sample, nsample, nsample/2);
+    for (long i = 0; i < nsample; i++)
+        sample[i] = fabsf(sample[i] - (float) level);
+    mad = select_kth(sample, nsample, nsample/2);
+    free(sample);
+
+    *sigma = 1.4826*mad;
+    *nbad = 0;
+    for (long i = 0; i < npix; i++) {
+        bpm[i] = bpm[i] || fabs(master[i] - level) > bpm_sigma*(*sigma);
+        *nbad += bpm[i];
+    }
+    return(level);
+}
+
+
+static int read_input(char *filename, t_input *in)
+{
+    fitsfile *fptr;
+    int status = 0;
+    int naxis;
+    long naxes[2] = {0, 0};
+    LONGLONG headstart, datastart, dataend;
+
+    memset(in, 0, sizeof(t_input));
+    in->filename = filename;
+    in->bscale = 1.0;
+    fits_open_file(&fptr, filename, READONLY, &status);
+    fits_get_img_param(fptr, 2, &in->bitpix, &naxis, naxes, &status);
+    if (status) {
+        fits_report_error(stderr, status);
+        return(1);
+    }
+    fits_read_key(fptr, TDOUBLE, "BZERO", &in->bzero, NULL, &status);
+    status = 0;
+    fits_read_key(fptr, TDOUBLE, "BSCALE", &in->bscale, NULL, &status);
+    status = 0;
+    fits_read_key(fptr, TSTRING, "SERIALNO", in->serial, NULL, &status);
+    if (status)
+        strcpy(in->serial, "unknown");
+    status = 0;
+    fits_read_key(fptr, TSTRING, "IMAGETYP", in->imagetype, NULL, &status);
+    if (status)
+        strcpy(in->imagetype, "frame");
+    status = 0;
+    fits_read_key(fptr, TDOUBLE, "EXPTIME", &in->exptime, NULL, &status);
+    status = 0;
+    fits_read_key(fptr, TDOUBLE, "TEMPERAT", &in->temperature, NULL, &status);
+    status = 0;
+    fits_get_hduaddrll(fptr, &headstart, &datastart, &dataend, &status);
+    fits_close_file(fptr, &status);
+    in->nx = naxes[0];
+    in->ny = naxes[1];
+    in->datastart = (off_t) datastart;
+
+    if (status || naxis != 2 || (in->bitpix != 16 && in->bitpix != FLOAT_IMG)
+            || strstr(filename, ".fz")) {
+        fprintf(stderr,"%s is not an uncompressed 16-bit or floating point image\n",filename);
+        return(1);
+    }
+    if ((in->fd = open(filename, O_RDONLY)) < 0) {
+        perror(filename);
+        return(1);
+    }
+    return(0);
+}
+
+
+static float *read_bias(char *template, char *serial)
+{
+    char filename[MAX_STRING];
+    fitsfile *fptr;
+    int status = 0;
+    int naxis;
+    long naxes[2] = {0, 0};
+    int bitpix;
+    float *data;
+
+    snprintf(filename, sizeof(filename), template, serial);
+    fits_open_file(&fptr, filename, READONLY, &status);
+    fits_get_img_param(fptr, 2, &bitpix, &naxis, naxes, &status);
+    if (status == 0 && (naxes[0] != nx || naxes[1] != ny)) {
+        fprintf(stderr,"%s is not the same size as the frames\n",filename);
+        fits_close_file(fptr, &status);
+        return(NULL);
+    }
+    data = (float *) malloc(nx*ny*sizeof(float));
+    fits_read_img(fptr, TFLOAT, 1, nx*ny, NULL, data, NULL, &status);
+    fits_close_file(fptr, &status);
+    if (status) {
+        fits_report_error(stderr, status);
+        free(data);
+        return(NULL);
+    }
+    return(data);
+}
+
+
+static int write_master(char *filename, char *bpmname, char *biasname, int normalize,
+                        double level, double sigma, long nbad)
+{
+    fitsfile *fptr;
+    int status = 0;
+    long naxes[2] = { nx, ny };
+    char path[MAX_STRING + 1];
+    char key[FLEN_KEYWORD];
+    double exptime = 0, temperature = 0;
+    int n = ngroup;
+
+    for (int k = 0; k < ngroup; k++) {
+        exptime += group[k]->exptime/ngroup;
+        temperature += group[k]->temperature/ngroup;
+    }
+
+    snprintf(path, sizeof(path), "!%s", filename);
+    fits_create_file(&fptr, path, &status);
+    fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status);
+    fits_update_key_str(fptr, "IMAGETYP", group[0]->imagetype, "Image type", &status);
+    fits_update_key_str(fptr, "SERIALNO", group[0]->serial, "Camera serial number", &status);
+    fits_update_key_dbl(fptr, "EXPTIME", exptime, -3, "Mean exposure time of the frames (s)", &status);
+    fits_update_key_dbl(fptr, "TEMPERAT", temperature, -3, "Mean CCD temperature of the frames (C)", &status);
+    fits_update_key(fptr, TINT, "NCOMBINE", &n, "Number of frames combined", &status);
+    fits_update_key_str(fptr, "COMBTYPE", clip ? "clip" : "median", "How the frames were combined", &status);
+    if (clip) {
+        fits_update_key_dbl(fptr, "CLIPSIG", kappa, -3, "Clipping threshold (sigma)", &status);
+        fits_update_key(fptr, TINT, "CLIPITER", &iterations, "Clipping iterations", &status);
+    }
+    if (biasname)
+        fits_update_key_str(fptr, "BIASFILE", biasname, "Master bias subtracted", &status);
+    fits_update_key_str(fptr, "NORMTYPE", normalize ? "median" : "none",
+                        "Frames divided by their median level", &status);
+    fits_update_key_dbl(fptr, "NORMLEV", level, -6, "Median level the master was divided by", &status);
+    fits_update_key_dbl(fptr, "SKYSIG", sigma, -6, "Robust standard deviation of the master", &status);
+    fits_update_key(fptr, TLONG, "NBADPIX", &nbad, "Pixels flagged in the bad pixel map", &status);
+    fits_update_key_str(fptr, "BPMFILE", bpmname, "Bad pixel map", &status);
+    for (int k = 0; k < ngroup; k++) {
+        snprintf(key, sizeof(key), "IMCMB%03d", k + 1);
+        fits_update_key_str(fptr, key, group[k]->filename, "Frame combined", &status);
+        snprintf(key, sizeof(key), "NORM%04d", k + 1);
+        fits_update_key_dbl(fptr, key, group[k]->norm, -6, "Level of that frame", &status);
+    }
+    fits_write_img(fptr, TFLOAT, 1, nx*ny, master, &status);
+    fits_write_chksum(fptr, &status);
+    fits_close_file(fptr, &status);
+
+    snprintf(path, sizeof(path), "!%s", bpmname);
+    fits_create_file(&fptr, path, &status);
+    fits_create_img(fptr, BYTE_IMG, 2, naxes, &status);
+    fits_update_key_str(fptr, "SERIALNO", group[0]->serial, "Camera serial number", &status);
+    fits_update_key_str(fptr, "MASTER", filename, "Master the map was made from", &status);
+    fits_update_key_dbl(fptr, "BPMSIG", bpm_sigma, -3, "Threshold (robust sigma)", &status);
+    fits_update_key(fptr, TLONG, "NBADPIX", &nbad, "Pixels flagged", &status);
+    fits_write_img(fptr, TBYTE, 1, nx*ny, bpm, &status);
+    fits_write_chksum(fptr, &status);
+    fits_close_file(fptr, &status);
+
+    if (status) {
+        fits_report_error(stderr, status);
+        return(1);
+    }
+    return(0);
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int c;
+    int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int normalize = -1;
+    double megabytes = 256;
+    char *bias_template = NULL;
+    char *output_template = NULL;
+    char filename[MAX_STRING], bpmname[MAX_STRING + 8], biasname[MAX_STRING];
+    int status = 0;
+
+    while ((c = getopt(argc, argv, "c:k:i:b:nNB:o:M:j:vh")) != -1) {
+        switch (c) {
+            case 'c':
+                if (strcmp(optarg, "clip") == 0)
+                    clip = 1;
+                else if (strcmp(optarg, "median") != 0) {
+                    error_exit(usage);
+                }
+                break;
+            case 'k':
+                kappa = atof(optarg);
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                break;
+            case 'b':
+                bias_template = optarg;
+                break;
+            case 'n':
+                normalize = 1;
+                break;
+            case 'N':
+                normalize = 0;
+                break;
+            case 'B':
+                bpm_sigma = atof(optarg);
+                break;
+            case 'o':
+                output_template = optarg;
+                break;
+            case 'M':
+                megabytes = atof(optarg);
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (optind == argc || kappa <= 0 || iterations < 0 || megabytes <= 0) {
+        error_exit(usage);
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (argc - optind > MAX_FRAMES) {
+        fprintf(stderr,"At most %d frames can be combined\n",MAX_FRAMES);
+        return(1);
+    }
+
+    for (int i = optind; i < argc; i++)
+        if (read_input(argv[i], &inputs[ninputs++]))
+            return(1);
+
+    /* One master for each camera, in the order the cameras first appear */
+    for (int first = 0; first < ninputs; first++) {
+        double start = monotonic_time();
+        double level, sigma;
+        long nbad;
+        int norm;
+        pthread_t *threads;
+
+        if (inputs[first].used)
+            continue;
+        ngroup = 0;
+        for (int i = first; i < ninputs; i++)
+            if (!inputs[i].used && strcmp(inputs[i].serial, inputs[first].serial) == 0) {
+                inputs[i].used = 1;
+                group[ngroup++] = &inputs[i];
+            }
+        nx = group[0]->nx;
+        ny = group[0]->ny;
+        for (int k = 1; k < ngroup; k++)
+            if (group[k]->nx != nx || group[k]->ny != ny) {
+                fprintf(stderr,"%s is not the same size as %s\n",group[k]->filename,group[0]->filename);
+                return(1);
+            }
+        norm = normalize >= 0 ? normalize : (strcmp(group[0]->imagetype, "flat") == 0);
+        if (!norm)
+            for (int k = 1; k < ngroup; k++)
+                if (fabs(group[k]->exptime - group[0]->exptime) > 0.01*group[0]->exptime + 0.001)
+                    fprintf(stderr,"Warning: %s and %s have different exposure times\n",
+                            group[0]->filename, group[k]->filename);
+
+        if (output_template)
+            snprintf(filename, sizeof(filename), output_template, group[0]->serial);
+        else
+            snprintf(filename, sizeof(filename), "master_%s_%s.fits", group[0]->serial, group[0]->imagetype);
+        snprintf(bpmname, sizeof(bpmname), "%s", filename);
+        if (strlen(bpmname) > 5 && strcmp(bpmname + strlen(bpmname) - 5, ".fits") == 0)
+            bpmname[strlen(bpmname) - 5] = '\0';
+        strcat(bpmname, "_bpm.fits");
+
+        bias = NULL;
+        if (bias_template) {
+            snprintf(biasname, sizeof(biasname), bias_template, group[0]->serial);
+            if ((bias = read_bias(bias_template, group[0]->serial)) == NULL)
+                return(1);
+        }
+
+        for (int k = 0; k < ngroup; k++) {
+            group[k]->norm = 1.0;
+            if (norm) {
+                group[k]->norm = frame_level(group[k]);
+                if (group[k]->norm <= 0) {
+                    fprintf(stderr,"%s has no signal to normalize by\n",group[k]->filename);
+                    return(1);
+                }
+            }
+        }
+
+        /* As many rows per strip as fit in memory with every thread busy */
+        strip_rows = (long) (megabytes*1048576.0/(nthreads*(ngroup + 1.0)*nx*sizeof(float)));
+        if (strip_rows < 1) {
+            strip_rows = 1;
+            fprintf(stderr,"Warning: one row of %d frames needs more than %.0f MB with %d threads\n",
+                    ngroup, megabytes, nthreads);
+        }
+        if (strip_rows*nthreads > ny)
+            strip_rows = (ny + nthreads - 1)/nthreads;
+        next_row = 0;
+
+        make_network(ngroup);
+        master = (float *) malloc(nx*ny*sizeof(float));
+        bpm = (unsigned char *) calloc(nx*ny, 1);
+        threads = (pthread_t *) malloc(nthreads*sizeof(pthread_t));
+        for (int i = 0; i < nthreads; i++)
+            pthread_create(&threads[i], NULL, worker, NULL);
+        for (int i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+
+        level = flag_bad_pixels(&sigma, &nbad);
+        if (norm && level > 0) {
+            for (long i = 0; i < nx*ny; i++)
+                master[i] /= level;
+            sigma /= level;
+        }
+        else
+            level = 1.0;
+
+        if (write_master(filename, bpmname, bias ? biasname : NULL, norm, level, sigma, nbad))
+            status = 1;
+        else
+            printf("%s %s %d %s %ld\n", group[0]->serial, filename, ngroup, bpmname, nbad);
+        if (verbose)
+            fprintf(stderr,"Combined %d frames of %ldx%ld in %.3f s with %d threads, %ld rows per strip\n",
+                    ngroup, nx, ny, monotonic_time() - start, nthreads, strip_rows);
+
+        free(master);
+        free(bpm);
+        free(bias);
+    }
+
+    for (int i = 0; i < ninputs; i++)
+        close(inputs[i].fd);
+    return(status);
+
+}
@@ -0,0 +1,753 @@
+/*
+ * PREVIEW - Quick-look images of raw frames.
+ *
+ * Each frame is read as the unsigned shorts the cameras write and reduced
+ * by averaging blocks of pixels as it is read, so a whole frame never has
+ * to be held in memory as floats. The sky level comes from a histogram of
+ * a sparse grid of raw pixels rather than from clipping every pixel, and
+ * the stretch is a 65536-entry lookup table, so turning a frame into bytes
+ * costs one table lookup per output pixel. Images are written as 8-bit
+ * greyscale PNG files.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <math.h>
+#include <libgen.h>
+#include <zlib.h>
+#include "fitsio.h"
+
+#include "wcs.h"
+#include "framering.h"
+
+#define MAX_STRING 1024
+#define NLEVELS 65536
+#define SKY_STEP 7              // sample every 7th pixel of every other strip for the sky
+#define GUTTER 8                // pixels between montage cells
+#define LABEL 24                // height of a label under a montage cell
+#define COLUMNS 5               // montage cells per row, as the lenses are mounted
+#define MAX_BLOCK 256           // largest block whose sum of 16-bit pixels fits in 32 bits
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+
+#define usage "\n\
+NAME\n\
+preview --- make quick-look PNG images of frames \n\
+\n\
+SYNOPSIS\n\
+preview [options] file1.fits [file2.fits ...] \n\
+preview -r [options] [serial1 serial2 ...] \n\
+\n\
+DESCRIPTION\n\
+\"preview\" makes 8-bit greyscale PNG images of frames for a quick look. By\n\
+default each frame is shrunk by averaging 8x8 blocks of pixels, the sky level\n\
+is estimated by sigma-clipping a sample of its pixels, and the brightness is\n\
+scaled by a square root from 100 counts below the sky to 5000 counts above\n\
+it. Stars are shown black on white. Row 1 of the frame is at the bottom.\n\
+\n\
+Without -m or -n, the preview of file.fits is written to file.png in the\n\
+current directory (or to the file given by -o if there is only one frame).\n\
+\n\
+With -m, the frames are arranged in a montage that matches the layout of the\n\
+lenses on the array: two rows of five cells, with each camera always in the\n\
+same cell. Frames from cameras not in the layout fill any empty cells, and\n\
+each cell is labelled with the name of its frame. This replaces imcheck.\n\
+\n\
+With -n, the first frame with a WCS is drawn north up and east left on a\n\
+canvas with room around it, and the outline of every frame with a WCS is\n\
+drawn on top, which shows how the fields of the array overlap. This replaces\n\
+nice_image.\n\
+\n\
+With -r, the frames are taken from the ring of frames in shared memory that\n\
+the cameras on this computer publish as each readout ends (see lastframe),\n\
+instead of from files. The arguments are the serial numbers of the cameras\n\
+whose newest frames are wanted; with none, the newest frame from every camera\n\
+in the ring is used. The pixels are read in place, so a preview can be made\n\
+before the frames have been written to disk. Frames from the ring have no\n\
+WCS, so -r cannot be used with -n.\n\
+\n\
+OPTIONS\n\
+-m            # montage of the array (default output /var/tmp/imcheck.png) \n\
+-n            # north-up view of the field (default output /var/tmp/nice_image.png) \n\
+-o file       # output file \n\
+-b block      # shrink by averaging block x block pixels (default: 8, at most 256) \n\
+-s size       # show the central size x size pixels at full resolution instead \n\
+-a            # asinh stretch instead of a square root \n\
+-l low,high   # stretch limits relative to the sky (default: -100,5000) \n\
+-d            # white stars on a dark background \n\
+-r            # frames from the shared-memory frame ring \n\
+-v            # verbose \n\
+\n\
+EXAMPLES\n\
+preview -m -o /var/tmp/imcheck.png /Users/dragonfly/Data/2016-05-02/*_17_light.fits \n\
+preview -s 200 -a 83F010783_17_light.fits \n\
+preview -n *_17_light.fits && open /var/tmp/nice_image.png \n\
+preview -r -m \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+typedef struct {
+    char   *filename;           // or the name made up for a frame from the ring
+    const unsigned short *pixels;   // in the frame ring, or NULL to read the file
+    int     nx, ny;             // size of the frame
+    int     width, height;      // size of the preview
+    int     block;              // frame pixels per preview pixel
+    int     x0, y0;             // frame pixel at the corner of the preview, less one
+    unsigned char *image;       // preview, top row first
+    int     has_wcs;
+    t_wcs   wcs;
+    int     cell;               // in the montage
+} t_frame;
+
+/* Where each camera sits in the montage (cells count from 1 along the top row) */
+static struct {
+    char *serial;
+    int   cell;
+} layout[] = {
+    { "83F010730", 2 },
+    { "83F010784", 3 },
+    { "83F010827", 4 },
+    { "83F010692", 6 },
+    { "83F010826", 7 },
+    { "83F010820", 8 },
+    { "83F010687", 9 },
+    { "83F010783", 10 }
+};
+#define NLAYOUT (sizeof(layout)/sizeof(layout[0]))
+
+/* Options */
+static int block = 8;
+static int stamp = 0;
+static int use_asinh = 0;
+static double low = -100, high = 5000;
+static int dark = 0;
+static int verbose = 0;
+static int from_ring = 0;
+
+static unsigned char background, foreground;
+
+
+/* A 5x7 font for labels */
+static char glyphs[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_-.";
+static unsigned char font[][7] = {
+    { 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E }, { 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E },
+    { 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F }, { 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E },
+    { 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 }, { 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E },
+    { 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E }, { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },
+    { 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E }, { 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C },
+    { 0x0E, 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11 }, { 0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E },
+    { 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E }, { 0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C },
+    { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F }, { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10 },
+    { 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F }, { 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 },
+    { 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E }, { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C },
+    { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 }, { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F },
+    { 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11 }, { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 },
+    { 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E }, { 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10 },
+    { 0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D }, { 0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11 },
+    { 0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E }, { 0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E }, { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04 },
+    { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A }, { 0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11 },
+    { 0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04 }, { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F },
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1F }, { 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 },
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C }
+};
+
+
+/* Draw text twice the size of the font with its top left corner at (x,y) */
+static void draw_text(unsigned char *canvas, int width, int height, int x, int y, char *text)
+{
+    for (; *text; text++, x += 12) {
+        char *g = strchr(glyphs, toupper((unsigned char) *text));
+        if (g == NULL)
+            continue;
+        for (int r = 0; r < 14; r++)
+            for (int c = 0; c < 10; c++)
+                if (font[g - glyphs][r/2] & (0x10 >> c/2)
+                        && x + c >= 0 && x + c < width && y + r >= 0 && y + r < height)
+                    canvas[(long) (y + r)*width + x + c] = foreground;
+    }
+}
+
+
+static void draw_line(unsigned char *canvas, int width, int height, double x0, double y0, double x1, double y1)
+{
+    int n = (int) ceil(fmax(fabs(x1 - x0), fabs(y1 - y0))) + 1;
+
+    for (int i = 0; i <= n; i++) {
+        int x = (int) lround(x0 + (x1 - x0)*i/n);
+        int y = (int) lround(y0 + (y1 - y0)*i/n);
+        if (x >= 0 && x < width && y >= 0 && y < height)
+            canvas[(long) y*width + x] = foreground;
+    }
+}
+
+
+/* Sky level and scatter from a histogram of pixel values: the median and */
+/* the median absolute deviation, recomputed within 3 sigma of the median */
+/* until they settle down.                                               */
+static void sky_level(uint32_t *histogram, double *sky, double *sigma)
+{
+    long lo = 0, hi = NLEVELS - 1;
+    double median = 0, mad = 0;
+
+    for (int iteration = 0; iteration < 10; iteration++) {
+        uint64_t n = 0, count = 0;
+        long m, d;
+        double last = median;
+
+        for (long v = lo; v <= hi; v++)
+            n += histogram[v];
+        if (n == 0)
+            break;
+        for (m = lo; m <= hi && 2*(count + histogram[m]) < n; m++)
+            count += histogram[m];
+        median = m;
+
+        // Smallest d with half the pixels within d of the median
+        for (d = 0; ; d++) {
+            count = 0;
+            for (long v = (m - d > lo ? m - d : lo); v <= (m + d < hi ? m + d : hi); v++)
+                count += histogram[v];
+            if (2*count >= n)
+                break;
+        }
+        mad = d > 0 ? d : 0.5;
+        lo = (long) fmax(0, median - 3*1.4826*mad);
+        hi = (long) fmin(NLEVELS - 1, median + 3*1.4826*mad);
+        if (iteration > 0 && fabs(median - last) < 0.1*1.4826*mad)
+            break;
+    }
+    *sky = median;
+    *sigma = 1.4826*mad;
+}
+
+
+/* Bytes for every possible pixel value */
+static void make_stretch(double sky, unsigned char *lut)
+{
+    double beta = 0.05;
+
+    for (long v = 0; v < NLEVELS; v++) {
+        double t = (v - (sky + low))/(high - low);
+        t = t < 0 ? 0 : t > 1 ? 1 : t;
+        t = use_asinh ? asinh(t/beta)/asinh(1/beta) : sqrt(t);
+        lut[v] = (unsigned char) lround(255*(dark ? t : 1 - t));
+    }
+}
+
+
+/* Read a frame's header and, if asked, make its preview */
+static int load_frame(t_frame *frame, int pixels)
+{
+    fitsfile *fptr = NULL;
+    int status = 0;
+    int naxis;
+    long naxes[2];
+    static uint32_t histogram[NLEVELS];
+    static unsigned char lut[NLEVELS];
+    unsigned short *values;
+    double sky, sigma;
+
+    // Frames from the ring come with their size and without a WCS
+    if (!frame->pixels) {
+        if (fits_open_file(&fptr, frame->filename, READONLY, &status)) {
+            fits_report_error(stderr, status);
+            return(1);
+        }
+        fits_get_img_param(fptr, 2, NULL, &naxis, naxes, &status);
+        if (status || naxis != 2) {
+            fprintf(stderr, "%s is not an image\n", frame->filename);
+            fits_close_file(fptr, &status);
+            return(1);
+        }
+        frame->nx = naxes[0];
+        frame->ny = naxes[1];
+        frame->has_wcs = (ReadWCS(fptr, &frame->wcs) == 0);
+        if (!pixels) {
+            fits_close_file(fptr, &status);
+            return(0);
+        }
+    }
+
+    memset(histogram, 0, sizeof(histogram));
+    if (stamp) {
+        // The middle of the frame at full resolution
+        long fpixel[2], lpixel[2], inc[2] = { 1, 1 };
+        frame->block = 1;
+        frame->width = stamp < frame->nx ? stamp : frame->nx;
+        frame->height = stamp < frame->ny ? stamp : frame->ny;
+        frame->x0 = (frame->nx - frame->width)/2;
+        frame->y0 = (frame->ny - frame->height)/2;
+        fpixel[0] = frame->x0 + 1;
+        fpixel[1] = frame->y0 + 1;
+        lpixel[0] = frame->x0 + frame->width;
+        lpixel[1] = frame->y0 + frame->height;
+        values = (unsigned short *) malloc((size_t) frame->width*frame->height*sizeof(unsigned short));
+        if (frame->pixels)
+            for (int j = 0; j < frame->height; j++)
+                memcpy(values + (long) j*frame->width,
+                       frame->pixels + (long) (frame->y0 + j)*frame->nx + frame->x0,
+                       frame->width*sizeof(unsigned short));
+        else
+            fits_read_subset(fptr, TUSHORT, fpixel, lpixel, inc, NULL, values, NULL, &status);
+        for (long i = 0; i < (long) frame->width*frame->height; i++)
+            histogram[values[i]]++;
+    }
+    else {
+        // Average blocks a strip of rows at a time
+        int nx = frame->nx;
+        unsigned short *buffer = (unsigned short *) malloc((size_t) block*nx*sizeof(unsigned short));
+        const unsigned short *strip = buffer;
+        uint32_t *sums;
+        frame->block = block;
+        frame->width = nx/block;
+        frame->height = frame->ny/block;
+        frame->x0 = frame->y0 = 0;
+        sums = (uint32_t *) malloc((frame->width + 1)*sizeof(uint32_t));
+        values = (unsigned short *) malloc((size_t) frame->width*frame->height*sizeof(unsigned short));
+        for (int j = 0; j < frame->height && !status; j++) {
+            long fpixel[2] = { 1, (long) j*block + 1 };
+            if (frame->pixels)
+                strip = frame->pixels + (long) j*block*nx;
+            else
+                fits_read_pix(fptr, TUSHORT, fpixel, (LONGLONG) block*nx, NULL, buffer, NULL, &status);
+            memset(sums, 0, frame->width*sizeof(uint32_t));
+            for (int r = 0; r < block; r++) {
+                const unsigned short *row = strip + (long) r*nx;
+                for (int i = 0; i < frame->width; i++)
+                    for (int k = 0; k < block; k++)
+                        sums[i] += row[i*block + k];
+            }
+            for (int i = 0; i < frame->width; i++)
+                values[(long) j*frame->width + i] = (sums[i] + block*block/2)/(block*block);
+            if (j % 2 == 0)
+                for (int i = 0; i < nx; i += SKY_STEP)
+                    histogram[strip[i]]++;
+        }
+        free(buffer);
+        free(sums);
+    }
+    if (fptr)
+        fits_close_file(fptr, &status);
+    if (status) {
+        fits_report_error(stderr, status);
+        free(values);
+        return(1);
+    }
+
+    sky_level(histogram, &sky, &sigma);
+    make_stretch(sky, lut);
+    if (verbose)
+        printf("%s: sky %.1f sigma %.1f, preview %dx%d\n", frame->filename, sky, sigma,
+               frame->width, frame->height);
+
+    // Flip so that row 1 of the frame is at the bottom
+    frame->image = (unsigned char *) malloc((size_t) frame->width*frame->height);
+    for (int j = 0; j < frame->height; j++) {
+        unsigned short *in = values + (long) j*frame->width;
+        unsigned char *out = frame->image + (long) (frame->height - 1 - j)*frame->width;
+        for (int i = 0; i < frame->width; i++)
+            out[i] = lut[in[i]];
+    }
+    free(values);
+    return(0);
+}
+
+
+static void put_chunk(FILE *fp, const char *type, unsigned char *data, uint32_t length)
+{
+    unsigned char word[4] = { length >> 24, length >> 16, length >> 8, length };
+    uLong crc = crc32(0, (const Bytef *) type, 4);
+
+    if (length)
+        crc = crc32(crc, data, length);
+    fwrite(word, 1, 4, fp);
+    fwrite(type, 1, 4, fp);
+    fwrite(data, 1, length, fp);
+    word[0] = crc >> 24;
+    word[1] = crc >> 16;
+    word[2] = crc >> 8;
+    word[3] = crc;
+    fwrite(word, 1, 4, fp);
+}
+
+
+/* Write an 8-bit greyscale PNG. Each row is stored as the differences */
+/* between neighbouring pixels (the "Sub" filter), which suits the sky. */
+static int write_png(char *filename, unsigned char *image, int width, int height)
+{
+    FILE *fp;
+    unsigned char ihdr[13] = { width >> 24, width >> 16, width >> 8, width,
+                               height >> 24, height >> 16, height >> 8, height,
+                               8, 0, 0, 0, 0 };
+    size_t rawsize = (size_t) (width + 1)*height;
+    unsigned char *raw = (unsigned char *) malloc(rawsize);
+    uLongf zsize = compressBound(rawsize);
+    unsigned char *z = (unsigned char *) malloc(zsize);
+
+    for (int j = 0; j < height; j++) {
+        unsigned char *in = image + (long) j*width;
+        unsigned char *out = raw + (long) j*(width + 1);
+        out[0] = 1;
+        out[1] = in[0];
+        for (int i = 1; i < width; i++)
+            out[i + 1] = in[i] - in[i - 1];
+    }
+    if (compress2(z, &zsize, raw, rawsize, 6) != Z_OK) {
+        fprintf(stderr, "Unable to compress %s\n", filename);
+        free(raw);
+        free(z);
+        return(1);
+    }
+    if ((fp = fopen(filename, "wb")) == NULL) {
+        perror(filename);
+        free(raw);
+        free(z);
+        return(1);
+    }
+    fwrite("\211PNG\r\n\032\n", 1, 8, fp);
+    put_chunk(fp, "IHDR", ihdr, 13);
+    put_chunk(fp, "IDAT", z, zsize);
+    put_chunk(fp, "IEND", NULL, 0);
+    free(raw);
+    free(z);
+    if (fclose(fp) != 0) {
+        perror(filename);
+        return(1);
+    }
+    return(0);
+}
+
+
+/* The frame's name without the directory or .fits */
+static void frame_name(t_frame *frame, char *name)
+{
+    char path[MAX_STRING];
+    char *dot;
+
+    snprintf(path, sizeof(path), "%s", frame->filename);
+    snprintf(name, MAX_STRING, "%s", basename(path));
+    if ((dot = strstr(name, ".fit")) != NULL)
+        *dot = '\0';
+}
+
+
+static int montage(t_frame *frames, int nframes, char *output)
+{
+    int cellwidth = 0, cellheight = 0, ncells = COLUMNS*2;
+    int width, height, rows;
+    unsigned char *canvas;
+    char *used;
+    int result;
+
+    // Cameras go in their own cells and anything else in the gaps
+    for (int f = 0; f < nframes; f++) {
+        char name[MAX_STRING];
+        frame_name(&frames[f], name);
+        frames[f].cell = 0;
+        for (int k = 0; k < NLAYOUT; k++)
+            if (strncmp(name, layout[k].serial, strlen(layout[k].serial)) == 0)
+                frames[f].cell = layout[k].cell;
+        if (frames[f].width > cellwidth)
+            cellwidth = frames[f].width;
+        if (frames[f].height > cellheight)
+            cellheight = frames[f].height;
+    }
+    if (nframes > ncells)
+        ncells = nframes;
+    used = (char *) calloc(ncells + NLAYOUT + 1, 1);
+    for (int f = 0; f < nframes; f++) {
+        if (frames[f].cell && !used[frames[f].cell])
+            used[frames[f].cell] = 1;
+        else
+            frames[f].cell = 0;
+    }
+    for (int f = 0, next = 1; f < nframes; f++) {
+        if (frames[f].cell)
+            continue;
+        while (used[next])
+            next++;
+        frames[f].cell = next;
+        used[next] = 1;
+        if (next > ncells)
+            ncells = next;
+    }
+    free(used);
+
+    rows = (ncells + COLUMNS - 1)/COLUMNS;
+    width = COLUMNS*cellwidth + (COLUMNS + 1)*GUTTER;
+    height = rows*(cellheight + LABEL) + (rows + 1)*GUTTER;
+    canvas = (unsigned char *) malloc((size_t) width*height);
+    memset(canvas, background, (size_t) width*height);
+    for (int f = 0; f < nframes; f++) {
+        t_frame *frame = &frames[f];
+        char name[MAX_STRING];
+        int row = (frame->cell - 1)/COLUMNS;
+        int column = (frame->cell - 1) % COLUMNS;
+        int x = GUTTER + column*(cellwidth + GUTTER) + (cellwidth - frame->width)/2;
+        int y = GUTTER + row*(cellheight + LABEL + GUTTER) + (cellheight - frame->height)/2;
+        for (int j = 0; j < frame->height; j++)
+            memcpy(canvas + (long) (y + j)*width + x, frame->image + (long) j*frame->width, frame->width);
+        frame_name(frame, name);
+        draw_text(canvas, width, height, GUTTER + column*(cellwidth + GUTTER) + (cellwidth - 12*(int) strlen(name))/2,
+                  GUTTER + row*(cellheight + LABEL + GUTTER) + cellheight + 5, name);
+    }
+    result = write_png(output, canvas, width, height);
+    free(canvas);
+    return(result);
+}
+
+
+/* The first frame with a WCS, north up and east left, with the outlines of */
+/* all the frames on it                                                     */
+static int north_up(t_frame *frames, int nframes, char *output)
+{
+    t_frame *first = NULL;
+    t_wcs sky;
+    double scale;
+    int width, height;
+    unsigned char *canvas;
+    char name[MAX_STRING];
+    int result;
+
+    for (int f = 0; f < nframes && first == NULL; f++)
+        if (frames[f].has_wcs)
+            first = &frames[f];
+    if (first == NULL) {
+        fprintf(stderr, "None of the frames has a WCS\n");
+        return(1);
+    }
+    if (load_frame(first, 1))
+        return(1);
+
+    // A tangent plane at the centre of the first frame, with the same
+    // pixels as its preview
+    sky = first->wcs;
+    PixelToSky(&first->wcs, (first->nx + 1)/2.0, (first->ny + 1)/2.0, &sky.crval[0], &sky.crval[1]);
+    scale = sqrt(fabs(first->wcs.cd[0][0]*first->wcs.cd[1][1] - first->wcs.cd[0][1]*first->wcs.cd[1][0]))
+                *first->block;
+    width = 5*first->nx/(4*first->block);
+    height = 3*first->ny/(2*first->block);
+    sky.crpix[0] = (width + 1)/2.0;
+    sky.crpix[1] = (height + 1)/2.0;
+    sky.cd[0][0] = -scale;
+    sky.cd[0][1] = sky.cd[1][0] = 0;
+    sky.cd[1][1] = scale;
+
+    canvas = (unsigned char *) malloc((size_t) width*height);
+    for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++) {
+            double ra, dec, x, y;
+            int px, py;
+            PixelToSky(&sky, i + 1, height - j, &ra, &dec);
+            SkyToPixel(&first->wcs, ra, dec, &x, &y);
+            px = (int) floor((x - 0.5 - first->x0)/first->block);
+            py = (int) floor((y - 0.5 - first->y0)/first->block);
+            if (px >= 0 && px < first->width && py >= 0 && py < first->height)
+                canvas[(long) j*width + i] = first->image[(long) (first->height - 1 - py)*first->width + px];
+            else
+                canvas[(long) j*width + i] = background;
+        }
+
+    for (int f = 0; f < nframes; f++) {
+        double corners[5][2] = { { 0.5, 0.5 }, { frames[f].nx + 0.5, 0.5 },
+                                 { frames[f].nx + 0.5, frames[f].ny + 0.5 }, { 0.5, frames[f].ny + 0.5 },
+                                 { 0.5, 0.5 } };
+        double x[5], y[5];
+        if (!frames[f].has_wcs)
+            continue;
+        for (int k = 0; k < 5; k++) {
+            double ra, dec;
+            PixelToSky(&frames[f].wcs, corners[k][0], corners[k][1], &ra, &dec);
+            SkyToPixel(&sky, ra, dec, &x[k], &y[k]);
+        }
+        for (int k = 0; k < 4; k++)
+            draw_line(canvas, width, height, x[k] - 1, height - y[k], x[k + 1] - 1, height - y[k + 1]);
+    }
+    frame_name(first, name);
+    draw_text(canvas, width, height, GUTTER, GUTTER, name);
+    draw_text(canvas, width, height, width - GUTTER - 10, GUTTER, "N");
+    draw_line(canvas, width, height, width - GUTTER - 5, GUTTER + 18, width - GUTTER - 5, GUTTER + 48);
+    draw_text(canvas, width, height, width - GUTTER - 50, GUTTER + 40, "E");
+    draw_line(canvas, width, height, width - GUTTER - 35, GUTTER + 48, width - GUTTER - 5, GUTTER + 48);
+
+    result = write_png(output, canvas, width, height);
+    free(canvas);
+    return(result);
+}
+
+
+/* Pin the newest frame from each of the given cameras, or from every */
+/* camera in the ring if none are given. Returns the number of frames. */
+static int ring_frames(t_framering *ring, char **serials, int nserials,
+                       t_frame **frames, t_ringframe **pinned)
+{
+    t_framering_header *h = ring->header;
+    char (*wanted)[16] = calloc(nserials + h->nslots, 16);
+    int nwanted = 0, n = 0;
+
+    for (int i = 0; i < nserials; i++)
+        snprintf(wanted[nwanted++], 16, "%s", serials[i]);
+    if (nserials == 0)
+        for (int i = 0; i < (int) h->nslots; i++) {
+            int k;
+            if (h->slot[i].sequence == 0 || !h->slot[i].serial_number[0])
+                continue;
+            for (k = 0; k < nwanted; k++)
+                if (!strncmp(wanted[k], h->slot[i].serial_number, 16))
+                    break;
+            if (k == nwanted)
+                memcpy(wanted[nwanted++], h->slot[i].serial_number, 16);
+        }
+
+    *frames = (t_frame *) calloc(nwanted + 1, sizeof(t_frame));
+    *pinned = (t_ringframe *) calloc(nwanted + 1, sizeof(t_ringframe));
+    for (int k = 0; k < nwanted; k++) {
+        t_frame *frame = &(*frames)[n];
+        t_ringframe *rf = &(*pinned)[n];
+        wanted[k][15] = '\0';
+        if (AcquireFrame(ring, 0, wanted[k], rf)) {
+            fprintf(stderr, "No frame from %s in the ring\n", wanted[k]);
+            continue;
+        }
+        frame->filename = (char *) malloc(MAX_STRING);
+        snprintf(frame->filename, MAX_STRING, "%s_%llu", wanted[k], (unsigned long long) rf->sequence);
+        frame->pixels = rf->data;
+        frame->nx = rf->info.width;
+        frame->ny = rf->info.height;
+        n++;
+    }
+    free(wanted);
+    return(n);
+}
+
+
+int main(int argc, char *argv[]) {
+
+    t_frame *frames;
+    t_framering ring;
+    t_ringframe *pinned = NULL;
+    int nframes;
+    int mode = 0;
+    char *output = NULL;
+    int status = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "mno:b:s:al:drvh")) != -1) {
+        switch (c) {
+            case 'm':
+            case 'n':
+                mode = c;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'b':
+                block = atoi(optarg);
+                break;
+            case 's':
+                stamp = atoi(optarg);
+                break;
+            case 'a':
+                use_asinh = 1;
+                break;
+            case 'l':
+                if (sscanf(optarg, "%lf,%lf", &low, &high) != 2) {
+                    error_exit(usage);
+                }
+                break;
+            case 'd':
+                dark = 1;
+                break;
+            case 'r':
+                from_ring = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    nframes = argc - optind;
+    if ((nframes < 1 && !from_ring) || block < 1 || block > MAX_BLOCK || stamp < 0 || high <= low
+            || (output && !mode && nframes > 1) || (from_ring && mode == 'n')) {
+        error_exit(usage);
+    }
+    background = dark ? 0 : 255;
+    foreground = dark ? 255 : 0;
+
+    if (from_ring) {
+        if (OpenFrameRing(&ring, 0))
+            return(1);
+        if ((nframes = ring_frames(&ring, argv + optind, argc - optind, &frames, &pinned)) == 0) {
+            CloseFrameRing(&ring);
+            return(1);
+        }
+        if (nframes < argc - optind)
+            status = 1;
+        if (output && !mode && nframes > 1) {
+            error_exit(usage);
+        }
+    }
+    else {
+        frames = (t_frame *) calloc(nframes, sizeof(t_frame));
+        for (int f = 0; f < nframes; f++)
+            frames[f].filename = argv[optind + f];
+    }
+
+    if (mode == 'n') {
+        for (int f = 0; f < nframes; f++)
+            if (load_frame(&frames[f], 0))
+                status = 1;
+        if (north_up(frames, nframes, output ? output : "/var/tmp/nice_image.png"))
+            status = 1;
+    }
+    else if (mode == 'm') {
+        int n = 0;
+        for (int f = 0; f < nframes; f++) {
+            if (load_frame(&frames[f], 1)) {
+                status = 1;
+                continue;
+            }
+            frames[n++] = frames[f];
+        }
+        if (n == 0 || montage(frames, n, output ? output : "/var/tmp/imcheck.png"))
+            status = 1;
+    }
+    else {
+        for (int f = 0; f < nframes; f++) {
+            char name[MAX_STRING + 4];
+            if (load_frame(&frames[f], 1)) {
+                status = 1;
+                continue;
+            }
+            frame_name(&frames[f], name);
+            strcat(name, ".png");
+            if (write_png(output ? output : name, frames[f].image, frames[f].width, frames[f].height))
+                status = 1;
+            free(frames[f].image);
+        }
+    }
+    if (from_ring) {
+        for (int f = 0; f < nframes; f++)
+            if (ReleaseFrame(&ring, &pinned[f])) {
+                fprintf(stderr, "Frame %llu was overwritten while it was being read\n",
+                        (unsigned long long) pinned[f].sequence);
+                status = 1;
+            }
+        CloseFrameRing(&ring);
+    }
+    return(status);
+
+}
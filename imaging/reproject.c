@@ -0,0 +1,729 @@
+/*
+ * REPROJECT - Resample the solved frames of the whole array onto one grid.
+ *
+ * Every frame is resampled onto the same north-up tangent-plane grid, so
+ * the lenses can be compared pixel for pixel or added together. The grid
+ * is cut into square tiles and a pool of threads takes tiles in turn; each
+ * output pixel belongs to one tile, so nothing has to be locked. Working
+ * out where an output pixel falls in a frame takes trigonometry, so within
+ * a tile it is done exactly only on a coarse grid of nodes and interpolated
+ * in between, which is far more accurate than a pixel over so short a
+ * stretch of a TAN projection. The Lanczos kernel is read from a table.
+ *
+ * One frame is held in memory at a time, along with the output grids.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <libgen.h>
+#include <pthread.h>
+#include "fitsio.h"
+
+#include "wcs.h"
+
+#define MAX_STRING 1024
+#define MAX_FRAMES 1024
+#define TILE 128                // output pixels on a side of a tile
+#define STEP 16                 // output pixels between nodes where the mapping is exact
+#define LANCZOS_A 3             // lobes of the Lanczos kernel
+#define LANCZOS_RES 1024        // table entries per pixel
+#define SKY_STEP 16             // sample every 16th pixel for a frame's sky and noise
+#define EDGE_POINTS 16          // points along each edge of a frame when fitting the grid around it
+#define MAX_GRID 40000          // largest grid side, to catch frames with a bad WCS
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+
+#define usage "\n\
+NAME\n\
+reproject --- resample frames from the whole array onto a common grid \n\
+\n\
+SYNOPSIS\n\
+reproject [options] file1.fits file2.fits ... \n\
+\n\
+DESCRIPTION\n\
+\"reproject\" resamples plate-solved frames, from any or all of the cameras,\n\
+onto one tangent-plane (TAN) grid with north up and east to the left. Frames\n\
+without a TAN WCS are skipped with a warning.\n\
+\n\
+By default the grid is centred on the middle of the frames, its pixels are\n\
+the mean size of theirs, and it is just big enough to hold all of them. -c,\n\
+-p and -s set the centre, pixel size and size instead.\n\
+\n\
+Pixels are interpolated with a Lanczos kernel with three lobes (-k lanczos,\n\
+the default) or bilinearly (-k bilinear), and scaled by the ratio of the\n\
+areas of the output and input pixels, so a star has the same total counts\n\
+on the grid as in the frame. An output pixel whose kernel reaches beyond the\n\
+edge of a frame, or touches a pixel flagged in the frame's MASK extension,\n\
+gets nothing from that frame.\n\
+\n\
+The frames are added into a weighted mean, written to the file given by -o\n\
+(default reproject.fits), and its weight map, the sum of the weights of the\n\
+frames that cover each pixel, is written to the same name ending _wt.fits.\n\
+Each frame is weighted by the inverse square of the robust standard\n\
+deviation of its sky (-u weights them all equally), and with -b has its\n\
+median sky level subtracted first. Pixels nothing covers are NaN.\n\
+\n\
+With -e each frame resampled onto the grid is also written, as NAME_rep.fits\n\
+with a weight map NAME_rep_wt.fits, in the current directory. Give -e without\n\
+-o to write only these. The grid's WCS is written to every output.\n\
+\n\
+For a quick north-up picture of a single frame use \"preview -n\" instead.\n\
+\n\
+OPTIONS\n\
+-o file        # weighted mean of the frames (default reproject.fits) \n\
+-e             # also write each frame resampled onto the grid \n\
+-k kernel      # lanczos (default) or bilinear \n\
+-c ra,dec      # centre of the grid (degrees) \n\
+-p arcsec      # pixel size of the grid \n\
+-s nx,ny       # size of the grid \n\
+-b             # subtract the sky level of each frame \n\
+-u             # weight the frames equally \n\
+-M             # ignore MASK extensions \n\
+-j threads     # number of threads (default: one per processor) \n\
+-v             # verbose \n\
+\n\
+EXAMPLES\n\
+reproject -b -o field.fits *_17_light.fits \n\
+reproject -e -k bilinear -p 2.85 83F010783_17_light.fits 83F010784_17_light.fits \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+typedef struct {
+    char   *filename;
+    char    serial[FLEN_VALUE];
+    long    nx, ny;
+    t_wcs   wcs;
+    double  sky;                // median level
+    double  sigma;              // robust standard deviation of the sky
+    double  weight;
+    double  area;               // output pixel area over input pixel area
+} t_input;
+
+static t_input inputs[MAX_FRAMES];
+static int ninputs = 0;
+
+static int verbose = 0;
+static int lanczos = 1;
+static int subtract_sky = 0;
+static int uniform = 0;
+static int use_masks = 1;
+
+/* The grid */
+static t_wcs grid;
+static long gnx, gny;
+static long ntiles_x, ntiles_y;
+static float *sum = NULL, *wsum = NULL;        // weighted sum of all the frames
+static float *image = NULL, *wimage = NULL;    // the frame being resampled
+
+/* The frame being resampled */
+static t_input *current;
+static float *data;
+static unsigned char *mask;
+
+static float lanczos_table[LANCZOS_A*LANCZOS_RES + 2];
+
+/* Tiles are handed out in order */
+static long next_tile;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static double monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+/* The k-th smallest of n values (which are reordered) */
+static float select_kth(float *v, long n, long k)
+{
+    long lo = 0, hi = n - 1;
+
+    while (lo < hi) {
+        float pivot = v[(lo + hi)/2];
+        long i = lo, j = hi;
+        while (i <= j) {
+            while (v[i] < pivot) i++;
+            while (v[j] > pivot) j--;
+            if (i <= j) {
+                float t = v[i]; v[i] = v[j]; v[j] = t;
+                i++; j--;
+            }
+        }
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+    return(v[k]);
+}
+
+
+static void make_lanczos_table()
+{
+    lanczos_table[0] = 1.0f;
+    for (int i = 1; i < LANCZOS_A*LANCZOS_RES + 2; i++) {
+        double x = (double) i/LANCZOS_RES;
+        lanczos_table[i] = x >= LANCZOS_A ? 0.0f
+            : (float) (LANCZOS_A*sin(M_PI*x)*sin(M_PI*x/LANCZOS_A)/(M_PI*M_PI*x*x));
+    }
+}
+
+
+/* Read the header of a frame. Returns 0, 1 on error, or -1 to skip it. */
+static int read_input(char *filename, t_input *in)
+{
+    fitsfile *fptr;
+    int status = 0;
+    int naxis, bitpix, rc;
+    long naxes[2] = { 0, 0 };
+
+    memset(in, 0, sizeof(t_input));
+    in->filename = filename;
+    if (fits_open_file(&fptr, filename, READONLY, &status)
+            || fits_get_img_param(fptr, 2, &bitpix, &naxis, naxes, &status)) {
+        fits_report_error(stderr, status);
+        return(1);
+    }
+    in->nx = naxes[0];
+    in->ny = naxes[1];
+    if (fits_read_key(fptr, TSTRING, "SERIALNO", in->serial, NULL, &status))
+        status = 0;
+    rc = ReadWCS(fptr, &in->wcs);
+    fits_close_file(fptr, &status);
+    if (naxis != 2 || in->nx < 2*LANCZOS_A || in->ny < 2*LANCZOS_A) {
+        fprintf(stderr,"%s is not an image: skipped\n",filename);
+        return(-1);
+    }
+    if (rc) {
+        fprintf(stderr,"%s has no %sWCS: skipped\n",filename,rc == 2 ? "TAN " : "");
+        return(-1);
+    }
+    return(0);
+}
+
+
+/* Read the pixels of a frame, and its mask if it has one */
+static int read_pixels(t_input *in)
+{
+    fitsfile *fptr;
+    int status = 0;
+    long npix = in->nx*in->ny;
+
+    data = (float *) malloc(npix*sizeof(float));
+    mask = NULL;
+    if (data == NULL) {
+        fprintf(stderr,"Not enough memory for %s\n",in->filename);
+        return(1);
+    }
+    fits_open_file(&fptr, in->filename, READONLY, &status);
+    fits_read_img(fptr, TFLOAT, 1, npix, NULL, data, NULL, &status);
+    if (status) {
+        fits_report_error(stderr, status);
+        fits_close_file(fptr, &status);
+        return(1);
+    }
+    if (use_masks && fits_movnam_hdu(fptr, IMAGE_HDU, "MASK", 0, &status) == 0) {
+        long naxes[2] = { 0, 0 };
+        fits_get_img_size(fptr, 2, naxes, &status);
+        if (status == 0 && naxes[0] == in->nx && naxes[1] == in->ny
+                && (mask = (unsigned char *) malloc(npix)) != NULL
+                && fits_read_img(fptr, TBYTE, 1, npix, NULL, mask, NULL, &status)) {
+            free(mask);
+            mask = NULL;
+        }
+    }
+    status = 0;
+    fits_close_file(fptr, &status);
+    if (verbose && mask)
+        fprintf(stderr,"Using the mask of %s\n",in->filename);
+    return(0);
+}
+
+
+/* Sky level and noise from a sparse sample of the frame */
+static void measure_sky(t_input *in)
+{
+    long npix = in->nx*in->ny;
+    float *sample = (float *) malloc((npix/SKY_STEP + 1)*sizeof(float));
+    long n = 0;
+
+    for (long i = 0; i < npix; i += SKY_STEP)
+        if (!mask || !mask[i])
+            sample[n++] = data[i];
+    if (n == 0) {
+        in->sky = 0;
+        in->sigma = 1;
+        free(sample);
+        return;
+    }
+    in->sky = select_kth(sample, n, n/2);
+    for (long i = 0; i < n; i++)
+        sample[i] = fabsf(sample[i] - (float) in->sky);
+    in->sigma = 1.4826*select_kth(sample, n, n/2);
+    if (in->sigma <= 0)
+        in->sigma = 1;
+    free(sample);
+}
+
+
+static double pixel_scale(t_wcs *wcs)
+{
+    return sqrt(fabs(wcs->cd[0][0]*wcs->cd[1][1] - wcs->cd[0][1]*wcs->cd[1][0]));
+}
+
+
+/* Fit the grid around the frames, or centre it on the given centre */
+static int make_grid(double ra, double dec, double scale, long nx, long ny)
+{
+    double minx = INFINITY, maxx = -INFINITY, miny = INFINITY, maxy = -INFINITY;
+
+    /* The middle of the frames: the mean of the unit vectors to their centres */
+    if (isnan(ra)) {
+        double v[3] = { 0, 0, 0 };
+        for (int i = 0; i < ninputs; i++) {
+            double r, d;
+            PixelToSky(&inputs[i].wcs, (inputs[i].nx + 1)/2.0, (inputs[i].ny + 1)/2.0, &r, &d);
+            v[0] += cos(d*D2R)*cos(r*D2R);
+            v[1] += cos(d*D2R)*sin(r*D2R);
+            v[2] += sin(d*D2R);
+        }
+        ra = fmod(atan2(v[1], v[0])/D2R + 360.0, 360.0);
+        dec = atan2(v[2], hypot(v[0], v[1]))/D2R;
+    }
+    if (isnan(scale)) {
+        scale = 0;
+        for (int i = 0; i < ninputs; i++)
+            scale += pixel_scale(&inputs[i].wcs)/ninputs;
+    }
+
+    memset(&grid, 0, sizeof(grid));
+    strcpy(grid.ctype[0], "RA---TAN");
+    strcpy(grid.ctype[1], "DEC--TAN");
+    grid.crval[0] = ra;
+    grid.crval[1] = dec;
+    grid.cd[0][0] = -scale;
+    grid.cd[1][1] = scale;
+    strcpy(grid.radesys, inputs[0].wcs.radesys);
+    grid.equinox = inputs[0].wcs.equinox;
+
+    if (nx > 0) {
+        gnx = nx;
+        gny = ny;
+        grid.crpix[0] = (nx + 1)/2.0;
+        grid.crpix[1] = (ny + 1)/2.0;
+        return(0);
+    }
+
+    /* Just big enough to hold the edges of every frame */
+    for (int i = 0; i < ninputs; i++) {
+        t_input *in = &inputs[i];
+        for (int k = 0; k < 4*EDGE_POINTS; k++) {
+            double f = (double) (k % EDGE_POINTS)/EDGE_POINTS;
+            double x, y, r, d;
+            switch (k/EDGE_POINTS) {
+                case 0: x = 0.5 + f*in->nx; y = 0.5; break;
+                case 1: x = in->nx + 0.5; y = 0.5 + f*in->ny; break;
+                case 2: x = in->nx + 0.5 - f*in->nx; y = in->ny + 0.5; break;
+                default: x = 0.5; y = in->ny + 0.5 - f*in->ny; break;
+            }
+            PixelToSky(&in->wcs, x, y, &r, &d);
+            SkyToPixel(&grid, r, d, &x, &y);
+            minx = fmin(minx, x);
+            maxx = fmax(maxx, x);
+            miny = fmin(miny, y);
+            maxy = fmax(maxy, y);
+        }
+    }
+    if (!(maxx - minx < MAX_GRID && maxy - miny < MAX_GRID)) {
+        fprintf(stderr,"The frames cover more than %dx%d pixels: check their WCS, or give -s\n",
+                MAX_GRID, MAX_GRID);
+        return(1);
+    }
+    gnx = (long) ceil(maxx - minx);
+    gny = (long) ceil(maxy - miny);
+    grid.crpix[0] = 0.5 - minx;
+    grid.crpix[1] = 0.5 - miny;
+    return(0);
+}
+
+
+/* Where the centre of output pixel (i, j), counting from 0, falls in the */
+/* current frame, also counting from 0                                    */
+static void map_pixel(double i, double j, double *x, double *y)
+{
+    double ra, dec;
+
+    PixelToSky(&grid, i + 1, j + 1, &ra, &dec);
+    SkyToPixel(&current->wcs, ra, dec, x, y);
+    *x -= 1;
+    *y -= 1;
+}
+
+
+/* The frame interpolated at (x, y). Returns 0 if it cannot be. */
+static int sample_frame(double x, double y, float *value)
+{
+    long nx = current->nx, ny = current->ny;
+
+    if (!lanczos) {
+        long x0 = (long) floor(x), y0 = (long) floor(y);
+        float fx = (float) (x - x0), fy = (float) (y - y0);
+        if (x0 < 0 || y0 < 0 || x0 + 1 >= nx || y0 + 1 >= ny)
+            return(0);
+        const float *p = data + y0*nx + x0;
+        if (mask) {
+            const unsigned char *m = mask + y0*nx + x0;
+            if (m[0] | m[1] | m[nx] | m[nx + 1])
+                return(0);
+        }
+        *value = (1 - fy)*((1 - fx)*p[0] + fx*p[1]) + fy*((1 - fx)*p[nx] + fx*p[nx + 1]);
+        return(1);
+    }
+
+    long x0 = (long) floor(x) - (LANCZOS_A - 1), y0 = (long) floor(y) - (LANCZOS_A - 1);
+    float wx[2*LANCZOS_A], wy[2*LANCZOS_A], sx = 0, sy = 0, v = 0;
+    if (x0 < 0 || y0 < 0 || x0 + 2*LANCZOS_A > nx || y0 + 2*LANCZOS_A > ny)
+        return(0);
+    for (int t = 0; t < 2*LANCZOS_A; t++) {
+        wx[t] = lanczos_table[(int) (fabs(x - (x0 + t))*LANCZOS_RES + 0.5)];
+        wy[t] = lanczos_table[(int) (fabs(y - (y0 + t))*LANCZOS_RES + 0.5)];
+        sx += wx[t];
+        sy += wy[t];
+    }
+    for (int u = 0; u < 2*LANCZOS_A; u++) {
+        const float *p = data + (y0 + u)*nx + x0;
+        float row = 0;
+        if (mask) {
+            const unsigned char *m = mask + (y0 + u)*nx + x0;
+            for (int t = 0; t < 2*LANCZOS_A; t++)
+                if (m[t])
+                    return(0);
+        }
+        for (int t = 0; t < 2*LANCZOS_A; t++)
+            row += wx[t]*p[t];
+        v += wy[u]*row;
+    }
+    *value = v/(sx*sy);
+    return(1);
+}
+
+
+static void resample_tile(long tile)
+{
+    long i0 = (tile % ntiles_x)*TILE, j0 = (tile/ntiles_x)*TILE;
+    long ni = i0 + TILE > gnx ? gnx - i0 : TILE;
+    long nj = j0 + TILE > gny ? gny - j0 : TILE;
+    enum { NODES = (TILE - 1)/STEP + 2 };
+    double nodex[NODES][NODES], nodey[NODES][NODES];
+    double minx = INFINITY, maxx = -INFINITY, miny = INFINITY, maxy = -INFINITY;
+    float offset = (float) (subtract_sky ? current->sky : 0);
+    float area = (float) current->area, weight = (float) current->weight;
+    /* Pixel i lies between nodes i/STEP and i/STEP + 1, so both must exist */
+    int nodes_i = (int) ((ni - 1)/STEP) + 2, nodes_j = (int) ((nj - 1)/STEP) + 2;
+
+    if (image)
+        for (long j = j0; j < j0 + nj; j++)
+            for (long i = i0; i < i0 + ni; i++) {
+                image[j*gnx + i] = NAN;
+                wimage[j*gnx + i] = 0;
+            }
+
+    /* The mapping, exactly, at the nodes */
+    for (int b = 0; b < nodes_j; b++)
+        for (int a = 0; a < nodes_i; a++) {
+            map_pixel(i0 + a*STEP, j0 + b*STEP, &nodex[b][a], &nodey[b][a]);
+            minx = fmin(minx, nodex[b][a]);
+            maxx = fmax(maxx, nodex[b][a]);
+            miny = fmin(miny, nodey[b][a]);
+            maxy = fmax(maxy, nodey[b][a]);
+        }
+    if (maxx < -STEP || maxy < -STEP || minx > current->nx + STEP || miny > current->ny + STEP)
+        return;
+
+    for (long j = 0; j < nj; j++) {
+        int b = (int) (j/STEP);
+        double fy = (double) (j - b*STEP)/STEP;
+        for (long i = 0; i < ni; i++) {
+            int a = (int) (i/STEP);
+            double fx = (double) (i - a*STEP)/STEP;
+            double x = (1 - fy)*((1 - fx)*nodex[b][a] + fx*nodex[b][a + 1])
+                + fy*((1 - fx)*nodex[b + 1][a] + fx*nodex[b + 1][a + 1]);
+            double y = (1 - fy)*((1 - fx)*nodey[b][a] + fx*nodey[b][a + 1])
+                + fy*((1 - fx)*nodey[b + 1][a] + fx*nodey[b + 1][a + 1]);
+            long p = (j0 + j)*gnx + i0 + i;
+            float v;
+
+            if (!sample_frame(x, y, &v))
+                continue;
+            v = (v - offset)*area;
+            if (image) {
+                image[p] = v;
+                wimage[p] = weight;
+            }
+            if (sum) {
+                sum[p] += weight*v;
+                wsum[p] += weight;
+            }
+        }
+    }
+}
+
+
+static void *worker(void *arg)
+{
+    long tile;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        tile = next_tile++;
+        pthread_mutex_unlock(&lock);
+        if (tile >= ntiles_x*ntiles_y)
+            break;
+        resample_tile(tile);
+    }
+    return(NULL);
+}
+
+
+static void write_grid_wcs(fitsfile *fptr, int *status)
+{
+    fits_update_key_str(fptr, "CTYPE1", grid.ctype[0], "TAN projection", status);
+    fits_update_key_str(fptr, "CTYPE2", grid.ctype[1], "TAN projection", status);
+    fits_update_key_dbl(fptr, "CRVAL1", grid.crval[0], -10, "RA of the reference pixel (deg)", status);
+    fits_update_key_dbl(fptr, "CRVAL2", grid.crval[1], -10, "Dec of the reference pixel (deg)", status);
+    fits_update_key_dbl(fptr, "CRPIX1", grid.crpix[0], -10, "Reference pixel", status);
+    fits_update_key_dbl(fptr, "CRPIX2", grid.crpix[1], -10, "Reference pixel", status);
+    fits_update_key_dbl(fptr, "CD1_1", grid.cd[0][0], -10, "Degrees per pixel", status);
+    fits_update_key_dbl(fptr, "CD1_2", grid.cd[0][1], -10, "Degrees per pixel", status);
+    fits_update_key_dbl(fptr, "CD2_1", grid.cd[1][0], -10, "Degrees per pixel", status);
+    fits_update_key_dbl(fptr, "CD2_2", grid.cd[1][1], -10, "Degrees per pixel", status);
+    if (grid.radesys[0])
+        fits_update_key_str(fptr, "RADESYS", grid.radesys, "Reference frame", status);
+    if (grid.equinox > 0)
+        fits_update_key_dbl(fptr, "EQUINOX", grid.equinox, -1, "Equinox of the coordinates", status);
+    fits_update_key_str(fptr, "KERNEL", lanczos ? "lanczos3" : "bilinear", "Resampling kernel", status);
+    fits_update_key_log(fptr, "SKYSUB", subtract_sky, "Sky level of each frame subtracted", status);
+}
+
+
+/* Write an image on the grid, and its weight map, with the given frames */
+static int write_images(char *filename, float *pixels, float *weights, t_input **frames, int nframes)
+{
+    fitsfile *fptr;
+    int status = 0;
+    long naxes[2] = { gnx, gny };
+    char path[MAX_STRING + 8];
+    char key[FLEN_KEYWORD];
+
+    snprintf(path, sizeof(path), "!%s", filename);
+    fits_create_file(&fptr, path, &status);
+    fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status);
+    write_grid_wcs(fptr, &status);
+    fits_update_key(fptr, TINT, "NCOMBINE", &nframes, "Number of frames resampled", &status);
+    for (int k = 0; k < nframes; k++) {
+        snprintf(key, sizeof(key), "IMCMB%03d", k + 1);
+        fits_update_key_str(fptr, key, frames[k]->filename, "Frame resampled", &status);
+        snprintf(key, sizeof(key), "WGHT%04d", k + 1);
+        fits_update_key_dbl(fptr, key, frames[k]->weight, -6, "Weight of that frame", &status);
+        snprintf(key, sizeof(key), "SKY%05d", k + 1);
+        fits_update_key_dbl(fptr, key, frames[k]->sky, -6, "Sky level of that frame", &status);
+    }
+    if (nframes == 1 && frames[0]->serial[0])
+        fits_update_key_str(fptr, "SERIALNO", frames[0]->serial, "Camera serial number", &status);
+    fits_write_img(fptr, TFLOAT, 1, gnx*gny, pixels, &status);
+    fits_write_chksum(fptr, &status);
+    fits_close_file(fptr, &status);
+
+    snprintf(path, sizeof(path), "!%s", filename);
+    if (strlen(path) > 5 && strcmp(path + strlen(path) - 5, ".fits") == 0)
+        path[strlen(path) - 5] = '\0';
+    strcat(path, "_wt.fits");
+    fits_create_file(&fptr, path, &status);
+    fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status);
+    write_grid_wcs(fptr, &status);
+    fits_update_key_str(fptr, "IMAGE", filename, "Image the weights are for", &status);
+    fits_update_key(fptr, TINT, "NCOMBINE", &nframes, "Number of frames resampled", &status);
+    fits_write_img(fptr, TFLOAT, 1, gnx*gny, weights, &status);
+    fits_write_chksum(fptr, &status);
+    fits_close_file(fptr, &status);
+
+    if (status) {
+        fits_report_error(stderr, status);
+        return(1);
+    }
+    return(0);
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int c;
+    int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int each = 0;
+    char *output = NULL;
+    double ra = NAN, dec = NAN, scale = NAN;
+    long nx = 0, ny = 0;
+    t_input *frames[MAX_FRAMES];
+    pthread_t *threads;
+    int status = 0;
+
+    while ((c = getopt(argc, argv, "o:ek:c:p:s:buMj:vh")) != -1) {
+        switch (c) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'e':
+                each = 1;
+                break;
+            case 'k':
+                if (strcmp(optarg, "bilinear") == 0)
+                    lanczos = 0;
+                else if (strcmp(optarg, "lanczos") != 0) {
+                    error_exit(usage);
+                }
+                break;
+            case 'c':
+                if (sscanf(optarg, "%lf,%lf", &ra, &dec) != 2) {
+                    error_exit(usage);
+                }
+                break;
+            case 'p':
+                scale = atof(optarg)/3600.0;
+                break;
+            case 's':
+                if (sscanf(optarg, "%ld,%ld", &nx, &ny) != 2 || nx < 1 || ny < 1) {
+                    error_exit(usage);
+                }
+                break;
+            case 'b':
+                subtract_sky = 1;
+                break;
+            case 'u':
+                uniform = 1;
+                break;
+            case 'M':
+                use_masks = 0;
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (optind == argc || !(isnan(scale) || scale > 0)) {
+        error_exit(usage);
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (argc - optind > MAX_FRAMES) {
+        fprintf(stderr,"At most %d frames can be reprojected\n",MAX_FRAMES);
+        return(1);
+    }
+    if (output == NULL && !each)
+        output = "reproject.fits";
+
+    for (int i = optind; i < argc; i++) {
+        int rc = read_input(argv[i], &inputs[ninputs]);
+        if (rc > 0)
+            return(1);
+        if (rc == 0)
+            ninputs++;
+    }
+    if (ninputs == 0) {
+        fprintf(stderr,"No frames with a WCS\n");
+        return(1);
+    }
+    if (make_grid(ra, dec, scale, nx, ny))
+        return(1);
+    if (verbose)
+        fprintf(stderr,"Grid of %ldx%ld pixels of %.3f arcsec centred on %.6f %.6f\n",
+                gnx, gny, pixel_scale(&grid)*3600, grid.crval[0], grid.crval[1]);
+
+    make_lanczos_table();
+    ntiles_x = (gnx + TILE - 1)/TILE;
+    ntiles_y = (gny + TILE - 1)/TILE;
+    if (output) {
+        sum = (float *) calloc(gnx*gny, sizeof(float));
+        wsum = (float *) calloc(gnx*gny, sizeof(float));
+    }
+    if (each) {
+        image = (float *) malloc(gnx*gny*sizeof(float));
+        wimage = (float *) malloc(gnx*gny*sizeof(float));
+    }
+    if ((output && (sum == NULL || wsum == NULL)) || (each && (image == NULL || wimage == NULL))) {
+        fprintf(stderr,"Not enough memory for a %ldx%ld grid\n",gnx,gny);
+        return(1);
+    }
+    threads = (pthread_t *) malloc(nthreads*sizeof(pthread_t));
+
+    for (int k = 0; k < ninputs; k++) {
+        double start = monotonic_time();
+
+        current = &inputs[k];
+        frames[k] = current;
+        if (read_pixels(current))
+            return(1);
+        measure_sky(current);
+        current->weight = uniform ? 1.0 : 1.0/(current->sigma*current->sigma);
+        current->area = pow(pixel_scale(&grid)/pixel_scale(&current->wcs), 2);
+
+        next_tile = 0;
+        for (int i = 0; i < nthreads; i++)
+            pthread_create(&threads[i], NULL, worker, NULL);
+        for (int i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+
+        if (each) {
+            char filename[MAX_STRING], base[MAX_STRING];
+            snprintf(base, sizeof(base), "%s", current->filename);
+            snprintf(filename, sizeof(filename), "%s", basename(base));
+            if (strlen(filename) > 5 && strcmp(filename + strlen(filename) - 5, ".fits") == 0)
+                filename[strlen(filename) - 5] = '\0';
+            strncat(filename, "_rep.fits", sizeof(filename) - strlen(filename) - 1);
+            if (write_images(filename, image, wimage, &current, 1))
+                status = 1;
+            else
+                printf("%s %s\n", current->filename, filename);
+        }
+        if (verbose)
+            fprintf(stderr,"Resampled %s (sky %.1f, sigma %.1f%s) in %.3f s with %d threads\n",
+                    current->filename, current->sky, current->sigma, mask ? ", masked" : "",
+                    monotonic_time() - start, nthreads);
+        free(data);
+        free(mask);
+    }
+
+    if (output) {
+        for (long i = 0; i < gnx*gny; i++)
+            sum[i] = wsum[i] > 0 ? sum[i]/wsum[i] : NAN;
+        if (write_images(output, sum, wsum, frames, ninputs))
+            status = 1;
+        else
+            printf("%s %d\n", output, ninputs);
+    }
+
+    free(threads);
+    free(sum);
+    free(wsum);
+    free(image);
+    free(wimage);
+    return(status);
+
+}
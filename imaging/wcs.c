@@ -0,0 +1,103 @@
+/*
+ * WCS - Read TAN world coordinate systems and convert between pixel and
+ * sky coordinates (see wcs.h).
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "wcs.h"
+
+
+/* Read the WCS from the current HDU. Returns 0, or 1 if there is no WCS, */
+/* or 2 if there is one but it is not a TAN projection we can use.        */
+int ReadWCS(fitsfile *fptr, t_wcs *wcs)
+{
+    int status = 0;
+
+    memset(wcs, 0, sizeof(t_wcs));
+    fits_read_key(fptr, TSTRING, "CTYPE1", wcs->ctype[0], NULL, &status);
+    fits_read_key(fptr, TSTRING, "CTYPE2", wcs->ctype[1], NULL, &status);
+    fits_read_key(fptr, TDOUBLE, "CRVAL1", &wcs->crval[0], NULL, &status);
+    fits_read_key(fptr, TDOUBLE, "CRVAL2", &wcs->crval[1], NULL, &status);
+    fits_read_key(fptr, TDOUBLE, "CRPIX1", &wcs->crpix[0], NULL, &status);
+    fits_read_key(fptr, TDOUBLE, "CRPIX2", &wcs->crpix[1], NULL, &status);
+    if (status)
+        return(1);
+    if (strcmp(wcs->ctype[0], "RA---TAN") || strcmp(wcs->ctype[1], "DEC--TAN"))
+        return(2);
+
+    // Older solutions give a pixel scale and rotation rather than a CD matrix
+    fits_read_key(fptr, TDOUBLE, "CD1_1", &wcs->cd[0][0], NULL, &status);
+    fits_read_key(fptr, TDOUBLE, "CD1_2", &wcs->cd[0][1], NULL, &status);
+    fits_read_key(fptr, TDOUBLE, "CD2_1", &wcs->cd[1][0], NULL, &status);
+    fits_read_key(fptr, TDOUBLE, "CD2_2", &wcs->cd[1][1], NULL, &status);
+    if (status) {
+        double cdelt1, cdelt2, crota2 = 0;
+        status = 0;
+        fits_read_key(fptr, TDOUBLE, "CDELT1", &cdelt1, NULL, &status);
+        fits_read_key(fptr, TDOUBLE, "CDELT2", &cdelt2, NULL, &status);
+        if (status)
+            return(2);
+        if (fits_read_key(fptr, TDOUBLE, "CROTA2", &crota2, NULL, &status))
+            status = 0;
+        wcs->cd[0][0] = cdelt1*cos(crota2*D2R);
+        wcs->cd[0][1] = -cdelt2*sin(crota2*D2R);
+        wcs->cd[1][0] = cdelt1*sin(crota2*D2R);
+        wcs->cd[1][1] = cdelt2*cos(crota2*D2R);
+    }
+    if (fits_read_key(fptr, TSTRING, "RADESYS", wcs->radesys, NULL, &status))
+        status = 0;
+    if (fits_read_key(fptr, TDOUBLE, "EQUINOX", &wcs->equinox, NULL, &status))
+        status = 0;
+    return(0);
+}
+
+
+/* Tangent plane coordinates (degrees) of a point on the sky */
+void Project(t_wcs *wcs, double ra, double dec, double *xi, double *eta)
+{
+    double dra = (ra - wcs->crval[0])*D2R;
+    double dec0 = wcs->crval[1]*D2R;
+    double cosc;
+
+    dec *= D2R;
+    cosc = sin(dec0)*sin(dec) + cos(dec0)*cos(dec)*cos(dra);
+    *xi = cos(dec)*sin(dra)/cosc/D2R;
+    *eta = (cos(dec0)*sin(dec) - sin(dec0)*cos(dec)*cos(dra))/cosc/D2R;
+}
+
+
+/* Celestial coordinates of a point on the tangent plane (degrees) */
+void Deproject(t_wcs *wcs, double xi, double eta, double *ra, double *dec)
+{
+    double dec0 = wcs->crval[1]*D2R;
+    double denom = cos(dec0) - eta*D2R*sin(dec0);
+
+    *ra = wcs->crval[0] + atan2(xi*D2R, denom)/D2R;
+    *dec = atan2(sin(dec0) + eta*D2R*cos(dec0), hypot(xi*D2R, denom))/D2R;
+    *ra = fmod(*ra + 360.0, 360.0);
+}
+
+
+/* Pixel coordinates are FITS ones, so the first pixel is centred on (1,1) */
+void PixelToSky(t_wcs *wcs, double x, double y, double *ra, double *dec)
+{
+    x -= wcs->crpix[0];
+    y -= wcs->crpix[1];
+    Deproject(wcs, wcs->cd[0][0]*x + wcs->cd[0][1]*y, wcs->cd[1][0]*x + wcs->cd[1][1]*y, ra, dec);
+}
+
+
+void SkyToPixel(t_wcs *wcs, double ra, double dec, double *x, double *y)
+{
+    double xi, eta;
+    double det = wcs->cd[0][0]*wcs->cd[1][1] - wcs->cd[0][1]*wcs->cd[1][0];
+
+    Project(wcs, ra, dec, &xi, &eta);
+    *x = wcs->crpix[0] + (wcs->cd[1][1]*xi - wcs->cd[0][1]*eta)/det;
+    *y = wcs->crpix[1] + (wcs->cd[0][0]*eta - wcs->cd[1][0]*xi)/det;
+}
@@ -0,0 +1,30 @@
+/*
+ * WCS - The little bit of world coordinate system handling our imaging tools
+ * need: TAN (gnomonic) projections described by a CD matrix, which is what
+ * the plate solver and wcsmatch write.
+ */
+
+#ifndef WCS_H
+#define WCS_H
+
+#include "fitsio.h"
+
+#define D2R (M_PI/180.0)
+
+typedef struct {
+    char   ctype[2][FLEN_VALUE];
+    double crval[2];                // degrees
+    double crpix[2];
+    double cd[2][2];                // degrees per pixel
+    char   radesys[FLEN_VALUE];
+    double equinox;
+} t_wcs;
+
+/* Function prototypes */
+int  ReadWCS(fitsfile *fptr, t_wcs *wcs);
+void Project(t_wcs *wcs, double ra, double dec, double *xi, double *eta);
+void Deproject(t_wcs *wcs, double xi, double eta, double *ra, double *dec);
+void PixelToSky(t_wcs *wcs, double x, double y, double *ra, double *dec);
+void SkyToPixel(t_wcs *wcs, double ra, double dec, double *x, double *y);
+
+#endif
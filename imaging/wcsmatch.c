@@ -0,0 +1,728 @@
+/*
+ * WCSMATCH - Carry a plate solution over from a reference frame by matching
+ * stars.
+ *
+ * Frames taken one after another on the same field differ only by a dither,
+ * so rather than solving each of them from scratch against a star catalog
+ * we match the stars detected in a frame to those detected in an earlier
+ * frame that was solved, fit the shift, rotation and scale between the two,
+ * and apply it to the reference WCS.
+ *
+ * Stars are matched by comparing triangles made from the brightest of them.
+ * The shape of a triangle (the ratios of its sides) does not change under a
+ * shift or rotation and, because the frames come from the same camera, nor
+ * does its size, so each pair of similar triangles votes for three star
+ * pairs. The pairs with the most votes give a first transformation, which
+ * is then refined using every star that lands on a reference star, and
+ * the WCS is finally fitted to the sky positions of those stars.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <math.h>
+#include <libgen.h>
+#include "fitsio.h"
+
+#include "wcs.h"
+
+#define MAX_STRING 1024
+#define MAX_REFINE 500       // stars used when refining the fit
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+
+#define usage "\n\
+NAME\n\
+wcsmatch --- copy a plate solution to a frame by matching its stars to a solved frame \n\
+\n\
+SYNOPSIS\n\
+wcsmatch [options] reference.fits reference.cat image.fits image.cat \n\
+\n\
+DESCRIPTION\n\
+\"wcsmatch\" gives image.fits a WCS by matching the stars detected in it\n\
+(listed in image.cat) to those detected in reference.fits (listed in\n\
+reference.cat), which has already been plate solved. The shift, rotation and\n\
+scale between the two frames are fitted and applied to the WCS of the\n\
+reference, and CTYPE, CRPIX, CRVAL and CD keywords are written to image.fits\n\
+along with WCSREF (the reference frame), WCSNMAT (the number of stars\n\
+matched) and WCSRMS (the scatter of the fit in pixels).\n\
+\n\
+This takes a fraction of a second where a full plate solve can take a minute,\n\
+but it needs a solved frame of the same field from the same camera. The\n\
+reference must have a TAN (gnomonic) WCS without distortion terms.\n\
+\n\
+A catalog is either an LDAC catalog (as written by extract -S) or a\n\
+SExtractor-style text table (as written by extract). Either way it needs\n\
+X_IMAGE, Y_IMAGE and FLUX_ISO or FLUX_AUTO columns. Objects with non-zero\n\
+FLAGS are ignored.\n\
+\n\
+The exit status is 0 if the frames were matched and the WCS written, and 1\n\
+otherwise, in which case image.fits is not touched. A script can then fall\n\
+back on plate_solve.\n\
+\n\
+OPTIONS\n\
+-n number     # brightest stars used to build triangles (default: 40) \n\
+-t tolerance  # matching tolerance in pixels (default: 2) \n\
+-s scale      # largest allowed fractional scale change (default: 0.01) \n\
+-m number     # fewest matched stars to accept (default: 6) \n\
+-d            # dry run: report the match but don't write the WCS \n\
+-v            # verbose \n\
+\n\
+EXAMPLES\n\
+extract -S solved.fits > solved.ldac \n\
+extract -S next.fits > next.ldac \n\
+wcsmatch solved.fits solved.ldac next.fits next.ldac || plate_solve --update next.fits \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+typedef struct {
+    double x, y, flux;
+} t_star;
+
+typedef struct {
+    double side;         // longest side
+    double ratio[2];     // the other two sides as fractions of the longest
+    int    vertex[3];    // stars opposite the sides, longest first
+    int    orientation;  // +1 or -1 for anticlockwise or clockwise vertices
+} t_triangle;
+
+typedef struct {
+    int    star;         // in the image
+    int    reference;    // in the reference
+    int    votes;
+} t_pair;
+
+/* Reference position from image position: x' = a x - b y + dx, y' = b x + a y + dy */
+typedef struct {
+    double a, b, dx, dy;
+} t_transform;
+
+/* Options */
+static int nbright = 40;
+static double tolerance = 2.0;
+static double maxscale = 0.01;
+static int minmatch = 6;
+static int dryrun = 0;
+static int verbose = 0;
+
+
+static int compare_flux(const void *a, const void *b)
+{
+    double fa = ((t_star *) a)->flux;
+    double fb = ((t_star *) b)->flux;
+    return (fa < fb) - (fa > fb);
+}
+
+
+static int compare_ratio(const void *a, const void *b)
+{
+    double ra = ((t_triangle *) a)->ratio[0];
+    double rb = ((t_triangle *) b)->ratio[0];
+    return (ra > rb) - (ra < rb);
+}
+
+
+static int compare_votes(const void *a, const void *b)
+{
+    return ((t_pair *) b)->votes - ((t_pair *) a)->votes;
+}
+
+
+/* Read the stars from an LDAC catalog */
+static int read_ldac(char *filename, t_star **stars)
+{
+    fitsfile *fptr;
+    int status = 0;
+    int xcol, ycol, fluxcol, flagcol = 0;
+    long nrows;
+    double *x, *y, *flux, *flags;
+    int n = 0;
+
+    if (fits_open_file(&fptr, filename, READONLY, &status)) {
+        fits_report_error(stderr, status);
+        return(-1);
+    }
+    if (fits_movnam_hdu(fptr, BINARY_TBL, "LDAC_OBJECTS", 0, &status)) {
+        status = 0;
+        fits_movabs_hdu(fptr, 2, NULL, &status);
+    }
+    fits_get_num_rows(fptr, &nrows, &status);
+    fits_get_colnum(fptr, CASEINSEN, "X_IMAGE", &xcol, &status);
+    fits_get_colnum(fptr, CASEINSEN, "Y_IMAGE", &ycol, &status);
+    if (!status && fits_get_colnum(fptr, CASEINSEN, "FLUX_ISO", &fluxcol, &status) == COL_NOT_FOUND) {
+        status = 0;
+        fits_get_colnum(fptr, CASEINSEN, "FLUX_AUTO", &fluxcol, &status);
+    }
+    if (!status && fits_get_colnum(fptr, CASEINSEN, "FLAGS", &flagcol, &status) == COL_NOT_FOUND) {
+        status = 0;
+        flagcol = 0;
+    }
+    if (status) {
+        fprintf(stderr, "%s is not a catalog of stars\n", filename);
+        fits_close_file(fptr, &status);
+        return(-1);
+    }
+
+    x = (double *) malloc((nrows + 1)*sizeof(double));
+    y = (double *) malloc((nrows + 1)*sizeof(double));
+    flux = (double *) malloc((nrows + 1)*sizeof(double));
+    flags = (double *) calloc(nrows + 1, sizeof(double));
+    *stars = (t_star *) malloc((nrows + 1)*sizeof(t_star));
+    fits_read_col(fptr, TDOUBLE, xcol, 1, 1, nrows, NULL, x, NULL, &status);
+    fits_read_col(fptr, TDOUBLE, ycol, 1, 1, nrows, NULL, y, NULL, &status);
+    fits_read_col(fptr, TDOUBLE, fluxcol, 1, 1, nrows, NULL, flux, NULL, &status);
+    if (flagcol)
+        fits_read_col(fptr, TDOUBLE, flagcol, 1, 1, nrows, NULL, flags, NULL, &status);
+    if (status) {
+        fits_report_error(stderr, status);
+        n = -1;
+    }
+    else {
+        for (long i = 0; i < nrows; i++) {
+            if (flags[i] != 0 || !(flux[i] > 0))
+                continue;
+            (*stars)[n].x = x[i];
+            (*stars)[n].y = y[i];
+            (*stars)[n++].flux = flux[i];
+        }
+    }
+    status = 0;
+    fits_close_file(fptr, &status);
+    free(x);
+    free(y);
+    free(flux);
+    free(flags);
+    return(n);
+}
+
+
+/* Read the stars from a text table */
+static int read_table(char *filename, t_star **stars)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t size = 0;
+    int xcol = 0, ycol = 0, fluxcol = 0, autocol = 0, flagcol = 0;
+    int n = 0, maxstars = 0;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        perror(filename);
+        return(-1);
+    }
+    *stars = NULL;
+    while (getline(&line, &size, fp) > 0) {
+        if (line[0] == '#') {
+            int number;
+            char name[MAX_STRING];
+            if (sscanf(line + 1, "%d %1023s", &number, name) != 2)
+                continue;
+            if (!strcmp(name, "X_IMAGE"))
+                xcol = number;
+            else if (!strcmp(name, "Y_IMAGE"))
+                ycol = number;
+            else if (!strcmp(name, "FLUX_ISO"))
+                fluxcol = number;
+            else if (!strcmp(name, "FLUX_AUTO"))
+                autocol = number;
+            else if (!strcmp(name, "FLAGS"))
+                flagcol = number;
+            continue;
+        }
+        if (!fluxcol)
+            fluxcol = autocol;
+        if (!xcol || !ycol || !fluxcol) {
+            fprintf(stderr, "%s is not a catalog of stars\n", filename);
+            fclose(fp);
+            return(-1);
+        }
+
+        double x = NAN, y = NAN, flux = NAN, flags = 0;
+        int k = 1;
+        for (char *field = strtok(line, " \t\r\n"); field; field = strtok(NULL, " \t\r\n"), k++) {
+            if (k == xcol)
+                x = atof(field);
+            else if (k == ycol)
+                y = atof(field);
+            else if (k == fluxcol)
+                flux = atof(field);
+            else if (k == flagcol)
+                flags = atof(field);
+        }
+        if (isnan(x) || isnan(y) || !(flux > 0) || flags != 0)
+            continue;
+        if (n == maxstars) {
+            maxstars = maxstars ? 2*maxstars : 1024;
+            *stars = (t_star *) realloc(*stars, maxstars*sizeof(t_star));
+        }
+        (*stars)[n].x = x;
+        (*stars)[n].y = y;
+        (*stars)[n++].flux = flux;
+    }
+    free(line);
+    fclose(fp);
+    return(n);
+}
+
+
+/* Read a catalog in either form, brightest stars first */
+static int read_catalog(char *filename, t_star **stars)
+{
+    FILE *fp;
+    char start[6] = "";
+    int n;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        perror(filename);
+        return(-1);
+    }
+    fread(start, 1, sizeof(start), fp);
+    fclose(fp);
+    if (strncmp(start, "SIMPLE", 6) == 0)
+        n = read_ldac(filename, stars);
+    else
+        n = read_table(filename, stars);
+    if (n > 0)
+        qsort(*stars, n, sizeof(t_star), compare_flux);
+    if (verbose && n >= 0)
+        printf("Read %d stars from %s\n", n, filename);
+    return(n);
+}
+
+
+/* Triangles from every three of the brightest stars whose vertices can be */
+/* told apart: no two sides may be the same length to within the tolerance */
+static int make_triangles(t_star *stars, int nstars, t_triangle **triangles)
+{
+    int n = 0;
+
+    if (nstars > nbright)
+        nstars = nbright;
+    *triangles = (t_triangle *) malloc(((size_t) nstars*nstars*nstars/6 + 1)*sizeof(t_triangle));
+    for (int i = 0; i < nstars; i++)
+        for (int j = i + 1; j < nstars; j++)
+            for (int k = j + 1; k < nstars; k++) {
+                int v[3] = { i, j, k };
+                double d[3];
+                int o[3] = { 0, 1, 2 };
+                t_triangle *t = &(*triangles)[n];
+
+                // Side m is opposite vertex m
+                d[0] = hypot(stars[j].x - stars[k].x, stars[j].y - stars[k].y);
+                d[1] = hypot(stars[i].x - stars[k].x, stars[i].y - stars[k].y);
+                d[2] = hypot(stars[i].x - stars[j].x, stars[i].y - stars[j].y);
+                for (int p = 0; p < 2; p++)
+                    for (int q = 0; q < 2 - p; q++)
+                        if (d[o[q]] < d[o[q + 1]]) {
+                            int swap = o[q];
+                            o[q] = o[q + 1];
+                            o[q + 1] = swap;
+                        }
+                if (d[o[0]] < 10*tolerance || d[o[0]] - d[o[1]] < 2*tolerance
+                        || d[o[1]] - d[o[2]] < 2*tolerance)
+                    continue;
+
+                t->side = d[o[0]];
+                t->ratio[0] = d[o[1]]/d[o[0]];
+                t->ratio[1] = d[o[2]]/d[o[0]];
+                for (int m = 0; m < 3; m++)
+                    t->vertex[m] = v[o[m]];
+                t->orientation = ((stars[t->vertex[1]].x - stars[t->vertex[0]].x)
+                                    *(stars[t->vertex[2]].y - stars[t->vertex[0]].y)
+                                - (stars[t->vertex[1]].y - stars[t->vertex[0]].y)
+                                    *(stars[t->vertex[2]].x - stars[t->vertex[0]].x)) > 0 ? 1 : -1;
+                n++;
+            }
+    return(n);
+}
+
+
+/* Vote for star pairs with similar triangles, and keep the pairs that */
+/* got the most votes for both their stars                             */
+static int match_triangles(t_triangle *tri, int ntri, t_triangle *ref, int nref,
+                           int nstars, int nrefstars, t_pair *pairs)
+{
+    int *votes = (int *) calloc((size_t) nstars*nrefstars, sizeof(int));
+    int npairs = 0;
+
+    qsort(ref, nref, sizeof(t_triangle), compare_ratio);
+    for (int i = 0; i < ntri; i++) {
+        t_triangle *t = &tri[i];
+        double eps = 3*tolerance/t->side;
+        int lo = 0, hi = nref;
+
+        // First reference triangle that might be similar
+        while (lo < hi) {
+            int mid = (lo + hi)/2;
+            if (ref[mid].ratio[0] < t->ratio[0] - eps)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (int j = lo; j < nref && ref[j].ratio[0] <= t->ratio[0] + eps; j++) {
+            t_triangle *r = &ref[j];
+            if (r->orientation != t->orientation || fabs(r->ratio[1] - t->ratio[1]) > eps
+                    || fabs(r->side - t->side) > maxscale*t->side + 2*tolerance)
+                continue;
+            for (int m = 0; m < 3; m++)
+                votes[t->vertex[m]*nrefstars + r->vertex[m]]++;
+        }
+    }
+
+    for (int i = 0; i < nstars; i++) {
+        int best = 0;
+        for (int j = 1; j < nrefstars; j++)
+            if (votes[i*nrefstars + j] > votes[i*nrefstars + best])
+                best = j;
+        if (votes[i*nrefstars + best] < 2)
+            continue;
+        int mutual = 1;
+        for (int k = 0; k < nstars; k++)
+            if (k != i && votes[k*nrefstars + best] >= votes[i*nrefstars + best])
+                mutual = 0;
+        if (!mutual)
+            continue;
+        pairs[npairs].star = i;
+        pairs[npairs].reference = best;
+        pairs[npairs++].votes = votes[i*nrefstars + best];
+    }
+    free(votes);
+    qsort(pairs, npairs, sizeof(t_pair), compare_votes);
+    return(npairs);
+}
+
+
+/* Least-squares shift, rotation and scale taking stars onto reference stars */
+static void fit_transform(t_star *stars, t_star *ref, t_pair *pairs, int npairs, t_transform *tf)
+{
+    double mx = 0, my = 0, rx = 0, ry = 0;
+    double sxx = 0, sab = 0, sba = 0;
+
+    for (int i = 0; i < npairs; i++) {
+        mx += stars[pairs[i].star].x;
+        my += stars[pairs[i].star].y;
+        rx += ref[pairs[i].reference].x;
+        ry += ref[pairs[i].reference].y;
+    }
+    mx /= npairs;
+    my /= npairs;
+    rx /= npairs;
+    ry /= npairs;
+    for (int i = 0; i < npairs; i++) {
+        double x = stars[pairs[i].star].x - mx;
+        double y = stars[pairs[i].star].y - my;
+        double u = ref[pairs[i].reference].x - rx;
+        double v = ref[pairs[i].reference].y - ry;
+        sxx += x*x + y*y;
+        sab += x*u + y*v;
+        sba += x*v - y*u;
+    }
+    tf->a = sab/sxx;
+    tf->b = sba/sxx;
+    tf->dx = rx - (tf->a*mx - tf->b*my);
+    tf->dy = ry - (tf->b*mx + tf->a*my);
+}
+
+
+static double residual(t_star *s, t_star *r, t_transform *tf)
+{
+    return hypot(tf->a*s->x - tf->b*s->y + tf->dx - r->x,
+                 tf->b*s->x + tf->a*s->y + tf->dy - r->y);
+}
+
+
+/* Fit, dropping the worst pair until every pair fits to within the tolerance */
+static int fit_pairs(t_star *stars, t_star *ref, t_pair *pairs, int npairs, t_transform *tf)
+{
+    while (npairs >= 3) {
+        int worst = 0;
+        fit_transform(stars, ref, pairs, npairs, tf);
+        for (int i = 1; i < npairs; i++)
+            if (residual(&stars[pairs[i].star], &ref[pairs[i].reference], tf)
+                    > residual(&stars[pairs[worst].star], &ref[pairs[worst].reference], tf))
+                worst = i;
+        if (residual(&stars[pairs[worst].star], &ref[pairs[worst].reference], tf) <= tolerance)
+            break;
+        pairs[worst] = pairs[--npairs];
+    }
+    return(npairs);
+}
+
+
+/* Pair every star that lands within the tolerance of a reference star. */
+/* Only mutual nearest neighbours are paired, so two stars blended in   */
+/* one catalogue never both claim the same star in the other.           */
+static int pair_all(t_star *stars, int nstars, t_star *ref, int nref, t_transform *tf, t_pair *pairs)
+{
+    int npairs = 0;
+
+    for (int i = 0; i < nstars; i++) {
+        int best = -1;
+        double bestdist = tolerance;
+        for (int j = 0; j < nref; j++) {
+            double d = residual(&stars[i], &ref[j], tf);
+            if (d < bestdist) {
+                bestdist = d;
+                best = j;
+            }
+        }
+        if (best < 0)
+            continue;
+        for (int k = 0; k < nstars && best >= 0; k++)
+            if (k != i && residual(&stars[k], &ref[best], tf) <= bestdist)
+                best = -1;
+        if (best < 0)
+            continue;
+        pairs[npairs].star = i;
+        pairs[npairs].reference = best;
+        pairs[npairs++].votes = 0;
+    }
+    return(npairs);
+}
+
+
+static int read_wcs(char *filename, t_wcs *wcs)
+{
+    fitsfile *fptr;
+    int status = 0;
+    int result;
+
+    if (fits_open_file(&fptr, filename, READONLY, &status)) {
+        fits_report_error(stderr, status);
+        return(1);
+    }
+    if ((result = ReadWCS(fptr, wcs)) == 1)
+        fprintf(stderr, "%s has no WCS\n", filename);
+    else if (result)
+        fprintf(stderr, "%s has a %s/%s WCS, not a plain TAN one\n", filename, wcs->ctype[0], wcs->ctype[1]);
+    fits_close_file(fptr, &status);
+    return(result);
+}
+
+
+/* The image sees the sky as the reference does, through the transform. */
+/* Keep the reference pixel, find where it now points, and turn the CD */
+/* matrix to match.                                                     */
+static void transform_wcs(t_wcs *ref, t_transform *tf, t_wcs *wcs)
+{
+    *wcs = *ref;
+    PixelToSky(ref, tf->a*ref->crpix[0] - tf->b*ref->crpix[1] + tf->dx,
+               tf->b*ref->crpix[0] + tf->a*ref->crpix[1] + tf->dy, &wcs->crval[0], &wcs->crval[1]);
+    for (int i = 0; i < 2; i++) {
+        wcs->cd[i][0] = ref->cd[i][0]*tf->a + ref->cd[i][1]*tf->b;
+        wcs->cd[i][1] = -ref->cd[i][0]*tf->b + ref->cd[i][1]*tf->a;
+    }
+}
+
+
+/* Moving the tangent point is not quite a shift and rotation of the      */
+/* image, which matters at the corners of a wide field. So finish off by */
+/* fitting the CD matrix and tangent point to the positions the matched  */
+/* reference stars have on the sky.                                      */
+static void fit_wcs(t_wcs *refwcs, t_star *stars, t_star *ref, t_pair *pairs, int npairs, t_wcs *wcs)
+{
+    double *ra = (double *) malloc(npairs*sizeof(double));
+    double *dec = (double *) malloc(npairs*sizeof(double));
+
+    for (int i = 0; i < npairs; i++)
+        PixelToSky(refwcs, ref[pairs[i].reference].x, ref[pairs[i].reference].y, &ra[i], &dec[i]);
+
+    for (int iteration = 0; iteration < 3; iteration++) {
+        double n[3][3] = { { 0 } }, r[2][3] = { { 0 } }, p[2][3], det;
+        for (int i = 0; i < npairs; i++) {
+            double u[3], xi, eta;
+            u[0] = stars[pairs[i].star].x - wcs->crpix[0];
+            u[1] = stars[pairs[i].star].y - wcs->crpix[1];
+            u[2] = 1;
+            Project(wcs, ra[i], dec[i], &xi, &eta);
+            for (int j = 0; j < 3; j++) {
+                for (int k = 0; k < 3; k++)
+                    n[j][k] += u[j]*u[k];
+                r[0][j] += u[j]*xi;
+                r[1][j] += u[j]*eta;
+            }
+        }
+        // Solve the normal equations by Cramer's rule
+        det = n[0][0]*(n[1][1]*n[2][2] - n[1][2]*n[2][1])
+            - n[0][1]*(n[1][0]*n[2][2] - n[1][2]*n[2][0])
+            + n[0][2]*(n[1][0]*n[2][1] - n[1][1]*n[2][0]);
+        for (int m = 0; m < 2; m++)
+            for (int j = 0; j < 3; j++) {
+                double a[3][3];
+                memcpy(a, n, sizeof(a));
+                for (int k = 0; k < 3; k++)
+                    a[k][j] = r[m][k];
+                p[m][j] = (a[0][0]*(a[1][1]*a[2][2] - a[1][2]*a[2][1])
+                         - a[0][1]*(a[1][0]*a[2][2] - a[1][2]*a[2][0])
+                         + a[0][2]*(a[1][0]*a[2][1] - a[1][1]*a[2][0]))/det;
+            }
+        for (int m = 0; m < 2; m++) {
+            wcs->cd[m][0] = p[m][0];
+            wcs->cd[m][1] = p[m][1];
+        }
+        Deproject(wcs, p[0][2], p[1][2], &wcs->crval[0], &wcs->crval[1]);
+    }
+    free(ra);
+    free(dec);
+}
+
+
+static int write_wcs(char *filename, t_wcs *wcs, char *reference, int nmatch, double rms)
+{
+    fitsfile *fptr;
+    int status = 0;
+    char history[MAX_STRING];
+    char checksum[FLEN_VALUE];
+    char *obsolete[] = { "CDELT1", "CDELT2", "CROTA1", "CROTA2" };
+
+    if (fits_open_file(&fptr, filename, READWRITE, &status)) {
+        fits_report_error(stderr, status);
+        return(1);
+    }
+    fits_update_key_str(fptr, "CTYPE1", wcs->ctype[0], "TAN (gnomonic) projection", &status);
+    fits_update_key_str(fptr, "CTYPE2", wcs->ctype[1], "TAN (gnomonic) projection", &status);
+    fits_update_key_dbl(fptr, "CRVAL1", wcs->crval[0], -12, "RA of reference pixel [deg]", &status);
+    fits_update_key_dbl(fptr, "CRVAL2", wcs->crval[1], -12, "Dec of reference pixel [deg]", &status);
+    fits_update_key_dbl(fptr, "CRPIX1", wcs->crpix[0], -12, "X of reference pixel", &status);
+    fits_update_key_dbl(fptr, "CRPIX2", wcs->crpix[1], -12, "Y of reference pixel", &status);
+    fits_update_key_dbl(fptr, "CD1_1", wcs->cd[0][0], -12, "Transformation matrix [deg/pixel]", &status);
+    fits_update_key_dbl(fptr, "CD1_2", wcs->cd[0][1], -12, "Transformation matrix [deg/pixel]", &status);
+    fits_update_key_dbl(fptr, "CD2_1", wcs->cd[1][0], -12, "Transformation matrix [deg/pixel]", &status);
+    fits_update_key_dbl(fptr, "CD2_2", wcs->cd[1][1], -12, "Transformation matrix [deg/pixel]", &status);
+    if (wcs->radesys[0])
+        fits_update_key_str(fptr, "RADESYS", wcs->radesys, "Reference frame", &status);
+    if (wcs->equinox)
+        fits_update_key_dbl(fptr, "EQUINOX", wcs->equinox, -8, "Equinox of coordinates", &status);
+    for (int i = 0; i < 4; i++)
+        if (fits_delete_key(fptr, obsolete[i], &status) == KEY_NO_EXIST)
+            status = 0;
+    fits_update_key_str(fptr, "WCSREF", basename(reference), "Frame the WCS was matched to", &status);
+    fits_update_key_lng(fptr, "WCSNMAT", nmatch, "Stars matched to the reference", &status);
+    fits_update_key_dbl(fptr, "WCSRMS", rms, -4, "RMS of the match [pixel]", &status);
+    snprintf(history, sizeof(history), "WCS matched to %.40s by wcsmatch", basename(reference));
+    fits_write_history(fptr, history, &status);
+    // The pixels are untouched, so the data sum made at readout still holds
+    if (fits_read_key(fptr, TSTRING, "CHECKSUM", checksum, NULL, &status) == KEY_NO_EXIST)
+        status = 0;
+    else
+        fits_update_chksum(fptr, &status);
+    fits_close_file(fptr, &status);
+    if (status) {
+        fits_report_error(stderr, status);
+        return(1);
+    }
+    return(0);
+}
+
+
+int main(int argc, char *argv[]) {
+
+    char *reffits, *refcat, *imfits, *imcat;
+    t_star *stars, *ref;
+    t_triangle *triangles, *reftriangles;
+    t_pair *pairs;
+    t_transform tf;
+    t_wcs refwcs, wcs;
+    int nstars, nref, ntri, nreftri, npairs, nbrightest;
+    double scale, rotation, rms = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:t:s:m:dvh")) != -1) {
+        switch (c) {
+            case 'n':
+                nbright = atoi(optarg);
+                break;
+            case 't':
+                tolerance = atof(optarg);
+                break;
+            case 's':
+                maxscale = atof(optarg);
+                break;
+            case 'm':
+                minmatch = atoi(optarg);
+                break;
+            case 'd':
+                dryrun = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (argc - optind != 4 || nbright < 3 || tolerance <= 0 || minmatch < 3) {
+        error_exit(usage);
+    }
+    reffits = argv[optind];
+    refcat = argv[optind + 1];
+    imfits = argv[optind + 2];
+    imcat = argv[optind + 3];
+
+    if (read_wcs(reffits, &refwcs))
+        return(1);
+    if ((nref = read_catalog(refcat, &ref)) < 0 || (nstars = read_catalog(imcat, &stars)) < 0)
+        return(1);
+    if (nref < minmatch || nstars < minmatch) {
+        fprintf(stderr, "Too few stars to match (%d in the reference, %d in the image)\n", nref, nstars);
+        return(1);
+    }
+
+    // Match the brightest stars by their triangles
+    nbrightest = nstars < nbright ? nstars : nbright;
+    ntri = make_triangles(stars, nstars, &triangles);
+    nreftri = make_triangles(ref, nref, &reftriangles);
+    pairs = (t_pair *) malloc(((nstars < MAX_REFINE ? nstars : MAX_REFINE) + nbright)*sizeof(t_pair));
+    npairs = match_triangles(triangles, ntri, reftriangles, nreftri, nbrightest,
+                             nref < nbright ? nref : nbright, pairs);
+    if (verbose)
+        printf("%d and %d triangles give %d candidate pairs\n", ntri, nreftri, npairs);
+    npairs = fit_pairs(stars, ref, pairs, npairs, &tf);
+    if (npairs < 3) {
+        fprintf(stderr, "No match between %s and %s\n", imcat, refcat);
+        return(1);
+    }
+    if (verbose)
+        printf("%d pairs agree on a first transformation\n", npairs);
+
+    // Refine using everything that lands on a reference star
+    for (int iteration = 0; iteration < 2; iteration++) {
+        npairs = pair_all(stars, nstars < MAX_REFINE ? nstars : MAX_REFINE, ref, nref, &tf, pairs);
+        if (npairs < 3)
+            break;
+        npairs = fit_pairs(stars, ref, pairs, npairs, &tf);
+    }
+    if (npairs < minmatch) {
+        fprintf(stderr, "Only %d stars in %s match %s\n", npairs, imcat, refcat);
+        return(1);
+    }
+    for (int i = 0; i < npairs; i++) {
+        double r = residual(&stars[pairs[i].star], &ref[pairs[i].reference], &tf);
+        rms += r*r;
+    }
+    rms = sqrt(rms/npairs);
+    scale = hypot(tf.a, tf.b);
+    rotation = atan2(tf.b, tf.a)/D2R;
+    if (fabs(scale - 1) > maxscale) {
+        fprintf(stderr, "Scale of %.4f between %s and %s is too far from 1\n", scale, imcat, refcat);
+        return(1);
+    }
+
+    transform_wcs(&refwcs, &tf, &wcs);
+    fit_wcs(&refwcs, stars, ref, pairs, npairs, &wcs);
+    printf("Matched %d stars: shift %.2f %.2f pixels, rotation %.4f deg, scale %.5f, rms %.3f pixels\n",
+           npairs, tf.dx, tf.dy, rotation, scale, rms);
+    if (verbose)
+        printf("CRVAL %.6f %.6f  CD %.6e %.6e %.6e %.6e\n", wcs.crval[0], wcs.crval[1],
+               wcs.cd[0][0], wcs.cd[0][1], wcs.cd[1][0], wcs.cd[1][1]);
+    if (dryrun)
+        return(0);
+    return(write_wcs(imfits, &wcs, reffits, npairs, rms));
+
+}
@@ -0,0 +1,224 @@
+/*
+ * CAMERA_SERVER_SIM - A stand-in for the camera server on one host.
+ *
+ * Listens on a TCP port and answers the commands the observing scripts
+ * send on port 7078 (expose, status, list, pwd, abort, regulate, mkdir)
+ * with replies shaped like the real server's, without any cameras. Start
+ * several on different ports to test fanout and the scripts on one
+ * computer:
+ *
+ * camera_server_sim -p 7078 &
+ * camera_server_sim -p 7079 -d 500 &
+ * fanout status localhost:7078 localhost:7079
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define MAX_STRING 256
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+
+#define usage "\n\
+NAME\n\
+camera_server_sim --- simulate the camera server on one host \n\
+\n\
+SYNOPSIS\n\
+camera_server_sim [options] \n\
+\n\
+DESCRIPTION\n\
+\"camera_server_sim\" accepts one command per connection, replies, and closes\n\
+the connection, the way the camera server does. An \"expose\" command puts the\n\
+simulated cameras into an exposure lasting the requested time plus a fixed\n\
+readout time, during which \"status\" reports the exposure in progress. Every\n\
+other command gets a short canned reply.\n\
+\n\
+OPTIONS\n\
+-p port      # port to listen on (default 7078) \n\
+-d msec      # delay before every reply (default 0) \n\
+-s           # silent: accept connections but never reply (a hung host) \n\
+-r sec       # readout time added to each exposure (default 2) \n\
+-v           # verbose mode: print each command on stderr \n\
+\n\
+EXAMPLES\n\
+camera_server_sim -p 7079 -d 250 & \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+static int verbose = 0;
+static int port = 7078;
+static int delay_msec = 0;
+static int silent = 0;
+static double readout_time = 2.0;
+
+/* State of the simulated cameras */
+static time_t exposure_end = 0;
+static int nframes = 0;
+static char directory[MAX_STRING] = "/Users/dragonfly/Data";
+
+
+static void answer(char *command, char *reply, size_t size)
+{
+    char imtype[MAX_STRING] = "light";
+    double exptime = 0;
+    char *p;
+    time_t now = time(NULL);
+
+    if (strncmp(command, "status", 6) == 0) {
+        if (now < exposure_end)
+            snprintf(reply, size, "Exposure in progress (%ld s remaining)\n",
+                    (long) (exposure_end - now));
+        else
+            snprintf(reply, size, "Idle\n");
+    }
+    else if (strncmp(command, "expose", 6) == 0) {
+        // The image type and exposure time are the last two words
+        if ((p = strrchr(command, ' ')) != NULL) {
+            exptime = atof(p + 1);
+            while (p > command && *(p - 1) == ' ')
+                p--;
+            *p = '\0';
+            if ((p = strrchr(command, ' ')) != NULL)
+                snprintf(imtype, sizeof(imtype), "%s", p + 1);
+        }
+        exposure_end = now + (time_t) (exptime + readout_time + 0.5);
+        nframes++;
+        snprintf(reply, size, "Exposure started: %s %.3f s\n", imtype, exptime);
+    }
+    else if (strncmp(command, "list", 4) == 0) {
+        if (nframes == 0)
+            snprintf(reply, size, "No files\n");
+        else
+            snprintf(reply, size, "%s/SIM00001_%d_light.fits\n%s/SIM00002_%d_light.fits\n",
+                    directory, nframes, directory, nframes);
+    }
+    else if (strncmp(command, "pwd", 3) == 0) {
+        snprintf(reply, size, "127.0.0.1 directory = %s\n", directory);
+    }
+    else if (strncmp(command, "mkdir", 5) == 0) {
+        if ((p = strchr(command, ' ')) != NULL)
+            snprintf(directory, sizeof(directory), "%s", p + 1);
+        snprintf(reply, size, "Directory set to %s\n", directory);
+    }
+    else if (strncmp(command, "abort", 5) == 0) {
+        exposure_end = 0;
+        snprintf(reply, size, "Aborted\n");
+    }
+    else if (strncmp(command, "regulate", 8) == 0) {
+        snprintf(reply, size, "Regulating\n");
+    }
+    else {
+        snprintf(reply, size, "Error: unknown command\n");
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int c;
+    int listenfd;
+    int on = 1;
+    struct sockaddr_in addr;
+
+    while ((c = getopt(argc, argv, "p:d:sr:vh")) != -1) {
+        switch (c) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'd':
+                delay_msec = atoi(optarg);
+                break;
+            case 's':
+                silent = 1;
+                break;
+            case 'r':
+                readout_time = atof(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (optind != argc) {
+        error_exit(usage);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || listen(listenfd, 16) != 0) {
+        perror("Unable to listen");
+        return(1);
+    }
+    if (verbose)
+        fprintf(stderr, "Listening on port %d\n", port);
+
+    for (;;) {
+        char command[MAX_STRING];
+        char reply[2*MAX_STRING + 64];
+        size_t n = 0;
+        ssize_t rc;
+        int fd;
+
+        if ((fd = accept(listenfd, NULL, NULL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            return(1);
+        }
+
+        // One command per connection, ended by a newline or by the client
+        while (n < sizeof(command) - 1) {
+            rc = read(fd, command + n, sizeof(command) - 1 - n);
+            if (rc <= 0)
+                break;
+            n += rc;
+            if (memchr(command, '\n', n))
+                break;
+        }
+        command[n] = '\0';
+        command[strcspn(command, "\r\n")] = '\0';
+        if (verbose)
+            fprintf(stderr, "Port %d received: %s\n", port, command);
+
+        if (silent) {
+            // Hold the connection open like a host that has hung
+            pause();
+        }
+
+        if (delay_msec > 0) {
+            struct timespec ts;
+            ts.tv_sec = delay_msec/1000;
+            ts.tv_nsec = (delay_msec % 1000)*1000000L;
+            nanosleep(&ts, NULL);
+        }
+
+        answer(command, reply, sizeof(reply));
+        write(fd, reply, strlen(reply));
+        close(fd);
+    }
+
+    return(0);
+
+}
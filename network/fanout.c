@@ -0,0 +1,343 @@
+/*
+ * FANOUT - Send one command to many camera servers at once.
+ *
+ * The per-host loops in df_send.pl and all_expose.pl wait for each host in
+ * turn, so starting an exposure or polling status across the array takes
+ * as long as all of the hosts put together. Here every connection is made
+ * non-blocking and driven from a single poll() loop, so the whole array
+ * takes as long as its slowest host, and a host that has gone away costs
+ * at most its deadline.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define MAX_STRING 256
+#define MAX_HOSTS  64
+#define MAX_REPLY  65536
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+
+#define usage "\n\
+NAME\n\
+fanout --- send a command to several camera servers in parallel \n\
+\n\
+SYNOPSIS\n\
+fanout [options] command host [host ...] \n\
+\n\
+DESCRIPTION\n\
+\"fanout\" connects to the camera server on every host at the same time, sends\n\
+each of them the command, and collects the replies. When every host has\n\
+answered (or its deadline has passed) the replies are printed in the order\n\
+the hosts were given, with each line tagged by the host it came from:\n\
+\n\
+    [192.168.1.10] Idle\n\
+\n\
+A host may be given as host:port to override the default port, which makes it\n\
+possible to run several camera_server_sim stand-ins on one computer.\n\
+\n\
+A host that cannot be reached, or that has not finished replying by the\n\
+deadline, is reported on a tagged line starting with \"Error:\". The exit\n\
+status is the number of hosts that failed.\n\
+\n\
+OPTIONS\n\
+-p port      # default port (default 7078) \n\
+-t timeout   # per-host deadline in seconds, connection included (default 10) \n\
+-u           # untagged: print replies exactly as received \n\
+-v           # verbose mode: report per-host round-trip times on stderr \n\
+\n\
+EXAMPLES\n\
+fanout status 192.168.1.10 192.168.1.11 192.168.1.12 \n\
+fanout -t 2 \"expose -n M101 light 600\" 192.168.1.10 192.168.1.11 \n\
+fanout list localhost:7078 localhost:7079 localhost:7080 \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+/* Progress of the conversation with one host */
+#define HOST_CONNECTING 0
+#define HOST_SENDING    1
+#define HOST_RECEIVING  2
+#define HOST_DONE       3
+#define HOST_FAILED     4
+
+typedef struct {
+    char   name[MAX_STRING];    // As given on the command line, used as the tag
+    char   host[MAX_STRING];
+    char   port[MAX_STRING];
+    int    fd;
+    int    state;
+    size_t nsent;
+    char   *reply;
+    size_t nreply;
+    double start;
+    double end;
+    char   error[MAX_STRING];
+} t_host;
+
+static t_host hosts[MAX_HOSTS];
+static int nhosts = 0;
+static char message[MAX_STRING + 2];
+static size_t message_length;
+static int verbose = 0;
+
+
+static double monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+static void fail(t_host *h, char *reason)
+{
+    snprintf(h->error, sizeof(h->error), "%s", reason);
+    if (h->fd >= 0)
+        close(h->fd);
+    h->fd = -1;
+    h->state = HOST_FAILED;
+    h->end = monotonic_time();
+}
+
+
+/* Start a non-blocking connection to one host */
+static void start_connection(t_host *h)
+{
+    struct addrinfo hints, *res;
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo(h->host, h->port, &hints, &res)) != 0) {
+        fail(h, (char *) gai_strerror(rc));
+        return;
+    }
+
+    h->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (h->fd < 0) {
+        freeaddrinfo(res);
+        fail(h, strerror(errno));
+        return;
+    }
+    fcntl(h->fd, F_SETFL, fcntl(h->fd, F_GETFL) | O_NONBLOCK);
+
+    if (connect(h->fd, res->ai_addr, res->ai_addrlen) == 0)
+        h->state = HOST_SENDING;
+    else if (errno == EINPROGRESS)
+        h->state = HOST_CONNECTING;
+    else
+        fail(h, strerror(errno));
+    freeaddrinfo(res);
+}
+
+
+/* Advance one host's conversation after poll() says its socket is ready */
+static void service(t_host *h, short revents)
+{
+    ssize_t n;
+
+    if (h->state == HOST_CONNECTING) {
+        int soerr = 0;
+        socklen_t len = sizeof(soerr);
+        getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &soerr, &len);
+        if (soerr != 0) {
+            fail(h, strerror(soerr));
+            return;
+        }
+        h->state = HOST_SENDING;
+    }
+
+    if (h->state == HOST_SENDING) {
+        n = write(h->fd, message + h->nsent, message_length - h->nsent);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                fail(h, strerror(errno));
+            return;
+        }
+        h->nsent += n;
+        if (h->nsent == message_length) {
+            // The server replies and closes once it has the whole command
+            shutdown(h->fd, SHUT_WR);
+            h->state = HOST_RECEIVING;
+        }
+        return;
+    }
+
+    if (h->state == HOST_RECEIVING && (revents & (POLLIN | POLLHUP | POLLERR))) {
+        if (h->nreply == MAX_REPLY) {
+            fail(h, "reply too long");
+            return;
+        }
+        n = read(h->fd, h->reply + h->nreply, MAX_REPLY - h->nreply);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                fail(h, strerror(errno));
+            return;
+        }
+        if (n == 0) {
+            close(h->fd);
+            h->fd = -1;
+            h->state = HOST_DONE;
+            h->end = monotonic_time();
+            return;
+        }
+        h->nreply += n;
+    }
+}
+
+
+/* Print one host's reply, tagging every line */
+static void print_reply(t_host *h, int tagged)
+{
+    char *line = h->reply;
+    char *end = h->reply + h->nreply;
+
+    if (h->state != HOST_DONE) {
+        printf("[%s] Error: %s\n", h->name, h->error);
+        return;
+    }
+    if (!tagged) {
+        fwrite(h->reply, 1, h->nreply, stdout);
+        return;
+    }
+    while (line < end) {
+        char *eol = memchr(line, '\n', end - line);
+        size_t len = eol ? (size_t) (eol - line) : (size_t) (end - line);
+        printf("[%s] %.*s\n", h->name, (int) len, line);
+        line += len + 1;
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+
+    char *default_port = "7078";
+    double timeout = 10.0;
+    int tagged = 1;
+    int nfailed = 0;
+    int c;
+    struct pollfd pfd[MAX_HOSTS];
+    int pfdhost[MAX_HOSTS];
+
+    while ((c = getopt(argc, argv, "p:t:uvh")) != -1) {
+        switch (c) {
+            case 'p':
+                default_port = optarg;
+                break;
+            case 't':
+                timeout = atof(optarg);
+                break;
+            case 'u':
+                tagged = 0;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (argc - optind < 2 || timeout <= 0) {
+        error_exit(usage);
+    }
+    if (strlen(argv[optind]) > MAX_STRING) {
+        fprintf(stderr, "Command is too long.\n");
+        return(1);
+    }
+    message_length = snprintf(message, sizeof(message), "%s\n", argv[optind++]);
+
+    for (; optind < argc && nhosts < MAX_HOSTS; optind++) {
+        t_host *h = &hosts[nhosts++];
+        char *colon;
+        memset(h, 0, sizeof(t_host));
+        snprintf(h->name, sizeof(h->name), "%s", argv[optind]);
+        snprintf(h->host, sizeof(h->host), "%s", argv[optind]);
+        snprintf(h->port, sizeof(h->port), "%s", default_port);
+        if ((colon = strrchr(h->host, ':')) != NULL && strchr(h->host, ':') == colon) {
+            *colon = '\0';
+            snprintf(h->port, sizeof(h->port), "%s", colon + 1);
+        }
+        h->fd = -1;
+        if ((h->reply = (char *) malloc(MAX_REPLY)) == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            return(1);
+        }
+    }
+    if (optind < argc)
+        fprintf(stderr, "Only the first %d hosts will be contacted.\n", MAX_HOSTS);
+
+    /* A server that resets its connection fails that host, not the */
+    /* whole fan-out with the replies of every other host           */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Scatter */
+    for (int i = 0; i < nhosts; i++) {
+        hosts[i].start = monotonic_time();
+        start_connection(&hosts[i]);
+    }
+
+    /* Gather */
+    for (;;) {
+        int npfd = 0;
+        double now = monotonic_time();
+        double deadline = -1;
+
+        for (int i = 0; i < nhosts; i++) {
+            t_host *h = &hosts[i];
+            if (h->state == HOST_DONE || h->state == HOST_FAILED)
+                continue;
+            if (now - h->start >= timeout) {
+                fail(h, "no reply before the deadline");
+                continue;
+            }
+            if (deadline < 0 || h->start + timeout < deadline)
+                deadline = h->start + timeout;
+            pfd[npfd].fd = h->fd;
+            pfd[npfd].events = (h->state == HOST_RECEIVING) ? POLLIN : POLLOUT;
+            pfd[npfd].revents = 0;
+            pfdhost[npfd++] = i;
+        }
+        if (npfd == 0)
+            break;
+
+        if (poll(pfd, npfd, (int) ((deadline - now)*1000.0) + 1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return(1);
+        }
+        for (int i = 0; i < npfd; i++)
+            if (pfd[i].revents)
+                service(&hosts[pfdhost[i]], pfd[i].revents);
+    }
+
+    for (int i = 0; i < nhosts; i++) {
+        print_reply(&hosts[i], tagged);
+        if (hosts[i].state != HOST_DONE)
+            nfailed++;
+        if (verbose)
+            fprintf(stderr, "%s: %s in %.3f s\n", hosts[i].name,
+                    hosts[i].state == HOST_DONE ? "replied" : "failed",
+                    hosts[i].end - hosts[i].start);
+        free(hosts[i].reply);
+    }
+
+    return(nfailed);
+
+}
@@ -0,0 +1,266 @@
+/*
+ * FRAMERECV - Receive frames streamed from the camera hosts.
+ *
+ * Runs on the data server. Each camera host keeps one connection open and
+ * sends its frames down it as they are read out (see transfer.h). Every
+ * connection is served by its own process, so a slow host never holds up
+ * the others.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "transfer.h"
+
+#define MAX_STRING 256
+#define BUFFER_SIZE (1 << 20)
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+
+#define usage "\n\
+NAME\n\
+framerecv --- receive frames streamed from the camera hosts \n\
+\n\
+SYNOPSIS\n\
+framerecv [options] \n\
+\n\
+DESCRIPTION\n\
+\"framerecv\" listens for connections from \"expose -s\", \"plan -s\" and\n\
+\"framesend\", and stores every frame they send in the output directory. A\n\
+frame is written under a temporary name and renamed into place once it has\n\
+arrived in full, so anything watching the directory never sees half a frame.\n\
+\n\
+For each frame one line is printed on stdout:\n\
+\n\
+    time  sender  file  bytes  seconds  MB/s\n\
+\n\
+OPTIONS\n\
+-p port      # port to listen on (default 7080) \n\
+-d dir       # output directory (default: current directory) \n\
+-v           # verbose mode \n\
+\n\
+EXAMPLES\n\
+framerecv -d /Users/dragonfly/Data/incoming \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+static int verbose = 0;
+static char outdir[MAX_STRING] = ".";
+
+
+static double monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+static int reply(int fd, const char *fmt, char *arg)
+{
+    char line[2*MAX_STRING];
+    snprintf(line, sizeof(line), fmt, arg);
+    return(write(fd, line, strlen(line)) != (ssize_t) strlen(line));
+}
+
+
+/* Serve one sender until it hangs up */
+static int serve(int fd, char *peer)
+{
+    char *buffer = (char *) malloc(BUFFER_SIZE);
+    size_t have = 0;   // bytes in buffer not yet consumed
+
+    if (buffer == NULL)
+        return(1);
+
+    for (;;) {
+        char header[FRAME_MAX_NAME + 64];
+        char name[FRAME_MAX_NAME];
+        char path[2*MAX_STRING + FRAME_MAX_NAME];
+        char tmppath[sizeof(path) + 8];
+        unsigned long nbytes, remaining;
+        char *eol;
+        int outfd;
+        int failed = 0;
+        double t0;
+        struct timespec now;
+
+        /* Read the header line */
+        while ((eol = memchr(buffer, '\n', have)) == NULL) {
+            ssize_t rc;
+            if (have >= sizeof(header) - 1) {
+                reply(fd, "ERROR header too long\n", NULL);
+                free(buffer);
+                return(1);
+            }
+            rc = read(fd, buffer + have, BUFFER_SIZE - have);
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc <= 0) {
+                free(buffer);
+                return(have == 0 ? 0 : 1);
+            }
+            have += rc;
+        }
+        if (eol - buffer >= (long) sizeof(header)) {
+            reply(fd, "ERROR header too long\n", NULL);
+            free(buffer);
+            return(1);
+        }
+        memcpy(header, buffer, eol - buffer);
+        header[eol - buffer] = '\0';
+        have -= eol + 1 - buffer;
+        memmove(buffer, eol + 1, have);
+
+        if (sscanf(header, "FRAME %lu %255s", &nbytes, name) != 2
+                || strchr(name, '/') != NULL || name[0] == '.') {
+            reply(fd, "ERROR bad header\n", NULL);
+            free(buffer);
+            return(1);
+        }
+
+        /* Stream the body to a temporary file, then rename it into place */
+        snprintf(path, sizeof(path), "%s/%s", outdir, name);
+        snprintf(tmppath, sizeof(tmppath), "%s/.%s.part", outdir, name);
+        if ((outfd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+            failed = errno;
+
+        t0 = monotonic_time();
+        remaining = nbytes;
+        while (remaining > 0) {
+            size_t chunk;
+            if (have == 0) {
+                ssize_t rc = read(fd, buffer, BUFFER_SIZE);
+                if (rc < 0 && errno == EINTR)
+                    continue;
+                if (rc <= 0) {
+                    fprintf(stderr,"%s hung up in the middle of %s\n",peer,name);
+                    if (outfd >= 0) {
+                        close(outfd);
+                        unlink(tmppath);
+                    }
+                    free(buffer);
+                    return(1);
+                }
+                have = rc;
+            }
+            chunk = have < remaining ? have : remaining;
+            if (outfd >= 0 && !failed && write(outfd, buffer, chunk) != (ssize_t) chunk)
+                failed = errno;
+            remaining -= chunk;
+            have -= chunk;
+            memmove(buffer, buffer + chunk, have);
+        }
+
+        if (outfd >= 0) {
+            if (close(outfd) != 0 && !failed)
+                failed = errno;
+            if (!failed && rename(tmppath, path) != 0)
+                failed = errno;
+            if (failed)
+                unlink(tmppath);
+        }
+        if (failed) {
+            fprintf(stderr,"Unable to store %s from %s: %s\n",name,peer,strerror(failed));
+            reply(fd, "ERROR %s\n", strerror(failed));
+            continue;
+        }
+        reply(fd, "OK %s\n", name);
+
+        double dt = monotonic_time() - t0;
+        clock_gettime(CLOCK_REALTIME, &now);
+        printf("%.3f %s %s %lu %.3f %.1f\n", now.tv_sec + 1e-9*now.tv_nsec,
+                peer, path, nbytes, dt, dt > 0 ? nbytes/dt/1.0e6 : 0.0);
+        fflush(stdout);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int c;
+    int port = FRAME_PORT;
+    int listenfd;
+    int on = 1;
+    struct sockaddr_in addr;
+
+    while ((c = getopt(argc, argv, "p:d:vh")) != -1) {
+        switch (c) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'd':
+                snprintf(outdir, sizeof(outdir), "%s", optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (optind != argc) {
+        error_exit(usage);
+    }
+
+    // Children are reaped automatically
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || listen(listenfd, 16) != 0) {
+        perror("Unable to listen");
+        return(1);
+    }
+    if (verbose)
+        fprintf(stderr, "Receiving frames on port %d into %s\n", port, outdir);
+
+    for (;;) {
+        struct sockaddr_in from;
+        socklen_t len = sizeof(from);
+        char peer[MAX_STRING];
+        int fd = accept(listenfd, (struct sockaddr *) &from, &len);
+
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            return(1);
+        }
+        snprintf(peer, sizeof(peer), "%s", inet_ntoa(from.sin_addr));
+        if (verbose)
+            fprintf(stderr, "Connection from %s\n", peer);
+
+        if (fork() == 0) {
+            close(listenfd);
+            _exit(serve(fd, peer));
+        }
+        close(fd);
+    }
+
+    return(0);
+
+}
@@ -0,0 +1,92 @@
+/*
+ * FRAMESEND - Send frames already on disk to the frame receiver.
+ *
+ * All the files go down one connection, each with sendfile(), so catching
+ * up on a night's data costs one connection setup rather than one copy
+ * command per frame.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "transfer.h"
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+
+#define usage "\n\
+NAME\n\
+framesend --- send FITS files to the frame receiver on the data server \n\
+\n\
+SYNOPSIS\n\
+framesend [options] host[:port] file [file ...] \n\
+\n\
+DESCRIPTION\n\
+\"framesend\" sends each file to \"framerecv\" over a single connection and\n\
+waits for the receiver to acknowledge it before sending the next. The exit\n\
+status is the number of files that could not be delivered.\n\
+\n\
+OPTIONS\n\
+-v           # verbose mode: report the time taken for each file \n\
+\n\
+EXAMPLES\n\
+framesend dataserver *_light.fits \n\
+framesend localhost:7081 83F010783_17_light.fits \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+
+int main(int argc, char *argv[]) {
+
+    int c;
+    int verbose = 0;
+    int fd;
+    int nfailed = 0;
+    char *destination;
+
+    while ((c = getopt(argc, argv, "vh")) != -1) {
+        switch (c) {
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (argc - optind < 2) {
+        error_exit(usage);
+    }
+
+    destination = argv[optind++];
+    if ((fd = OpenFrameStream(destination)) < 0)
+        return(argc - optind);
+
+    for (; optind < argc; optind++) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (SendFrameFile(fd, argv[optind])) {
+            nfailed++;
+            // The connection is in an unknown state after a failure
+            CloseFrameStream(fd);
+            fd = -1;
+            if (optind + 1 < argc && (fd = OpenFrameStream(destination)) < 0)
+                return(nfailed + argc - optind - 1);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (verbose)
+            fprintf(stderr, "Sent %s in %.3f s\n", argv[optind],
+                    (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec));
+    }
+    CloseFrameStream(fd);
+
+    return(nfailed);
+
+}
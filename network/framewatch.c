@@ -0,0 +1,370 @@
+/*
+ * FRAMEWATCH - Report new FITS files in a directory as soon as they are
+ * complete.
+ *
+ * On Linux this is driven by inotify close-write and moved-to events, so
+ * a frame is reported within a millisecond or so of its file being closed
+ * (or, for framerecv, renamed into place). Elsewhere the directory is
+ * rescanned every 100 ms and a file is reported once its size has stopped
+ * changing.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#define MAX_STRING 256
+#define MANIFEST_FIFO "/var/tmp/frames.fifo"
+#define MAX_PATTERNS 8
+#define SCAN_MSEC 100
+
+#define error_exit(a)   fprintf(stderr, (a)); return(2)
+
+#define usage "\n\
+NAME\n\
+framewatch --- report new FITS files in a directory as they are written \n\
+\n\
+SYNOPSIS\n\
+framewatch [options] [directory] \n\
+\n\
+DESCRIPTION\n\
+\"framewatch\" prints the path of each file matching the pattern (by default\n\
+*.fits*) that is written into the directory (by default the current one),\n\
+one per line, as soon as the file has been closed. Files whose names start\n\
+with a dot, such as the partial files of framerecv, are ignored.\n\
+\n\
+With -c, the command is run while the directory is watched, and framewatch\n\
+exits once the command has finished and every file it wrote has been\n\
+reported. This replaces listing the directory before and after a command\n\
+and comparing the two. With -n, framewatch exits after that many files.\n\
+\n\
+Every frame written by the camera programs is also announced, with its\n\
+serial number, image type and exposure time, on the FIFO /var/tmp/frames.fifo\n\
+whenever something is reading it. -m creates the FIFO if necessary and copies\n\
+what arrives to stdout, one line per frame:\n\
+\n\
+    1500000603.410 frame file=/Users/dragonfly/Data/2017-07-14/83F010783_17_light.fits\n\
+      serial=83F010783 imtype=light exptime=600.000 width=3326 height=2504 camera=0\n\
+\n\
+(all on one line). -n and -t apply to manifest lines as they do to files.\n\
+\n\
+The exit status is that of the command (0 if there is none), 1 if the\n\
+timeout expired before -n files were seen, or 2 on error.\n\
+\n\
+OPTIONS\n\
+-p pattern   # report files matching this shell pattern (may be repeated) \n\
+-n count     # exit after this many files \n\
+-t seconds   # give up after this long \n\
+-c command   # run command and report the files it writes \n\
+-m           # instead of watching a directory, print the frame manifest that \n\
+             # expose, plan and array write to /var/tmp/frames.fifo \n\
+\n\
+EXAMPLES\n\
+framewatch -c \"expose light 10\" \n\
+framewatch -n 1 -t 30 -p guider_image.fits /var/tmp \n\
+framewatch /Users/dragonfly/Data/incoming | xargs -n 1 store_metadata \n\
+framewatch -m | grep imtype=light \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+static char *patterns[MAX_PATTERNS];
+static int npatterns = 0;
+static char *directory = ".";
+static int nreported = 0;
+
+
+static double monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+static int wanted(const char *name)
+{
+    if (name[0] == '.')
+        return(0);
+    for (int i = 0; i < npatterns; i++)
+        if (fnmatch(patterns[i], name, 0) == 0)
+            return(1);
+    return(0);
+}
+
+
+static void report(const char *name)
+{
+    if (strcmp(directory, ".") == 0)
+        printf("%s\n", name);
+    else
+        printf("%s/%s\n", directory, name);
+    fflush(stdout);
+    nreported++;
+}
+
+
+#ifdef __linux__
+
+static int watch_fd = -1;
+
+static int start_watching()
+{
+    if ((watch_fd = inotify_init1(IN_NONBLOCK)) < 0
+            || inotify_add_watch(watch_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror(directory);
+        return(1);
+    }
+    return(0);
+}
+
+
+/* Wait up to msec for events and report any new frames */
+static void check_for_frames(int msec)
+{
+    char events[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd;
+    ssize_t n;
+
+    pfd.fd = watch_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, msec) <= 0)
+        return;
+    while ((n = read(watch_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + n; ) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->len > 0 && wanted(ev->name))
+                report(ev->name);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+#else
+
+/* Without inotify, keep a list of the files present and their sizes */
+typedef struct {
+    char  name[MAX_STRING];
+    off_t size;
+    int   reported;
+    int   seen;
+} t_entry;
+
+static t_entry *entries = NULL;
+static int nentries = 0;
+
+static void scan(int initial)
+{
+    DIR *dir = opendir(directory);
+    struct dirent *de;
+    char path[2*MAX_STRING];
+    struct stat sb;
+
+    if (dir == NULL)
+        return;
+    for (int i = 0; i < nentries; i++)
+        entries[i].seen = 0;
+    while ((de = readdir(dir)) != NULL) {
+        int i;
+        if (!wanted(de->d_name) || strlen(de->d_name) >= MAX_STRING)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", directory, de->d_name);
+        if (stat(path, &sb) != 0 || !S_ISREG(sb.st_mode))
+            continue;
+        for (i = 0; i < nentries; i++)
+            if (strcmp(entries[i].name, de->d_name) == 0)
+                break;
+        if (i == nentries) {
+            entries = (t_entry *) realloc(entries, (++nentries)*sizeof(t_entry));
+            snprintf(entries[i].name, MAX_STRING, "%s", de->d_name);
+            entries[i].size = -1;
+            entries[i].reported = initial;
+        }
+        // Report a new file once its size holds steady between scans
+        if (!entries[i].reported && sb.st_size == entries[i].size && sb.st_size > 0) {
+            report(entries[i].name);
+            entries[i].reported = 1;
+        }
+        entries[i].size = sb.st_size;
+        entries[i].seen = 1;
+    }
+    closedir(dir);
+    // Forget files that have gone, so that a new file of the same name is reported
+    for (int i = 0; i < nentries; i++)
+        if (!entries[i].seen)
+            entries[i--] = entries[--nentries];
+}
+
+static int start_watching()
+{
+    if (access(directory, R_OK) != 0) {
+        perror(directory);
+        return(1);
+    }
+    scan(1);
+    return(0);
+}
+
+static void check_for_frames(int msec)
+{
+    struct timespec ts;
+    ts.tv_sec = msec/1000;
+    ts.tv_nsec = (msec % 1000)*1000000L;
+    nanosleep(&ts, NULL);
+    scan(0);
+}
+
+#endif
+
+
+/* Copy manifest lines from the FIFO to stdout. The FIFO is opened for
+ * writing as well as reading so that it never reports end-of-file between
+ * one writer and the next. */
+static int follow_manifest(int count, double timeout)
+{
+    char buffer[4096];
+    double start = monotonic_time();
+    struct pollfd pfd;
+    int fd;
+
+    if ((mkfifo(MANIFEST_FIFO, 0666) != 0 && errno != EEXIST)
+            || (fd = open(MANIFEST_FIFO, O_RDWR)) < 0) {
+        perror(MANIFEST_FIFO);
+        return(2);
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    for (;;) {
+        int msec = -1;
+        ssize_t n;
+        if (timeout > 0) {
+            msec = (int) ((timeout - (monotonic_time() - start))*1000.0);
+            if (msec <= 0)
+                return(1);
+        }
+        if (poll(&pfd, 1, msec) <= 0)
+            continue;
+        if ((n = read(fd, buffer, sizeof(buffer))) <= 0)
+            continue;
+        fwrite(buffer, 1, n, stdout);
+        fflush(stdout);
+        // Writers send whole lines in single writes
+        for (ssize_t i = 0; i < n; i++)
+            if (buffer[i] == '\n')
+                nreported++;
+        if (count > 0 && nreported >= count)
+            return(0);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int c;
+    int count = 0;
+    double timeout = 0;
+    char *command = NULL;
+    int manifest = 0;
+    pid_t pid = -1;
+    int command_status = 0;
+    double start;
+
+    while ((c = getopt(argc, argv, "p:n:t:c:mh")) != -1) {
+        switch (c) {
+            case 'p':
+                if (npatterns < MAX_PATTERNS)
+                    patterns[npatterns++] = optarg;
+                break;
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 't':
+                timeout = atof(optarg);
+                break;
+            case 'c':
+                command = optarg;
+                break;
+            case 'm':
+                manifest = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (argc - optind > 1) {
+        error_exit(usage);
+    }
+    if (optind < argc)
+        directory = argv[optind];
+    if (npatterns == 0)
+        patterns[npatterns++] = "*.fits*";
+    if (manifest)
+        return(follow_manifest(count, timeout));
+
+    // The watch must be in place before the command can write anything
+    if (start_watching())
+        return(2);
+    start = monotonic_time();
+
+    if (command) {
+        if ((pid = fork()) < 0) {
+            perror("fork");
+            return(2);
+        }
+        if (pid == 0) {
+            // Keep the command's output off our list of files
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+            execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+            _exit(127);
+        }
+    }
+
+    for (;;) {
+        check_for_frames(SCAN_MSEC);
+
+        if (count > 0 && nreported >= count)
+            break;
+        if (timeout > 0 && monotonic_time() - start > timeout) {
+            if (pid > 0)
+                kill(pid, SIGTERM);
+            return(1);
+        }
+        if (pid > 0) {
+            int status;
+            if (waitpid(pid, &status, WNOHANG) == pid) {
+                pid = -1;
+                command_status = WIFEXITED(status) ? WEXITSTATUS(status) : 2;
+                // Collect anything the command wrote just before it exited.
+                // (A scan needs to see a new file twice to report it.)
+                check_for_frames(SCAN_MSEC);
+                check_for_frames(SCAN_MSEC);
+                if (count == 0)
+                    break;
+            }
+        }
+    }
+
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+    return(command_status);
+
+}
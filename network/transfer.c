@@ -0,0 +1,205 @@
+/*
+ * TRANSFER - Send frames to the data server over a persistent connection.
+ *
+ * See transfer.h for the protocol. Frames already on disk go out with
+ * sendfile(), so the pixels never pass through user space; frames in
+ * memory (for example tile-compressed copies made at readout) are written
+ * straight from the caller's buffer.
+ */
+
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "transfer.h"
+
+
+int OpenFrameStream(char *destination)
+{
+    char host[FRAME_MAX_NAME];
+    char port[16];
+    char *colon;
+    struct addrinfo hints, *res, *ai;
+    struct timeval tv;
+    int fd = -1;
+    int one = 1;
+    int rc;
+
+    snprintf(host, sizeof(host), "%s", destination);
+    snprintf(port, sizeof(port), "%d", FRAME_PORT);
+    if ((colon = strrchr(host, ':')) != NULL) {
+        *colon = '\0';
+        snprintf(port, sizeof(port), "%s", colon + 1);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo(host, port, &hints, &res)) != 0) {
+        fprintf(stderr,"Unable to find frame receiver %s: %s\n",destination,gai_strerror(rc));
+        return(-1);
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        fprintf(stderr,"Unable to connect to frame receiver %s: %s\n",destination,strerror(errno));
+        return(-1);
+    }
+
+    // A receiver that stops reading must not hang the acquisition
+    tv.tv_sec = FRAME_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // The header and the frame go out in separate writes and then we wait
+    // for the acknowledgement, which Nagle's algorithm would otherwise
+    // hold up behind the receiver's delayed ACK on every small frame
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Nor may a receiver that has gone away kill it with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+    return(fd);
+}
+
+
+void CloseFrameStream(int fd)
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+
+static int write_all(int fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t rc = write(fd, p, n);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return(1);
+        }
+        p += rc;
+        n -= rc;
+    }
+    return(0);
+}
+
+
+static int send_header(int fd, char *name, size_t size)
+{
+    char header[FRAME_MAX_NAME + 64];
+    char *base = strrchr(name, '/');
+    snprintf(header, sizeof(header), "FRAME %lu %s\n", (unsigned long) size, base ? base + 1 : name);
+    return(write_all(fd, header, strlen(header)));
+}
+
+
+/* Wait for the receiver to acknowledge the frame */
+static int read_ack(int fd, char *name)
+{
+    char reply[FRAME_MAX_NAME + 64];
+    size_t n = 0;
+
+    while (n < sizeof(reply) - 1) {
+        ssize_t rc = read(fd, reply + n, 1);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0) {
+            fprintf(stderr,"No acknowledgement from frame receiver for %s\n",name);
+            return(1);
+        }
+        if (reply[n++] == '\n')
+            break;
+    }
+    reply[n] = '\0';
+    if (strncmp(reply, "OK", 2) != 0) {
+        fprintf(stderr,"Frame receiver rejected %s: %s",name,reply);
+        return(1);
+    }
+    return(0);
+}
+
+
+int SendFrameBuffer(int fd, char *name, void *buffer, size_t size)
+{
+    if (send_header(fd, name, size) || write_all(fd, buffer, size)) {
+        fprintf(stderr,"Unable to send %s: %s\n",name,strerror(errno));
+        return(1);
+    }
+    return(read_ack(fd, name));
+}
+
+
+int SendFrameFile(int fd, char *filename)
+{
+    struct stat sb;
+    off_t offset = 0;
+    int filefd;
+    int status = 0;
+
+    if ((filefd = open(filename, O_RDONLY)) < 0 || fstat(filefd, &sb) != 0) {
+        fprintf(stderr,"Unable to open %s for sending: %s\n",filename,strerror(errno));
+        if (filefd >= 0)
+            close(filefd);
+        return(1);
+    }
+    if (send_header(fd, filename, sb.st_size)) {
+        fprintf(stderr,"Unable to send %s: %s\n",filename,strerror(errno));
+        close(filefd);
+        return(1);
+    }
+
+    while (offset < sb.st_size && status == 0) {
+#if defined(__linux__)
+        ssize_t rc = sendfile(fd, filefd, &offset, sb.st_size - offset);
+        if (rc == 0 || (rc < 0 && errno != EINTR))
+            status = 1;
+#elif defined(__APPLE__)
+        off_t len = sb.st_size - offset;
+        // A timed-out send comes back as EAGAIN having sent nothing
+        if (sendfile(filefd, fd, offset, &len, NULL, 0) != 0 && errno != EINTR
+                && !(errno == EAGAIN && len > 0))
+            status = 1;
+        offset += len;
+#else
+        char buffer[65536];
+        ssize_t rc = pread(filefd, buffer, sizeof(buffer), offset);
+        if (rc <= 0 || write_all(fd, buffer, rc))
+            status = 1;
+        else
+            offset += rc;
+#endif
+    }
+    close(filefd);
+    if (status) {
+        fprintf(stderr,"Unable to send %s: %s\n",filename,strerror(errno));
+        return(1);
+    }
+    return(read_ack(fd, filename));
+}
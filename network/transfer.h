@@ -0,0 +1,27 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stddef.h>
+
+/* Frame streaming protocol
+ *
+ * A sender opens one TCP connection to the receiver (framerecv) and keeps
+ * it for as many frames as it likes. Each frame is a one-line header
+ *
+ *     FRAME <nbytes> <name>\n
+ *
+ * followed by exactly nbytes of FITS file. The receiver stores the frame
+ * under <name> (stripped of any directory) and answers with one line,
+ * "OK <name>\n" or "ERROR <reason>\n", before the next frame is sent.
+ */
+
+#define FRAME_PORT          7080
+#define FRAME_TIMEOUT       30      // seconds before a stalled transfer is abandoned
+#define FRAME_MAX_NAME      256
+
+int  OpenFrameStream(char *destination);     // "host" or "host:port"; returns a socket or -1
+int  SendFrameBuffer(int fd, char *name, void *buffer, size_t size);
+int  SendFrameFile(int fd, char *filename);  // Zero-copy where the OS allows it
+void CloseFrameStream(int fd);
+
+#endif
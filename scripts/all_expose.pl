@@ -4,6 +4,7 @@ use Getopt::Long;
 use Pod::Usage;
 use Term::ProgressBar;
 use DateTime;
+use Time::HiRes;
 
 # Do not buffer output
 $| = 1;
@@ -23,6 +24,7 @@ my $maestro = 1;
 my $verbose = 0;
 my $nocoords = 0;
 my $port = 3040;
+my $lead = 3.0;
 
 $result = GetOptions(
     "help|?" => \$help, 
@@ -31,6 +33,7 @@ $result = GetOptions(
     "maestro!" => \$maestro,
     "verbose" => \$verbose,
     "nocoords!" => \$nocoords,
+    "lead=f" => \$lead,
     "location=s" => \$location,
      man=> \$man) or pod2usage(2);
 pod2usage(1) if $help;
@@ -101,16 +104,19 @@ if (!$ra || !$dec || !$alt || !$az) {
     $name = "UNKNOWN";
 }
 
-# Begin integrations
-foreach(@ip) {
-    print "Sending expose command to $_\n" if $verbose;
-    if ($position_known) {
-        `send $_ 7078 "expose -r \"$ra\" -d \"$dec\" -a $alt -z $az -n \"$name\" $imtype $exptime"`;
-    }
-    else {
-        `send $_ 7078 "expose -n \"$name\" $imtype $exptime"`;
-    }
+# Begin integrations on all hosts at once. Every host is told to start at
+# the same wall-clock time, far enough ahead for all of them to get their
+# cameras ready, so the starts are not staggered by the network.
+$start = sprintf("%.3f",Time::HiRes::time() + $lead);
+print "Sending expose command to @ip for start at $start\n" if $verbose;
+if ($position_known) {
+    `fanout -p 7078 "expose -t $start -r \"$ra\" -d \"$dec\" -a $alt -z $az -n \"$name\" $imtype $exptime" @ip`;
 }
+else {
+    `fanout -p 7078 "expose -t $start -n \"$name\" $imtype $exptime" @ip`;
+}
+$wait = $start - Time::HiRes::time();
+Time::HiRes::sleep($wait) if $wait > 0;
 
 # Check that integrations have started (DISABLED!)
 while(0) {
@@ -141,18 +147,22 @@ if ($exptime > 3 && $verbose) {
 }
 print "  Wall-clock exposure time expired. CCDs should be reading out now.\n" if $verbose;
 
-# Check that integrations have completed
-foreach(@ip) {
-    print "Checking CCD status to determine whether exposures are completed.\n" if $verbose;
-    $result="";
-    while($result !~ /idle/i){
-        $result=`send $_ 7078 status`;
-        sleep(1);
+# Check that integrations have completed. Poll all hosts at once and stop
+# asking the ones that have finished.
+print "Checking CCD status to determine whether exposures are completed.\n" if $verbose;
+@busy = @ip;
+while(@busy) {
+    $result=`fanout -p 7078 status @busy`;
+    %reply = ();
+    foreach (split(/\n/,$result)) {
+        $reply{$1} .= $2 if /^\[(.*?)\] (.*)/;
     }
-    print "Mac Mini at IP address $_ reports that all integrations are completed.\n" if $verbose;
-    $result=`send $_ 7078 list | sed s/^/\[$_\]\\ /`;
-    print $result;
+    @busy = grep { $reply{$_} !~ /idle/i } @busy;
+    sleep(1) if @busy;
 }
+print "All Mac Minis report that all integrations are completed.\n" if $verbose;
+$result=`fanout -p 7078 list @ip`;
+print $result;
 
 # Ring the bell
 print "\a\a\aIntegrations completed!\n" if ($verbose);
@@ -164,9 +174,7 @@ exit(0);
 sub interrupt {
     my($signal)=@_;
     print "Caught Interrupt\: $signal \n";
-    foreach(@ip) {
-        `send $_ 7078 abort`;
-    }
+    `fanout -p 7078 abort @ip`;
     print "Integrations aborted.\n";
     exit(1);
 } 
@@ -214,6 +222,14 @@ Add object name as the value of the OBJNAME FITS header keyword (default = "Unkn
 
 Number of integrations (default = 1). 
 
+=item B<-lead seconds>
+
+Seconds between sending the expose command and the moment every camera
+starts integrating (default = 3). All hosts are given the same start time,
+so this must be long enough for the slowest host to initialize its cameras.
+The actual start of each frame relative to the requested start is recorded in
+the STARTOFF header keyword.
+
 =item B<-help>
 
 Prints a brief help message and exits.
@@ -9,11 +9,13 @@ my $help = 0;
 my $location = "NewMexicoSkies";
 my $verbose = 0;
 my $port = 3040;
+my $timeout = 3600;
 
 $result = GetOptions(
     "help|?" => \$help, 
     "verbose" => \$verbose,
     "file=s" => \$focus_file,
+    "timeout=i" => \$timeout,
      man=> \$man) or pod2usage(2);
 pod2usage(1) if $help;
 pod2usage(-exitstatus =>0, -verbose =>2) if $man;
@@ -25,11 +27,10 @@ if ($server =~ /camera/) {
     # Determine the IP addresses of the computers hosting cameras
 	$ip=`camera_info host lens location status | grep $location | grep Nominal | awk '{print \$2}' | sort | uniq | tr '\n' ' '`;
 	@ip = split('\s+',$ip);
-    # Send the message to each server
-	foreach(@ip) {
-		$result = `send $_ 7078 "$message"`;
-		print $result;
-	}
+    # Send the message to all servers at once. The deadline has to outlast
+    # the slowest command (e.g. a long exposure), not just the connection.
+	$result = `fanout -u -p 7078 -t $timeout "$message" @ip`;
+	print $result;
 }
 elsif ($server =~ /focuser/) {
 	$result = `send XXX.XXX.XXX.XXX XXXX "$message"`;
@@ -61,6 +62,7 @@ options:
 
  -help
  -man
+ -timeout seconds
 
 =head1 ARGUMENTS 
 
@@ -89,6 +91,11 @@ Prints a brief help message and exits.
 
 Prints the manual page and exits.
 
+=item B<-timeout seconds>
+
+How long to wait for each camera server to reply (default 3600). A server
+that has not replied by then is reported with an "Error:" line.
+
 =back
 
 =head1 DESCRIPTION
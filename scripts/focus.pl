@@ -186,15 +186,16 @@ print MYLOCKFILE "Data taking started at ",scalar(localtime),"\n";
 
 for (my $count = -1; $count < $nsample; $count++) {
 
-    # Take a snapshot of the FITS files in this directory
-    `ls -1 *.fits > /var/tmp/before.txt 2> /dev/null`;
+    # framewatch reports the FITS files written by each expose as they are
+    # closed, so there is no need to compare directory listings.
+    $new_files = "";
 
     # Obtain new data... one dark frame followed by a user-specified
     # number of light frames.
     if ($count == -1) {
         if ($dark) {
             print STDERR "Taking dark frames\n";
-            system("expose dark $exptime");
+            $new_files = `framewatch -c "expose dark $exptime"`;
         }else{
             next; 
         }
@@ -246,14 +247,12 @@ for (my $count = -1; $count < $nsample; $count++) {
         # Focus movement succeeded. Take a data frame.
         print "Integrating\n";
         $start_time = DateTime->now();
-        system("expose light $exptime");
+        $new_files = `framewatch -c "expose light $exptime"`;
         $integration_time += report_timing($start_time,$verbose);
     }
 
-    # Figure out which FITS files have just been created
-    `ls -1 *.fits > /var/tmp/after.txt`;
-    $new_files = `diff /var/tmp/before.txt /var/tmp/after.txt  | grep ">" | awk '{print \$2}'`;
-    chop($new_files);
+    # These are the FITS files that have just been created
+    chomp($new_files);
     @new_files = split(/\n/,$new_files);
     print "Files to process: @new_files\n" if $verbose;
 
@@ -310,7 +309,7 @@ for (my $count = -1; $count < $nsample; $count++) {
             }
 
             print(STDERR "Source extracting...\n");
-            $seeing_data = `extract -s $dsfile | tfilter 'FLAGS==0 && FWHM_IMAGE>0' | tcolumn FWHM_IMAGE | rstats c e s`;
+            $seeing_data = `extract -s $dsfile | tquery -f 'FLAGS==0 && FWHM_IMAGE>0' -s n,median,sigma FWHM_IMAGE`;
             $seeing_data =~ s/^\s+//g;
             chop($seeing_data);
             ($nobj,$seeing,$sigma) = split(/\s+/,$seeing_data);
@@ -266,8 +266,8 @@ else {
 
         # This is a good filter when using a Canon EF400 lens as an autoguider (un-binned):
         $cmd1 = "extract /var/tmp/guider_image.fits | ";
-        $cmd2 = "tfilter 'FLAGS==0 && FLUX_ISO>10000 && ISOAREA_IMAGE<200 && FLUX_MAX<30000 && X_IMAGE>50 && X_IMAGE<2000 && Y_IMAGE>50 && Y_IMAGE<2000' | ";
-        $cmd3 = "tcolumn X_IMAGE Y_IMAGE FLUX_ISO | sort -r -n -k 3 | awk '{print \$1-0.5,\$2-0.5}'";
+        $cmd2 = "tquery -f 'FLAGS==0 && FLUX_ISO>10000 && ISOAREA_IMAGE<200 && FLUX_MAX<30000 && X_IMAGE>50 && X_IMAGE<2000 && Y_IMAGE>50 && Y_IMAGE<2000' X_IMAGE Y_IMAGE FLUX_ISO | ";
+        $cmd3 = "sort -r -n -k 3 | awk '{print \$1-0.5,\$2-0.5}'";
 
         # This is a good filter when using an ST-i or ST-402:
         # $cmd1 = "extract /var/tmp/guider_image.fits | ";
@@ -289,20 +289,14 @@ else {
         `guider $maestro_flag disconnect`;
         # `expose light 1`;
 
+        # Take the image and wait for it to be saved to disk. framewatch
+        # returns as soon as the file has been closed.
         print "Starting exposure\n";
-        my $result = `guider $maestro_flag --exptime $exptime --bin $bin --host $host image`;
+        my $timeout = 30 + $exptime;
+        my $result = `framewatch -n 1 -t $timeout -p guider_image.fits -c "guider $maestro_flag --exptime $exptime --bin $bin --host $host image" /var/tmp`;
+        die "Guider image failed to appear" if ($? >> 8) == 1;
         die 'Error taking image' if $?;
 
-        print "Waiting for image to be saved to disk.\n";
-        my $count = 0;
-        my $timeout = 30;
-        while(! -e "/var/tmp/guider_image.fits") {
-            sleep(1);
-            $count++;
-            die "Guider image failed to appear" if ($count>$timeout);
-        }
-        sleep(1);
-
         print "Finding stars\n";
         `guider $maestro_flag  --bin $bin --host $host list > /var/tmp/stars.txt`;
         die 'Could not list guide stars' if $?;
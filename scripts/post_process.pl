@@ -17,6 +17,7 @@ my $scamp = 0;
 my $minobj = 5;
 my $help = 0;
 my $crop = 1;
+my $match = 1;
 my $man = 0;
 my $subject = "post process results";
 
@@ -25,6 +26,7 @@ $result = GetOptions(
     "mail!" => \$mail,
     "subject=s" => \$subject,
     "crop!" => \$crop,
+    "match!" => \$match,
     "minobj=i" => \$minobj,
     "help|?" => \$help,
      man=> \$man) or pod2usage(2);
@@ -38,7 +40,7 @@ die "File(s) not found" if (@fits_files==0);
 # All operations happen in a temporary directory... this is important
 # in practise!
 chdir "/var/tmp";
-`rm -f *.png *.xml *.SRC *.head *.ldac head.tgz`;
+`rm -f *.png *.xml *.SRC *.head *.ldac *.stars head.tgz`;
 
 # Add keywords and basic statistical information to all the files
 print "Computing mean and mode for every image\n" if $verbose;
@@ -61,6 +63,7 @@ foreach $filename (@fits_files) {
     $file =~ /(^.+)(_.+)(_.+)/;
     $serial_number = $1;
     $serial_number =~ s/^\.\///g; # nuke preceding ./
+    $serial{$filename} = $serial_number;
 
     # Basic statistical information is stored regardless of file type
     $reg = "[1000:1500,900:1200]";
@@ -86,38 +89,66 @@ foreach $filename (@fits_files) {
     # Try to plate solve the image. This needs to be done first because Scamp requires
     # an approximate WCS in the image.
     #
-    # Plate solving seems to be more robust if it is done on the central portion of the
-    # image so we optionally cut out a bit of the image, plate solve that, then copy
-    # the WCS of the solved subset back into the full image. This is a kludge, obviously.
-    print "Plate solving $filename\n" if $verbose;
-    `rm -f /var/tmp/plate_solve_me.fits`;
+    # Frames after the first on a field are only dithered, so once a frame from a camera
+    # has been solved the next ones are matched to it with wcsmatch, which just needs the
+    # positions of the bright stars. Only if that fails do we fall back on ImageLink.
     $plate_solve_succeeded{$filename} = "No";
-    if ($crop) {
-        print "Cropping image to assist in plate solving\n" if $verbose;
-        #`fitscopy "$filename\[1176:2175,766:1765\]" /var/tmp/plate_solve_me.fits`;
-        `fitscopy "$filename\[1:1500,1:1500\]" /var/tmp/plate_solve_me.fits`;
-        print "Calling ImageLink via plate_solve\n" if $verbose;
-        `plate_solve --update --nomaestro --time 60 --scale 2.85 /var/tmp/plate_solve_me.fits`;
-        $result = `modhead /var/tmp/plate_solve_me.fits CD1_1`;
+    $reference = $reference{$serial{$filename}};
+    if ($match) {
+        `extract -B $filename > "$basename.stars"`;
+        if ($reference) {
+            print "Matching stars in $filename to $reference\n" if $verbose;
+            `wcsmatch $reference "$reference_stars{$reference}" $filename "$basename.stars"`;
+            if (!$?) {
+                $plate_solve_succeeded{$filename} = "Matched";
+                push(@good_catalogs,"$basename.ldac");
+            }
+            else {
+                print "Star matching failed for $filename\n";
+            }
+        }
     }
-    else{
-        `plate_solve --update --nomaestro --time 60 --scale 2.85 $filename`;
-        $result = `modhead $filename CD1_1`;
-    }
-
-    if ($?){
-        print "ImageLink failed for $filename\n";
-    }
-    elsif ($result =~ /Keyword does not exist/i) {
-        print "Plate solving failed for $filename failed\n";
-    }
-    else {
-        # Successfully plate-solved. 
-        $plate_solve_succeeded{$filename} = "Yes";
-        push(@good_catalogs,"$basename.ldac");
 
-        # Copy WCS to original image if we were using the cropped image
-        `imcopywcs /var/tmp/plate_solve_me.fits $filename` if $crop; 
+    if ($plate_solve_succeeded{$filename} ne "Matched") {
+
+        # Plate solving seems to be more robust if it is done on the central portion of the
+        # image so we optionally cut out a bit of the image, plate solve that, then copy
+        # the WCS of the solved subset back into the full image. This is a kludge, obviously.
+        print "Plate solving $filename\n" if $verbose;
+        `rm -f /var/tmp/plate_solve_me.fits`;
+        if ($crop) {
+            print "Cropping image to assist in plate solving\n" if $verbose;
+            #`fitscopy "$filename\[1176:2175,766:1765\]" /var/tmp/plate_solve_me.fits`;
+            `fitscopy "$filename\[1:1500,1:1500\]" /var/tmp/plate_solve_me.fits`;
+            print "Calling ImageLink via plate_solve\n" if $verbose;
+            `plate_solve --update --nomaestro --time 60 --scale 2.85 /var/tmp/plate_solve_me.fits`;
+            $result = `modhead /var/tmp/plate_solve_me.fits CD1_1`;
+        }
+        else{
+            `plate_solve --update --nomaestro --time 60 --scale 2.85 $filename`;
+            $result = `modhead $filename CD1_1`;
+        }
+
+        if ($?){
+            print "ImageLink failed for $filename\n";
+        }
+        elsif ($result =~ /Keyword does not exist/i) {
+            print "Plate solving failed for $filename failed\n";
+        }
+        else {
+            # Successfully plate-solved. 
+            $plate_solve_succeeded{$filename} = "Yes";
+            push(@good_catalogs,"$basename.ldac");
+
+            # Copy WCS to original image if we were using the cropped image
+            `imcopywcs /var/tmp/plate_solve_me.fits $filename` if $crop; 
+
+            # Later frames from this camera will be matched to this one
+            if ($match) {
+                $reference{$serial{$filename}} = $filename;
+                $reference_stars{$filename} = "$basename.stars";
+            }
+        }
     }
 
     # Compute FWHM etc. This happens for all files (even ones that weren't successfully) plate solved.
@@ -159,6 +190,10 @@ foreach $filename (@fits_files) {
     `modhead $filename NOBJ $nobj`;
     `modhead $filename ELLIP $b_over_a`;
     `modhead $filename BOVERA $b_over_a`;
+
+    # Nothing above updates CHECKSUM, so bring it up to date (the pixels are
+    # untouched, and DATASUM still vouches for them)
+    `fitssum -u -q $filename`;
 }
 
 print "Writing summary to temporary file\n" if $verbose;
@@ -180,13 +215,13 @@ foreach $camfile (keys %fwhm) {
 }
 close(RESULTS);
 
-# Create postage stamp montage
+# Create a montage of the frames laid out as the lenses are on the array
 print "Generating postage stamps\n" if $verbose;
-`rm -f /var/tmp/imcheck.jpg`;
-$filenames = "@fits_files\n";
-$command = "imcheck $filenames";
-print "Executing this command: $command";
-$postage_stamp_attachment_command = " -a /var/tmp/imcheck.jpg ";
+`rm -f /var/tmp/imcheck.png`;
+$filenames = "@fits_files";
+$command = "preview -m -o /var/tmp/imcheck.png $filenames";
+print "Executing this command: $command\n" if $verbose;
+$postage_stamp_attachment_command = " -a /var/tmp/imcheck.png ";
 `$command`;
 $postage_stamp_attachment_command = "" if $?;
 
@@ -211,7 +246,7 @@ if ($scamp) {
         if (!$?) {
             `tar -cvzf headers.tgz *.head post_process_results.txt`;
             `montage -geometry 800x -border 0 -tile 2x4 distort*.png dall.png`;
-            $scamp_attachment_command = " -a /var/tmp/imcheck.jpg -a fgroups_1.png -a astr_interror2d_1.png -a dall.png -a headers.tgz ";
+            $scamp_attachment_command = " -a /var/tmp/imcheck.png -a fgroups_1.png -a astr_interror2d_1.png -a dall.png -a headers.tgz ";
         } 
     }
 }
@@ -233,7 +268,7 @@ if ($nsolved > 0 ) {
 	$solved_files = "@fits_files";
     print "Generating a nice image showing the overlapping fields covered by @fits_files\n" if $verbose;
     `rm -f /var/tmp/nice_image.png`;
-    `nice_image $solved_files`;
+    `preview -n -o /var/tmp/nice_image.png $solved_files`;
 }
 $full_field_attachment_command = "" if $?;
 
@@ -243,7 +278,7 @@ $attachment_commands = " $postage_stamp_attachment_command $full_field_attachmen
 `mutt -s \"$subject\" $attachment_commands projectdragonfly\@icloud.com < /var/tmp/post_process_results.txt`;
 
 # Clean up temporary files
-`rm -f *.png *.xml *.SRC *.head *.ldac head.tgz`;
+`rm -f *.png *.xml *.SRC *.head *.ldac *.stars head.tgz`;
 
 exit(0);
 
@@ -352,6 +387,12 @@ crazy FWHM values. The default is 5.
 
 Print informational messages. Default is --verbose.
 
+=item B<--[no]match>
+
+Once a frame from a camera has been plate solved, give later frames from the
+same camera a WCS by matching their stars to the solved frame with wcsmatch,
+and only plate solve them if that fails. Default is --match.
+
 =item B<--[no]force>
 
 Recompute metadata if it already exists. Default is --noforce.
@@ -388,10 +429,16 @@ are done:
    and MODE though.
 
    2. A World Coordinate System is computed using TheSkyX's ImageLink. This is
-   embedded into the header.
-
-   3. A montage of 200x200 postage stamp images in the correct geometric
-   positions is created and emailed to the user as an attachment.
+   embedded into the header. Only the first frame from each camera usually
+   needs this: the WCS of later frames is found by matching their bright stars
+   to those of a solved frame (see wcsmatch), which takes well under a second
+   rather than up to a minute. The PLATE_SOLVED column of the summary says
+   "Matched" for these frames.
+
+   3. A montage of shrunken images of the frames, arranged as the lenses are
+   on the array, is created with preview and emailed to the user as an
+   attachment, along with a north-up view of the field showing the outline of
+   every plate-solved frame.
 
    4. A distortion map is created using SCAMP. This is stored in a .head
    auxiliary file (one for each frame) and the set of .head files emailed to
@@ -4,6 +4,7 @@ use Getopt::Long;
 use Pod::Usage;
 use File::Basename;
 use DateTime;
+use Fcntl qw(:flock);
 
 # Make sure we're not buffering output
 $| = 1;
@@ -70,12 +71,14 @@ foreach $filename (@fits_files) {
     printf("Mean = %8.1f\nMode = %8.1f\n", $statistics{'mean'}, $statistics{'mode'}) if $verbose;
     `modhead $filename MEAN $statistics{'mean'}`;
     `modhead $filename MODE $statistics{'mode'}`;
+    %stored = ("MEAN" => $statistics{'mean'}, "MODE" => $statistics{'mode'});
 
     # Filter information is stored regardless of file type too
     $filter_name = `camera_info filters location | grep $serial_number | awk '{print \$2}'`;
     chop($filter_name);
     $filter_name =~ s/\(|\)//g;
     `modhead $filename FILTNAM $filter_name`;
+    $stored{"FILTNAM"} = $filter_name;
 
     # Seeing is computed if the image is a light frame. This is not allowed to take an
     # arbitrarily long time so we timeout if it isn't finished after a short perior of time.
@@ -98,11 +101,11 @@ foreach $filename (@fits_files) {
 
             # Source extract and filter so we just keep stars
             print "Running SExtractor... " if $verbose;
-            `rm -f /var/tmp/store_metadata.txt`;
+            `rm -f /var/tmp/store_metadata.tbin`;
             $start_time = DateTime->now();
             #`extract /var/tmp/store_metadata_file.fits | tfilter 'CLASS_STAR>0.7 && FLAGS==0' > /var/tmp/store_metadata.txt`;
             # `extract /var/tmp/store_metadata_file.fits > /var/tmp/store_metadata.txt`;
-	    `extract /var/tmp/store_metadata_file.fits |  tfilter 'FWHM_IMAGE>0 && FWHM_IMAGE<10 && CLASS_STAR>0.8 && ISOAREA_IMAGE<100 && ISOAREA_IMAGE>20 && FLAGS==0'  > /var/tmp/store_metadata.txt`;
+	    `extract /var/tmp/store_metadata_file.fits |  tquery -f 'FWHM_IMAGE>0 && FWHM_IMAGE<10 && CLASS_STAR>0.8 && ISOAREA_IMAGE<100 && ISOAREA_IMAGE>20 && FLAGS==0' | tbin > /var/tmp/store_metadata.tbin`;
 
             $end_time = DateTime->now;
             $elapsed_time = $end_time - $start_time;
@@ -110,7 +113,7 @@ foreach $filename (@fits_files) {
             print "done (took $elapsed_time seconds).\n" if $verbose;
 
             # FWHM information
-            $data = `cat /var/tmp/store_metadata.txt | tfilter 'FLAGS==0 && FWHM_IMAGE>0' | tcolumn FWHM_IMAGE | rstats c e s`;
+            $data = `tquery -f 'FLAGS==0 && FWHM_IMAGE>0' -s n,median,sigma FWHM_IMAGE < /var/tmp/store_metadata.tbin`;
             $data =~ s/^\s+//g;
             chop($data);
             ($nobj,$seeing,$sigma) = split(/\s+/,$data);
@@ -126,7 +129,7 @@ foreach $filename (@fits_files) {
             }
 
             # PSF shape information
-            $b_over_a = `cat /var/tmp/store_metadata.txt | tfilter 'FLAGS==0 && FWHM_IMAGE>0' | tcolumn ELLIPTICITY | rstats e`;
+            $b_over_a = `tquery -f 'FLAGS==0 && FWHM_IMAGE>0' -s median ELLIPTICITY < /var/tmp/store_metadata.tbin`;
             chop($b_over_a);
             if (!$b_over_a || $b_over_a =~ /nan/ || $seeing > 900) {
                 $b_over_a = 999;
@@ -140,6 +143,7 @@ foreach $filename (@fits_files) {
                 `modhead $filename NOBJ $nobj`;
                 `modhead $filename ELLIP $b_over_a`;
                 `modhead $filename BOVERA $b_over_a`;
+                @stored{"SEEING","NOBJ","ELLIP"} = ($seeing,$nobj,$b_over_a);
             }
             else {
                 `modhead $filename SEEING 999`;
@@ -147,6 +151,7 @@ foreach $filename (@fits_files) {
                 `modhead $filename NOBJ 0`;
                 `modhead $filename ELLIP 999`;
                 `modhead $filename BOVERA 999`;
+                @stored{"SEEING","NOBJ","ELLIP"} = (999,0,999);
             }
         }
 
@@ -162,15 +167,24 @@ foreach $filename (@fits_files) {
         `modhead $filename SSIGMA 999`;
         `modhead $filename NOBJ 0`;
         `modhead $filename ELLIP 999`;
+        @stored{"SEEING","NOBJ","ELLIP"} = (999,0,999);
     }
 
+    # modhead leaves CHECKSUM as it was, so bring it up to date (the pixels
+    # are untouched, and DATASUM still vouches for them)
+    `fitssum -u -q $filename`;
+
+    &catalog_frame($filename, %stored);
     print "Metadata stored in $filename.\n" if $verbose;
 
 }
 
 # This is a bit gratuitous but useful?
 $tmp = "@fits_files";
-`imcheck -m $tmp` if $mail;
+if ($mail) {
+    `preview -m -o /var/tmp/imcheck.png $tmp`;
+    `mutt -s "postage stamps" -a /var/tmp/imcheck.png projectdragonfly\@icloud.com < /dev/null` if !$?;
+}
 
 
 exit(0);
@@ -178,6 +192,40 @@ exit(0);
 
 ######### Subroutines ########
 
+# Append an up-to-date row for the frame to the catalog in its directory,
+# so that summarize sees the new values without reading the header. Frames
+# that the camera programs did not catalog are left alone.
+sub catalog_frame {
+    my ($filename, %stored) = @_;
+    my ($file, $dirname) = fileparse($filename);
+    my (@names, %entry);
+
+    open(CATALOG, "+<", "${dirname}frames.cat") or return;
+    flock(CATALOG, LOCK_EX);
+    while (<CATALOG>) {
+        if (/^#\s+\d+\s+(\S+)/) {
+            push(@names, $1);
+            next;
+        }
+        my @values = split;
+        @entry{@names} = @values if $values[0] eq $file;
+    }
+    if (%entry) {
+        foreach $keyword (keys %stored) {
+            my $value = &trim($stored{$keyword});
+            $value =~ s/\s+/_/g;
+            $entry{$keyword} = ($value ne "") ? $value : "---";
+        }
+        $check_wcs = `modhead $filename CRPIX1`;
+        $entry{"WCS"} = ($check_wcs =~ /does not exist/) ? "N" : "Y";
+        $entry{"MTIME"} = (stat($filename))[9];
+        seek(CATALOG, 0, 2);
+        print CATALOG join(" ", map { $entry{$_} } @names), "\n";
+    }
+    close(CATALOG);
+}
+
+
 sub getkeys {
     my ($file) = @_;
     my $value = '';
@@ -306,6 +354,11 @@ of seeing), NOBJ (number of objects detected), MEAN (mean of central pixels),
 MODE (mode of central pixels). The SEEING, SSIGMA and NOBJ values are computed
 by running the full frame through SExtractor. 
 
+If the frame is listed in the catalog (frames.cat) that the camera programs
+keep in each data directory, a row with the new values is appended to the
+catalog as well, so that B<summarize> can pick them up without reading the
+header.
+
 Only frames with the IMAGETYP keyword having the value "light" are run through
 SExtractor. All frames are analyzed for MEAN and MODE though.
 
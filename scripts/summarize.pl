@@ -23,6 +23,7 @@ use Pod::Usage;
 # Parse command-line options
 my $positions = 0;
 my $directory = 1;
+my $use_catalog = 1;
 my $bias_subtract = 0;
 my $comment = "";
 my $help = 0;
@@ -34,6 +35,7 @@ $result = GetOptions(
     "positions" => \$positions,
     "bias_subtract!" => \$bias_subtract,
     "directory!" => \$directory,
+    "catalog!" => \$use_catalog,
     "comment=s" => \$comment,
     "help|?" => \$help, 
      man=> \$man) or pod2usage(2);
@@ -57,7 +59,14 @@ foreach $fits_file (@fits_files) {
     $file = "$dirname$basename";
     $filename{$basename} = "$file";
 
-    %mykeys = &getkeys($file);
+    # Frames the catalog knows about, and that have not been modified since
+    # it was told about them, need not be opened
+    $catalog{$dirname} = { &read_catalog($dirname) }
+        if ($use_catalog && !exists $catalog{$dirname});
+    $entry = $catalog{$dirname}{$basename};
+    undef $entry unless ($entry && $entry->{"MTIME"} == (stat($file))[9]);
+
+    %mykeys = $entry ? &catalog_keys($entry) : &getkeys($file);
     $naxis1{$basename}   = $mykeys{"NAXIS1"};
     $naxis2{$basename}   = $mykeys{"NAXIS2"};
     $date{$basename}     = $mykeys{"DATE"}; 
@@ -88,9 +97,14 @@ foreach $fits_file (@fits_files) {
         $rate{$basename} = "---";
     }
 
-    $haswcs{$basename} = "Y";
-    $check_wcs = `modhead $fits_file CRPIX1`;
-    $haswcs{$basename} = "N" if ($check_wcs =~ /does not exist/);
+    if ($entry) {
+        $haswcs{$basename} = $entry->{"WCS"};
+    }
+    else {
+        $haswcs{$basename} = "Y";
+        $check_wcs = `modhead $fits_file CRPIX1`;
+        $haswcs{$basename} = "N" if ($check_wcs =~ /does not exist/);
+    }
 
 }
 
@@ -294,6 +308,43 @@ sub getkeys {
 }
 
 
+# Read the catalog (frames.cat) written alongside the frames by the camera
+# programs and store_metadata. Returns a reference to each frame's most
+# recent row, keyed by file name.
+sub read_catalog {
+    my ($dirname) = @_;
+    my (@names, %rows);
+    open(CATALOG, "<", "${dirname}frames.cat") or return %rows;
+    while (<CATALOG>) {
+        if (/^#\s+\d+\s+(\S+)/) {
+            push(@names, $1);
+            next;
+        }
+        next if /^#/;
+        my %row;
+        @row{@names} = split;
+        $rows{$row{"FILENAME"}} = \%row;
+    }
+    close(CATALOG);
+    return %rows;
+}
+
+
+# The same keys as getkeys, from a catalog row
+sub catalog_keys {
+    my ($entry) = @_;
+    my %key = ();
+    foreach (qw(NAXIS1 NAXIS2 TEMPERAT OBJCTRA OBJCTDEC ALTITUDE EXPTIME IMAGETYP
+                FILTNUM FILTNAM TARGET SEEING ELLIP NOBJ MEAN MODE)) {
+        $key{$_} = $entry->{$_} unless $entry->{$_} eq "---";
+    }
+    $key{"SERIAL"} = $entry->{"SERIALNO"};
+    # getkeys ends up with DATE-OBS when the header has one
+    $key{"DATE"} = ($entry->{"DATE_OBS"} ne "---") ? $entry->{"DATE_OBS"} : $entry->{"DATE"};
+    return %key;
+}
+
+
 sub trim($)
 {
         my $string = shift;
@@ -355,6 +406,11 @@ summarize [options] *.fits
 
 Include directory in filenames.
 
+=item B<--[no]catalog>
+
+Take header values from the catalog (frames.cat) in each directory for frames
+it lists, rather than reading every header. Default is --catalog.
+
 =item B<--bias_subtract>
 
 Bias subtract data for cameras with known bias levels.
@@ -388,5 +444,14 @@ catalog format. In addition to quanties stored in the FITS
 header, image statistics are also reported, computed within 
 a sub-frame. 
 
+The camera programs append a row for every frame they write to a catalog,
+frames.cat, in the same directory, and B<store_metadata> appends an updated
+row when it adds SEEING, MEAN and so on. Frames listed there are summarized
+from the catalog, so a night of frames takes a fraction of a second rather
+than one B<listhead> per file. A frame whose file has changed since its last
+catalog row (for example because it has since been plate solved) is read
+from its header as before. A catalog for a directory written before the
+camera programs kept one can be made with B<fitsscan>.
+
 =cut
 
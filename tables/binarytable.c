@@ -0,0 +1,296 @@
+/*
+ * BINARYTABLE - Read and write the binary table format (see binarytable.h).
+ *
+ * A table on disk is mapped rather than read, so opening one costs the
+ * same however many rows it has, and a query only touches the pages of
+ * the columns it uses.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "binarytable.h"
+
+#define ALIGN(n) (((n) + 7) & ~((uint64_t) 7))
+
+
+int OpenBinaryTable(t_table *table, FILE *fp)
+{
+    struct stat sb;
+    int fd = fileno(fp);
+
+    memset(table, 0, sizeof(t_table));
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        table->size = sb.st_size;
+        table->base = mmap(NULL, table->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (table->base == MAP_FAILED) {
+            perror("Unable to map table");
+            return(1);
+        }
+        table->mapped = 1;
+    }
+    else {
+        // A pipe has to be read in full
+        size_t allocated = 1 << 20;
+        size_t n;
+        table->base = (char *) malloc(allocated);
+        while ((n = fread(table->base + table->size, 1, allocated - table->size, fp)) > 0) {
+            table->size += n;
+            if (table->size == allocated)
+                table->base = (char *) realloc(table->base, allocated *= 2);
+        }
+    }
+
+    table->header = (t_tablehdr *) table->base;
+    table->columns = (t_tablecol *) (table->base + sizeof(t_tablehdr));
+    if (table->size < sizeof(t_tablehdr)
+            || memcmp(table->header->magic, TABLE_MAGIC, 8) != 0) {
+        fprintf(stderr, "Not a binary table\n");
+        CloseBinaryTable(table);
+        return(1);
+    }
+    if (table->header->byteorder != TABLE_BYTEORDER) {
+        fprintf(stderr, "Binary table was written with a different byte order\n");
+        CloseBinaryTable(table);
+        return(1);
+    }
+    if (sizeof(t_tablehdr) + table->header->ncolumns*sizeof(t_tablecol) > table->size) {
+        fprintf(stderr, "Binary table is truncated\n");
+        CloseBinaryTable(table);
+        return(1);
+    }
+    for (uint32_t i = 0; i < table->header->ncolumns; i++) {
+        t_tablecol *c = &table->columns[i];
+        if (c->offset + table->header->nrows*c->width > table->size
+                || c->name[TABLE_NAME - 1] || c->description[TABLE_DESCRIPTION - 1]) {
+            fprintf(stderr, "Binary table is corrupt\n");
+            CloseBinaryTable(table);
+            return(1);
+        }
+    }
+    return(0);
+}
+
+
+void CloseBinaryTable(t_table *table)
+{
+    if (table->mapped)
+        munmap(table->base, table->size);
+    else
+        free(table->base);
+    memset(table, 0, sizeof(t_table));
+}
+
+
+void *TableColumn(t_table *table, int column)
+{
+    return(table->base + table->columns[column].offset);
+}
+
+
+/* Format a value as it would appear in a text table */
+int FormatTableValue(t_table *table, int column, uint64_t row, char *buffer, size_t size)
+{
+    t_tablecol *c = &table->columns[column];
+    char *value = table->base + c->offset + row*c->width;
+
+    switch (c->type) {
+        case TABLE_INT:
+            return snprintf(buffer, size, "%lld", (long long) *(int64_t *) value);
+        case TABLE_DOUBLE:
+            return snprintf(buffer, size, "%.15g", *(double *) value);
+        default:
+            return snprintf(buffer, size, "%.*s", (int) strnlen(value, c->width), value);
+    }
+}
+
+
+/* Convert a text table (header lines and rows, as read) to binary. The */
+/* type of each column is the narrowest that holds every value in it.   */
+
+int WriteBinaryTable(FILE *fp, char **header, int nheader, char **rows, long nrows)
+{
+    t_tablehdr hdr;
+    t_tablecol *cols = NULL;
+    char **start = NULL;
+    int *length = NULL;
+    int ncolumns = 0;
+    uint64_t offset;
+    char padding[8] = { 0 };
+
+    /* Split the rows, remembering where each field is */
+    for (long r = 0; r < nrows; r++) {
+        int n = 0;
+        for (char *p = rows[r]; ; n++) {
+            while (isspace((unsigned char) *p))
+                p++;
+            if (*p == '\0')
+                break;
+            while (*p && !isspace((unsigned char) *p))
+                p++;
+        }
+        if (n > ncolumns)
+            ncolumns = n;
+    }
+    for (int i = 0; i < nheader; i++) {
+        int number;
+        if (header[i][1] != '!' && sscanf(header[i] + 1, "%d", &number) == 1 && number > ncolumns)
+            ncolumns = number;
+    }
+    start = (char **) calloc((size_t) nrows*ncolumns + 1, sizeof(char *));
+    length = (int *) calloc((size_t) nrows*ncolumns + 1, sizeof(int));
+    cols = (t_tablecol *) calloc(ncolumns + 1, sizeof(t_tablecol));
+    if (start == NULL || length == NULL || cols == NULL) {
+        fprintf(stderr, "Not enough memory to convert table\n");
+        return(1);
+    }
+    for (long r = 0; r < nrows; r++) {
+        char *p = rows[r];
+        for (int k = 0; k < ncolumns; k++) {
+            while (isspace((unsigned char) *p))
+                p++;
+            if (*p == '\0')
+                break;
+            start[r*ncolumns + k] = p;
+            while (*p && !isspace((unsigned char) *p))
+                p++;
+            length[r*ncolumns + k] = p - start[r*ncolumns + k];
+        }
+    }
+
+    /* Name the columns from the header. Fields with no header line of */
+    /* their own are later elements of a vector (e.g. MAG_APER).       */
+    for (int i = 0; i < nheader; i++) {
+        int number, skip;
+        char name[TABLE_NAME];
+        char *desc;
+        if (header[i][1] == '!' || sscanf(header[i] + 1, "%d %31s%n", &number, name, &skip) != 2
+                || number < 1 || number > ncolumns)
+            continue;
+        snprintf(cols[number - 1].name, TABLE_NAME, "%s", name);
+        for (desc = header[i] + 1 + skip; isspace((unsigned char) *desc); desc++)
+            ;
+        snprintf(cols[number - 1].description, TABLE_DESCRIPTION, "%s", desc);
+        cols[number - 1].description[strcspn(cols[number - 1].description, "\r\n")] = '\0';
+    }
+    for (int k = 0, last = -1; k < ncolumns; k++) {
+        if (cols[k].name[0]) {
+            last = k;
+            continue;
+        }
+        if (last >= 0)
+            snprintf(cols[k].name, TABLE_NAME, "%.24s_%u", cols[last].name,
+                    (unsigned) (k - last + 1) % 1000000u);
+        else
+            snprintf(cols[k].name, TABLE_NAME, "COLUMN%d", k + 1);
+    }
+
+    /* Work out the type of each column */
+    for (int k = 0; k < ncolumns; k++) {
+        int is_int = 1, is_double = 1;
+        uint32_t width = 1;
+        for (long r = 0; r < nrows; r++) {
+            char *s = start[r*ncolumns + k];
+            int len = length[r*ncolumns + k];
+            char field[64];
+            char *end;
+            if (len > width)
+                width = len;
+            if (s == NULL) {
+                is_int = 0;       // a missing value can only be a NaN
+                continue;
+            }
+            if (!is_double)
+                continue;
+            if (len >= (int) sizeof(field)) {
+                is_int = is_double = 0;
+                continue;
+            }
+            memcpy(field, s, len);
+            field[len] = '\0';
+            if (is_int) {
+                errno = 0;
+                strtoll(field, &end, 10);
+                if (*end != '\0' || errno == ERANGE)
+                    is_int = 0;
+            }
+            if (!is_int) {
+                strtod(field, &end);
+                if (*end != '\0')
+                    is_double = 0;
+            }
+        }
+        if (is_int) {
+            cols[k].type = TABLE_INT;
+            cols[k].width = sizeof(int64_t);
+        }
+        else if (is_double) {
+            cols[k].type = TABLE_DOUBLE;
+            cols[k].width = sizeof(double);
+        }
+        else {
+            cols[k].type = TABLE_STRING;
+            cols[k].width = width;
+        }
+    }
+
+    /* Lay out the file */
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TABLE_MAGIC, 8);
+    hdr.byteorder = TABLE_BYTEORDER;
+    hdr.ncolumns = ncolumns;
+    hdr.nrows = nrows;
+    offset = sizeof(t_tablehdr) + ncolumns*sizeof(t_tablecol);
+    for (int k = 0; k < ncolumns; k++) {
+        cols[k].offset = offset;
+        offset = ALIGN(offset + (uint64_t) nrows*cols[k].width);
+    }
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fwrite(cols, sizeof(t_tablecol), ncolumns, fp);
+
+    for (int k = 0; k < ncolumns; k++) {
+        char field[64];
+        char *value = (char *) malloc(cols[k].width);
+        for (long r = 0; r < nrows; r++) {
+            char *s = start[r*ncolumns + k];
+            int len = length[r*ncolumns + k];
+            if (cols[k].type == TABLE_STRING) {
+                memset(value, 0, cols[k].width);
+                if (s)
+                    memcpy(value, s, len);
+            }
+            else {
+                if (s) {
+                    memcpy(field, s, len);
+                    field[len] = '\0';
+                }
+                if (cols[k].type == TABLE_INT)
+                    *(int64_t *) value = strtoll(field, NULL, 10);
+                else
+                    *(double *) value = s ? strtod(field, NULL) : NAN;
+            }
+            fwrite(value, cols[k].width, 1, fp);
+        }
+        free(value);
+        fwrite(padding, 1, ALIGN((uint64_t) nrows*cols[k].width) - (uint64_t) nrows*cols[k].width, fp);
+    }
+
+    free(start);
+    free(length);
+    free(cols);
+    if (fflush(fp) != 0 || ferror(fp)) {
+        perror("Unable to write table");
+        return(1);
+    }
+    return(0);
+}
@@ -0,0 +1,62 @@
+/*
+ * BINARYTABLE - A column-oriented binary form of our text tables.
+ *
+ * The file is a fixed header, a descriptor per column, then the values of
+ * each column stored contiguously, 8-byte aligned, in the byte order of the
+ * machine that wrote it:
+ *
+ *     t_tablehdr                        magic, byte order, counts
+ *     t_tablecol[ncolumns]              name, description, type, offset
+ *     column 1: nrows values
+ *     column 2: nrows values
+ *     ...
+ *
+ * Integers are int64_t, reals are doubles and strings are fixed-width and
+ * NUL-padded, so once the file is mapped a column is just an array.
+ */
+
+#ifndef BINARYTABLE_H
+#define BINARYTABLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define TABLE_MAGIC "TBIN\r\n\032\n"
+#define TABLE_BYTEORDER 0x01020304
+#define TABLE_NAME 32
+#define TABLE_DESCRIPTION 96
+
+enum { TABLE_INT = 'K', TABLE_DOUBLE = 'D', TABLE_STRING = 'A' };
+
+typedef struct {
+    char     magic[8];
+    uint32_t byteorder;
+    uint32_t ncolumns;
+    uint64_t nrows;
+} t_tablehdr;
+
+typedef struct {
+    char     name[TABLE_NAME];
+    char     description[TABLE_DESCRIPTION];  // rest of the text header line
+    uint32_t type;
+    uint32_t width;                           // bytes per value
+    uint64_t offset;                          // from the start of the file
+} t_tablecol;
+
+typedef struct {
+    char       *base;
+    size_t      size;
+    int         mapped;
+    t_tablehdr *header;
+    t_tablecol *columns;
+} t_table;
+
+/* Function prototypes */
+int  OpenBinaryTable(t_table *table, FILE *fp);
+void CloseBinaryTable(t_table *table);
+void *TableColumn(t_table *table, int column);
+int  FormatTableValue(t_table *table, int column, uint64_t row, char *buffer, size_t size);
+int  WriteBinaryTable(FILE *fp, char **header, int nheader, char **rows, long nrows);
+
+#endif
@@ -0,0 +1,488 @@
+/*
+ * FITSSCAN - Tabulate FITS header keywords for many files in parallel.
+ *
+ * Only the header blocks of each file are read, never the pixels, and the
+ * files are shared out among a pool of threads. Scanning an archive is
+ * then limited by how fast the disks can deliver a few kilobytes per file,
+ * rather than by starting a listhead process for every frame.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define MAX_STRING 1024
+#define MAX_COLUMNS 64
+#define BLOCK 2880
+#define CARD 80
+#define READ_BLOCKS 4           // header blocks fetched per read
+#define MAX_HEADER_BLOCKS 256   // give up on headers longer than this
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+
+#define usage "\n\
+NAME\n\
+fitsscan --- tabulate FITS header keywords for many files in parallel \n\
+\n\
+SYNOPSIS\n\
+fitsscan [options] file|directory [file|directory ...] \n\
+\n\
+DESCRIPTION\n\
+\"fitsscan\" reads the header of every FITS file named, or found in the\n\
+directories named (files ending in .fits, .fit, .fts or .fz), and prints one\n\
+row per file as a SExtractor-style table that tfilter, tcolumn and the other\n\
+table tools understand. \"-\" reads a list of files, one per line, from stdin.\n\
+Only the header blocks of each file are read, and the files are spread over\n\
+several threads. Rows come out in the order the files were given, with the\n\
+contents of each directory sorted by name. Missing keywords are shown as ---.\n\
+\n\
+For a file with an empty primary array, such as one compressed with fpack,\n\
+keywords from the first extension take precedence and ZNAXIS1 and ZNAXIS2\n\
+are reported as NAXIS1 and NAXIS2.\n\
+\n\
+By default the columns are those of the frame catalog (frames.cat) that the\n\
+camera programs keep in each data directory, so a catalog can be made for a\n\
+night that was taken before they kept one:\n\
+\n\
+    fitsscan /Users/dragonfly/Data/2016-05-02 > /Users/dragonfly/Data/2016-05-02/frames.cat\n\
+\n\
+With -k, the columns are just the keywords asked for (with - in a keyword\n\
+becoming _ in the column name).\n\
+\n\
+The exit status is 1 if any file could not be read as FITS.\n\
+\n\
+OPTIONS\n\
+-k keywords  # comma-separated list of keywords to tabulate \n\
+-j threads   # number of threads (default: one per processor) \n\
+-r           # descend into subdirectories \n\
+-v           # report the number of files and the time taken \n\
+\n\
+EXAMPLES\n\
+fitsscan *_light.fits | tfilter 'SEEING < 3' | tcolumn FILENAME \n\
+fitsscan -r -k SERIALNO,IMAGETYP,EXPTIME,DATE-OBS /Users/dragonfly/Data \n\
+find . -name '*_flat.fits' | fitsscan -k FILTNAM,MEAN - \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+/* What goes in a column */
+enum { KEYWORD, PRESENT, MTIME, NOTHING };
+
+typedef struct {
+    char *name;
+    char *keyword;
+    int   kind;
+    char *description;
+} t_column;
+
+typedef struct {
+    char *path;      // file to read
+    char *name;      // as shown in the FILENAME column
+    char *row;       // the formatted row, once scanned (NULL if unreadable)
+    int   done;
+} t_frame;
+
+/* The layout of frames.cat (see store_frame_catalog in camera.c) */
+static t_column catalog_columns[] = {
+    { "SERIALNO", "SERIALNO", KEYWORD, "Camera serial number" },
+    { "IMAGETYP", "IMAGETYP", KEYWORD, "Image type" },
+    { "EXPTIME",  "EXPTIME",  KEYWORD, "Exposure time                                             [s]" },
+    { "TEMPERAT", "TEMPERAT", KEYWORD, "CCD temperature                                           [C]" },
+    { "FILTNUM",  "FILTNUM",  KEYWORD, "Filter number" },
+    { "FILTNAM",  "FILTNAM",  KEYWORD, "Filter name" },
+    { "TARGET",   "TARGET",   KEYWORD, "Target name" },
+    { "OBJCTRA",  "OBJCTRA",  KEYWORD, "Right ascension" },
+    { "OBJCTDEC", "OBJCTDEC", KEYWORD, "Declination" },
+    { "ALTITUDE", "ALTITUDE", KEYWORD, "Altitude                                                  [deg]" },
+    { "NAXIS1",   "NAXIS1",   KEYWORD, "Width                                                     [pixel]" },
+    { "NAXIS2",   "NAXIS2",   KEYWORD, "Height                                                    [pixel]" },
+    { "DATE",     "DATE",     KEYWORD, "UTC when the file was written" },
+    { "DATE_OBS", "DATE-OBS", KEYWORD, "UTC at start of exposure" },
+    { "DEADTIME", "",         NOTHING, "Time from end of exposure to end of write                 [s]" },
+    { "SEEING",   "SEEING",   KEYWORD, "Seeing FWHM                                               [pixel]" },
+    { "ELLIP",    "ELLIP",    KEYWORD, "Ellipticity" },
+    { "NOBJ",     "NOBJ",     KEYWORD, "Number of objects detected" },
+    { "MEAN",     "MEAN",     KEYWORD, "Mean of central pixels" },
+    { "MODE",     "MODE",     KEYWORD, "Mode of central pixels" },
+    { "WCS",      "CRPIX1",   PRESENT, "Y if the header has a WCS" },
+    { "MTIME",    "",         MTIME,   "Modification time of the file for this row                [s]" }
+};
+#define NCATALOGCOLUMNS (sizeof(catalog_columns)/sizeof(t_column))
+
+static t_column *columns = catalog_columns;
+static int ncolumns = NCATALOGCOLUMNS;
+
+static t_frame *frames = NULL;
+static int nframes = 0;
+static int next_frame = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+
+
+static void add_frame(char *path, char *name)
+{
+    static int maxframes = 0;
+    if (nframes == maxframes) {
+        maxframes = maxframes ? 2*maxframes : 1024;
+        frames = (t_frame *) realloc(frames, maxframes*sizeof(t_frame));
+    }
+    frames[nframes].path = strdup(path);
+    frames[nframes].name = strdup(name);
+    frames[nframes].row = NULL;
+    frames[nframes].done = 0;
+    nframes++;
+}
+
+
+static int is_fits(const char *name)
+{
+    static const char *extensions[] = { ".fits", ".fit", ".fts", ".fz" };
+    size_t n = strlen(name);
+    if (name[0] == '.')
+        return(0);
+    for (size_t i = 0; i < sizeof(extensions)/sizeof(char *); i++) {
+        size_t m = strlen(extensions[i]);
+        if (n > m && strcasecmp(name + n - m, extensions[i]) == 0)
+            return(1);
+    }
+    return(0);
+}
+
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(((const t_frame *) a)->name, ((const t_frame *) b)->name);
+}
+
+
+/* Add the FITS files in a directory, named relative to the top directory */
+
+static void add_directory(char *top, char *relative, int recurse)
+{
+    char path[MAX_STRING], name[MAX_STRING];
+    int first = nframes;
+    struct dirent *de;
+    struct stat sb;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "%s%s%s", top, relative[0] ? "/" : "", relative);
+    if ((dir = opendir(path)) == NULL) {
+        perror(path);
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        // A truncated name would be the wrong file, or none
+        if ((size_t) snprintf(name, sizeof(name), "%s%s%s", relative, relative[0] ? "/" : "",
+                    de->d_name) >= sizeof(name)
+                || (size_t) snprintf(path, sizeof(path), "%s/%s", top, name) >= sizeof(path)) {
+            fprintf(stderr, "Path too long, skipped: %s\n", de->d_name);
+            continue;
+        }
+        if (is_fits(de->d_name))
+            add_frame(path, name);
+        else if (recurse && stat(path, &sb) == 0 && S_ISDIR(sb.st_mode))
+            add_directory(top, name, recurse);
+    }
+    closedir(dir);
+    qsort(frames + first, nframes - first, sizeof(t_frame), compare_names);
+}
+
+
+/* Copy the value of a header card, without quotes, comment or padding. */
+/* Blanks inside a value become underscores to keep the table columnar. */
+
+static void card_value(const char *card, char *value)
+{
+    const char *p = card + 10;
+    const char *end = card + CARD;
+    char *v = value;
+
+    while (p < end && *p == ' ')
+        p++;
+    if (p < end && *p == '\'') {
+        // A quote inside a string is written as two quotes
+        for (p++; p < end; p++) {
+            if (*p == '\'') {
+                if (p + 1 < end && p[1] == '\'')
+                    p++;
+                else
+                    break;
+            }
+            *v++ = *p;
+        }
+    } else {
+        while (p < end && *p != '/')
+            *v++ = *p++;
+    }
+    while (v > value && v[-1] == ' ')
+        v--;
+    *v = '\0';
+    for (v = value; *v; v++)
+        if (*v == ' ' || *v == '\t')
+            *v = '_';
+}
+
+
+/* Read the header starting at *offset and note the values of any columns */
+/* in it. Leaves *offset at the end of the header. Returns 0 on success.   */
+
+static int scan_header(int fd, off_t *offset, char *buffer, char **values,
+        char *naxis, char *znaxis1, char *znaxis2)
+{
+    for (int nblocks = 0; nblocks < MAX_HEADER_BLOCKS; nblocks += READ_BLOCKS) {
+        ssize_t n = pread(fd, buffer, READ_BLOCKS*BLOCK, *offset);
+        if (n < BLOCK)
+            return(1);
+        n -= n % BLOCK;
+        for (char *card = buffer; card < buffer + n; card += CARD) {
+            if (strncmp(card, "END     ", 8) == 0) {
+                *offset += (card - buffer)/BLOCK*BLOCK + BLOCK;
+                return(0);
+            }
+            if (card[8] != '=')
+                continue;
+            if (strncmp(card, "NAXIS   ", 8) == 0 && naxis)
+                card_value(card, naxis);
+            else if (strncmp(card, "ZNAXIS1 ", 8) == 0)
+                card_value(card, znaxis1);
+            else if (strncmp(card, "ZNAXIS2 ", 8) == 0)
+                card_value(card, znaxis2);
+            for (int i = 0; i < ncolumns; i++) {
+                size_t len = strlen(columns[i].keyword);
+                if (columns[i].kind == NOTHING || columns[i].kind == MTIME || len > 8
+                        || strncmp(card, columns[i].keyword, len) != 0
+                        || (len < 8 && card[len] != ' '))
+                    continue;
+                card_value(card, values[i]);
+            }
+        }
+        *offset += n;
+    }
+    return(1);
+}
+
+
+/* Format one row of the table for a file, or return NULL if it is not FITS */
+
+static char *scan_frame(t_frame *frame, char *buffer)
+{
+    char storage[MAX_COLUMNS][CARD];
+    char *values[MAX_COLUMNS];
+    char naxis[CARD] = "", znaxis1[CARD] = "", znaxis2[CARD] = "";
+    char row[MAX_COLUMNS*CARD + MAX_STRING];
+    size_t len;
+    off_t offset = 0;
+    struct stat sb;
+    int fd;
+
+    for (int i = 0; i < ncolumns; i++) {
+        values[i] = storage[i];
+        storage[i][0] = '\0';
+    }
+
+    if ((fd = open(frame->path, O_RDONLY)) < 0 || fstat(fd, &sb) != 0) {
+        perror(frame->path);
+        if (fd >= 0)
+            close(fd);
+        return(NULL);
+    }
+#ifdef POSIX_FADV_RANDOM
+    // Only the first few blocks are wanted, so don't read ahead into the pixels
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+
+    if (pread(fd, buffer, CARD, 0) != CARD || strncmp(buffer, "SIMPLE  =", 9) != 0
+            || scan_header(fd, &offset, buffer, values, naxis, znaxis1, znaxis2)) {
+        fprintf(stderr, "%s: not a FITS file\n", frame->path);
+        close(fd);
+        return(NULL);
+    }
+    // The image of a compressed file is in the first extension
+    if (atoi(naxis) == 0 && offset < sb.st_size) {
+        if (scan_header(fd, &offset, buffer, values, NULL, znaxis1, znaxis2) == 0) {
+            for (int i = 0; i < ncolumns; i++) {
+                if (strcmp(columns[i].keyword, "NAXIS1") == 0 && znaxis1[0])
+                    strcpy(values[i], znaxis1);
+                if (strcmp(columns[i].keyword, "NAXIS2") == 0 && znaxis2[0])
+                    strcpy(values[i], znaxis2);
+            }
+        }
+    }
+    close(fd);
+
+    len = snprintf(row, sizeof(row), "%s", frame->name);
+    for (int i = 0; i < ncolumns && len < sizeof(row); i++) {
+        char *value = values[i][0] ? values[i] : "---";
+        if (columns[i].kind == PRESENT)
+            value = values[i][0] ? "Y" : "N";
+        if (columns[i].kind == MTIME) {
+            snprintf(values[i], CARD, "%ld", (long) sb.st_mtime);
+            value = values[i];
+        }
+        len += snprintf(row + len, sizeof(row) - len, " %s", value);
+    }
+    if (len >= sizeof(row) - 1)
+        len = sizeof(row) - 2;
+    row[len++] = '\n';
+    row[len] = '\0';
+    return(strdup(row));
+}
+
+
+static void *worker(void *arg)
+{
+    char *buffer = (char *) malloc(READ_BLOCKS*BLOCK);
+
+    for (;;) {
+        int i;
+        char *row;
+
+        pthread_mutex_lock(&lock);
+        i = next_frame++;
+        pthread_mutex_unlock(&lock);
+        if (i >= nframes)
+            break;
+
+        row = scan_frame(&frames[i], buffer);
+
+        pthread_mutex_lock(&lock);
+        frames[i].row = row;
+        frames[i].done = 1;
+        pthread_cond_signal(&finished);
+        pthread_mutex_unlock(&lock);
+    }
+    free(buffer);
+    return(NULL);
+}
+
+
+static double monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int c;
+    int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int recurse = 0;
+    int verbose = 0;
+    int nfailed = 0;
+    char *keywords = NULL;
+    pthread_t *threads;
+    double start = monotonic_time();
+    struct stat sb;
+
+    while ((c = getopt(argc, argv, "k:j:rvh")) != -1) {
+        switch (c) {
+            case 'k':
+                keywords = optarg;
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                break;
+            case 'r':
+                recurse = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (optind == argc) {
+        error_exit(usage);
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+
+    if (keywords) {
+        columns = (t_column *) calloc(MAX_COLUMNS, sizeof(t_column));
+        ncolumns = 0;
+        for (char *k = strtok(keywords, ","); k && ncolumns < MAX_COLUMNS; k = strtok(NULL, ",")) {
+            columns[ncolumns].keyword = k;
+            columns[ncolumns].name = strdup(k);
+            for (char *p = columns[ncolumns].name; *p; p++)
+                if (*p == '-')
+                    *p = '_';
+            columns[ncolumns].kind = KEYWORD;
+            columns[ncolumns].description = "";
+            ncolumns++;
+        }
+    }
+
+    /* Make the list of files */
+    for (; optind < argc; optind++) {
+        if (strcmp(argv[optind], "-") == 0) {
+            char line[MAX_STRING];
+            while (fgets(line, sizeof(line), stdin) != NULL) {
+                line[strcspn(line, "\r\n")] = '\0';
+                if (line[0])
+                    add_frame(line, line);
+            }
+        }
+        else if (stat(argv[optind], &sb) == 0 && S_ISDIR(sb.st_mode))
+            add_directory(argv[optind], "", recurse);
+        else
+            add_frame(argv[optind], argv[optind]);
+    }
+
+    /* Scan them, printing the rows in order as they become available */
+    if (keywords)
+        printf("#%4d %s\n", 1, "FILENAME");
+    else
+        printf("#%4d %-16s%s\n", 1, "FILENAME", "Name of the FITS file");
+    for (int i = 0; i < ncolumns; i++) {
+        if (columns[i].description[0])
+            printf("#%4d %-16s%s\n", i + 2, columns[i].name, columns[i].description);
+        else
+            printf("#%4d %s\n", i + 2, columns[i].name);
+    }
+
+    threads = (pthread_t *) malloc(nthreads*sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, NULL);
+
+    for (int i = 0; i < nframes; i++) {
+        pthread_mutex_lock(&lock);
+        while (!frames[i].done)
+            pthread_cond_wait(&finished, &lock);
+        pthread_mutex_unlock(&lock);
+        if (frames[i].row) {
+            fputs(frames[i].row, stdout);
+            free(frames[i].row);
+        }
+        else
+            nfailed++;
+    }
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    if (verbose) {
+        double dt = monotonic_time() - start;
+        fprintf(stderr, "Scanned %d files in %.3f s (%.0f files/s) with %d threads\n",
+                nframes, dt, dt > 0 ? nframes/dt : 0.0, nthreads);
+    }
+    return(nfailed > 0);
+
+}
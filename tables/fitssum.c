@@ -0,0 +1,526 @@
+/*
+ * FITSSUM - Verify the FITS checksums (DATASUM and CHECKSUM) of many files
+ * in parallel.
+ *
+ * Each file is mapped and summed in one sequential pass, with the files
+ * shared out among a pool of threads. The ones' complement sums are made
+ * from 16-bit halves of the 32-bit words in runs short enough that 32-bit
+ * lanes cannot overflow, so the compiler turns the inner loop into vector
+ * adds and a pass runs at close to memory speed. Checking a night's frames
+ * is then limited by the disks rather than by cfitsio reading and
+ * converting every pixel.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define MAX_STRING 1024
+#define BLOCK 2880
+#define CARD 80
+#define RUN 65536               // words summed in 32-bit lanes before carrying out
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+
+#define usage "\n\
+NAME\n\
+fitssum --- verify the checksums of many FITS files in parallel \n\
+\n\
+SYNOPSIS\n\
+fitssum [options] file|directory [file|directory ...] \n\
+\n\
+DESCRIPTION\n\
+\"fitssum\" checks the DATASUM and CHECKSUM keywords of every HDU of every FITS\n\
+file named, or found in the directories named (files ending in .fits, .fit,\n\
+.fts or .fz), and prints one row per file as a SExtractor-style table that\n\
+tfilter, tcolumn and the other table tools understand. \"-\" reads a list of\n\
+files, one per line, from stdin. The camera programs write both keywords as\n\
+each frame is taken, so a frame that fails has been damaged since.\n\
+\n\
+DATASUM covers only the pixels and CHECKSUM the whole HDU, so the STATUS\n\
+column is one of:\n\
+\n\
+    OK          every checksum present is right\n\
+    BAD_DATA    the pixels have changed (DATASUM is wrong)\n\
+    BAD_HEADER  the pixels are intact but the header was edited without\n\
+                updating CHECKSUM (for example by modhead)\n\
+    UPDATED     as BAD_HEADER, but CHECKSUM has been brought up to date (-u)\n\
+    NO_SUMS     no HDU has a DATASUM or CHECKSUM\n\
+    UNREADABLE  not a FITS file, or shorter than its headers say\n\
+\n\
+Files are checked by several threads at once and the rows come out in the\n\
+order the files were given, with the contents of each directory sorted by\n\
+name. The exit status is 1 if any file is BAD_DATA, BAD_HEADER or\n\
+UNREADABLE.\n\
+\n\
+-u rewrites CHECKSUM in every HDU whose pixels are intact (DATASUM is right)\n\
+but whose header has been edited since. Run it after adding keywords with\n\
+modhead, as store_metadata and post_process do, so that later checks only\n\
+fail frames that have really been damaged. DATASUM is never changed, so -u\n\
+cannot hide damage to the pixels.\n\
+\n\
+OPTIONS\n\
+-j threads   # number of threads (default: one per processor) \n\
+-r           # descend into subdirectories \n\
+-q           # only list files that fail \n\
+-u           # bring CHECKSUM up to date where only the header has changed \n\
+-v           # report the number of files, bytes and the time taken \n\
+\n\
+EXAMPLES\n\
+fitssum /Users/dragonfly/Data/2016-05-02 \n\
+fitssum -q -r /Volumes/archive | tcolumn FILENAME \n\
+fitssum -u -q 83F010783_17_light.fits \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+enum { OK, BAD_DATA, BAD_HEADER, UPDATED, NO_SUMS, UNREADABLE };
+static char *status_names[] = { "OK", "BAD_DATA", "BAD_HEADER", "UPDATED", "NO_SUMS", "UNREADABLE" };
+
+typedef struct {
+    char *path;      // file to read
+    char *name;      // as shown in the FILENAME column
+    int   status;
+    int   nhdu;
+    off_t size;
+    int   done;
+} t_frame;
+
+static t_frame *frames = NULL;
+static int nframes = 0;
+static int next_frame = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+static int update = 0;
+
+
+static void add_frame(char *path, char *name)
+{
+    static int maxframes = 0;
+    if (nframes == maxframes) {
+        maxframes = maxframes ? 2*maxframes : 1024;
+        frames = (t_frame *) realloc(frames, maxframes*sizeof(t_frame));
+    }
+    memset(&frames[nframes], 0, sizeof(t_frame));
+    frames[nframes].path = strdup(path);
+    frames[nframes].name = strdup(name);
+    nframes++;
+}
+
+
+static int is_fits(const char *name)
+{
+    static const char *extensions[] = { ".fits", ".fit", ".fts", ".fz" };
+    size_t n = strlen(name);
+    if (name[0] == '.')
+        return(0);
+    for (size_t i = 0; i < sizeof(extensions)/sizeof(char *); i++) {
+        size_t m = strlen(extensions[i]);
+        if (n > m && strcasecmp(name + n - m, extensions[i]) == 0)
+            return(1);
+    }
+    return(0);
+}
+
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(((const t_frame *) a)->name, ((const t_frame *) b)->name);
+}
+
+
+/* Add the FITS files in a directory, named relative to the top directory */
+
+static void add_directory(char *top, char *relative, int recurse)
+{
+    char path[MAX_STRING], name[MAX_STRING];
+    int first = nframes;
+    struct dirent *de;
+    struct stat sb;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "%s%s%s", top, relative[0] ? "/" : "", relative);
+    if ((dir = opendir(path)) == NULL) {
+        perror(path);
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        // A truncated name would be the wrong file, or none
+        if ((size_t) snprintf(name, sizeof(name), "%s%s%s", relative, relative[0] ? "/" : "",
+                    de->d_name) >= sizeof(name)
+                || (size_t) snprintf(path, sizeof(path), "%s/%s", top, name) >= sizeof(path)) {
+            fprintf(stderr, "Path too long, skipped: %s\n", de->d_name);
+            continue;
+        }
+        if (is_fits(de->d_name))
+            add_frame(path, name);
+        else if (recurse && stat(path, &sb) == 0 && S_ISDIR(sb.st_mode))
+            add_directory(top, name, recurse);
+    }
+    closedir(dir);
+    qsort(frames + first, nframes - first, sizeof(t_frame), compare_names);
+}
+
+
+/* The 32-bit ones' complement sum of n bytes (a multiple of 4) taken as */
+/* big-endian words, before the final fold                               */
+
+static uint64_t sum_words(const unsigned char *p, size_t n)
+{
+    uint64_t hi = 0, lo = 0, sum;
+    size_t nwords = n/4;
+
+    for (size_t i = 0; i < nwords; i += RUN) {
+        size_t m = nwords - i < RUN ? nwords - i : RUN;
+        const unsigned char *q = p + 4*i;
+        uint32_t h = 0, l = 0;
+        for (size_t k = 0; k < m; k++) {
+            h += (q[4*k] << 8) | q[4*k + 1];
+            l += (q[4*k + 2] << 8) | q[4*k + 3];
+        }
+        hi += h;
+        lo += l;
+    }
+    sum = (hi << 16) + lo;
+    while (sum >> 32)
+        sum = (sum & 0xffffffff) + (sum >> 32);
+    return(sum);
+}
+
+
+static uint32_t fold(uint64_t sum)
+{
+    while (sum >> 32)
+        sum = (sum & 0xffffffff) + (sum >> 32);
+    return (uint32_t) sum;
+}
+
+
+/* The 16-character ASCII encoding of a checksum, as cfitsio makes it */
+
+static void encode_checksum(uint32_t sum, char *ascii)
+{
+    static const unsigned char exclude[] = { 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40,
+                                             0x5b, 0x5c, 0x5d, 0x5e, 0x5f, 0x60 };
+    char asc[16];
+    int ch[4];
+
+    for (int i = 0; i < 4; i++) {
+        int byte = (sum >> (24 - 8*i)) & 0xff;
+        for (int j = 0; j < 4; j++)
+            ch[j] = byte/4 + 0x30;
+        ch[0] += byte % 4;
+        for (int changed = 1; changed; ) {
+            changed = 0;
+            for (size_t k = 0; k < sizeof(exclude); k++)
+                for (int j = 0; j < 4; j += 2)
+                    if (ch[j] == exclude[k] || ch[j + 1] == exclude[k]) {
+                        ch[j]++;
+                        ch[j + 1]--;
+                        changed = 1;
+                    }
+        }
+        for (int j = 0; j < 4; j++)
+            asc[4*j + i] = (char) ch[j];
+    }
+    for (int i = 0; i < 16; i++)
+        ascii[i] = asc[(i + 15) % 16];
+}
+
+
+/* Integer or string value of a header card */
+
+static long card_long(const char *card)
+{
+    char value[CARD];
+    memcpy(value, card + 10, CARD - 10);
+    value[CARD - 10] = '\0';
+    return atol(value);
+}
+
+
+static void card_string(const char *card, char *value)
+{
+    const char *p = card + 10, *end = card + CARD;
+    char *v = value;
+
+    while (p < end && *p == ' ')
+        p++;
+    if (p < end && *p == '\'')
+        for (p++; p < end && *p != '\''; p++)
+            *v++ = *p;
+    while (v > value && v[-1] == ' ')
+        v--;
+    *v = '\0';
+}
+
+
+/* Check every HDU in a mapped file. With -u the file is mapped for   */
+/* writing, and CHECKSUM is rewritten where only the header has changed */
+
+static int check_file(unsigned char *file, off_t size, int *nhdu)
+{
+    off_t offset = 0;
+    int has_sums = 0, bad_data = 0, bad_header = 0, updated = 0;
+
+    *nhdu = 0;
+    if (size < BLOCK || strncmp((const char *) file, "SIMPLE  =", 9) != 0)
+        return(UNREADABLE);
+
+    while (offset + BLOCK <= size) {
+        long bitpix = 0, naxis = 0, naxes[999] = { 0 }, pcount = 0, gcount = 1;
+        char datasum[CARD] = "", checksum[CARD] = "";
+        char *card, *checksum_card = NULL;
+        off_t hdrend = -1, datasize;
+        uint64_t hdrsum, datsum;
+
+        // The header, up to and including the block with END
+        for (off_t o = offset; o + CARD <= size && hdrend < 0; o += CARD) {
+            card = (char *) file + o;
+            if (strncmp(card, "END     ", 8) == 0)
+                hdrend = (o - offset)/BLOCK*BLOCK + BLOCK + offset;
+            else if (strncmp(card, "BITPIX  =", 9) == 0)
+                bitpix = card_long(card);
+            else if (strncmp(card, "NAXIS   =", 9) == 0)
+                naxis = card_long(card);
+            else if (strncmp(card, "NAXIS", 5) == 0 && card[8] == '=') {
+                int axis = atoi(card + 5);
+                if (axis >= 1 && axis <= 999)
+                    naxes[axis - 1] = card_long(card);
+            }
+            else if (strncmp(card, "PCOUNT  =", 9) == 0)
+                pcount = card_long(card);
+            else if (strncmp(card, "GCOUNT  =", 9) == 0)
+                gcount = card_long(card);
+            else if (strncmp(card, "DATASUM =", 9) == 0)
+                card_string(card, datasum);
+            else if (strncmp(card, "CHECKSUM=", 9) == 0) {
+                card_string(card, checksum);
+                checksum_card = card;
+            }
+        }
+        if (hdrend < 0 || hdrend > size || naxis < 0 || naxis > 999)
+            return(UNREADABLE);
+
+        datasize = naxis ? 1 : 0;
+        for (int i = 0; i < naxis; i++)
+            datasize *= naxes[i];
+        datasize = (labs(bitpix)/8)*gcount*(pcount + datasize);
+        datasize = (datasize + BLOCK - 1)/BLOCK*BLOCK;
+        if (hdrend + datasize > size)
+            return(UNREADABLE);
+
+        datsum = sum_words(file + hdrend, datasize);
+        int data_ok = 0;
+        if (datasum[0]) {
+            has_sums = 1;
+            if (strtoul(datasum, NULL, 10) != datsum)
+                bad_data = 1;
+            else
+                data_ok = 1;
+        }
+        if (checksum[0]) {
+            has_sums = 1;
+            hdrsum = sum_words(file + offset, hdrend - offset);
+            if (fold(hdrsum + datsum) != 0xffffffff) {
+                // The value is 16 characters in quotes, and is summed as
+                // zeros when a new one is made
+                char *value = memchr(checksum_card + 10, '\'', CARD - 10);
+                if (update && data_ok && value != NULL && value + 18 <= checksum_card + CARD
+                        && value[17] == '\'') {
+                    memset(value + 1, '0', 16);
+                    hdrsum = sum_words(file + offset, hdrend - offset);
+                    encode_checksum(~fold(hdrsum + datsum), value + 1);
+                    updated = 1;
+                }
+                else
+                    bad_header = 1;
+            }
+        }
+        (*nhdu)++;
+        offset = hdrend + datasize;
+    }
+
+    if (bad_data)
+        return(BAD_DATA);
+    if (bad_header)
+        return(BAD_HEADER);
+    if (updated)
+        return(UPDATED);
+    return(has_sums ? OK : NO_SUMS);
+}
+
+
+static void check_frame(t_frame *frame)
+{
+    struct stat sb;
+    unsigned char *file;
+    int fd;
+
+    frame->status = UNREADABLE;
+    if ((fd = open(frame->path, update ? O_RDWR : O_RDONLY)) < 0 || fstat(fd, &sb) != 0) {
+        perror(frame->path);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    frame->size = sb.st_size;
+    if (sb.st_size < BLOCK) {
+        close(fd);
+        return;
+    }
+    if (update)
+        file = (unsigned char *) mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    else
+        file = (unsigned char *) mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        perror(frame->path);
+        return;
+    }
+    madvise(file, sb.st_size, MADV_SEQUENTIAL);
+    frame->status = check_file(file, sb.st_size, &frame->nhdu);
+    if (frame->status == UPDATED && msync(file, sb.st_size, MS_SYNC) != 0) {
+        perror(frame->path);
+        frame->status = BAD_HEADER;
+    }
+    munmap(file, sb.st_size);
+}
+
+
+static void *worker(void *arg)
+{
+    for (;;) {
+        int i;
+
+        pthread_mutex_lock(&lock);
+        i = next_frame++;
+        pthread_mutex_unlock(&lock);
+        if (i >= nframes)
+            break;
+
+        check_frame(&frames[i]);
+
+        pthread_mutex_lock(&lock);
+        frames[i].done = 1;
+        pthread_cond_signal(&finished);
+        pthread_mutex_unlock(&lock);
+    }
+    return(NULL);
+}
+
+
+static double monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int c;
+    int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int recurse = 0;
+    int quiet = 0;
+    int verbose = 0;
+    int nfailed = 0;
+    double nbytes = 0;
+    pthread_t *threads;
+    double start = monotonic_time();
+    struct stat sb;
+
+    while ((c = getopt(argc, argv, "j:rquvh")) != -1) {
+        switch (c) {
+            case 'j':
+                nthreads = atoi(optarg);
+                break;
+            case 'r':
+                recurse = 1;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            case 'u':
+                update = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (optind == argc) {
+        error_exit(usage);
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+
+    /* Make the list of files */
+    for (; optind < argc; optind++) {
+        if (strcmp(argv[optind], "-") == 0) {
+            char line[MAX_STRING];
+            while (fgets(line, sizeof(line), stdin) != NULL) {
+                line[strcspn(line, "\r\n")] = '\0';
+                if (line[0])
+                    add_frame(line, line);
+            }
+        }
+        else if (stat(argv[optind], &sb) == 0 && S_ISDIR(sb.st_mode))
+            add_directory(argv[optind], "", recurse);
+        else
+            add_frame(argv[optind], argv[optind]);
+    }
+
+    /* Check them, printing the rows in order as they become available */
+    printf("#%4d %-16s%s\n", 1, "FILENAME", "Name of the FITS file");
+    printf("#%4d %-16s%s\n", 2, "STATUS", "OK, BAD_DATA, BAD_HEADER, UPDATED, NO_SUMS or UNREADABLE");
+    printf("#%4d %-16s%s\n", 3, "NHDU", "Number of HDUs checked");
+
+    threads = (pthread_t *) malloc(nthreads*sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, NULL);
+
+    for (int i = 0; i < nframes; i++) {
+        t_frame *frame = &frames[i];
+        pthread_mutex_lock(&lock);
+        while (!frame->done)
+            pthread_cond_wait(&finished, &lock);
+        pthread_mutex_unlock(&lock);
+        if (frame->status == BAD_DATA || frame->status == BAD_HEADER || frame->status == UNREADABLE)
+            nfailed++;
+        if (!quiet || (frame->status != OK && frame->status != NO_SUMS && frame->status != UPDATED))
+            printf("%s %s %d\n", frame->name, status_names[frame->status], frame->nhdu);
+        nbytes += frame->size;
+    }
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    if (verbose) {
+        double dt = monotonic_time() - start;
+        fprintf(stderr, "Checked %d files (%.1f MB) in %.3f s (%.0f MB/s) with %d threads\n",
+                nframes, nbytes/1e6, dt, dt > 0 ? nbytes/1e6/dt : 0.0, nthreads);
+    }
+    return(nfailed > 0);
+
+}
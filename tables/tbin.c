@@ -0,0 +1,129 @@
+/*
+ * TBIN - Convert between text tables and binary tables.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "binarytable.h"
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+
+#define usage "\n\
+NAME\n\
+tbin --- convert a table between text and binary form \n\
+\n\
+SYNOPSIS\n\
+tbin < table > converted \n\
+\n\
+DESCRIPTION\n\
+\"tbin\" turns a SExtractor-style text table on stdin into a binary table on\n\
+stdout, and a binary table back into text. The direction is chosen from the\n\
+input.\n\
+\n\
+A binary table stores each column as an array of 64-bit integers, doubles\n\
+or fixed-width strings, whichever is the narrowest that holds every value in\n\
+the column. It is read by mapping it into memory, so tquery can filter and\n\
+summarize it without parsing any text. Values come back as text in full\n\
+precision, though not necessarily with the original number of digits. The\n\
+later elements of a vector column such as MAG_APER get their own names\n\
+(MAG_APER_2 and so on), and #! comment lines are dropped.\n\
+\n\
+Binary tables are written in the byte order of the machine, so they are\n\
+meant for passing data between programs on one host, not for archiving.\n\
+\n\
+EXAMPLES\n\
+extract foo.fits | tbin > foo.tbin \n\
+tquery -f 'FLAGS==0' -s n,median FWHM_IMAGE < foo.tbin \n\
+tbin < foo.tbin | tfilter 'FLUX_ISO > 1000' \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+
+static int text_to_binary()
+{
+    char **header = NULL, **rows = NULL;
+    int nheader = 0;
+    long nrows = 0, maxrows = 0;
+    char *line = NULL;
+    size_t size = 0;
+
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Not writing a binary table to a terminal\n");
+        return(1);
+    }
+    while (getline(&line, &size, stdin) > 0) {
+        if (line[0] == '#') {
+            header = (char **) realloc(header, (nheader + 1)*sizeof(char *));
+            header[nheader++] = strdup(line);
+            continue;
+        }
+        if (line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        if (nrows == maxrows) {
+            maxrows = maxrows ? 2*maxrows : 4096;
+            rows = (char **) realloc(rows, maxrows*sizeof(char *));
+        }
+        rows[nrows++] = strdup(line);
+    }
+    return(WriteBinaryTable(stdout, header, nheader, rows, nrows));
+}
+
+
+static int binary_to_text()
+{
+    t_table table;
+    char value[256];
+
+    if (OpenBinaryTable(&table, stdin))
+        return(1);
+    for (uint32_t k = 0; k < table.header->ncolumns; k++) {
+        t_tablecol *c = &table.columns[k];
+        if (c->description[0])
+            printf("#%4u %-22s %s\n", k + 1, c->name, c->description);
+        else
+            printf("#%4u %s\n", k + 1, c->name);
+    }
+    for (uint64_t r = 0; r < table.header->nrows; r++) {
+        for (uint32_t k = 0; k < table.header->ncolumns; k++) {
+            FormatTableValue(&table, k, r, value, sizeof(value));
+            printf("%s%s", k ? " " : "", value);
+        }
+        printf("\n");
+    }
+    CloseBinaryTable(&table);
+    return(0);
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int c;
+
+    while ((c = getopt(argc, argv, "h")) != -1) {
+        switch (c) {
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    if (optind != argc) {
+        error_exit(usage);
+    }
+
+    // Binary tables start with a magic number, text tables with a #
+    c = getc(stdin);
+    if (c == EOF)
+        return(0);
+    ungetc(c, stdin);
+    if (c == TABLE_MAGIC[0])
+        return(binary_to_text());
+    return(text_to_binary());
+
+}
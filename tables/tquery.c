@@ -0,0 +1,865 @@
+/*
+ * TQUERY - Filter, cut and summarize a SExtractor-style text table in one
+ * pass.
+ *
+ * Does the work of "tfilter expr | tcolumn COLUMNS | rstats ..." without
+ * three interpreters each re-parsing the table: the header is read once,
+ * the filter expression is compiled to a tree that is evaluated against
+ * each row as it streams past, and only the fields the expression and the
+ * output need are ever converted to numbers. A binary table (see tbin) is
+ * mapped instead, and its columns are used where they lie.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "binarytable.h"
+
+#define MAX_STRING 256
+#define MAX_COLUMNS 4096
+#define MAX_OUTPUT 64
+#define MAX_STATS 16
+
+#define error_exit(a)   fprintf(stderr, (a)); return(1)
+
+#define usage "\n\
+NAME\n\
+tquery --- filter, select and summarize columns of a table in one pass \n\
+\n\
+SYNOPSIS\n\
+tquery [options] [COLUMN ...] < table \n\
+\n\
+DESCRIPTION\n\
+\"tquery\" reads a SExtractor-style text table (as written by extract,\n\
+summarize, fitsscan and friends) on stdin and does the job of tfilter, tcolumn\n\
+and rstats together. Rows are kept if they satisfy the -f expression. With no\n\
+columns named, the kept rows are printed in full under the original header,\n\
+exactly as tfilter would. With columns named, just those columns of the kept\n\
+rows are printed, as tcolumn would. With -s, nothing but the statistics of each\n\
+named column is printed, one line per column.\n\
+\n\
+The input may also be a binary table made by tbin, which is mapped into\n\
+memory and queried without parsing any text. The output is always text.\n\
+\n\
+The filter expression is written as for tfilter: column names, numbers,\n\
+quoted strings, + - * / ** ( ), the comparisons == != < > <= >= for numbers,\n\
+eq ne lt gt le ge for strings, and && || ! (or and or not) to combine them.\n\
+A word on the right of eq, ne etc. that is not a column name is taken as a\n\
+string, so IMAGETYP eq light works as it does in tfilter. As in Perl, **\n\
+binds tighter than a unary minus, so -2**2 is -4.\n\
+The functions abs, sqrt, log, log10, exp and int are available. A field that\n\
+is not a number (such as ---) counts as 0 in arithmetic.\n\
+\n\
+The statistics are given to -s as a comma-separated list of:\n\
+\n\
+    n       number of values \n\
+    mean    mean \n\
+    median  median \n\
+    sigma   standard deviation \n\
+    cmean   mean after iterative sigma clipping about the median \n\
+    csigma  standard deviation after clipping \n\
+    cn      number of values left after clipping \n\
+    min     minimum \n\
+    max     maximum \n\
+\n\
+Values that are not numbers are left out of the statistics. Statistics of no\n\
+values are printed as nan.\n\
+\n\
+OPTIONS\n\
+-f expr      # keep only rows for which the expression is true \n\
+-s stats     # print these statistics of each column instead of the rows \n\
+-k nsigma    # clipping threshold (default 3) \n\
+-i n         # maximum number of clipping iterations (default 5) \n\
+-H           # print a header for the selected columns \n\
+\n\
+EXAMPLES\n\
+extract foo.fits | tquery -f 'FLAGS==0 && FWHM_IMAGE>0' -s n,median,sigma FWHM_IMAGE \n\
+tquery -f \"SERIAL_NUMBER eq '83F010783' && EXPOSURE == 600\" FILENAME < darks.txt \n\
+tquery -f 'FLAGS==0 && FLUX_ISO>10000' X_IMAGE Y_IMAGE FLUX_ISO < catalog.txt \n\
+tquery -f 'FLAGS==0' -s n,median FWHM_IMAGE ELLIPTICITY < catalog.tbin \n\
+\n\
+AUTHOR\n\
+Bob Abraham:  abraham@astro.utoronto.ca\n\
+"
+
+/* Filter expressions are compiled to a tree of these */
+enum {
+    NUMBER, STRING, COLUMN, NEGATE, NOT, AND, OR, ADD, SUBTRACT, MULTIPLY,
+    DIVIDE, POWER, EQ, NE, LT, GT, LE, GE, SEQ, SNE, SLT, SGT, SLE, SGE,
+    FUNCTION
+};
+
+typedef struct t_node {
+    int    op;
+    double value;
+    char  *string;
+    int    column;
+    double (*function)(double);
+    struct t_node *left, *right;
+} t_node;
+
+typedef struct {
+    char  *name;
+    int    number;      // 1-based, as in the header
+    char  *header;      // the header line, for -H
+} t_column;
+
+/* The row being looked at */
+typedef struct {
+    char  *start[MAX_COLUMNS];
+    int    length[MAX_COLUMNS];
+    int    nfields;
+    double number[MAX_COLUMNS];
+    long   converted[MAX_COLUMNS];   // row number at which number[] was filled in
+    long   row;
+} t_row;
+
+static t_column columns[MAX_COLUMNS];
+static int ncolumns = 0;
+static t_row current;
+static t_table table;
+static int binary = 0;
+
+static char *expression;
+static char *cursor;
+static char token[MAX_STRING];
+static int bareword_strings = 0;   // parsing the right of eq, ne etc.
+
+static double round_down(double x) { return (double) (long) x; }
+
+static struct { char *name; double (*function)(double); } functions[] = {
+    { "abs", fabs }, { "sqrt", sqrt }, { "log", log }, { "log10", log10 },
+    { "exp", exp },  { "int", round_down }
+};
+#define NFUNCTIONS (sizeof(functions)/sizeof(functions[0]))
+
+
+/* Tokenizer */
+
+static void next_token()
+{
+    char *t = token;
+
+    while (isspace((unsigned char) *cursor))
+        cursor++;
+    if (*cursor == '\0') {
+        token[0] = '\0';
+        return;
+    }
+    if (*cursor == '\'' || *cursor == '"') {
+        // Keep the opening quote to mark the token as a string
+        char quote = *cursor;
+        *t++ = *cursor++;
+        while (*cursor && *cursor != quote && t < token + MAX_STRING - 1)
+            *t++ = *cursor++;
+        if (*cursor == quote)
+            cursor++;
+    }
+    else if (isalnum((unsigned char) *cursor) || *cursor == '_' || *cursor == '.') {
+        while ((isalnum((unsigned char) *cursor) || *cursor == '_' || *cursor == '.'
+                    || ((*cursor == '+' || *cursor == '-') && (t[-1] == 'e' || t[-1] == 'E')
+                        && isdigit((unsigned char) token[0])))
+                && t < token + MAX_STRING - 1)
+            *t++ = *cursor++;
+    }
+    else if (strncmp(cursor, "&&", 2) == 0 || strncmp(cursor, "||", 2) == 0
+            || strncmp(cursor, "==", 2) == 0 || strncmp(cursor, "!=", 2) == 0
+            || strncmp(cursor, "<=", 2) == 0 || strncmp(cursor, ">=", 2) == 0
+            || strncmp(cursor, "**", 2) == 0) {
+        *t++ = *cursor++;
+        *t++ = *cursor++;
+    }
+    else
+        *t++ = *cursor++;
+    *t = '\0';
+}
+
+
+static t_node *node(int op, t_node *left, t_node *right)
+{
+    t_node *n = (t_node *) calloc(1, sizeof(t_node));
+    n->op = op;
+    n->left = left;
+    n->right = right;
+    return(n);
+}
+
+
+static void syntax_error(char *what)
+{
+    fprintf(stderr, "tquery: %s at \"%s\" in \"%s\"\n", what, token, expression);
+    exit(1);
+}
+
+
+static int find_column(char *name)
+{
+    for (int i = 0; i < ncolumns; i++)
+        if (strcmp(columns[i].name, name) == 0)
+            return(i);
+    return(-1);
+}
+
+
+/* Recursive descent parser, lowest precedence first */
+
+static t_node *parse_or();
+static t_node *parse_unary();
+
+static t_node *parse_primary()
+{
+    t_node *n;
+
+    if (token[0] == '(') {
+        next_token();
+        n = parse_or();
+        if (token[0] != ')')
+            syntax_error("missing )");
+        next_token();
+        return(n);
+    }
+    if (token[0] == '\'' || token[0] == '"') {
+        n = node(STRING, NULL, NULL);
+        n->string = strdup(token + 1);
+        next_token();
+        return(n);
+    }
+    if (isdigit((unsigned char) token[0]) || token[0] == '.') {
+        n = node(NUMBER, NULL, NULL);
+        n->value = atof(token);
+        next_token();
+        return(n);
+    }
+    if (isalpha((unsigned char) token[0]) || token[0] == '_') {
+        for (int i = 0; i < NFUNCTIONS; i++) {
+            if (strcmp(token, functions[i].name) == 0) {
+                next_token();
+                if (token[0] != '(')
+                    syntax_error("expected ( after function");
+                n = node(FUNCTION, parse_primary(), NULL);
+                n->function = functions[i].function;
+                return(n);
+            }
+        }
+        if (find_column(token) < 0 && bareword_strings) {
+            // As in Perl, a bareword that is no column is a string
+            n = node(STRING, NULL, NULL);
+            n->string = strdup(token);
+            next_token();
+            return(n);
+        }
+        n = node(COLUMN, NULL, NULL);
+        if ((n->column = find_column(token)) < 0)
+            syntax_error("no such column");
+        n->column = columns[n->column].number - 1;
+        next_token();
+        return(n);
+    }
+    syntax_error("unexpected token");
+    return(NULL);
+}
+
+/* ** binds tighter than a unary minus on its left, as in Perl: -2**2 is -4 */
+static t_node *parse_power()
+{
+    t_node *n = parse_primary();
+    if (strcmp(token, "**") == 0) {
+        next_token();
+        n = node(POWER, n, parse_unary());   // right associative
+    }
+    return(n);
+}
+
+static t_node *parse_unary()
+{
+    if (strcmp(token, "-") == 0) {
+        next_token();
+        return(node(NEGATE, parse_unary(), NULL));
+    }
+    if (strcmp(token, "+") == 0) {
+        next_token();
+        return(parse_unary());
+    }
+    if (strcmp(token, "!") == 0) {
+        next_token();
+        return(node(NOT, parse_unary(), NULL));
+    }
+    return(parse_power());
+}
+
+static t_node *parse_product()
+{
+    t_node *n = parse_unary();
+    for (;;) {
+        if (strcmp(token, "*") == 0) {
+            next_token();
+            n = node(MULTIPLY, n, parse_unary());
+        }
+        else if (strcmp(token, "/") == 0) {
+            next_token();
+            n = node(DIVIDE, n, parse_unary());
+        }
+        else
+            return(n);
+    }
+}
+
+static t_node *parse_sum()
+{
+    t_node *n = parse_product();
+    for (;;) {
+        if (strcmp(token, "+") == 0) {
+            next_token();
+            n = node(ADD, n, parse_product());
+        }
+        else if (strcmp(token, "-") == 0) {
+            next_token();
+            n = node(SUBTRACT, n, parse_product());
+        }
+        else
+            return(n);
+    }
+}
+
+static t_node *parse_comparison()
+{
+    static struct { char *symbol; int op; } comparisons[] = {
+        { "==", EQ },  { "!=", NE },  { "<", LT },   { ">", GT },   { "<=", LE },  { ">=", GE },
+        { "eq", SEQ }, { "ne", SNE }, { "lt", SLT }, { "gt", SGT }, { "le", SLE }, { "ge", SGE }
+    };
+    t_node *n = parse_sum();
+    for (int i = 0; i < sizeof(comparisons)/sizeof(comparisons[0]); i++) {
+        if (strcmp(token, comparisons[i].symbol) == 0) {
+            next_token();
+            bareword_strings = (comparisons[i].op >= SEQ);
+            n = node(comparisons[i].op, n, parse_sum());
+            bareword_strings = 0;
+            return(n);
+        }
+    }
+    return(n);
+}
+
+static t_node *parse_not()
+{
+    if (strcmp(token, "not") == 0) {
+        next_token();
+        return(node(NOT, parse_not(), NULL));
+    }
+    return(parse_comparison());
+}
+
+static t_node *parse_and()
+{
+    t_node *n = parse_not();
+    while (strcmp(token, "&&") == 0 || strcmp(token, "and") == 0) {
+        next_token();
+        n = node(AND, n, parse_not());
+    }
+    return(n);
+}
+
+static t_node *parse_or()
+{
+    t_node *n = parse_and();
+    while (strcmp(token, "||") == 0 || strcmp(token, "or") == 0) {
+        next_token();
+        n = node(OR, n, parse_and());
+    }
+    return(n);
+}
+
+static t_node *compile(char *text)
+{
+    t_node *n;
+    expression = text;
+    cursor = text;
+    next_token();
+    n = parse_or();
+    if (token[0] != '\0')
+        syntax_error("unexpected token");
+    return(n);
+}
+
+
+/* Evaluation */
+
+static double binary_number(int column)
+{
+    t_tablecol *c = &table.columns[column];
+    char *value = (char *) TableColumn(&table, column) + (current.row - 1)*c->width;
+    char field[MAX_STRING];
+
+    if (c->type == TABLE_DOUBLE)
+        return(*(double *) value);
+    if (c->type == TABLE_INT)
+        return((double) *(int64_t *) value);
+    snprintf(field, sizeof(field), "%.*s", (int) strnlen(value, c->width), value);
+    return(strtod(field, NULL));
+}
+
+static double field_number(int column)
+{
+    if (column >= current.nfields)
+        return(0.0);
+    if (binary)
+        return(binary_number(column));
+    if (current.converted[column] != current.row) {
+        // As in Perl, a field that isn't a number is 0
+        current.number[column] = strtod(current.start[column], NULL);
+        current.converted[column] = current.row;
+    }
+    return(current.number[column]);
+}
+
+/* The text of a string operand, which may not be NUL-terminated */
+static const char *string_operand(t_node *n, int *length)
+{
+    if (n->op == STRING) {
+        *length = strlen(n->string);
+        return(n->string);
+    }
+    if (n->op == COLUMN) {
+        if (n->column >= current.nfields) {
+            *length = 0;
+            return("");
+        }
+        if (binary) {
+            t_tablecol *c = &table.columns[n->column];
+            char *value = (char *) TableColumn(&table, n->column) + (current.row - 1)*c->width;
+            // Numbers are compared as they would be printed
+            if (c->type != TABLE_STRING)
+                return(NULL);
+            *length = strnlen(value, c->width);
+            return(value);
+        }
+        *length = current.length[n->column];
+        return(current.start[n->column]);
+    }
+    return(NULL);
+}
+
+static double evaluate(t_node *n);
+
+static int compare_strings(t_node *n)
+{
+    char buffer[2][64];
+    const char *s[2];
+    int length[2];
+    t_node *operand[2] = { n->left, n->right };
+    int c;
+
+    for (int i = 0; i < 2; i++) {
+        if ((s[i] = string_operand(operand[i], &length[i])) == NULL) {
+            snprintf(buffer[i], sizeof(buffer[i]), "%.15g", evaluate(operand[i]));
+            s[i] = buffer[i];
+            length[i] = strlen(buffer[i]);
+        }
+    }
+    c = memcmp(s[0], s[1], length[0] < length[1] ? length[0] : length[1]);
+    if (c == 0)
+        c = length[0] - length[1];
+    return(c);
+}
+
+static double evaluate(t_node *n)
+{
+    switch (n->op) {
+        case NUMBER:   return(n->value);
+        case STRING:   return(atof(n->string));
+        case COLUMN:   return(field_number(n->column));
+        case NEGATE:   return(-evaluate(n->left));
+        case NOT:      return(!evaluate(n->left));
+        case AND:      return(evaluate(n->left) && evaluate(n->right));
+        case OR:       return(evaluate(n->left) || evaluate(n->right));
+        case ADD:      return(evaluate(n->left) + evaluate(n->right));
+        case SUBTRACT: return(evaluate(n->left) - evaluate(n->right));
+        case MULTIPLY: return(evaluate(n->left) * evaluate(n->right));
+        case DIVIDE:   return(evaluate(n->left) / evaluate(n->right));
+        case POWER:    return(pow(evaluate(n->left), evaluate(n->right)));
+        case EQ:       return(evaluate(n->left) == evaluate(n->right));
+        case NE:       return(evaluate(n->left) != evaluate(n->right));
+        case LT:       return(evaluate(n->left) <  evaluate(n->right));
+        case GT:       return(evaluate(n->left) >  evaluate(n->right));
+        case LE:       return(evaluate(n->left) <= evaluate(n->right));
+        case GE:       return(evaluate(n->left) >= evaluate(n->right));
+        case SEQ:      return(compare_strings(n) == 0);
+        case SNE:      return(compare_strings(n) != 0);
+        case SLT:      return(compare_strings(n) <  0);
+        case SGT:      return(compare_strings(n) >  0);
+        case SLE:      return(compare_strings(n) <= 0);
+        case SGE:      return(compare_strings(n) >= 0);
+        case FUNCTION: return(n->function(evaluate(n->left)));
+    }
+    return(0.0);
+}
+
+
+/* Statistics */
+
+typedef struct {
+    double *values;
+    long    n, size;
+} t_sample;
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double median(double *sorted, long n)
+{
+    if (n == 0)
+        return(NAN);
+    return (n % 2) ? sorted[n/2] : 0.5*(sorted[n/2 - 1] + sorted[n/2]);
+}
+
+static void mean_sigma(double *x, long n, double *mean, double *sigma)
+{
+    double sum = 0.0, sumsq = 0.0;
+    for (long i = 0; i < n; i++)
+        sum += x[i];
+    *mean = n ? sum/n : NAN;
+    for (long i = 0; i < n; i++)
+        sumsq += (x[i] - *mean)*(x[i] - *mean);
+    *sigma = n > 1 ? sqrt(sumsq/(n - 1)) : NAN;
+}
+
+static void print_statistics(t_sample *s, char **stats, int nstats, double nsigma, int iterations)
+{
+    double mean, sigma, cmean, csigma;
+    long first = 0, last;
+
+    qsort(s->values, s->n, sizeof(double), compare_doubles);
+    mean_sigma(s->values, s->n, &mean, &sigma);
+
+    // Clip about the median. The values are sorted, so the survivors are
+    // always a contiguous run of them.
+    last = s->n;
+    cmean = mean;
+    csigma = sigma;
+    for (int i = 0; i < iterations && last - first > 2; i++) {
+        double centre = median(s->values + first, last - first);
+        long f = first, l = last;
+        while (f < l && s->values[f] < centre - nsigma*csigma)
+            f++;
+        while (l > f && s->values[l - 1] > centre + nsigma*csigma)
+            l--;
+        if (f == first && l == last)
+            break;
+        first = f;
+        last = l;
+        mean_sigma(s->values + first, last - first, &cmean, &csigma);
+    }
+
+    for (int i = 0; i < nstats; i++) {
+        double v = NAN;
+        if (strcmp(stats[i], "n") == 0)           v = s->n;
+        else if (strcmp(stats[i], "mean") == 0)   v = mean;
+        else if (strcmp(stats[i], "median") == 0) v = median(s->values, s->n);
+        else if (strcmp(stats[i], "sigma") == 0)  v = sigma;
+        else if (strcmp(stats[i], "cmean") == 0)  v = cmean;
+        else if (strcmp(stats[i], "csigma") == 0) v = csigma;
+        else if (strcmp(stats[i], "cn") == 0)     v = last - first;
+        else if (strcmp(stats[i], "min") == 0)    v = s->n ? s->values[0] : NAN;
+        else if (strcmp(stats[i], "max") == 0)    v = s->n ? s->values[s->n - 1] : NAN;
+        printf("%s%.6g", i ? " " : "", v);
+    }
+    printf("\n");
+}
+
+
+/* Split the current line into fields without copying it */
+static void split_row(char *line)
+{
+    char *p = line;
+    current.nfields = 0;
+    current.row++;
+    while (current.nfields < MAX_COLUMNS) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0')
+            break;
+        current.start[current.nfields] = p;
+        while (*p && !isspace((unsigned char) *p))
+            p++;
+        current.length[current.nfields] = p - current.start[current.nfields];
+        current.nfields++;
+    }
+}
+
+
+/* What to do with the rows that pass the filter */
+static t_node *tree = NULL;
+static char *stats[MAX_STATS];
+static int nstats = 0;
+static int output[MAX_OUTPUT];
+static int noutput = 0;
+static t_sample samples[MAX_OUTPUT];
+
+
+/* Once the header has been read, find the columns asked for */
+static int resolve_columns(char **names, int nnames, char *filter, int print_header)
+{
+    for (int i = 0; i < nnames; i++) {
+        int k = find_column(names[i]);
+        if (k < 0) {
+            fprintf(stderr, "tquery: no column %s\n", names[i]);
+            return(1);
+        }
+        output[noutput++] = k;
+    }
+    if (filter)
+        tree = compile(filter);
+    if (print_header && nstats == 0)
+        for (int i = 0; i < noutput; i++) {
+            char *desc = columns[output[i]].header + 1;
+            // Skip the old number and name, keep the description
+            while (*desc == ' ') desc++;
+            while (*desc && *desc != ' ') desc++;
+            while (*desc == ' ') desc++;
+            while (*desc && *desc != ' ' && *desc != '\n') desc++;
+            printf("#%4d %s%s", i + 1, columns[output[i]].name, desc);
+        }
+    return(0);
+}
+
+
+static void add_sample(t_sample *s, double v)
+{
+    if (isnan(v))
+        return;
+    if (s->n == s->size) {
+        s->size = s->size ? 2*s->size : 1024;
+        s->values = (double *) realloc(s->values, s->size*sizeof(double));
+    }
+    s->values[s->n++] = v;
+}
+
+
+/* Query a binary table, which is mapped rather than read */
+static int query_binary(char **names, int nnames, char *filter, int print_header)
+{
+    char value[MAX_STRING];
+    char line[MAX_STRING];
+
+    if (OpenBinaryTable(&table, stdin))
+        return(1);
+    binary = 1;
+    for (uint32_t k = 0; k < table.header->ncolumns && k < MAX_COLUMNS; k++) {
+        t_tablecol *c = &table.columns[k];
+        snprintf(line, sizeof(line), "#%4u %-22s %s\n", k + 1, c->name, c->description);
+        columns[ncolumns].name = c->name;
+        columns[ncolumns].number = k + 1;
+        columns[ncolumns].header = strdup(line);
+        ncolumns++;
+    }
+    if (resolve_columns(names, nnames, filter, print_header))
+        return(1);
+    if (nstats == 0 && noutput == 0) {
+        for (int k = 0; k < ncolumns; k++)
+            fputs(columns[k].header, stdout);
+        if (filter)
+            printf("#! tquery_filter:%s\n", filter);
+    }
+
+    current.nfields = ncolumns;
+    for (uint64_t r = 0; r < table.header->nrows; r++) {
+        current.row = r + 1;
+        if (tree && !evaluate(tree))
+            continue;
+        if (nstats) {
+            for (int i = 0; i < noutput; i++) {
+                int col = columns[output[i]].number - 1;
+                if (table.columns[col].type != TABLE_STRING)
+                    add_sample(&samples[i], field_number(col));
+                else {
+                    char *end;
+                    double v;
+                    FormatTableValue(&table, col, r, value, sizeof(value));
+                    v = strtod(value, &end);
+                    if (end != value)
+                        add_sample(&samples[i], v);
+                }
+            }
+        }
+        else if (noutput == 0) {
+            for (int k = 0; k < ncolumns; k++) {
+                FormatTableValue(&table, k, r, value, sizeof(value));
+                printf("%s%s", k ? " " : "", value);
+            }
+            printf("\n");
+        }
+        else {
+            for (int i = 0; i < noutput; i++) {
+                FormatTableValue(&table, columns[output[i]].number - 1, r, value, sizeof(value));
+                printf("%s%s", i ? " " : "", value);
+            }
+            printf("\n");
+        }
+    }
+    return(0);
+}
+
+
+/* Query a text table as it streams in */
+static int query_text(char **names, int nnames, char *filter, int print_header)
+{
+    char *line = NULL;
+    size_t size = 0;
+    int in_header = 1;
+    char **header = NULL;
+    int nheader = 0;
+
+    while (getline(&line, &size, stdin) > 0) {
+
+        if (line[0] == '#') {
+            char name[MAX_STRING];
+            int number;
+            // Keep the header in case the rows are printed in full
+            if (nstats == 0 && nnames == 0) {
+                if (!in_header) {
+                    fputs(line, stdout);
+                    continue;
+                }
+                header = (char **) realloc(header, (nheader + 1)*sizeof(char *));
+                header[nheader++] = strdup(line);
+            }
+            if (line[1] == '!' || ncolumns >= MAX_COLUMNS)
+                continue;
+            if (sscanf(line + 1, "%d %255s", &number, name) == 2 && number > 0) {
+                columns[ncolumns].name = strdup(name);
+                columns[ncolumns].number = number;
+                columns[ncolumns].header = strdup(line);
+                ncolumns++;
+            }
+            continue;
+        }
+
+        if (in_header) {
+            // First row: the header is complete, so resolve the names
+            in_header = 0;
+            if (resolve_columns(names, nnames, filter, print_header))
+                return(1);
+            for (int i = 0; i < nheader; i++)
+                fputs(header[i], stdout);
+            if (nheader > 0 && filter)
+                printf("#! tquery_filter:%s\n", filter);
+        }
+
+        split_row(line);
+        if (current.nfields == 0)
+            continue;
+        if (tree && !evaluate(tree))
+            continue;
+
+        if (nstats) {
+            for (int i = 0; i < noutput; i++) {
+                int col = columns[output[i]].number - 1;
+                char *end;
+                double v;
+                if (col >= current.nfields)
+                    continue;
+                v = strtod(current.start[col], &end);
+                if (end != current.start[col])
+                    add_sample(&samples[i], v);
+            }
+        }
+        else if (noutput == 0)
+            fputs(line, stdout);
+        else {
+            for (int i = 0; i < noutput; i++) {
+                int col = columns[output[i]].number - 1;
+                if (col < current.nfields)
+                    printf("%s%.*s", i ? " " : "", current.length[col], current.start[col]);
+            }
+            printf("\n");
+        }
+    }
+
+    if (in_header) {
+        // No rows at all, but the names must still be checked
+        if (resolve_columns(names, nnames, filter, print_header))
+            return(1);
+        for (int i = 0; i < nheader; i++)
+            fputs(header[i], stdout);
+    }
+    return(0);
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int c;
+    char *filter = NULL;
+    char *statlist = NULL;
+    double nsigma = 3.0;
+    int iterations = 5;
+    int print_header = 0;
+    char **names;
+    int nnames;
+    int status;
+
+    while ((c = getopt(argc, argv, "f:s:k:i:Hh")) != -1) {
+        switch (c) {
+            case 'f':
+                filter = optarg;
+                break;
+            case 's':
+                statlist = optarg;
+                break;
+            case 'k':
+                nsigma = atof(optarg);
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                break;
+            case 'H':
+                print_header = 1;
+                break;
+            default:
+                error_exit(usage);
+                break;
+        }
+    }
+    names = argv + optind;
+    nnames = argc - optind;
+    if (nnames > MAX_OUTPUT || (statlist && nnames == 0)) {
+        error_exit(usage);
+    }
+    if (statlist) {
+        for (char *s = strtok(statlist, ","); s && nstats < MAX_STATS; s = strtok(NULL, ",")) {
+            if (strcmp(s, "n") && strcmp(s, "mean") && strcmp(s, "median") && strcmp(s, "sigma")
+                    && strcmp(s, "cmean") && strcmp(s, "csigma") && strcmp(s, "cn")
+                    && strcmp(s, "min") && strcmp(s, "max")) {
+                fprintf(stderr, "tquery: unknown statistic %s\n", s);
+                return(1);
+            }
+            stats[nstats++] = s;
+        }
+    }
+
+    // Binary tables start with a magic number, text tables with a #
+    c = getc(stdin);
+    ungetc(c, stdin);
+    if (c == TABLE_MAGIC[0])
+        status = query_binary(names, nnames, filter, print_header);
+    else
+        status = query_text(names, nnames, filter, print_header);
+    if (status)
+        return(status);
+
+    if (nstats)
+        for (int i = 0; i < noutput; i++)
+            print_statistics(&samples[i], stats, nstats, nsigma, iterations);
+
+    return(0);
+
+}